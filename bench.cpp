@@ -0,0 +1,200 @@
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <thread>
+#include <functional>
+#include <algorithm>
+#include <stdexcept>
+
+#include "map1.hpp"
+#include "map3.hpp"
+#include "locks.hpp"
+#include "bench.hpp"
+
+namespace
+{
+
+typedef std::function< std::vector<bench::result_row>(const bench::config&) > runner;
+
+template<typename A>
+runner make_runner(const std::string& name)
+{ return [name](const bench::config& c) { return bench::run_container<A>(name, c); }; }
+
+const std::vector< std::pair<std::string, runner> >& containers()
+{
+  static const std::vector< std::pair<std::string, runner> > res = {
+    { "std_map",           make_runner< bench::locked_adapter< std::map<uint64_t, size_t> > >("std_map") },
+    { "std_unordered_map", make_runner< bench::locked_adapter< std::unordered_map<uint64_t, size_t> > >("std_unordered_map") },
+    { "t1",                make_runner< bench::concurrent_adapter< t1::map<uint64_t, size_t> > >("t1") },
+    { "t1_stats",          make_runner< bench::concurrent_adapter<
+                             t1::map<uint64_t, size_t, std::mutex, 0, t::transparent_hash<uint64_t>,
+                                     std::allocator< std::pair<uint64_t, size_t> >, t1::lock_stats > > >("t1_stats") },
+    { "t3",                make_runner< bench::concurrent_adapter< t3::map<uint64_t, size_t> > >("t3") },
+    { "t3_ttas",           make_runner< bench::concurrent_adapter< t3::map<uint64_t, size_t, t::ttas_spinlock> > >("t3_ttas") },
+    { "t3_ticket",         make_runner< bench::concurrent_adapter< t3::map<uint64_t, size_t, t::ticket_lock> > >("t3_ticket") },
+    { "t3_mcs",            make_runner< bench::concurrent_adapter< t3::map<uint64_t, size_t, t::mcs_lock> > >("t3_mcs") },
+    { "t3_adaptive",       make_runner< bench::concurrent_adapter< t3::map<uint64_t, size_t, t::adaptive_mutex> > >("t3_adaptive") },
+  };
+  return res;
+}
+
+void usage(const char* self)
+{
+  std::cerr
+    << "usage: " << self << " [options]\n"
+    << "  --containers LIST   std_map,std_unordered_map,t1,t1_stats,t3,\n"
+    << "                      t3_ttas,t3_ticket,t3_mcs,t3_adaptive (default: all)\n"
+    << "  --threads LIST      thread counts, e.g. 1,2,4 (default: 1 and powers of two up to 2*cores)\n"
+    << "  --workload A..E     YCSB-style preset (default: A)\n"
+    << "  --mix R,U,I,S       custom read/update/insert/scan percentages, sum 100\n"
+    << "  --dist NAME         uniform, zipfian or hotset (default: uniform)\n"
+    << "  --theta X           zipfian skew (default: 0.99)\n"
+    << "  --hot-fraction X    hotset: fraction of hot records (default: 0.2)\n"
+    << "  --hot-ops X         hotset: fraction of operations on them (default: 0.8)\n"
+    << "  --records N         records loaded before the run (default: 1000000)\n"
+    << "  --ops N             measured operations per trial, all threads (default: 1000000)\n"
+    << "  --warmup N          operations before measuring, all threads (default: 100000)\n"
+    << "  --trials N          measured runs per thread count (default: 3)\n"
+    << "  --scan-length N     records per scan (default: 100)\n"
+    << "  --format NAME       text, csv or json (default: text)\n"
+    << "  --out FILE          write results to FILE instead of stdout\n";
+}
+
+std::vector<std::string> split(const std::string& s)
+{
+  std::vector<std::string> res;
+  std::stringstream ss(s);
+  std::string item;
+  while ( std::getline(ss, item, ',') )
+    res.push_back(item);
+  return res;
+}
+
+}
+
+int main( int argc, char* argv[] )
+{
+  bench::config c;
+  std::vector<std::string> selected;
+  std::string format = "text";
+  std::string out;
+
+  c.threads.clear();
+  const size_t max_threads = 2 * std::max(1u, std::thread::hardware_concurrency());
+  for (size_t th = 1; th <= max_threads; th *= 2)
+    c.threads.push_back(th);
+
+  try {
+    for (int i = 1; i < argc; ++i) {
+      const std::string opt = argv[i];
+      if (opt == "--help" || opt == "-h") {
+        usage(argv[0]);
+        return 0;
+      }
+      if (i + 1 >= argc)
+        throw std::invalid_argument(opt + " needs a value");
+      const std::string val = argv[++i];
+
+      if (opt == "--containers") {
+        selected = split(val);
+        for (auto& name : selected) {
+          if ( std::none_of( containers().begin(), containers().end(),
+                             [&name](const auto& it) { return it.first == name; } ) )
+            throw std::invalid_argument("unknown container " + name);
+        }
+      } else if (opt == "--threads") {
+        c.threads.clear();
+        for (auto& it : split(val))
+          c.threads.push_back( std::stoul(it) );
+      } else if (opt == "--workload") {
+        if ( !bench::workload::preset(val, c.w) )
+          throw std::invalid_argument("unknown workload " + val);
+      } else if (opt == "--mix") {
+        const std::vector<std::string> p = split(val);
+        if (p.size() != bench::op_count)
+          throw std::invalid_argument("--mix needs four percentages");
+        c.w.name = "custom";
+        for (size_t k = 0; k < bench::op_count; ++k)
+          c.w.percent[k] = std::stoul(p[k]);
+        if ( !c.w.valid() )
+          throw std::invalid_argument("--mix percentages must sum to 100");
+      } else if (opt == "--dist") {
+        if (val == "uniform")
+          c.dist = bench::distribution::uniform;
+        else if (val == "zipfian")
+          c.dist = bench::distribution::zipfian;
+        else if (val == "hotset")
+          c.dist = bench::distribution::hotset;
+        else
+          throw std::invalid_argument("unknown distribution " + val);
+      } else if (opt == "--theta") {
+        c.theta = std::stod(val);
+      } else if (opt == "--hot-fraction") {
+        c.hot_fraction = std::stod(val);
+      } else if (opt == "--hot-ops") {
+        c.hot_ops = std::stod(val);
+      } else if (opt == "--records") {
+        c.records = std::stoull(val);
+      } else if (opt == "--ops") {
+        c.ops = std::stoull(val);
+      } else if (opt == "--warmup") {
+        c.warmup = std::stoull(val);
+      } else if (opt == "--trials") {
+        c.trials = std::stoul(val);
+      } else if (opt == "--scan-length") {
+        c.w.scan_length = std::stoul(val);
+      } else if (opt == "--format") {
+        if (val != "text" && val != "csv" && val != "json")
+          throw std::invalid_argument("unknown format " + val);
+        format = val;
+      } else if (opt == "--out") {
+        out = val;
+      } else {
+        throw std::invalid_argument("unknown option " + opt);
+      }
+    }
+    if ( c.dist == bench::distribution::zipfian && !(c.theta > 0 && c.theta < 1) )
+      throw std::invalid_argument("--theta must be in (0, 1)");
+    for (size_t th : c.threads) {
+      if (th == 0)
+        throw std::invalid_argument("thread count must be positive");
+    }
+  } catch (const std::exception& e) {
+    std::cerr << e.what() << std::endl;
+    usage(argv[0]);
+    return 1;
+  }
+
+  std::vector<bench::result_row> rows;
+  for (auto& it : containers()) {
+    if ( !selected.empty() && std::find( selected.begin(), selected.end(), it.first ) == selected.end() )
+      continue;
+    std::cerr << "running " << it.first << std::endl;
+    const std::vector<bench::result_row> r = it.second(c);
+    rows.insert( rows.end(), r.begin(), r.end() );
+  }
+
+  std::ofstream file;
+  if ( !out.empty() ) {
+    file.open(out);
+    if (!file) {
+      std::cerr << "cannot open " << out << std::endl;
+      return 1;
+    }
+  }
+  std::ostream& os = out.empty() ? std::cout : file;
+
+  if (format == "csv")
+    bench::write_csv(os, rows);
+  else if (format == "json")
+    bench::write_json(os, rows);
+  else
+    bench::write_text(os, rows);
+
+  return  0;
+}
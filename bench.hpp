@@ -0,0 +1,550 @@
+#ifndef BENCH_HPP
+#define BENCH_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <barrier>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace bench
+{
+
+typedef std::chrono::steady_clock clock_type;
+
+/**
+ *  Финализатор splitmix64: номер записи -> ключ. Ключи разбросаны по всему
+ *  диапазону, поэтому соседние номера не попадают в соседние сегменты и
+ *  вставка по возрастанию номеров не превращается в вставку по порядку.
+ */
+inline uint64_t mix64(uint64_t x)
+{
+  x ^= x >> 30;
+  x *= 0xBF58476D1CE4E5B9ull;
+  x ^= x >> 27;
+  x *= 0x94D049BB133111EBull;
+  x ^= x >> 31;
+  return x;
+}
+
+inline uint64_t key_of(uint64_t id)
+{ return mix64(id); }
+
+/**
+ *  splitmix64, свой у каждого потока.
+ */
+class rng
+{
+public:
+  explicit rng(uint64_t seed) : s_(seed)
+  { }
+
+  uint64_t next()
+  { return mix64( s_ += 0x9E3779B97F4A7C15ull ); }
+
+  //[0, 1)
+  double uniform()
+  { return static_cast<double>( next() >> 11 ) * (1.0 / 9007199254740992.0); }
+
+  //[0, n)
+  uint64_t below(uint64_t n)
+  { return static_cast<uint64_t>( ( static_cast<unsigned __int128>( next() ) * n ) >> 64 ); }
+
+private:
+  uint64_t s_;
+};
+
+/**
+ *  Гистограмма задержек в наносекундах, логарифмически-линейная (как
+ *  HdrHistogram): до 32 нс - по одной наносекунде, дальше каждая степень
+ *  двойки делится на 32 интервала, то есть погрешность перцентиля не больше
+ *  3%. Гистограммы потоков сливаются после замера.
+ */
+class histogram
+{
+public:
+  static const size_t sub_bits  = 5;
+  static const size_t sub_count = size_t(1) << sub_bits;
+  static const size_t buckets   = (64 - sub_bits + 1) * sub_count;
+
+  histogram() : counts_(buckets, 0), total_(0), max_(0)
+  { }
+
+  void record(uint64_t ns)
+  {
+    ++counts_[ index_of(ns) ];
+    ++total_;
+    if (ns > max_)
+      max_ = ns;
+  }
+
+  void merge(const histogram& v)
+  {
+    for (size_t i = 0; i < buckets; ++i)
+      counts_[i] += v.counts_[i];
+    total_ += v.total_;
+    if (v.max_ > max_)
+      max_ = v.max_;
+  }
+
+  uint64_t count() const noexcept
+  { return total_; }
+
+  uint64_t max() const noexcept
+  { return max_; }
+
+  /**
+   *  Верхняя граница интервала, в который попал q-й квантиль, q в (0, 1].
+   */
+  uint64_t percentile(double q) const
+  {
+    if (!total_)
+      return 0;
+    uint64_t rank = static_cast<uint64_t>( std::ceil( q * static_cast<double>(total_) ) );
+    if (rank == 0)
+      rank = 1;
+    uint64_t seen = 0;
+    for (size_t i = 0; i < buckets; ++i) {
+      seen += counts_[i];
+      if (seen >= rank)
+        return std::min( upper_of(i), max_ );
+    }
+    return max_;
+  }
+
+  static size_t index_of(uint64_t v)
+  {
+    if (v < sub_count)
+      return static_cast<size_t>(v);
+    const size_t e = 63 - static_cast<size_t>( __builtin_clzll(v) );
+    return (e - sub_bits + 1) * sub_count + ( (v >> (e - sub_bits)) & (sub_count - 1) );
+  }
+
+  static uint64_t upper_of(size_t i)
+  {
+    if (i < sub_count)
+      return i;
+    const size_t e = i / sub_count + sub_bits - 1;
+    const uint64_t sub = i % sub_count;
+    return ( (sub_count + sub + 1) << (e - sub_bits) ) - 1;
+  }
+
+private:
+  std::vector<uint64_t> counts_;
+  uint64_t total_;
+  uint64_t max_;
+};
+
+enum class distribution { uniform, zipfian, hotset };
+
+inline const char* name_of(distribution d)
+{
+  switch (d) {
+    case distribution::zipfian: return "zipfian";
+    case distribution::hotset:  return "hotset";
+    default:                    return "uniform";
+  }
+}
+
+/**
+ *  Выбор номера записи из [0, n) по заданному распределению.
+ *  zipfian - генератор Грея и др. (как ZipfianGenerator в YCSB), самые
+ *  частые записи - с меньшими номерами, а ключи разбросаны mix64.
+ *  hotset - доля hot_fraction записей получает долю hot_ops операций.
+ */
+class key_chooser
+{
+public:
+  key_chooser(distribution d, uint64_t n, double theta = 0.99,
+              double hot_fraction = 0.2, double hot_ops = 0.8) :
+    dist_(d), n_(n ? n : 1), theta_(theta), hot_fraction_(hot_fraction), hot_ops_(hot_ops),
+    alpha_(0), zetan_(0), eta_(0), half_pow_theta_(0)
+  {
+    if (dist_ == distribution::zipfian) {
+      const double zeta2 = zeta(2, theta_);
+      zetan_ = zeta(n_, theta_);
+      alpha_ = 1.0 / (1.0 - theta_);
+      eta_ = ( 1.0 - std::pow( 2.0 / static_cast<double>(n_), 1.0 - theta_ ) ) / (1.0 - zeta2 / zetan_);
+      half_pow_theta_ = 1.0 + std::pow(0.5, theta_);
+    }
+  }
+
+  uint64_t next(rng& r) const
+  {
+    switch (dist_) {
+      case distribution::zipfian: {
+        const double u = r.uniform();
+        const double uz = u * zetan_;
+        if (uz < 1.0)
+          return 0;
+        if (uz < half_pow_theta_)
+          return n_ > 1 ? 1 : 0;
+        const uint64_t res = static_cast<uint64_t>(
+          static_cast<double>(n_) * std::pow(eta_ * u - eta_ + 1.0, alpha_) );
+        return res < n_ ? res : n_ - 1;
+      }
+      case distribution::hotset: {
+        uint64_t hot = static_cast<uint64_t>( static_cast<double>(n_) * hot_fraction_ );
+        if (hot == 0)
+          hot = 1;
+        if ( hot >= n_ || r.uniform() < hot_ops_ )
+          return r.below(hot);
+        return hot + r.below(n_ - hot);
+      }
+      default:
+        return r.below(n_);
+    }
+  }
+
+private:
+  static double zeta(uint64_t n, double theta)
+  {
+    double res = 0;
+    for (uint64_t i = 1; i <= n; ++i)
+      res += 1.0 / std::pow( static_cast<double>(i), theta );
+    return res;
+  }
+
+  distribution dist_;
+  uint64_t n_;
+  double theta_;
+  double hot_fraction_;
+  double hot_ops_;
+  double alpha_;
+  double zetan_;
+  double eta_;
+  double half_pow_theta_;
+};
+
+enum op_type { op_read, op_update, op_insert, op_scan, op_count };
+
+inline const char* name_of(op_type op)
+{
+  static const char* names[op_count] = { "read", "update", "insert", "scan" };
+  return names[op];
+}
+
+/**
+ *  Смесь операций в процентах. Пресеты повторяют основные нагрузки YCSB:
+ *  A - 50/50 чтение/обновление, B - 95/5, C - только чтение,
+ *  D - 95 чтений и 5 вставок, E - 95 коротких сканов и 5 вставок.
+ */
+struct workload
+{
+  std::string name = "A";
+  unsigned percent[op_count] = { 50, 50, 0, 0 };
+  size_t scan_length = 100;
+
+  static bool preset(const std::string& n, workload& w)
+  {
+    static const struct { const char* name; unsigned p[op_count]; } presets[] = {
+      { "A", { 50, 50, 0, 0 } },
+      { "B", { 95, 5, 0, 0 } },
+      { "C", { 100, 0, 0, 0 } },
+      { "D", { 95, 0, 5, 0 } },
+      { "E", { 0, 0, 5, 95 } },
+    };
+    for (auto& it : presets) {
+      if (n == it.name) {
+        w.name = n;
+        for (size_t i = 0; i < op_count; ++i)
+          w.percent[i] = it.p[i];
+        return true;
+      }
+    }
+    return false;
+  }
+
+  bool valid() const
+  {
+    unsigned sum = 0;
+    for (size_t i = 0; i < op_count; ++i)
+      sum += percent[i];
+    return sum == 100;
+  }
+
+  op_type pick(rng& r) const
+  {
+    unsigned roll = static_cast<unsigned>( r.below(100) );
+    for (size_t i = 0; i < op_count; ++i) {
+      if (roll < percent[i])
+        return static_cast<op_type>(i);
+      roll -= percent[i];
+    }
+    return op_read;
+  }
+};
+
+/**
+ *  Контейнер std без синхронизации под одним мьютексом. scan у
+ *  упорядоченного контейнера - lower_bound и проход по n следующим
+ *  элементам, у хэш-таблицы - n поисков записей с соседними номерами.
+ */
+template<typename M>
+class locked_adapter
+{
+public:
+  bool read(uint64_t k, size_t& v)
+  {
+    std::lock_guard<std::mutex> lock(m_);
+    auto it = data_.find(k);
+    if ( it == data_.end() )
+      return false;
+    v = it->second;
+    return true;
+  }
+
+  void update(uint64_t k, size_t v)
+  {
+    std::lock_guard<std::mutex> lock(m_);
+    data_[k] = v;
+  }
+
+  void insert(uint64_t k, size_t v)
+  { update(k, v); }
+
+  size_t scan(uint64_t id, size_t n)
+  {
+    size_t sum = 0;
+    if constexpr ( requires (M& m, uint64_t k) { m.lower_bound(k); } ) {
+      std::lock_guard<std::mutex> lock(m_);
+      auto it = data_.lower_bound( key_of(id) );
+      for (size_t i = 0; i < n && it != data_.end(); ++i, ++it)
+        sum += it->second;
+    } else {
+      size_t v = 0;
+      for (size_t i = 0; i < n; ++i)
+        sum += read( key_of(id + i), v ) ? v : 0;
+    }
+    return sum;
+  }
+
+private:
+  M data_;
+  std::mutex m_;
+};
+
+/**
+ *  Потокобезопасный контейнер (t1::map, t3::map): чтение через visit,
+ *  чтобы значение копировалось под блокировкой, запись через upsert.
+ *  scan - n поисков записей с соседними номерами.
+ */
+template<typename M>
+class concurrent_adapter
+{
+public:
+  bool read(uint64_t k, size_t& v)
+  { return data_.visit( k, [&v](const auto& e) { v = e.second; } ); }
+
+  void update(uint64_t k, size_t v)
+  { data_.upsert( k, v, [v](size_t& e) { e = v; } ); }
+
+  void insert(uint64_t k, size_t v)
+  { update(k, v); }
+
+  size_t scan(uint64_t id, size_t n)
+  {
+    size_t sum = 0, v = 0;
+    for (size_t i = 0; i < n; ++i)
+      sum += read( key_of(id + i), v ) ? v : 0;
+    return sum;
+  }
+
+private:
+  M data_;
+};
+
+struct config
+{
+  workload w;
+  distribution dist = distribution::uniform;
+  double theta = 0.99;
+  double hot_fraction = 0.2;
+  double hot_ops = 0.8;
+  uint64_t records = 1000000;
+  uint64_t ops = 1000000;     //замеряемых операций за прогон, на все потоки
+  uint64_t warmup = 100000;   //операций до замера, на все потоки
+  size_t trials = 3;
+  std::vector<size_t> threads = { 1 };
+};
+
+/**
+ *  Строка результата: один прогон, одна операция (или "all" - все вместе).
+ *  ops_per_sec - пропускная способность всего прогона.
+ */
+struct result_row
+{
+  std::string container;
+  std::string workload;
+  std::string distribution;
+  size_t threads;
+  size_t trial;
+  std::string op;
+  uint64_t count;
+  double ops_per_sec;
+  uint64_t p50_ns;
+  uint64_t p99_ns;
+  uint64_t p999_ns;
+  uint64_t max_ns;
+};
+
+/**
+ *  Загружает records записей в свежий контейнер для каждого числа потоков
+ *  и делает trials прогонов подряд: вставленные в прогоне записи остаются
+ *  в контейнере, но чтения, обновления и сканы выбирают номера только из
+ *  загруженных. Каждый поток сначала делает свою долю прогрева, потом все
+ *  встают на барьер и замеряют каждую операцию парой вызовов steady_clock.
+ */
+template<typename A>
+std::vector<result_row> run_container(const std::string& name, const config& c)
+{
+  std::vector<result_row> rows;
+  const key_chooser chooser(c.dist, c.records, c.theta, c.hot_fraction, c.hot_ops);
+
+  for (size_t th : c.threads) {
+    A a;
+    for (uint64_t id = 0; id < c.records; ++id)
+      a.insert( key_of(id), id );
+    std::atomic<uint64_t> next_id(c.records);
+
+    for (size_t trial = 0; trial < c.trials; ++trial) {
+      struct thread_result
+      {
+        histogram h[op_count];
+        clock_type::time_point start;
+        clock_type::time_point end;
+        size_t checksum = 0;
+      };
+      std::vector<thread_result> res(th);
+      std::barrier<> sync( static_cast<std::ptrdiff_t>(th) );
+
+      auto body = [&](size_t t) {
+        thread_result& my = res[t];
+        rng r( mix64( (trial + 1) * 0x100000001B3ull + t ) );
+
+        auto one = [&](op_type op) {
+          switch (op) {
+            case op_read: {
+              size_t v = 0;
+              my.checksum += a.read( key_of( chooser.next(r) ), v ) ? v : 0;
+              break;
+            }
+            case op_update:
+              a.update( key_of( chooser.next(r) ), t );
+              break;
+            case op_insert: {
+              const uint64_t id = next_id.fetch_add(1, std::memory_order_relaxed);
+              a.insert( key_of(id), id );
+              break;
+            }
+            default:
+              my.checksum += a.scan( chooser.next(r), c.w.scan_length );
+          }
+        };
+
+        for (uint64_t i = 0; i < c.warmup / th; ++i)
+          one( c.w.pick(r) );
+        sync.arrive_and_wait();
+
+        const uint64_t n = c.ops / th;
+        my.start = clock_type::now();
+        for (uint64_t i = 0; i < n; ++i) {
+          const op_type op = c.w.pick(r);
+          const clock_type::time_point t0 = clock_type::now();
+          one(op);
+          const clock_type::time_point t1 = clock_type::now();
+          my.h[op].record( static_cast<uint64_t>(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(t1 - t0).count() ) );
+        }
+        my.end = clock_type::now();
+      };
+
+      std::vector<std::thread> workers;
+      for (size_t t = 1; t < th; ++t)
+        workers.emplace_back(body, t);
+      body(0);
+      for (auto& it : workers)
+        it.join();
+
+      histogram total[op_count];
+      histogram all;
+      clock_type::time_point start = res[0].start, end = res[0].end;
+      for (auto& it : res) {
+        for (size_t op = 0; op < op_count; ++op)
+          total[op].merge(it.h[op]);
+        start = std::min(start, it.start);
+        end = std::max(end, it.end);
+      }
+      for (size_t op = 0; op < op_count; ++op)
+        all.merge(total[op]);
+
+      const double seconds = std::chrono::duration<double>(end - start).count();
+      const double ops_per_sec = seconds > 0 ? static_cast<double>( all.count() ) / seconds : 0;
+      auto row = [&](const std::string& op, const histogram& h) {
+        rows.push_back( result_row{ name, c.w.name, name_of(c.dist), th, trial, op, h.count(), ops_per_sec,
+                                    h.percentile(0.5), h.percentile(0.99), h.percentile(0.999), h.max() } );
+      };
+      for (size_t op = 0; op < op_count; ++op) {
+        if ( total[op].count() )
+          row( name_of( static_cast<op_type>(op) ), total[op] );
+      }
+      row("all", all);
+    }
+  }
+  return rows;
+}
+
+//Output:
+inline void write_csv(std::ostream& os, const std::vector<result_row>& rows)
+{
+  os << "container,workload,distribution,threads,trial,op,count,ops_per_sec,p50_ns,p99_ns,p999_ns,max_ns\n";
+  for (auto& it : rows) {
+    os << it.container << ',' << it.workload << ',' << it.distribution << ',' << it.threads << ','
+       << it.trial << ',' << it.op << ',' << it.count << ',' << static_cast<uint64_t>(it.ops_per_sec) << ','
+       << it.p50_ns << ',' << it.p99_ns << ',' << it.p999_ns << ',' << it.max_ns << '\n';
+  }
+}
+
+inline void write_json(std::ostream& os, const std::vector<result_row>& rows)
+{
+  os << "[\n";
+  for (size_t i = 0; i < rows.size(); ++i) {
+    const result_row& it = rows[i];
+    os << "  {\"container\": \"" << it.container << "\", \"workload\": \"" << it.workload
+       << "\", \"distribution\": \"" << it.distribution << "\", \"threads\": " << it.threads
+       << ", \"trial\": " << it.trial << ", \"op\": \"" << it.op << "\", \"count\": " << it.count
+       << ", \"ops_per_sec\": " << static_cast<uint64_t>(it.ops_per_sec)
+       << ", \"p50_ns\": " << it.p50_ns << ", \"p99_ns\": " << it.p99_ns
+       << ", \"p999_ns\": " << it.p999_ns << ", \"max_ns\": " << it.max_ns << '}'
+       << (i + 1 < rows.size() ? ",\n" : "\n");
+  }
+  os << "]\n";
+}
+
+inline void write_text(std::ostream& os, const std::vector<result_row>& rows)
+{
+  char line[256];
+  std::snprintf( line, sizeof(line), "%-18s %-3s %-8s %7s %5s %-6s %10s %12s %9s %9s %9s %10s\n",
+                 "container", "wl", "dist", "threads", "trial", "op", "count", "ops/s",
+                 "p50 ns", "p99 ns", "p99.9 ns", "max ns" );
+  os << line;
+  for (auto& it : rows) {
+    std::snprintf( line, sizeof(line), "%-18s %-3s %-8s %7zu %5zu %-6s %10llu %12.0f %9llu %9llu %9llu %10llu\n",
+                   it.container.c_str(), it.workload.c_str(), it.distribution.c_str(), it.threads, it.trial,
+                   it.op.c_str(), static_cast<unsigned long long>(it.count), it.ops_per_sec,
+                   static_cast<unsigned long long>(it.p50_ns), static_cast<unsigned long long>(it.p99_ns),
+                   static_cast<unsigned long long>(it.p999_ns), static_cast<unsigned long long>(it.max_ns) );
+    os << line;
+  }
+}
+
+}
+
+#endif // BENCH_HPP
@@ -0,0 +1,25 @@
+TEMPLATE = app
+CONFIG += console
+CONFIG -= app_bundle
+CONFIG -= qt
+
+TARGET = omap_bench
+
+QMAKE_CXXFLAGS += -std=c++20
+LIBS += -pthread
+
+SOURCES += \
+    bench.cpp \
+
+HEADERS += \
+    bench.hpp \
+    map1.hpp \
+    map3.hpp \
+    flat_table.hpp \
+    ebr.hpp \
+    string_hash.h \
+    flat_combining.hpp \
+    thread_pool.hpp \
+    locks.hpp \
+    mapped_file.hpp \
+    timer_wheel.hpp \
@@ -0,0 +1,928 @@
+#ifndef BPLUS_TREE_HPP
+#define BPLUS_TREE_HPP
+
+#include <cstddef>
+#include <memory>
+#include <utility>
+#include <iterator>
+#include <algorithm>
+#include <functional>
+#include <type_traits>
+#include <vector>
+
+namespace t
+{
+
+/**
+ *  B+дерево - основа t::map.
+ *  Узел занимает несколько кэш-линий (node_bytes): во внутренних узлах
+ *  ключи-разделители лежат подряд отдельным массивом, в листьях подряд
+ *  лежат пары (ключ, значение), листья связаны в двусвязный список.
+ *  Поиск внутри узла - двоичный без ветвлений (cmov), обход по порядку -
+ *  последовательное чтение листьев, а высота дерева в разы меньше, чем у
+ *  красно-черного, поэтому и промахов кэша на поиск в разы меньше.
+ *
+ *  Элементы двигаются внутри листьев и между ними, поэтому, в отличие от
+ *  std::map, вставка и удаление делают недействительными итераторы и
+ *  ссылки на элементы.
+ */
+template<typename _Key, typename _Tp, typename _Compare, typename _Alloc>
+class bplus_tree
+{
+public:
+  typedef _Key                         key_type;
+  typedef _Tp                          mapped_type;
+  typedef std::pair<const _Key, _Tp>   value_type;
+  typedef _Compare                     key_compare;
+  typedef _Alloc                       allocator_type;
+  typedef size_t                       size_type;
+  typedef std::ptrdiff_t               difference_type;
+
+  static const size_t cache_line = 64;
+  static const size_t node_bytes = 4 * cache_line;
+
+private:
+  typedef std::pair<_Key, _Tp> mutable_value_type;
+
+  /**
+   *  Слот листа (как map_slot_type в absl::btree_map): пара живет как
+   *  mutable_value, чтобы ее можно было перемещать и присваивать, а наружу
+   *  отдается через член value того же объединения. Приводить
+   *  std::pair<_Key, _Tp>& к value_type& нельзя - это разные типы.
+   */
+  union slot_type
+  {
+    value_type         value;
+    mutable_value_type mutable_value;
+
+    template<typename... _Args>
+    explicit slot_type(_Args&&... args) :
+      mutable_value( std::forward<_Args>(args)... )
+    { }
+
+    slot_type(slot_type&& v) :
+      mutable_value( std::move(v.mutable_value) )
+    { }
+
+    slot_type& operator=(slot_type&& v)
+    {
+      mutable_value = std::move(v.mutable_value);
+      return *this;
+    }
+
+    ~slot_type()
+    { mutable_value.~mutable_value_type(); }
+
+    const _Key& key() const
+    { return mutable_value.first; }
+  };
+
+  static constexpr size_t max_of(size_t a, size_t b)
+  { return a > b ? a : b; }
+
+public:
+  static const size_t leaf_slots  = max_of( 4, node_bytes / sizeof(slot_type) );
+  static const size_t inner_slots = max_of( 4, node_bytes / (sizeof(_Key) + sizeof(void*)) );
+
+private:
+  static const size_t min_leaf  = leaf_slots / 2;
+  static const size_t min_inner = inner_slots / 2;
+
+  struct inner_node;
+
+  struct node
+  {
+    inner_node* parent;
+    size_t      count; //лист: число пар, внутренний узел: число ключей
+    bool        leaf;
+  };
+
+  struct alignas(cache_line) leaf_node : node
+  {
+    leaf_node* prev;
+    leaf_node* next;
+    alignas(slot_type) unsigned char storage[leaf_slots * sizeof(slot_type)];
+
+    slot_type* slots()
+    { return reinterpret_cast<slot_type*>(storage); }
+  };
+
+  struct alignas(cache_line) inner_node : node
+  {
+    alignas(_Key) unsigned char storage[inner_slots * sizeof(_Key)];
+    node* children[inner_slots + 1];
+
+    _Key* keys()
+    { return reinterpret_cast<_Key*>(storage); }
+  };
+
+  typedef typename std::allocator_traits<_Alloc>::template rebind_alloc<leaf_node>  leaf_allocator;
+  typedef typename std::allocator_traits<_Alloc>::template rebind_alloc<inner_node> inner_allocator;
+
+public:
+  template<bool _Const>
+  class iterator_base
+  {
+  public:
+    typedef std::bidirectional_iterator_tag  iterator_category;
+    typedef bplus_tree::value_type           value_type;
+    typedef std::ptrdiff_t                   difference_type;
+    typedef typename std::conditional<_Const, const value_type&, value_type&>::type reference;
+    typedef typename std::conditional<_Const, const value_type*, value_type*>::type pointer;
+
+    iterator_base() : tree_(nullptr), leaf_(nullptr), pos_(0)
+    { }
+
+    iterator_base(const bplus_tree* tree, leaf_node* leaf, size_t pos) :
+      tree_(tree), leaf_(leaf), pos_(pos)
+    { }
+
+    template<bool _C = _Const, typename = typename std::enable_if<_C>::type>
+    iterator_base(const iterator_base<false>& v) :
+      tree_(v.tree_), leaf_(v.leaf_), pos_(v.pos_)
+    { }
+
+    reference operator*() const
+    { return leaf_->slots()[pos_].value; }
+
+    pointer operator->() const
+    { return &operator*(); }
+
+    iterator_base& operator++()
+    {
+      if (++pos_ == leaf_->count) {
+        leaf_ = leaf_->next;
+        pos_ = 0;
+      }
+      return *this;
+    }
+
+    iterator_base operator++(int)
+    {
+      iterator_base i = *this;
+      operator++();
+      return i;
+    }
+
+    iterator_base& operator--()
+    {
+      if (!leaf_) {
+        leaf_ = tree_->last_;
+        pos_ = leaf_->count - 1;
+      } else if (pos_ == 0) {
+        leaf_ = leaf_->prev;
+        pos_ = leaf_->count - 1;
+      } else {
+        --pos_;
+      }
+      return *this;
+    }
+
+    iterator_base operator--(int)
+    {
+      iterator_base i = *this;
+      operator--();
+      return i;
+    }
+
+    bool operator==(const iterator_base& rhs) const
+    { return leaf_ == rhs.leaf_ && pos_ == rhs.pos_; }
+
+    bool operator!=(const iterator_base& rhs) const
+    { return !(*this == rhs); }
+
+  private:
+    friend class bplus_tree;
+    friend class iterator_base<!_Const>;
+
+    const bplus_tree* tree_;
+    leaf_node* leaf_;
+    size_t pos_;
+  };
+
+  typedef iterator_base<false> iterator;
+  typedef iterator_base<true>  const_iterator;
+
+  explicit bplus_tree(const _Compare& comp = _Compare(), const _Alloc& a = _Alloc()) :
+    root_(nullptr), first_(nullptr), last_(nullptr), size_(0), comp_(comp),
+    leaf_alloc_(a), inner_alloc_(a)
+  { }
+
+  bplus_tree(const bplus_tree& v) :
+    bplus_tree( v.comp_, std::allocator_traits<_Alloc>::select_on_container_copy_construction(
+                           _Alloc(v.leaf_alloc_) ) )
+  {
+    for (const_iterator it = v.begin(); it != v.end(); ++it)
+      emplace_hint_unique(end(), *it);
+  }
+
+  bplus_tree(bplus_tree&& v) noexcept :
+    root_(v.root_), first_(v.first_), last_(v.last_), size_(v.size_), comp_(v.comp_),
+    leaf_alloc_( std::move(v.leaf_alloc_) ), inner_alloc_( std::move(v.inner_alloc_) )
+  {
+    v.root_ = nullptr;
+    v.first_ = v.last_ = nullptr;
+    v.size_ = 0;
+  }
+
+  bplus_tree& operator=(const bplus_tree& v)
+  {
+    if (this != &v) {
+      bplus_tree tmp(v);
+      swap(tmp);
+    }
+    return *this;
+  }
+
+  bplus_tree& operator=(bplus_tree&& v) noexcept
+  {
+    if (this != &v) {
+      clear();
+      swap(v);
+    }
+    return *this;
+  }
+
+  ~bplus_tree()
+  { clear(); }
+
+  void swap(bplus_tree& v) noexcept
+  {
+    std::swap(root_, v.root_);
+    std::swap(first_, v.first_);
+    std::swap(last_, v.last_);
+    std::swap(size_, v.size_);
+    std::swap(comp_, v.comp_);
+    std::swap(leaf_alloc_, v.leaf_alloc_);
+    std::swap(inner_alloc_, v.inner_alloc_);
+  }
+
+  //Iterators:
+  iterator begin() noexcept
+  { return iterator(this, first_, 0); }
+
+  const_iterator begin() const noexcept
+  { return const_iterator(this, first_, 0); }
+
+  iterator end() noexcept
+  { return iterator(this, nullptr, 0); }
+
+  const_iterator end() const noexcept
+  { return const_iterator(this, nullptr, 0); }
+
+  //Capacity:
+  bool empty() const noexcept
+  { return size_ == 0; }
+
+  size_type size() const noexcept
+  { return size_; }
+
+  size_type max_size() const noexcept
+  { return std::allocator_traits<leaf_allocator>::max_size(leaf_alloc_) * leaf_slots; }
+
+  key_compare key_comp() const
+  { return comp_; }
+
+  allocator_type get_allocator() const
+  { return allocator_type(leaf_alloc_); }
+
+  //Element lookup
+  iterator lower_bound(const key_type& k)
+  { return to_mutable( static_cast<const bplus_tree*>(this)->lower_bound(k) ); }
+
+  const_iterator lower_bound(const key_type& k) const
+  {
+    if (!root_)
+      return end();
+    leaf_node* l = find_leaf(k);
+    return normalize( l, lower_index(l, k) );
+  }
+
+  iterator upper_bound(const key_type& k)
+  { return to_mutable( static_cast<const bplus_tree*>(this)->upper_bound(k) ); }
+
+  const_iterator upper_bound(const key_type& k) const
+  {
+    if (!root_)
+      return end();
+    leaf_node* l = find_leaf(k);
+    return normalize( l, upper_index(l, k) );
+  }
+
+  iterator find(const key_type& k)
+  { return to_mutable( static_cast<const bplus_tree*>(this)->find(k) ); }
+
+  const_iterator find(const key_type& k) const
+  {
+    const_iterator it = lower_bound(k);
+    if ( it == end() || comp_(k, it->first) )
+      return end();
+    return it;
+  }
+
+  //Modifiers:
+  template<typename... _Args>
+  std::pair<iterator, bool> emplace_unique(_Args&&... args)
+  {
+    slot_type v( std::forward<_Args>(args)... );
+    return insert_slot( std::move(v) );
+  }
+
+  /**
+   *  Если новый ключ ложится прямо перед hint (end() - после последнего
+   *  элемента), спуска от корня нет: для отсортированного входа вставка
+   *  O(1) в среднем. Неподходящий hint - обычная вставка.
+   */
+  template<typename... _Args>
+  iterator emplace_hint_unique(const_iterator hint, _Args&&... args)
+  {
+    slot_type v( std::forward<_Args>(args)... );
+    leaf_node* l;
+    size_t pos;
+    if ( hinted_position(hint, v.key(), l, pos) )
+      return insert_at( l, pos, std::move(v) ).first;
+    return insert_slot( std::move(v) ).first;
+  }
+
+  /**
+   *  Значение строится, только если ключа еще нет (operator[], try_emplace).
+   */
+  template<typename _K, typename... _Args>
+  std::pair<iterator, bool> try_emplace(_K&& k, _Args&&... args)
+  {
+    if (!root_)
+      return insert_at( nullptr, 0, slot_type( std::piecewise_construct,
+                                               std::forward_as_tuple( std::forward<_K>(k) ),
+                                               std::forward_as_tuple( std::forward<_Args>(args)... ) ) );
+
+    leaf_node* l = find_leaf(k);
+    const size_t pos = lower_index(l, k);
+    if ( pos < l->count && !comp_( k, l->slots()[pos].key() ) )
+      return std::make_pair( iterator(this, l, pos), false );
+
+    return insert_at( l, pos, slot_type( std::piecewise_construct,
+                                         std::forward_as_tuple( std::forward<_K>(k) ),
+                                         std::forward_as_tuple( std::forward<_Args>(args)... ) ) );
+  }
+
+  iterator erase(const_iterator position)
+  {
+    leaf_node* l = position.leaf_;
+    size_t pos = position.pos_;
+    erase_at(l, pos);
+    return to_mutable( normalize(l, pos) );
+  }
+
+  size_type erase(const key_type& k)
+  {
+    const_iterator it = find(k);
+    if ( it == end() )
+      return 0;
+    erase(it);
+    return 1;
+  }
+
+  iterator erase(const_iterator first, const_iterator last)
+  {
+    //итераторы сдвигаются при слиянии листьев, поэтому считаем количество
+    size_t n = std::distance(first, last);
+    iterator it = to_mutable(first);
+    while (n--)
+      it = erase(it);
+    return it;
+  }
+
+  void clear() noexcept
+  {
+    if (root_)
+      destroy(root_);
+    root_ = nullptr;
+    first_ = last_ = nullptr;
+    size_ = 0;
+  }
+
+private:
+  //Search inside a node
+  /**
+   *  Число элементов < k (lower) и <= k (upper) в отсортированном массиве:
+   *  двоичный поиск, где ветвление заменено условным сдвигом базы.
+   */
+  template<typename _Get>
+  size_t lower_index(const _Get& get, size_t n, const key_type& k) const
+  {
+    if (!n)
+      return 0;
+    size_t base = 0;
+    while (n > 1) {
+      const size_t half = n / 2;
+      base = comp_( get(base + half), k ) ? base + half : base;
+      n -= half;
+    }
+    return base + comp_( get(base), k );
+  }
+
+  template<typename _Get>
+  size_t upper_index(const _Get& get, size_t n, const key_type& k) const
+  {
+    if (!n)
+      return 0;
+    size_t base = 0;
+    while (n > 1) {
+      const size_t half = n / 2;
+      base = comp_( k, get(base + half) ) ? base : base + half;
+      n -= half;
+    }
+    return base + !comp_( k, get(base) );
+  }
+
+  size_t lower_index(leaf_node* l, const key_type& k) const
+  {
+    slot_type* s = l->slots();
+    return lower_index( [s](size_t i) -> const key_type& { return s[i].key(); }, l->count, k );
+  }
+
+  size_t upper_index(leaf_node* l, const key_type& k) const
+  {
+    slot_type* s = l->slots();
+    return upper_index( [s](size_t i) -> const key_type& { return s[i].key(); }, l->count, k );
+  }
+
+  /**
+   *  Ребенок i внутреннего узла содержит ключи из [keys[i-1], keys[i]).
+   */
+  size_t child_index(inner_node* n, const key_type& k) const
+  {
+    _Key* keys = n->keys();
+    return upper_index( [keys](size_t i) -> const key_type& { return keys[i]; }, n->count, k );
+  }
+
+  leaf_node* find_leaf(const key_type& k) const
+  {
+    node* n = root_;
+    while (!n->leaf) {
+      inner_node* in = static_cast<inner_node*>(n);
+      n = in->children[ child_index(in, k) ];
+    }
+    return static_cast<leaf_node*>(n);
+  }
+
+  const_iterator normalize(leaf_node* l, size_t pos) const
+  {
+    while (l && pos >= l->count) {
+      l = l->next;
+      pos = 0;
+    }
+    return const_iterator(this, l, pos);
+  }
+
+  iterator to_mutable(const_iterator it)
+  { return iterator(this, it.leaf_, it.pos_); }
+
+  //Insertion
+  /**
+   *  Место прямо перед hint подходит, если k строго между соседями. Перед
+   *  первым элементом листа (кроме самого первого) не вставляем: ключ может
+   *  оказаться меньше разделителя в родителе.
+   */
+  bool hinted_position(const_iterator hint, const key_type& k, leaf_node*& l, size_t& pos) const
+  {
+    if (!root_) {
+      l = nullptr;
+      pos = 0;
+      return true;
+    }
+
+    if (!hint.leaf_) {
+      l = last_;
+      pos = l->count;
+      return comp_( l->slots()[pos - 1].key(), k );
+    }
+
+    l = hint.leaf_;
+    pos = hint.pos_;
+    slot_type* s = l->slots();
+    if ( !comp_( k, s[pos].key() ) )
+      return false;
+    if (pos == 0)
+      return l == first_;
+    return comp_( s[pos - 1].key(), k );
+  }
+
+  std::pair<iterator, bool> insert_slot(slot_type&& v)
+  {
+    if (!root_)
+      return insert_at( nullptr, 0, std::move(v) );
+
+    leaf_node* l = find_leaf(v.key());
+    const size_t pos = lower_index(l, v.key());
+    if ( pos < l->count && !comp_( v.key(), l->slots()[pos].key() ) )
+      return std::make_pair( iterator(this, l, pos), false );
+    return insert_at( l, pos, std::move(v) );
+  }
+
+  std::pair<iterator, bool> insert_at(leaf_node* l, size_t pos, slot_type&& v)
+  {
+    if (!l) {
+      l = new_leaf();
+      root_ = first_ = last_ = l;
+    }
+
+    if (l->count < leaf_slots) {
+      put(l, pos, std::move(v));
+      return std::make_pair( iterator(this, l, pos), true );
+    }
+
+    //добавление в конец не делит лист пополам: левый остается полным,
+    //поэтому вставка по возрастанию упаковывает дерево плотно
+    const bool append = l == last_ && pos == l->count;
+    const size_t mid = append ? l->count : l->count / 2;
+    leaf_node* r = split_leaf(l, mid);
+    if (pos > mid || (append && pos == mid)) {
+      pos -= mid;
+      l = r;
+    }
+    put(l, pos, std::move(v));
+    insert_in_parent(r->prev, r->slots()[0].key(), r, append);
+    return std::make_pair( iterator(this, l, pos), true );
+  }
+
+  void put(leaf_node* l, size_t pos, slot_type&& v)
+  {
+    slot_type* s = l->slots();
+    if (pos == l->count) {
+      ::new (s + pos) slot_type( std::move(v) );
+    } else {
+      ::new (s + l->count) slot_type( std::move( s[l->count - 1] ) );
+      std::move_backward(s + pos, s + l->count - 1, s + l->count);
+      s[pos] = std::move(v);
+    }
+    ++l->count;
+    ++size_;
+  }
+
+  /**
+   *  Элементы с mid уходят в новый правый лист, разделитель в родителе
+   *  (первый ключ правого листа) ставит insert_in_parent.
+   */
+  leaf_node* split_leaf(leaf_node* l, size_t mid)
+  {
+    leaf_node* r = new_leaf();
+    slot_type* from = l->slots();
+    slot_type* to = r->slots();
+    for (size_t i = mid; i < l->count; ++i) {
+      ::new (to + i - mid) slot_type( std::move(from[i]) );
+      from[i].~slot_type();
+    }
+    r->count = l->count - mid;
+    l->count = mid;
+
+    r->next = l->next;
+    r->prev = l;
+    if (l->next)
+      l->next->prev = r;
+    else
+      last_ = r;
+    l->next = r;
+    return r;
+  }
+
+  void insert_in_parent(node* left, const key_type& sep, node* right, bool append)
+  {
+    if (left == root_) {
+      inner_node* root = new_inner();
+      ::new (root->keys()) _Key(sep);
+      root->children[0] = left;
+      root->children[1] = right;
+      root->count = 1;
+      left->parent = right->parent = root;
+      root_ = root;
+      return;
+    }
+
+    inner_node* p = left->parent;
+    const size_t i = index_in_parent(left);
+    if (p->count == inner_slots) {
+      split_inner(p, i, sep, right, append);
+      return;
+    }
+
+    insert_key(p, i, sep, right);
+  }
+
+  /**
+   *  Вставляет разделитель на место i и ребенка right справа от него.
+   */
+  static void insert_key(inner_node* p, size_t i, const key_type& sep, node* right)
+  {
+    _Key* keys = p->keys();
+    if (i == p->count) {
+      ::new (keys + i) _Key(sep);
+    } else {
+      ::new (keys + p->count) _Key( std::move( keys[p->count - 1] ) );
+      std::move_backward(keys + i, keys + p->count - 1, keys + p->count);
+      keys[i] = sep;
+    }
+    std::move_backward(p->children + i + 1, p->children + p->count + 1, p->children + p->count + 2);
+    p->children[i + 1] = right;
+    right->parent = p;
+    ++p->count;
+  }
+
+  void split_inner(inner_node* p, size_t i, const key_type& sep, node* right, bool append)
+  {
+    //inner_slots + 1 ключей: средний поднимается, остальные делятся пополам,
+    //при добавлении в конец в правом узле остается один ключ
+    std::vector<_Key> keys;
+    std::vector<node*> children;
+    keys.reserve(inner_slots + 1);
+    children.reserve(inner_slots + 2);
+    for (size_t j = 0; j < p->count; ++j)
+      keys.push_back( std::move( p->keys()[j] ) );
+    children.assign(p->children, p->children + p->count + 1);
+    keys.insert(keys.begin() + i, sep);
+    children.insert(children.begin() + i + 1, right);
+    destroy_keys(p);
+
+    const size_t mid = append ? keys.size() - 2 : keys.size() / 2;
+    inner_node* q = new_inner();
+    fill_inner(p, keys.begin(), keys.begin() + mid, children.begin());
+    fill_inner(q, keys.begin() + mid + 1, keys.end(), children.begin() + mid + 1);
+
+    insert_in_parent(p, keys[mid], q, append);
+  }
+
+  template<typename _KeyIt, typename _ChildIt>
+  static void fill_inner(inner_node* n, _KeyIt first, _KeyIt last, _ChildIt child)
+  {
+    size_t c = 0;
+    for (; first != last; ++first, ++c)
+      ::new (n->keys() + c) _Key( std::move(*first) );
+    n->count = c;
+    for (size_t j = 0; j <= c; ++j, ++child) {
+      n->children[j] = *child;
+      (*child)->parent = n;
+    }
+  }
+
+  //Erasure
+  void erase_at(leaf_node*& l, size_t& pos)
+  {
+    slot_type* s = l->slots();
+    std::move(s + pos + 1, s + l->count, s + pos);
+    s[l->count - 1].~slot_type();
+    --l->count;
+    --size_;
+
+    if (l == root_) {
+      if (l->count == 0) {
+        free_leaf(l);
+        root_ = first_ = last_ = nullptr;
+        l = nullptr;
+        pos = 0;
+      }
+      return;
+    }
+    if (l->count < min_leaf)
+      rebalance_leaf(l, pos);
+  }
+
+  /**
+   *  (l, pos) - позиция элемента, следующего за удаленным; она
+   *  пересчитывается вместе с переносом элементов.
+   */
+  void rebalance_leaf(leaf_node*& l, size_t& pos)
+  {
+    inner_node* p = l->parent;
+    const size_t i = index_in_parent(l);
+    leaf_node* left = i > 0 ? static_cast<leaf_node*>(p->children[i - 1]) : nullptr;
+    leaf_node* right = i < p->count ? static_cast<leaf_node*>(p->children[i + 1]) : nullptr;
+
+    if (left && left->count > min_leaf) {
+      slot_type* s = l->slots();
+      slot_type* ls = left->slots();
+      if (l->count) {
+        ::new (s + l->count) slot_type( std::move( s[l->count - 1] ) );
+        std::move_backward(s, s + l->count - 1, s + l->count);
+        s[0] = std::move( ls[left->count - 1] );
+      } else {
+        ::new (s) slot_type( std::move( ls[left->count - 1] ) );
+      }
+      ls[left->count - 1].~slot_type();
+      --left->count;
+      ++l->count;
+      ++pos;
+      p->keys()[i - 1] = s[0].key();
+      return;
+    }
+
+    if (right && right->count > min_leaf) {
+      slot_type* s = l->slots();
+      slot_type* rs = right->slots();
+      ::new (s + l->count) slot_type( std::move(rs[0]) );
+      ++l->count;
+      std::move(rs + 1, rs + right->count, rs);
+      rs[right->count - 1].~slot_type();
+      --right->count;
+      p->keys()[i] = rs[0].key();
+      return;
+    }
+
+    if (left) {
+      pos += left->count;
+      merge_leaves(left, l);
+      remove_key(p, i - 1);
+      l = left;
+    } else {
+      merge_leaves(l, right);
+      remove_key(p, i);
+    }
+    rebalance_inner(p);
+  }
+
+  /**
+   *  Переносит все из r в конец l и удаляет r.
+   */
+  void merge_leaves(leaf_node* l, leaf_node* r)
+  {
+    slot_type* s = l->slots();
+    slot_type* rs = r->slots();
+    for (size_t j = 0; j < r->count; ++j) {
+      ::new (s + l->count + j) slot_type( std::move(rs[j]) );
+      rs[j].~slot_type();
+    }
+    l->count += r->count;
+    r->count = 0;
+
+    l->next = r->next;
+    if (r->next)
+      r->next->prev = l;
+    else
+      last_ = l;
+    free_leaf(r);
+  }
+
+  /**
+   *  Удаляет ключ i и ребенка i + 1.
+   */
+  static void remove_key(inner_node* p, size_t i)
+  {
+    _Key* keys = p->keys();
+    std::move(keys + i + 1, keys + p->count, keys + i);
+    keys[p->count - 1].~_Key();
+    std::move(p->children + i + 2, p->children + p->count + 1, p->children + i + 1);
+    --p->count;
+  }
+
+  void rebalance_inner(inner_node* n)
+  {
+    if (n == root_) {
+      if (n->count == 0) {
+        root_ = n->children[0];
+        root_->parent = nullptr;
+        free_inner(n);
+      }
+      return;
+    }
+    if (n->count >= min_inner)
+      return;
+
+    inner_node* p = n->parent;
+    const size_t i = index_in_parent(n);
+    inner_node* left = i > 0 ? static_cast<inner_node*>(p->children[i - 1]) : nullptr;
+    inner_node* right = i < p->count ? static_cast<inner_node*>(p->children[i + 1]) : nullptr;
+    _Key* pk = p->keys();
+
+    if (left && left->count > min_inner) {
+      //разделитель из родителя спускается в n, последний ключ left поднимается
+      _Key* keys = n->keys();
+      if (n->count) {
+        ::new (keys + n->count) _Key( std::move( keys[n->count - 1] ) );
+        std::move_backward(keys, keys + n->count - 1, keys + n->count);
+        keys[0] = std::move(pk[i - 1]);
+      } else {
+        ::new (keys) _Key( std::move(pk[i - 1]) );
+      }
+      std::move_backward(n->children, n->children + n->count + 1, n->children + n->count + 2);
+      n->children[0] = left->children[left->count];
+      n->children[0]->parent = n;
+      ++n->count;
+
+      pk[i - 1] = std::move( left->keys()[left->count - 1] );
+      left->keys()[left->count - 1].~_Key();
+      --left->count;
+      return;
+    }
+
+    if (right && right->count > min_inner) {
+      _Key* rk = right->keys();
+      ::new (n->keys() + n->count) _Key( std::move(pk[i]) );
+      n->children[n->count + 1] = right->children[0];
+      n->children[n->count + 1]->parent = n;
+      ++n->count;
+
+      pk[i] = std::move(rk[0]);
+      std::move(rk + 1, rk + right->count, rk);
+      rk[right->count - 1].~_Key();
+      std::move(right->children + 1, right->children + right->count + 1, right->children);
+      --right->count;
+      return;
+    }
+
+    if (left) {
+      merge_inner(left, i - 1, n);
+    } else {
+      merge_inner(n, i, right);
+    }
+    rebalance_inner(p);
+  }
+
+  /**
+   *  l, разделитель sep родителя и r сливаются в l, r удаляется.
+   */
+  void merge_inner(inner_node* l, size_t sep, inner_node* r)
+  {
+    inner_node* p = l->parent;
+    ::new (l->keys() + l->count) _Key( std::move( p->keys()[sep] ) );
+    for (size_t j = 0; j < r->count; ++j)
+      ::new (l->keys() + l->count + 1 + j) _Key( std::move( r->keys()[j] ) );
+    for (size_t j = 0; j <= r->count; ++j) {
+      l->children[l->count + 1 + j] = r->children[j];
+      r->children[j]->parent = l;
+    }
+    l->count += r->count + 1;
+
+    destroy_keys(r);
+    free_inner(r);
+    remove_key(p, sep);
+  }
+
+  static size_t index_in_parent(node* n)
+  {
+    inner_node* p = n->parent;
+    size_t i = p->count;
+    while (p->children[i] != n)
+      --i;
+    return i;
+  }
+
+  //Node allocation
+  leaf_node* new_leaf()
+  {
+    leaf_node* l = std::allocator_traits<leaf_allocator>::allocate(leaf_alloc_, 1);
+    l->parent = nullptr;
+    l->count = 0;
+    l->leaf = true;
+    l->prev = l->next = nullptr;
+    return l;
+  }
+
+  inner_node* new_inner()
+  {
+    inner_node* n = std::allocator_traits<inner_allocator>::allocate(inner_alloc_, 1);
+    n->parent = nullptr;
+    n->count = 0;
+    n->leaf = false;
+    return n;
+  }
+
+  void free_leaf(leaf_node* l)
+  { std::allocator_traits<leaf_allocator>::deallocate(leaf_alloc_, l, 1); }
+
+  void free_inner(inner_node* n)
+  { std::allocator_traits<inner_allocator>::deallocate(inner_alloc_, n, 1); }
+
+  static void destroy_keys(inner_node* n)
+  {
+    for (size_t j = 0; j < n->count; ++j)
+      n->keys()[j].~_Key();
+  }
+
+  void destroy(node* n)
+  {
+    if (n->leaf) {
+      leaf_node* l = static_cast<leaf_node*>(n);
+      for (size_t j = 0; j < l->count; ++j)
+        l->slots()[j].~slot_type();
+      free_leaf(l);
+      return;
+    }
+
+    inner_node* in = static_cast<inner_node*>(n);
+    for (size_t j = 0; j <= in->count; ++j)
+      destroy(in->children[j]);
+    destroy_keys(in);
+    free_inner(in);
+  }
+
+  node*           root_;
+  leaf_node*      first_;
+  leaf_node*      last_;
+  size_t          size_;
+  _Compare        comp_;
+  leaf_allocator  leaf_alloc_;
+  inner_allocator inner_alloc_;
+};
+
+}
+
+#endif // BPLUS_TREE_HPP
@@ -0,0 +1,197 @@
+#ifndef EBR_HPP
+#define EBR_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+
+namespace ebr
+{
+
+/**
+ *  Освобождение памяти по эпохам (epoch-based reclamation, Fraser).
+ *  Поток, читающий разделяемую структуру без блокировки, закрепляется
+ *  (pin) в текущей глобальной эпохе. Писатель не освобождает удаленный
+ *  объект, а откладывает его с номером эпохи, в которой тот был удален.
+ *  Глобальная эпоха сдвигается, только когда все закрепленные потоки уже
+ *  видели текущую, поэтому объект, удаленный в эпохе e, можно освободить,
+ *  когда глобальная эпоха дошла до e + 2.
+ *  Списки отложенных объектов ведут сами структуры (см. flat_table):
+ *  так освобождение идет под той же защитой, что и запись.
+ */
+class domain
+{
+public:
+  static domain& global()
+  {
+    static domain d;
+    return d;
+  }
+
+  domain(const domain&) = delete;
+  domain& operator=(const domain&) = delete;
+
+  ~domain()
+  {
+    thread_record* r = records_.load(std::memory_order_relaxed);
+    while (r) {
+      thread_record* next = r->next;
+      delete r;
+      r = next;
+    }
+  }
+
+  uint64_t epoch() const noexcept
+  { return global_epoch_.load(std::memory_order_acquire); }
+
+  /**
+   *  Объект, удаленный в эпохе retired, больше никому не виден.
+   */
+  bool is_safe(uint64_t retired) const noexcept
+  { return retired + 2 <= epoch(); }
+
+  void pin()
+  {
+    thread_record* r = local();
+    if (r->nesting++ == 0) {
+      r->epoch.store( (global_epoch_.load(std::memory_order_relaxed) << 1) | 1,
+                      std::memory_order_release );
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+    }
+  }
+
+  void unpin()
+  {
+    thread_record* r = local();
+    if (--r->nesting == 0)
+      r->epoch.store(0, std::memory_order_release);
+  }
+
+  /**
+   *  Сдвигает глобальную эпоху, если все закрепленные потоки в текущей.
+   */
+  bool try_advance()
+  {
+    uint64_t e = global_epoch_.load(std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+
+    for (thread_record* r = records_.load(std::memory_order_acquire); r; r = r->next) {
+      const uint64_t le = r->epoch.load(std::memory_order_acquire);
+      if ( (le & 1) && (le >> 1) != e )
+        return false;
+    }
+
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return global_epoch_.compare_exchange_strong(e, e + 1, std::memory_order_release,
+                                                 std::memory_order_relaxed);
+  }
+
+private:
+  struct alignas(64) thread_record
+  {
+    std::atomic<uint64_t> epoch;  //(эпоха << 1) | 1 пока закреплен, иначе 0
+    std::atomic<bool>     in_use;
+    size_t                nesting;
+    thread_record*        next;
+
+    thread_record() : epoch(0), in_use(true), nesting(0), next(nullptr)
+    { }
+  };
+
+  /**
+   *  Запись потока занимается при первом обращении и отдается обратно
+   *  при завершении потока, сами записи живут до конца программы.
+   */
+  struct registration
+  {
+    thread_record* record;
+
+    explicit registration(domain& d) : record( d.acquire_record() )
+    { }
+
+    ~registration()
+    {
+      record->epoch.store(0, std::memory_order_release);
+      record->in_use.store(false, std::memory_order_release);
+    }
+  };
+
+  domain() : global_epoch_(0), records_(nullptr)
+  { }
+
+  thread_record* local()
+  {
+    static thread_local registration reg(*this);
+    return reg.record;
+  }
+
+  thread_record* acquire_record()
+  {
+    for (thread_record* r = records_.load(std::memory_order_acquire); r; r = r->next) {
+      bool expected = false;
+      if ( !r->in_use.load(std::memory_order_relaxed) &&
+           r->in_use.compare_exchange_strong(expected, true, std::memory_order_acquire) ) {
+        r->nesting = 0;
+        return r;
+      }
+    }
+
+    thread_record* r = new thread_record;
+    thread_record* head = records_.load(std::memory_order_relaxed);
+    do {
+      r->next = head;
+    } while ( !records_.compare_exchange_weak(head, r, std::memory_order_release,
+                                              std::memory_order_relaxed) );
+    return r;
+  }
+
+  alignas(64) std::atomic<uint64_t>       global_epoch_;
+  alignas(64) std::atomic<thread_record*> records_;
+};
+
+/**
+ *  Закрепление текущего потока на время жизни объекта, вложенные
+ *  закрепления дешевы. Неактивный guard ничего не делает (так устроены
+ *  итераторы end()). guard нельзя передавать в другой поток.
+ */
+class guard
+{
+public:
+  guard() : active_(true)
+  { domain::global().pin(); }
+
+  explicit guard(bool active) : active_(active)
+  {
+    if (active_)
+      domain::global().pin();
+  }
+
+  guard(const guard& v) : active_(v.active_)
+  {
+    if (active_)
+      domain::global().pin();
+  }
+
+  guard& operator=(const guard& v)
+  {
+    if (v.active_)
+      domain::global().pin();
+    if (active_)
+      domain::global().unpin();
+    active_ = v.active_;
+    return *this;
+  }
+
+  ~guard()
+  {
+    if (active_)
+      domain::global().unpin();
+  }
+
+private:
+  bool active_;
+};
+
+}
+
+#endif // EBR_HPP
@@ -0,0 +1,225 @@
+#ifndef FLAT_COMBINING_HPP
+#define FLAT_COMBINING_HPP
+
+#include <atomic>
+#include <thread>
+#include <optional>
+#include <exception>
+#include <functional>
+#include <type_traits>
+#include <utility>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace t3
+{
+
+/**
+ *  Flat combining (Hendler, Incze, Shavit, Tzafrir). Поток не ждет
+ *  мьютекс, а публикует операцию в свою ячейку массива publications_.
+ *  Тот, кому досталась блокировка (combiner), проходит весь массив и
+ *  выполняет все опубликованные операции подряд: защищаемая структура
+ *  остается в кэше одного ядра, а остальные потоки крутятся каждый на
+ *  своей кэш-линии, пока их операция не будет помечена выполненной.
+ *  Используется вместо мьютекса в threadsafe_adapter:
+ *  t3::map<K, V, t3::flat_combining>.
+ */
+class flat_combining
+{
+public:
+  static const size_t publication_slots = 128;
+
+  flat_combining() : locked_(false)
+  {
+    for (auto& it : publications_)
+      it.op.store(nullptr, std::memory_order_relaxed);
+  }
+
+  flat_combining(const flat_combining&) = delete;
+  flat_combining& operator=(const flat_combining&) = delete;
+
+  /**
+   *  Выполняет f под исключительным доступом (возможно, в другом потоке)
+   *  и возвращает ее результат, исключение из f пробрасывается вызвавшему.
+   */
+  template<typename F>
+  auto execute(F&& f) -> decltype( f() )
+  {
+    typedef decltype( f() ) result_type;
+    task<F, result_type> op(f);
+
+    publish(&op);
+    const size_t max_spins = spin_limit();
+    for (size_t spins = 0; !op.done.load(std::memory_order_acquire); ++spins) {
+      if ( try_lock() ) {
+        combine();
+        unlock();
+        continue;
+      }
+
+      //combiner может быть вытеснен, не отнимаем у него квант
+      if (spins % max_spins == max_spins - 1)
+        std::this_thread::yield();
+      else
+        pause();
+    }
+
+    return op.result();
+  }
+
+private:
+  struct operation
+  {
+    std::atomic<bool>  done;
+    std::exception_ptr error;
+
+    operation() : done(false)
+    { }
+
+    virtual ~operation()
+    { }
+
+    virtual void run() = 0;
+  };
+
+  template<typename R>
+  struct result_holder
+  {
+    std::optional<R> v;
+
+    template<typename F>
+    void set(F& f)
+    { v.emplace( f() ); }
+
+    R get()
+    { return std::move(*v); }
+  };
+
+  template<typename R>
+  struct result_holder<R&>
+  {
+    R* p = nullptr;
+
+    template<typename F>
+    void set(F& f)
+    { p = &f(); }
+
+    R& get()
+    { return *p; }
+  };
+
+  template<typename F, typename R>
+  struct task : operation
+  {
+    F& f;
+    result_holder<R> res;
+
+    explicit task(F& fn) : f(fn)
+    { }
+
+    void run() override
+    { res.set(f); }
+
+    R result()
+    {
+      if (this->error)
+        std::rethrow_exception(this->error);
+      return res.get();
+    }
+  };
+
+  template<typename F>
+  struct task<F, void> : operation
+  {
+    F& f;
+
+    explicit task(F& fn) : f(fn)
+    { }
+
+    void run() override
+    { f(); }
+
+    void result()
+    {
+      if (this->error)
+        std::rethrow_exception(this->error);
+    }
+  };
+
+  struct alignas(64) publication
+  {
+    std::atomic<operation*> op;
+  };
+
+  /**
+   *  Ячейка ищется от "домашней" ячейки потока, занятые пропускаются.
+   */
+  void publish(operation* op)
+  {
+    static thread_local const size_t home = std::hash<std::thread::id>{}( std::this_thread::get_id() );
+    for (size_t i = home; ; ++i) {
+      publication& p = publications_[i % publication_slots];
+      operation* expected = nullptr;
+      if ( p.op.load(std::memory_order_relaxed) == nullptr &&
+           p.op.compare_exchange_strong(expected, op, std::memory_order_release,
+                                        std::memory_order_relaxed) )
+        return;
+      if (i % publication_slots == (home - 1) % publication_slots)
+        std::this_thread::yield();
+    }
+  }
+
+  void combine()
+  {
+    for (auto& it : publications_) {
+      operation* op = it.op.load(std::memory_order_acquire);
+      if (!op)
+        continue;
+
+      try {
+        op->run();
+      } catch (...) {
+        op->error = std::current_exception();
+      }
+      it.op.store(nullptr, std::memory_order_relaxed);
+      op->done.store(true, std::memory_order_release);
+    }
+  }
+
+  bool try_lock()
+  {
+    return !locked_.load(std::memory_order_relaxed) &&
+           !locked_.exchange(true, std::memory_order_acquire);
+  }
+
+  void unlock()
+  { locked_.store(false, std::memory_order_release); }
+
+  /**
+   *  Сколько ждать на своей кэш-линии до yield. На одном ядре ждать
+   *  бесполезно: combiner не работает, пока мы крутимся.
+   */
+  static size_t spin_limit()
+  {
+    static const size_t limit = std::thread::hardware_concurrency() > 1 ? 64 : 1;
+    return limit;
+  }
+
+  static void pause()
+  {
+#if defined(__SSE2__)
+    _mm_pause();
+#else
+    std::this_thread::yield();
+#endif
+  }
+
+  alignas(64) std::atomic<bool> locked_;
+  publication publications_[publication_slots];
+};
+
+}
+
+#endif // FLAT_COMBINING_HPP
@@ -0,0 +1,1063 @@
+#ifndef FLAT_TABLE_HPP
+#define FLAT_TABLE_HPP
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <memory>
+#include <utility>
+#include <functional>
+#include <atomic>
+#include <algorithm>
+#include <deque>
+
+#include "ebr.hpp"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace t1
+{
+
+/**
+ *  Метаданные открытой адресации: на каждый слот таблицы приходится один
+ *  управляющий байт. Старший бит сброшен - слот занят, младшие 7 бит хранят
+ *  часть хэша (h2). Слоты объединены в группы, которые сравниваются
+ *  одной SIMD-инструкцией.
+ */
+namespace flat
+{
+
+typedef int8_t ctrl_t;
+
+static const ctrl_t ctrl_empty   = -128;
+static const ctrl_t ctrl_deleted = -2;
+
+inline size_t lowest_bit(uint32_t m)
+{ return static_cast<size_t>( __builtin_ctz(m) ); }
+
+#if defined(__AVX2__)
+
+struct group
+{
+  static const size_t width = 32;
+
+  __m256i ctrl;
+
+  explicit group(const ctrl_t* p) :
+    ctrl( _mm256_load_si256( reinterpret_cast<const __m256i*>(p) ) )
+  { }
+
+  uint32_t match(ctrl_t h) const
+  {
+    return static_cast<uint32_t>(
+             _mm256_movemask_epi8( _mm256_cmpeq_epi8(_mm256_set1_epi8(h), ctrl) ) );
+  }
+
+  uint32_t match_empty() const
+  { return match(ctrl_empty); }
+
+  uint32_t match_free() const
+  { return match(ctrl_empty) | match(ctrl_deleted); }
+
+  uint32_t match_full() const
+  { return ~static_cast<uint32_t>( _mm256_movemask_epi8(ctrl) ); }
+};
+
+#elif defined(__SSE2__)
+
+struct group
+{
+  static const size_t width = 16;
+
+  __m128i ctrl;
+
+  explicit group(const ctrl_t* p) :
+    ctrl( _mm_load_si128( reinterpret_cast<const __m128i*>(p) ) )
+  { }
+
+  uint32_t match(ctrl_t h) const
+  {
+    return static_cast<uint32_t>(
+             _mm_movemask_epi8( _mm_cmpeq_epi8(_mm_set1_epi8(h), ctrl) ) );
+  }
+
+  uint32_t match_empty() const
+  { return match(ctrl_empty); }
+
+  uint32_t match_free() const
+  { return match(ctrl_empty) | match(ctrl_deleted); }
+
+  uint32_t match_full() const
+  { return ~static_cast<uint32_t>( _mm_movemask_epi8(ctrl) ) & 0xFFFFu; }
+};
+
+#else
+
+struct group
+{
+  static const size_t width = 16;
+
+  ctrl_t ctrl[width];
+
+  explicit group(const ctrl_t* p)
+  { std::memcpy(ctrl, p, width); }
+
+  uint32_t match(ctrl_t h) const
+  {
+    uint32_t m = 0;
+    for (size_t i = 0; i < width; ++i)
+      m |= static_cast<uint32_t>(ctrl[i] == h) << i;
+    return m;
+  }
+
+  uint32_t match_empty() const
+  { return match(ctrl_empty); }
+
+  uint32_t match_free() const
+  { return match(ctrl_empty) | match(ctrl_deleted); }
+
+  uint32_t match_full() const
+  {
+    uint32_t m = 0;
+    for (size_t i = 0; i < width; ++i)
+      m |= static_cast<uint32_t>(ctrl[i] >= 0) << i;
+    return m;
+  }
+};
+
+#endif
+
+}
+
+/**
+ *  Пул записей одного super_bucket. Память выделяется блоками, освобожденные
+ *  записи уходят в список свободных, адрес записи не меняется до ее удаления:
+ *  map::operator[] возвращает ссылку, которой пользуются уже после снятия
+ *  блокировки, поэтому перестроение таблицы не должно двигать значения.
+ */
+template<typename _Tp, size_t _CHUNK=64, typename _Alloc=std::allocator<_Tp> >
+class entry_pool
+{
+public:
+  entry_pool() : free_(nullptr), chunks_(nullptr), used_(_CHUNK)
+  { }
+
+  entry_pool(const entry_pool&) = delete;
+  entry_pool& operator=(const entry_pool&) = delete;
+
+  entry_pool(entry_pool&& v) noexcept :
+    free_(v.free_), chunks_(v.chunks_), used_(v.used_)
+  {
+    v.free_ = nullptr;
+    v.chunks_ = nullptr;
+    v.used_ = _CHUNK;
+  }
+
+  entry_pool& operator=(entry_pool&& v) noexcept
+  {
+    std::swap(free_, v.free_);
+    std::swap(chunks_, v.chunks_);
+    std::swap(used_, v.used_);
+    return *this;
+  }
+
+  ~entry_pool()
+  { release(); }
+
+  void* allocate()
+  {
+    if (free_) {
+      cell* c = free_;
+      free_ = c->next;
+      return c;
+    }
+
+    if (used_ == _CHUNK) {
+      chunk* c = chunk_allocator().allocate(1);
+      c->next = chunks_;
+      chunks_ = c;
+      used_ = 0;
+    }
+    return &chunks_->cells[used_++];
+  }
+
+  void deallocate(void* p)
+  {
+    cell* c = static_cast<cell*>(p);
+    c->next = free_;
+    free_ = c;
+  }
+
+  /**
+   *  Освобождает все блоки разом, записи к этому моменту уже разрушены.
+   */
+  void release()
+  {
+    while (chunks_) {
+      chunk* next = chunks_->next;
+      chunk_allocator().deallocate(chunks_, 1);
+      chunks_ = next;
+    }
+    free_ = nullptr;
+    used_ = _CHUNK;
+  }
+
+private:
+  union cell
+  {
+    cell* next;
+    alignas(_Tp) unsigned char data[sizeof(_Tp)];
+  };
+
+  struct chunk
+  {
+    cell   cells[_CHUNK];
+    chunk* next;
+  };
+
+  typedef typename std::allocator_traits<_Alloc>::template rebind_alloc<chunk> chunk_allocator;
+
+  cell*  free_;
+  chunk* chunks_;
+  size_t used_;
+};
+
+/**
+ *  Хэш-таблица с открытой адресацией для одного super_bucket.
+ *  Поиск идет по группам управляющих байт (SSE2/AVX2), слоты лежат плоским
+ *  массивом и хранят полный хэш и адрес записи, поэтому обычный find - это
+ *  кэш-линия метаданных, кэш-линия слота и одно обращение к записи при
+ *  совпадении хэша, вместо обхода цепочки узлов std::unordered_map.
+ *  Хэш вычисляется снаружи (его уже посчитал map для выбора super_bucket).
+ *
+ *  Перестроение инкрементальное: новый блок индекса публикуется сразу и
+ *  помнит старый (prev), а слоты старого переносятся по migrate_batch групп
+ *  за каждую вставку и удаление. Пока перенос идет, поиск смотрит оба
+ *  блока, в старом - только еще не перенесенные группы. Сами записи при
+ *  переносе не двигаются, поэтому ни одна операция не перестраивает всю
+ *  таблицу разом.
+ *
+ *  Модификации не синхронизированы, защита - забота владельца. Читать
+ *  (find, обход блока индекса) можно без блокировки, закрепившись в эпохе
+ *  (ebr::guard): маска, управляющие байты и слоты лежат в одном блоке и
+ *  публикуются одним атомарным указателем, а удаленные записи и замененные
+ *  блоки не освобождаются, а откладываются до безопасной эпохи.
+ *  Отложенное освобождение делает писатель, под защитой владельца.
+ */
+template<typename _Key, typename _Value, typename _Alloc=std::allocator< std::pair<_Key, _Value> > >
+class flat_table
+{
+  //блоки и записи освобождаются в статических функциях и отложенно, поэтому
+  //аллокатор создается по месту и должен быть без состояния
+  static_assert(std::allocator_traits<_Alloc>::is_always_equal::value,
+                "flat_table needs a stateless allocator");
+
+public:
+  typedef _Key key_type;
+  typedef _Value mapped_type;
+  typedef std::pair<_Key, _Value> value_type;
+  typedef size_t size_type;
+  typedef flat::ctrl_t ctrl_t;
+  typedef flat::group group;
+
+  static const size_t npos = static_cast<size_t>(-1);
+
+  /**
+   *  Число групп старого блока, переносимых за одну модификацию. Новый
+   *  блок вдвое больше, и до его заполнения успевает пройти порядка
+   *  width * 7/8 вставок на группу старого, так что перенос заканчивается
+   *  задолго до следующего роста.
+   */
+  static const size_t migrate_batch = 2;
+
+  /**
+   *  Заголовок блока индекса, за ним идут управляющие байты и слоты.
+   *  prev - блок, из которого еще идет перенос, migrated - сколько его
+   *  групп уже перенесено. deadlines - сроки записей по слотам (см.
+   *  set_deadline), выделяются при первом сроке в блоке.
+   */
+  struct index_type
+  {
+    size_t                   group_mask;
+    std::atomic<index_type*> prev;
+    std::atomic<size_t>      migrated;
+    std::atomic< std::atomic<uint64_t>* > deadlines;
+
+    explicit index_type(size_t groups) : group_mask(groups - 1), prev(nullptr), migrated(0), deadlines(nullptr)
+    { }
+  };
+
+  flat_table() :
+    index_(nullptr), size_(0), growth_left_(0)
+  { }
+
+  flat_table(const flat_table&) = delete;
+  flat_table& operator=(const flat_table&) = delete;
+
+  flat_table(flat_table&& v) noexcept :
+    index_( v.index_.load(std::memory_order_relaxed) ), size_(v.size_),
+    growth_left_(v.growth_left_), limbo_( std::move(v.limbo_) ), pool_( std::move(v.pool_) )
+  {
+    v.index_.store(nullptr, std::memory_order_relaxed);
+    v.size_ = v.growth_left_ = 0;
+  }
+
+  flat_table& operator=(flat_table&& v) noexcept
+  {
+    if (this != &v) {
+      flat_table tmp( std::move(v) );
+      swap(tmp);
+    }
+    return *this;
+  }
+
+  ~flat_table()
+  {
+    index_type* h = index_.load(std::memory_order_relaxed);
+    if (h) {
+      index_type* p = prev_of(h);
+      if (p) {
+        for (size_t i = next_full(p, first_unmigrated(h)); i < capacity_of(p); i = next_full(p, i + 1))
+          slots_of(p)[i].entry->~value_type();
+        release_index(p);
+      }
+    }
+    for (size_t i = next_full(h, 0); i < capacity_of(h); i = next_full(h, i + 1))
+      slots_of(h)[i].entry->~value_type();
+    release_index(h);
+
+    while ( !limbo_.empty() )
+      release_front();
+  }
+
+  void swap(flat_table& v) noexcept
+  {
+    index_type* h = index_.load(std::memory_order_relaxed);
+    index_.store( v.index_.load(std::memory_order_relaxed), std::memory_order_relaxed );
+    v.index_.store(h, std::memory_order_relaxed);
+    std::swap(size_, v.size_);
+    std::swap(growth_left_, v.growth_left_);
+    std::swap(limbo_, v.limbo_);
+    std::swap(pool_, v.pool_);
+  }
+
+  static size_t h1(size_t hash)
+  { return hash >> 7; }
+
+  static ctrl_t h2(size_t hash)
+  { return static_cast<ctrl_t>(hash & 0x7F); }
+
+  //Capacity:
+  size_t size() const noexcept
+  { return size_; }
+
+  bool empty() const noexcept
+  { return size_ == 0; }
+
+  size_t capacity() const noexcept
+  { return capacity_of( index_.load(std::memory_order_relaxed) ); }
+
+  float load_factor() const noexcept
+  { return capacity() ? static_cast<float>(size_) / static_cast<float>( capacity() ) : 0.f; }
+
+  /**
+   *  Число удаленных, но еще не освобожденных записей и блоков.
+   */
+  size_t retired() const noexcept
+  { return limbo_.size(); }
+
+  /**
+   *  Наибольшее число групп, которое проходит поиск записи текущего блока
+   *  (1 - запись в своей группе). Полный проход по блоку.
+   */
+  size_t max_probe_length() const
+  {
+    const index_type* h = index_.load(std::memory_order_relaxed);
+    size_t res = 0;
+    for (size_t i = next_full(h, 0); i < capacity_of(h); i = next_full(h, i + 1)) {
+      const size_t target = i / group::width;
+      size_t g = h1( hash_at(h, i) ) & h->group_mask;
+      size_t len = 1;
+      for (size_t step = 1; g != target; ++step, ++len)
+        g = (g + step) & h->group_mask;
+      if (len > res)
+        res = len;
+    }
+    return res;
+  }
+
+  /**
+   *  Идет ли перенос из старого блока.
+   */
+  bool migrating() const noexcept
+  { return prev_of( index_.load(std::memory_order_relaxed) ) != nullptr; }
+
+  //Index blocks:
+  const index_type* index() const noexcept
+  { return index_.load(std::memory_order_acquire); }
+
+  static size_t capacity_of(const index_type* h)
+  { return h ? (h->group_mask + 1) * group::width : 0; }
+
+  static index_type* prev_of(const index_type* h)
+  { return h ? h->prev.load(std::memory_order_acquire) : nullptr; }
+
+  /**
+   *  Первый слот prev_of(h), который еще не перенесен в h.
+   */
+  static size_t first_unmigrated(const index_type* h)
+  { return h->migrated.load(std::memory_order_acquire) * group::width; }
+
+  /**
+   *  Индекс первого занятого слота блока h, начиная с i, либо capacity_of(h).
+   */
+  static size_t next_full(const index_type* h, size_t i)
+  {
+    const size_t cap = capacity_of(h);
+    const ctrl_t* ctrl = h ? ctrl_of(h) : nullptr;
+    while (i < cap) {
+      const size_t g = i / group::width;
+      const uint32_t m = group( ctrl + g * group::width ).match_full() >> (i % group::width);
+      if (m)
+        return i + flat::lowest_bit(m);
+      i = (g + 1) * group::width;
+    }
+    return cap;
+  }
+
+  static value_type* entry_at(const index_type* h, size_t i)
+  { return load_entry( slots_of(h)[i] ); }
+
+  /**
+   *  entry_at для чтения без блокировки: тег слота читается с acquire
+   *  (пара к store_ctrl), так что запись видна полностью построенной.
+   *  nullptr - слот уже освободили.
+   */
+  static value_type* published_entry(const index_type* h, size_t i)
+  {
+    const ctrl_t c = std::atomic_ref<ctrl_t>( ctrl_of(h)[i] ).load(std::memory_order_acquire);
+    return c < 0 ? nullptr : load_entry( slots_of(h)[i] );
+  }
+
+  /**
+   *  Бит обращения CLOCK для слота i блока h: ставится при попадании,
+   *  в том числе поиском без блокировки, сбрасывается clock_victim.
+   *  Байт пишется, только если бит еще не стоит.
+   */
+  static void touch(const index_type* h, size_t i) noexcept
+  {
+    std::atomic<uint8_t>& r = refs_of(h)[i];
+    if ( !r.load(std::memory_order_relaxed) )
+      r.store(1, std::memory_order_relaxed);
+  }
+
+  static size_t hash_at(const index_type* h, size_t i)
+  { return load_hash( slots_of(h)[i] ); }
+
+  /**
+   *  Срок записи в слоте i блока h, 0 - без срока. Таблица значения не
+   *  толкует (это делает map), только хранит его рядом со слотом и
+   *  переносит вместе со слотом. Читать можно без блокировки.
+   */
+  static uint64_t deadline_at(const index_type* h, size_t i) noexcept
+  {
+    const std::atomic<uint64_t>* d = h->deadlines.load(std::memory_order_acquire);
+    return d ? d[i].load(std::memory_order_relaxed) : 0;
+  }
+
+  static void set_deadline(const index_type* block, size_t i, uint64_t deadline)
+  {
+    index_type* h = const_cast<index_type*>(block);
+    std::atomic<uint64_t>* d = h->deadlines.load(std::memory_order_relaxed);
+    if (!d) {
+      if (!deadline)
+        return;
+      d = deadline_allocator().allocate( capacity_of(h) );
+      for (size_t j = 0; j < capacity_of(h); ++j)
+        ::new (d + j) std::atomic<uint64_t>(0);
+      h->deadlines.store(d, std::memory_order_release);
+    }
+    d[i].store(deadline, std::memory_order_relaxed);
+  }
+
+  //Slot access (текущий блок, без учета переносимого):
+  bool is_full(size_t i) const
+  { return ctrl_of( index_.load(std::memory_order_relaxed) )[i] >= 0; }
+
+  value_type& slot(size_t i)
+  { return *entry_at(index_.load(std::memory_order_relaxed), i); }
+
+  const value_type& slot(size_t i) const
+  { return *entry_at(index_.load(std::memory_order_relaxed), i); }
+
+  size_t slot_hash(size_t i) const
+  { return hash_at(index_.load(std::memory_order_relaxed), i); }
+
+  size_t next_full(size_t i) const
+  { return next_full(index_.load(std::memory_order_relaxed), i); }
+
+  //Element lookup
+  /**
+   *  Ищет в h и в переносимом из него блоке. Возвращает адрес записи либо
+   *  nullptr, block и slot - где она найдена.
+   */
+  template<typename K>
+  static value_type* find(const index_type* h, size_t hash, const K& k,
+                          const index_type*& block, size_t& slot)
+  {
+    if (!h)
+      return nullptr;
+
+    value_type* res = probe(h, 0, hash, k, slot);
+    block = h;
+    if (!res) {
+      const index_type* p = prev_of(h);
+      if (p) {
+        res = probe(p, h->migrated.load(std::memory_order_acquire), hash, k, slot);
+        block = p;
+      }
+    }
+    return res;
+  }
+
+  template<typename K>
+  value_type* find(size_t hash, const K& k, const index_type*& block, size_t& slot) const
+  { return find(index(), hash, k, block, slot); }
+
+  template<typename K>
+  value_type* find(size_t hash, const K& k) const
+  {
+    const index_type* block;
+    size_t slot;
+    return find(hash, k, block, slot);
+  }
+
+  /**
+   *  Подтягивает в кэш группу и слоты, с которых начнется поиск hash,
+   *  чтобы пакетные операции не ждали промаха на каждом ключе.
+   */
+  static void prefetch(const index_type* h, size_t hash)
+  {
+#if defined(__GNUC__)
+    if (h) {
+      const size_t g = h1(hash) & h->group_mask;
+      __builtin_prefetch( ctrl_of(h) + g * group::width );
+      __builtin_prefetch( slots_of(h) + g * group::width );
+    }
+#else
+    (void)h;
+    (void)hash;
+#endif
+  }
+
+  void prefetch(size_t hash) const
+  { prefetch( index_.load(std::memory_order_relaxed), hash ); }
+
+  /**
+   *  Слот записи по ее адресу, без обращения к самой записи: запись могли
+   *  уже удалить, а ее память - отдать новой. false - такой записи нет.
+   */
+  bool locate(size_t hash, const value_type* entry, const index_type*& block, size_t& slot) const
+  {
+    const index_type* h = index_.load(std::memory_order_relaxed);
+    if (!h)
+      return false;
+    block = h;
+    if ( probe_entry(h, 0, hash, entry, slot) )
+      return true;
+    const index_type* p = prev_of(h);
+    block = p;
+    return p && probe_entry(p, h->migrated.load(std::memory_order_relaxed), hash, entry, slot);
+  }
+
+  /**
+   *  Кандидат на вытеснение по CLOCK: с позиции hand ищет занятый слот
+   *  текущего блока со сброшенным битом обращения, сбрасывая биты по
+   *  дороге; запись keep пропускается. Возвращает номер слота (hand
+   *  встает за ним) или npos. Перенос из старого блока сначала
+   *  доводится до конца, чтобы все записи были в одном блоке.
+   */
+  size_t clock_victim(size_t& hand, const value_type* keep = nullptr)
+  {
+    if (size_ == 0 || (size_ == 1 && keep))
+      return npos;
+    finish_migration();
+    const index_type* h = index_.load(std::memory_order_relaxed);
+    const size_t cap = capacity_of(h);
+    std::atomic<uint8_t>* refs = refs_of(h);
+    if (hand >= cap)
+      hand = 0;
+    //за первый полный круг сбрасываются все биты, за второй - найдется
+    for (size_t wraps = 0; wraps < 3; ) {
+      const size_t i = next_full(h, hand);
+      if (i == cap) {
+        hand = 0;
+        ++wraps;
+        continue;
+      }
+      hand = i + 1;
+      if ( entry_at(h, i) == keep )
+        continue;
+      if ( refs[i].load(std::memory_order_relaxed) )
+        refs[i].store(0, std::memory_order_relaxed);
+      else
+        return i;
+    }
+    return npos;
+  }
+
+  //Modifiers:
+  /**
+   *  Создает новый элемент, ключа в таблице быть не должно
+   *  (вызывающий сначала делает find).
+   */
+  template<typename... Args>
+  value_type* emplace_new(size_t hash, Args&&... args)
+  {
+    migrate(migrate_batch);
+    if (growth_left_ == 0) {
+      finish_migration();
+      grow();
+    }
+
+    void* p = pool_.allocate();
+    value_type* entry;
+    try {
+      entry = ::new (p) value_type( std::forward<Args>(args)... );
+    } catch (...) {
+      pool_.deallocate(p);
+      throw;
+    }
+
+    index_type* h = index_.load(std::memory_order_relaxed);
+    const size_t i = find_free(h, hash);
+    if (ctrl_of(h)[i] == flat::ctrl_empty)
+      --growth_left_;
+    put(h, i, hash, entry, 1, 0);
+    ++size_;
+    return entry;
+  }
+
+  /**
+   *  Запись убирается из индекса, но разрушается только в безопасной эпохе.
+   *  block и slot - результат find.
+   */
+  void erase(const index_type* block, size_t slot)
+  {
+    index_type* h = const_cast<index_type*>(block);
+    retire( slots_of(h)[slot].entry, nullptr );
+    --size_;
+    if ( clear_slot(h, slot) && h == index_.load(std::memory_order_relaxed) )
+      ++growth_left_;
+
+    migrate(migrate_batch);
+    collect();
+  }
+
+  template<typename K>
+  bool erase(size_t hash, const K& k)
+  {
+    const index_type* block;
+    size_t slot;
+    if ( !find(hash, k, block, slot) )
+      return false;
+    erase(block, slot);
+    return true;
+  }
+
+  /**
+   *  Таблица получает новый пустой блок той же емкости и новый пул, а
+   *  старые блок, пул и отложенное уходят одной аренной: читатели, которые
+   *  еще смотрят в старый блок, видят живые записи, а освобождение потом
+   *  отдает блоки пула целиком вместо возврата каждой записи.
+   */
+  void clear()
+  {
+    finish_migration();
+    index_type* h = index_.load(std::memory_order_relaxed);
+    if (!h)
+      return;
+
+    retired_arena* a = new retired_arena{ h, std::move(limbo_), std::move(pool_) };
+    limbo_.clear();
+    index_.store(nullptr, std::memory_order_relaxed);
+    size_ = 0;
+    growth_left_ = 0;
+    resize(h->group_mask + 1);
+
+    retired_item item = { ebr::domain::global().epoch(), nullptr, nullptr, a };
+    limbo_.push_back(item);
+    collect();
+  }
+
+  //Hash policy
+  /**
+   *  reserve и rehash только публикуют новый блок, перенос идет
+   *  постепенно с последующими модификациями.
+   */
+  void reserve(size_t n)
+  {
+    if ( n > size_ + growth_left_ )
+      resize( groups_for(n) );
+  }
+
+  void rehash(size_t n)
+  {
+    if (n < size_)
+      n = size_;
+    index_type* h = index_.load(std::memory_order_relaxed);
+    const size_t groups = groups_for(n);
+    if ( !h || groups != h->group_mask + 1 )
+      resize(groups);
+  }
+
+  /**
+   *  Переносит до groups групп старого блока.
+   */
+  void migrate(size_t groups)
+  {
+    index_type* h = index_.load(std::memory_order_relaxed);
+    index_type* p = h ? h->prev.load(std::memory_order_relaxed) : nullptr;
+    if (!p)
+      return;
+
+    const size_t from = h->migrated.load(std::memory_order_relaxed);
+    const size_t to = std::min(from + groups, p->group_mask + 1);
+    for (size_t i = next_full(p, from * group::width); i < to * group::width; i = next_full(p, i + 1)) {
+      const slot_type& s = slots_of(p)[i];
+      put( h, find_free(h, s.hash), s.hash, s.entry, refs_of(p)[i].load(std::memory_order_relaxed),
+           deadline_at(p, i) );
+    }
+    h->migrated.store(to, std::memory_order_release);
+
+    if ( to == p->group_mask + 1 ) {
+      h->prev.store(nullptr, std::memory_order_release);
+      retire(nullptr, p);
+    }
+  }
+
+  void finish_migration()
+  { migrate( static_cast<size_t>(-1) / 2 ); }
+
+  /**
+   *  Освобождает отложенное, что уже никому не видно.
+   */
+  void reclaim()
+  {
+    ebr::domain& d = ebr::domain::global();
+    d.try_advance();
+    while ( !limbo_.empty() && d.is_safe(limbo_.front().epoch) )
+      release_front();
+  }
+
+private:
+  struct slot_type
+  {
+    size_t      hash;
+    value_type* entry;
+  };
+
+  struct retired_arena;
+
+  struct retired_item
+  {
+    uint64_t       epoch;
+    value_type*    entry;
+    index_type*    block;
+    retired_arena* arena;
+  };
+
+  static const size_t cache_line = 64;
+  static const size_t header_size = cache_line;
+  static const size_t reclaim_batch = 64;
+
+  static_assert(sizeof(index_type) <= header_size, "index header does not fit");
+
+  struct alignas(cache_line) index_unit
+  {
+    unsigned char b[cache_line];
+  };
+
+  static ctrl_t* ctrl_of(const index_type* h)
+  {
+    return reinterpret_cast<ctrl_t*>(
+             reinterpret_cast<unsigned char*>( const_cast<index_type*>(h) ) + header_size );
+  }
+
+  static slot_type* slots_of(const index_type* h)
+  { return reinterpret_cast<slot_type*>( ctrl_of(h) + capacity_of(h) ); }
+
+  static std::atomic<uint8_t>* refs_of(const index_type* h)
+  { return reinterpret_cast<std::atomic<uint8_t>*>( slots_of(h) + capacity_of(h) ); }
+
+  /**
+   *  Поиск и обход без блокировки (seqlock и итераторы t1::map) читают
+   *  слоты одновременно с писателем, поэтому hash, entry и ctrl, которые
+   *  они могут увидеть, читаются и пишутся атомарно: put пишет ctrl с
+   *  release после слота, проба после совпадения тега ставит
+   *  acquire-барьер, обход читает тег найденного слота с acquire
+   *  (published_entry). Под мьютексом гонок нет, там и доступ обычный.
+   */
+  static size_t load_hash(const slot_type& s) noexcept
+  { return std::atomic_ref<size_t>( const_cast<size_t&>(s.hash) ).load(std::memory_order_relaxed); }
+
+  static value_type* load_entry(const slot_type& s) noexcept
+  { return std::atomic_ref<value_type*>( const_cast<value_type*&>(s.entry) ).load(std::memory_order_relaxed); }
+
+  static void store_ctrl(index_type* h, size_t i, ctrl_t c) noexcept
+  { std::atomic_ref<ctrl_t>( ctrl_of(h)[i] ).store(c, std::memory_order_release); }
+
+  static size_t units_for(size_t groups)
+  {
+    const size_t cap = groups * group::width;
+    const size_t bytes = header_size + cap + cap * sizeof(slot_type) + cap * sizeof(std::atomic<uint8_t>);
+    return (bytes + cache_line - 1) / cache_line;
+  }
+
+  static size_t max_load(size_t cap)
+  { return cap - cap / 8; }
+
+  static size_t groups_for(size_t n)
+  {
+    size_t groups = 1;
+    while ( max_load(groups * group::width) < n )
+      groups <<= 1;
+    return groups;
+  }
+
+  /**
+   *  Поиск в одном блоке, группы с номером меньше skip уже перенесены и
+   *  только продолжают пробу.
+   */
+  template<typename K>
+  static value_type* probe(const index_type* h, size_t skip, size_t hash, const K& k, size_t& slot)
+  {
+    const ctrl_t* ctrl = ctrl_of(h);
+    const slot_type* slots = slots_of(h);
+    const ctrl_t tag = h2(hash);
+    size_t g = h1(hash) & h->group_mask;
+    for (size_t step = 1; step <= h->group_mask + 1; ++step) {
+      group grp( ctrl + g * group::width );
+      if (g >= skip) {
+        uint32_t m = grp.match(tag);
+        if (m)
+          std::atomic_thread_fence(std::memory_order_acquire); //пара к store_ctrl
+        for (; m; m &= m - 1) {
+          const size_t i = g * group::width + flat::lowest_bit(m);
+          if ( load_hash(slots[i]) != hash )
+            continue;
+          //слот мог освободиться и заново заполниться, пока мы читали:
+          //это отсеет версия seqlock, но разыменовывать null нельзя
+          value_type* entry = load_entry(slots[i]);
+          if ( entry && entry->first == k ) {
+            slot = i;
+            return entry;
+          }
+        }
+      }
+
+      if ( grp.match_empty() )
+        return nullptr;
+
+      g = (g + step) & h->group_mask;
+    }
+    return nullptr;
+  }
+
+  static bool probe_entry(const index_type* h, size_t skip, size_t hash, const value_type* entry, size_t& slot)
+  {
+    const ctrl_t* ctrl = ctrl_of(h);
+    const slot_type* slots = slots_of(h);
+    const ctrl_t tag = h2(hash);
+    size_t g = h1(hash) & h->group_mask;
+    for (size_t step = 1; step <= h->group_mask + 1; ++step) {
+      group grp( ctrl + g * group::width );
+      if (g >= skip) {
+        uint32_t m = grp.match(tag);
+        if (m)
+          std::atomic_thread_fence(std::memory_order_acquire);
+        for (; m; m &= m - 1) {
+          const size_t i = g * group::width + flat::lowest_bit(m);
+          if ( load_entry(slots[i]) == entry && load_hash(slots[i]) == hash ) {
+            slot = i;
+            return true;
+          }
+        }
+      }
+
+      if ( grp.match_empty() )
+        return false;
+
+      g = (g + step) & h->group_mask;
+    }
+    return false;
+  }
+
+  static size_t find_free(index_type* h, size_t hash)
+  {
+    const ctrl_t* ctrl = ctrl_of(h);
+    size_t g = h1(hash) & h->group_mask;
+    for (size_t step = 1; ; ++step) {
+      const uint32_t m = group( ctrl + g * group::width ).match_free();
+      if (m)
+        return g * group::width + flat::lowest_bit(m);
+      g = (g + step) & h->group_mask;
+    }
+  }
+
+  static void put(index_type* h, size_t i, size_t hash, value_type* entry, uint8_t ref, uint64_t deadline)
+  {
+    slot_type& s = slots_of(h)[i];
+    std::atomic_ref<size_t>(s.hash).store(hash, std::memory_order_relaxed);
+    std::atomic_ref<value_type*>(s.entry).store(entry, std::memory_order_relaxed);
+    refs_of(h)[i].store(ref, std::memory_order_relaxed);
+    set_deadline(h, i, deadline);
+    store_ctrl( h, i, h2(hash) );
+  }
+
+  /**
+   *  Освобождает слот, true - если он стал пустым, а не tombstone.
+   */
+  static bool clear_slot(index_type* h, size_t i)
+  {
+    ctrl_t* ctrl = ctrl_of(h);
+    //пробы никогда не проходили группу, в которой есть пустой слот,
+    //значит tombstone здесь не нужен
+    const size_t g = i / group::width;
+    if ( group( ctrl + g * group::width ).match_empty() ) {
+      store_ctrl(h, i, flat::ctrl_empty);
+      return true;
+    }
+    store_ctrl(h, i, flat::ctrl_deleted);
+    return false;
+  }
+
+  void grow()
+  {
+    index_type* h = index_.load(std::memory_order_relaxed);
+    if ( !h )
+      resize(1);
+    else if ( size_ <= capacity_of(h) * 7 / 16 )
+      resize(h->group_mask + 1); //много tombstone, чистим без роста
+    else
+      resize( (h->group_mask + 1) * 2 );
+  }
+
+  /**
+   *  Публикует новый блок, старые слоты переносит migrate. Места под
+   *  все записи резервируются сразу, поэтому перенос не трогает
+   *  growth_left_.
+   */
+  void resize(size_t groups)
+  {
+    finish_migration();
+
+    index_type* h = ::new ( index_allocator().allocate( units_for(groups) ) ) index_type(groups);
+    std::memset( ctrl_of(h), flat::ctrl_empty, capacity_of(h) );
+    //читатель без блокировки может увидеть слот раньше его тега
+    std::memset( static_cast<void*>( slots_of(h) ), 0, capacity_of(h) * sizeof(slot_type) );
+    for (size_t i = 0; i < capacity_of(h); ++i)
+      ::new ( refs_of(h) + i ) std::atomic<uint8_t>(0);
+    growth_left_ = max_load( capacity_of(h) ) - size_;
+
+    index_type* old = index_.load(std::memory_order_relaxed);
+    if (old && size_)
+      h->prev.store(old, std::memory_order_relaxed);
+
+    index_.store(h, std::memory_order_release);
+    if (old && !size_)
+      retire(nullptr, old);
+
+    //в маленьких таблицах переносить постепенно нечего
+    if ( h->group_mask < migrate_batch )
+      finish_migration();
+    collect();
+  }
+
+  void retire(value_type* entry, index_type* block)
+  {
+    retired_item item = { ebr::domain::global().epoch(), entry, block, nullptr };
+    limbo_.push_back(item);
+  }
+
+  void collect()
+  {
+    if ( limbo_.size() >= reclaim_batch )
+      reclaim();
+  }
+
+  void release_front()
+  {
+    const retired_item& item = limbo_.front();
+    if (item.entry) {
+      item.entry->~value_type();
+      pool_.deallocate(item.entry);
+    } else if (item.arena) {
+      release_arena(item.arena);
+    } else {
+      release_index(item.block);
+    }
+    limbo_.pop_front();
+  }
+
+  /**
+   *  Записи арены только разрушаются, память уходит вместе с ее пулом.
+   */
+  static void release_arena(retired_arena* a)
+  {
+    for (const retired_item& it : a->limbo) {
+      if (it.entry)
+        it.entry->~value_type();
+      else if (it.arena)
+        release_arena(it.arena);
+      else
+        release_index(it.block);
+    }
+
+    index_type* h = a->block;
+    for (size_t i = next_full(h, 0); i < capacity_of(h); i = next_full(h, i + 1))
+      slots_of(h)[i].entry->~value_type();
+    release_index(h);
+    delete a;
+  }
+
+  static void release_index(index_type* h)
+  {
+    if (h) {
+      if ( std::atomic<uint64_t>* d = h->deadlines.load(std::memory_order_relaxed) )
+        deadline_allocator().deallocate( d, capacity_of(h) );
+      const size_t units = units_for(h->group_mask + 1);
+      h->~index_type();
+      index_allocator().deallocate( reinterpret_cast<index_unit*>(h), units );
+    }
+  }
+
+  typedef typename std::allocator_traits<_Alloc>::template rebind_alloc<index_unit> index_allocator;
+  typedef typename std::allocator_traits<_Alloc>::template rebind_alloc< std::atomic<uint64_t> > deadline_allocator;
+
+  /**
+   *  Все, что было в таблице до clear(): старый блок индекса с живыми
+   *  записями, отложенное до clear и пул, из которого выделены записи.
+   *  Освобождается целиком, без возврата записей в пул по одной.
+   */
+  struct retired_arena
+  {
+    index_type*              block;
+    std::deque<retired_item> limbo;
+    entry_pool<value_type, 64, _Alloc> pool;
+  };
+
+  std::atomic<index_type*>   index_;
+  size_t                     size_;
+  size_t                     growth_left_;
+  std::deque<retired_item>   limbo_;
+  entry_pool<value_type, 64, _Alloc> pool_;
+};
+
+}
+
+#endif // FLAT_TABLE_HPP
@@ -0,0 +1,318 @@
+#ifndef FROZEN_MAP_HPP
+#define FROZEN_MAP_HPP
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <utility>
+#include <memory>
+#include <algorithm>
+#include <stdexcept>
+#include <initializer_list>
+
+#include "string_hash.h"
+
+namespace t1
+{
+
+/**
+ *  Неизменяемый map для данных, которые загрузили один раз и дальше только
+ *  читают (t1::map::freeze() или любой диапазон пар). Построен на
+ *  минимальном совершенном хэше в духе PTHash: ключи раскладываются по
+ *  корзинам, для каждой корзины подбирается pilot - число, с которым
+ *  позиции всех ее ключей свободны. Позиции за пределами n (таблица на 1%
+ *  больше n, чтобы подбор шел быстро) переотображаются в свободные места
+ *  внутри [0, n), так что записи лежат плотным массивом без пропусков.
+ *
+ *  Поиск: хэш, pilot корзины, одна проба в массив записей и сравнение
+ *  ключа - без блокировок, читать можно из любого числа потоков. Сверх
+ *  самих записей - около 2 байт на ключ (pilot'ы и переотображение).
+ *  Ключи диапазона с одинаковым ключом: остается первый.
+ */
+template<typename _Key, typename _Value,
+         typename _Hash = t::transparent_hash<_Key>,
+         typename _Alloc = std::allocator< std::pair<_Key, _Value> > >
+class frozen_map
+{
+public:
+  typedef _Key key_type;
+  typedef _Value mapped_type;
+  typedef std::pair<_Key, _Value> value_type;
+  typedef _Hash hasher;
+  typedef _Alloc allocator_type;
+  typedef size_t size_type;
+
+private:
+  typedef typename std::allocator_traits<_Alloc>::template rebind_alloc<value_type> value_allocator;
+  typedef typename std::allocator_traits<_Alloc>::template rebind_alloc<uint32_t>   index_allocator;
+  typedef std::vector<value_type, value_allocator> slots_type;
+
+public:
+  typedef typename slots_type::const_iterator const_iterator;
+  typedef const_iterator iterator;
+
+  frozen_map() :
+    buckets_(0), dense_buckets_(0), table_size_(0)
+  { }
+
+  template<typename It>
+  frozen_map(It first, It last) :
+    frozen_map()
+  {
+    std::vector<value_type, value_allocator> items;
+    for (; first != last; ++first)
+      items.emplace_back(*first);
+    build(items);
+  }
+
+  frozen_map(std::initializer_list<value_type> items) :
+    frozen_map( items.begin(), items.end() )
+  { }
+
+  //Capacity:
+  size_type size() const noexcept
+  { return slots_.size(); }
+
+  bool empty() const noexcept
+  { return slots_.empty(); }
+
+  /**
+   *  Память под записи и служебные массивы, без того, чем владеют сами
+   *  ключи и значения (буферы строк).
+   */
+  size_t memory_usage() const noexcept
+  {
+    return slots_.capacity() * sizeof(value_type) +
+           (pilots_.capacity() + remap_.capacity()) * sizeof(uint32_t);
+  }
+
+  //Iterators:
+  const_iterator begin() const noexcept
+  { return slots_.begin(); }
+
+  const_iterator end() const noexcept
+  { return slots_.end(); }
+
+  const_iterator cbegin() const noexcept
+  { return begin(); }
+
+  const_iterator cend() const noexcept
+  { return end(); }
+
+  //Element lookup:
+  const_iterator find(const key_type& k) const
+  { return find_hashed( hash_of(k), k ); }
+
+  /**
+   *  Поиск по ключу другого типа (std::string_view, const char*) или по
+   *  prehashed_key, как у t1::map.
+   */
+  template<typename K>
+  const_iterator find(const K& k) const
+  { return find_hashed( hash_of(k), key_of(k) ); }
+
+  template<typename K>
+  size_type count(const K& k) const
+  { return find(k) != end(); }
+
+  template<typename K>
+  bool contains(const K& k) const
+  { return find(k) != end(); }
+
+  template<typename K>
+  const _Value& at(const K& k) const
+  {
+    const_iterator it = find(k);
+    if ( it == end() )
+      throw std::out_of_range("frozen_map::at");
+    return it->second;
+  }
+
+private:
+  /**
+   *  Доля ключей, попадающих в первые 30% корзин (перекос PTHash: большие
+   *  корзины размещаются первыми, пока таблица пуста), и средний размер
+   *  корзины - log2(n) / 10 ключей.
+   */
+  static const uint32_t dense_keys_threshold = 0x9999999Au; // 0.6 * 2^32
+  static const size_t   bucket_density = 10;
+
+  template<typename K>
+  static size_t hash_of(const K& k)
+  { return hasher{}(k); }
+
+  template<typename K>
+  static size_t hash_of(const t::prehashed_key<K>& k)
+  { return k.hash(); }
+
+  template<typename K>
+  static const K& key_of(const K& k)
+  { return k; }
+
+  template<typename K>
+  static const K& key_of(const t::prehashed_key<K>& k)
+  { return k.key(); }
+
+  /**
+   *  Хэш пользователя может быть слабым (std::hash<size_t> - тождественный),
+   *  поэтому корзина и позиция считаются по перемешанному хэшу.
+   */
+  static uint64_t mix(size_t hash) noexcept
+  { return t::hash_detail::avalanche(hash); }
+
+  static uint64_t fastrange(uint64_t x, uint64_t n) noexcept
+  { return static_cast<uint64_t>( (static_cast<unsigned __int128>(x) * n) >> 64 ); }
+
+  size_t bucket_of(uint64_t x) const noexcept
+  {
+    const uint64_t hi = x >> 32;
+    if ( static_cast<uint32_t>(x) < dense_keys_threshold )
+      return (hi * dense_buckets_) >> 32;
+    return dense_buckets_ + ( ( hi * (buckets_ - dense_buckets_) ) >> 32 );
+  }
+
+  size_t position(uint64_t x, uint32_t pilot) const noexcept
+  { return fastrange( mix( x ^ (pilot * 0x9E3779B97F4A7C15ull) ), table_size_ ); }
+
+  template<typename K>
+  const_iterator find_hashed(size_t hash, const K& k) const
+  {
+    if ( slots_.empty() )
+      return end();
+    const uint64_t x = mix(hash);
+    size_t p = position( x, pilots_[ bucket_of(x) ] );
+    if ( p >= slots_.size() )
+      p = remap_[ p - slots_.size() ];
+    const_iterator it = slots_.begin() + p;
+    return it->first == k ? it : end();
+  }
+
+  void build(std::vector<value_type, value_allocator>& items)
+  {
+    if ( items.size() >= (uint64_t(1) << 32) )
+      throw std::length_error("frozen_map: too many keys");
+    if ( items.empty() )
+      return;
+
+    size_t log2n = 1;
+    while ( (size_t(1) << log2n) < items.size() )
+      ++log2n;
+    buckets_ = std::max<size_t>( 1, (bucket_density * items.size() + log2n - 1) / log2n );
+    dense_buckets_ = std::max<size_t>( 1, buckets_ * 3 / 10 );
+    if (dense_buckets_ == buckets_)
+      buckets_ = dense_buckets_ + 1;
+
+    //(хэш, номер) по корзинам (сортировка подсчетом); дальше все проходы
+    //идут по корзине подряд, а не вразброс по items
+    typedef std::pair<uint64_t, uint32_t> member_type;
+    std::vector<member_type> members( items.size() );
+    std::vector<uint32_t> first( buckets_ + 1, 0 );
+    for (size_t i = 0; i < items.size(); ++i) {
+      members[i] = member_type( mix( hash_of(items[i].first) ), static_cast<uint32_t>(i) );
+      ++first[ bucket_of(members[i].first) + 1 ];
+    }
+    for (size_t b = 1; b <= buckets_; ++b)
+      first[b] += first[b - 1];
+    {
+      std::vector<member_type> sorted( items.size() );
+      std::vector<uint32_t> pos( first.begin(), first.end() - 1 );
+      for (auto& it : members)
+        sorted[ pos[ bucket_of(it.first) ]++ ] = it;
+      members.swap(sorted);
+    }
+
+    //одинаковые хэши попадают в одну корзину: повторы ключа убираются
+    //внутри корзин (остается первый), разные ключи с одним хэшем не
+    //развести никаким pilot'ом
+    size_t n = 0, max_size = 0;
+    for (size_t b = 0; b < buckets_; ++b) {
+      member_type* m = members.data() + first[b];
+      const size_t size = first[b + 1] - first[b];
+      std::sort(m, m + size);
+      first[b] = static_cast<uint32_t>(n);
+      for (size_t j = 0; j < size; ++j) {
+        if ( j && m[j].first == m[j - 1].first ) {
+          if ( !(items[ m[j].second ].first == items[ m[j - 1].second ].first) )
+            throw std::runtime_error("frozen_map: 64-bit hash collision between different keys");
+          continue;
+        }
+        members[n++] = m[j];
+      }
+      max_size = std::max<size_t>( max_size, n - first[b] );
+    }
+    first[buckets_] = static_cast<uint32_t>(n);
+    table_size_ = n + (n + 98) / 99;
+
+    //корзины по убыванию размера
+    std::vector<uint32_t> by_size_first( max_size + 2, 0 );
+    for (size_t b = 0; b < buckets_; ++b)
+      ++by_size_first[ max_size - (first[b + 1] - first[b]) + 1 ];
+    for (size_t s = 1; s < by_size_first.size(); ++s)
+      by_size_first[s] += by_size_first[s - 1];
+    std::vector<uint32_t> order(buckets_);
+    for (size_t b = 0; b < buckets_; ++b)
+      order[ by_size_first[ max_size - (first[b + 1] - first[b]) ]++ ] = static_cast<uint32_t>(b);
+
+    //подбор pilot'ов
+    pilots_.assign(buckets_, 0);
+    std::vector<uint64_t> taken( (table_size_ + 63) / 64, 0 );
+    auto is_taken = [&taken](size_t p) { return (taken[p / 64] >> (p % 64)) & 1; };
+    std::vector<size_t> trial;
+    for (uint32_t b : order) {
+      member_type* m = members.data() + first[b];
+      const size_t size = first[b + 1] - first[b];
+      if (size == 0)
+        break;
+      for (uint32_t pilot = 0;; ++pilot) {
+        if ( pilot == UINT32_MAX )
+          throw std::runtime_error("frozen_map: no pilot found");
+        trial.clear();
+        bool ok = true;
+        for (size_t j = 0; j < size && ok; ++j) {
+          const size_t p = position( m[j].first, pilot );
+          ok = !is_taken(p) && std::find( trial.begin(), trial.end(), p ) == trial.end();
+          trial.push_back(p);
+        }
+        if (!ok)
+          continue;
+        for (size_t j = 0; j < size; ++j) {
+          taken[ trial[j] / 64 ] |= uint64_t(1) << (trial[j] % 64);
+          m[j].first = trial[j]; //дальше нужен только слот
+        }
+        pilots_[b] = pilot;
+        break;
+      }
+    }
+
+    //занятые позиции за n -> свободные места внутри [0, n)
+    remap_.assign(table_size_ - n, 0);
+    size_t hole = 0;
+    for (size_t p = n; p < table_size_; ++p) {
+      if ( !is_taken(p) )
+        continue;
+      while ( is_taken(hole) )
+        ++hole;
+      remap_[p - n] = static_cast<uint32_t>(hole++);
+    }
+
+    std::vector<uint32_t> item_at(n);
+    for (size_t j = 0; j < n; ++j) {
+      const size_t p = members[j].first;
+      item_at[ p < n ? p : remap_[p - n] ] = members[j].second;
+    }
+    slots_.reserve(n);
+    for (size_t p = 0; p < n; ++p)
+      slots_.push_back( std::move( items[ item_at[p] ] ) );
+  }
+
+  slots_type slots_;
+  std::vector<uint32_t, index_allocator> pilots_;
+  std::vector<uint32_t, index_allocator> remap_;
+  size_t buckets_;
+  size_t dense_buckets_;
+  size_t table_size_;
+};
+
+}
+
+#endif // FROZEN_MAP_HPP
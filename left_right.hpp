@@ -0,0 +1,360 @@
+#ifndef LEFT_RIGHT_HPP
+#define LEFT_RIGHT_HPP
+
+#include <unordered_map>
+#include <mutex>
+#include <atomic>
+#include <optional>
+#include <stdexcept>
+#include <tuple>
+#include <utility>
+
+#include "string_hash.h"
+#include "locks.hpp"
+
+namespace t3
+{
+
+/**
+ *  Left-right (Ramalhete, Correia) - вариант threadsafe_adapter для
+ *  нагрузки почти из одних поисков. Контейнер хранится в двух экземплярах.
+ *  Читатель отмечается в счетчике текущей версии и идет в экземпляр, на
+ *  который указывает read_side_: без блокировок и без циклов ожидания
+ *  (wait-free), писатель его никогда не задерживает. Писатели идут по
+ *  одному (writer_): изменение делается в экземпляре без читателей,
+ *  read_side_ переключается на него, писатель дожидается ухода читателей
+ *  из старого экземпляра и переносит изменение туда.
+ *
+ *  Цена: вдвое больше памяти, каждая запись делается дважды и ждет
+ *  читателей. Итераторы и ссылки наружу не отдаются - экземпляр меняется,
+ *  как только читатель из него вышел, поэтому чтение только через
+ *  visit/get/at (копия)/read.
+ */
+template<typename _T, typename _Mutex_type = std::mutex>
+class left_right_adapter
+{
+public:
+  typedef typename _T::key_type key_type;
+  typedef typename _T::mapped_type mapped_type;
+  typedef typename _T::value_type value_type;
+  typedef typename _T::size_type size_type;
+  typedef typename _T::allocator_type allocator_type;
+
+  left_right_adapter() : read_side_(0), version_(0)
+  {  }
+
+  explicit left_right_adapter(const allocator_type& a) :
+    instances_{ _T(a), _T(a) }, read_side_(0), version_(0)
+  {  }
+
+  left_right_adapter(const left_right_adapter&) = delete;
+  left_right_adapter& operator=(const left_right_adapter&) = delete;
+
+  //Capacity:
+  bool empty() const noexcept
+  { return read( [](const _T& m) { return m.empty(); } ); }
+
+  size_type size() const noexcept
+  { return read( [](const _T& m) { return m.size(); } ); }
+
+  //Element lookup:
+  /**
+   *  fn(const value_type&) выполняется в читающем экземпляре.
+   */
+  template<typename K, typename F>
+  bool visit(const K& k, F fn) const
+  {
+    return read( [&](const _T& m) -> bool {
+      auto it = m.find(k);
+      if ( it == m.end() )
+        return false;
+      fn(*it);
+      return true;
+    } );
+  }
+
+  template<typename K>
+  bool contains(const K& k) const
+  { return read( [&](const _T& m) { return m.find(k) != m.end(); } ); }
+
+  template<typename K>
+  size_type count(const K& k) const
+  { return contains(k); }
+
+  template<typename K>
+  std::optional<mapped_type> get(const K& k) const
+  {
+    return read( [&](const _T& m) -> std::optional<mapped_type> {
+      auto it = m.find(k);
+      if ( it == m.end() )
+        return std::nullopt;
+      return it->second;
+    } );
+  }
+
+  template<typename K>
+  mapped_type at(const K& k) const
+  {
+    std::optional<mapped_type> res = get(k);
+    if (!res)
+      throw std::out_of_range("left_right_adapter::at");
+    return std::move(*res);
+  }
+
+  template<typename K>
+  static t::prehashed_key<K> prehash(const K& k)
+  { return t::prehashed_key<K>( k, typename _T::hasher{}(k) ); }
+
+  /**
+   *  Произвольное чтение читающего экземпляра, например обход:
+   *  f(const _T&), возвращается результат f.
+   */
+  template<typename F>
+  auto read(F&& f) const -> decltype( f( std::declval<const _T&>() ) )
+  {
+    reader_guard guard(*this);
+    return f( instances_[ read_side_.load() ] );
+  }
+
+  //Modifiers:
+  /**
+   *  Как std::unordered_map::insert: существующий ключ не меняется.
+   */
+  bool insert(const value_type& val)
+  {
+    return write_key( val.first, [&](_T& m, bool& changed) {
+      changed = m.insert(val).second;
+      return changed;
+    } );
+  }
+
+  /**
+   *  Вставка или замена значения, как у threadsafe_adapter.
+   */
+  template<typename K>
+  void insert(const t::prehashed_key<K>& k, const mapped_type& val)
+  {
+    write_key( k, [&](_T& m, bool&) {
+      auto it = m.find(k);
+      if ( it == m.end() )
+        m.emplace( std::piecewise_construct, std::forward_as_tuple( k.key() ),
+                   std::forward_as_tuple(val) );
+      else
+        it->second = val;
+      return true;
+    } );
+  }
+
+  template<typename K>
+  size_type erase(const K& k)
+  {
+    return write_key( k, [&](_T& m, bool& changed) -> size_type {
+      auto it = m.find(k);
+      changed = it != m.end();
+      if (changed)
+        m.erase(it);
+      return changed;
+    } );
+  }
+
+  void clear()
+  { write( [](_T& m) { m.clear(); } ); }
+
+  void reserve(size_t n)
+  { write( [n](_T& m) { m.reserve(n); } ); }
+
+  //Compute in place:
+  /**
+   *  То же, что у threadsafe_adapter. fn и factory вызываются один раз:
+   *  во второй экземпляр копируется уже готовая запись.
+   */
+  template<typename K, typename F>
+  bool upsert(const K& k, const mapped_type& val, F fn)
+  {
+    return write_key( k, [&](_T& m, bool&) -> bool {
+      auto it = m.find(k);
+      if ( it != m.end() ) {
+        fn(it->second);
+        return false;
+      }
+      m.emplace( std::piecewise_construct, std::forward_as_tuple( key_of(k) ),
+                 std::forward_as_tuple(val) );
+      return true;
+    } );
+  }
+
+  template<typename K, typename F>
+  mapped_type compute_if_absent(const K& k, F factory)
+  {
+    return write_key( k, [&](_T& m, bool& changed) -> mapped_type {
+      auto it = m.find(k);
+      changed = it == m.end();
+      if (changed)
+        it = m.emplace( std::piecewise_construct, std::forward_as_tuple( key_of(k) ),
+                        std::forward_as_tuple( factory() ) ).first;
+      return it->second;
+    } );
+  }
+
+  template<typename K, typename P>
+  bool erase_if(const K& k, P pred)
+  {
+    return write_key( k, [&](_T& m, bool& changed) -> bool {
+      auto it = m.find(k);
+      changed = it != m.end() && pred(*it);
+      if (changed)
+        m.erase(it);
+      return changed;
+    } );
+  }
+
+  /**
+   *  Пакет изменений за одно переключение: f(_T&) применяется к обоим
+   *  экземплярам по очереди и должна менять их одинаково (не зависеть от
+   *  времени, случайных чисел и т.п.).
+   */
+  template<typename F>
+  void write(F f)
+  {
+    std::lock_guard<_Mutex_type> lock(writer_);
+    const int front = read_side_.load(std::memory_order_relaxed);
+    f( instances_[1 - front] );
+    publish(front);
+    //та же f на копии, где она только что прошла: упасть здесь может
+    //только по памяти, а разошедшиеся копии хуже std::terminate
+    [&]() noexcept { f( instances_[front] ); }();
+  }
+
+private:
+  /**
+   *  Счетчик читателей одной версии, разнесенный по кэш-линиям: потоки
+   *  отмечаются каждый в своем слоте.
+   */
+  struct read_indicator
+  {
+    static const size_t slots = 16;
+
+    struct alignas(64) slot
+    {
+      std::atomic<uint32_t> readers;
+
+      slot() : readers(0)
+      { }
+    };
+
+    slot counters[slots];
+
+    void arrive() noexcept
+    { counters[ t::lock_detail::thread_index() % slots ].readers.fetch_add(1); }
+
+    void depart() noexcept
+    { counters[ t::lock_detail::thread_index() % slots ].readers.fetch_sub(1, std::memory_order_release); }
+
+    bool empty() const noexcept
+    {
+      for (auto& it : counters) {
+        if ( it.readers.load() != 0 )
+          return false;
+      }
+      return true;
+    }
+  };
+
+  struct reader_guard
+  {
+    read_indicator& indicator;
+
+    explicit reader_guard(const left_right_adapter& lr) :
+      indicator( lr.indicators_[ lr.version_.load() ] )
+    { indicator.arrive(); }
+
+    ~reader_guard()
+    { indicator.depart(); }
+  };
+
+  /**
+   *  Изменение по одному ключу: f(back, changed) работает с экземпляром
+   *  без читателей, во второй переносится итоговое состояние ключа.
+   *  Если f ничего не изменила (changed = false), копии и так совпадают,
+   *  и переключения нет.
+   */
+  template<typename K, typename F>
+  auto write_key(const K& k, F&& f) -> decltype( f( std::declval<_T&>(), std::declval<bool&>() ) )
+  {
+    std::lock_guard<_Mutex_type> lock(writer_);
+    const int front = read_side_.load(std::memory_order_relaxed);
+    _T& back = instances_[1 - front];
+    bool changed = true;
+    auto res = f(back, changed);
+    if (changed) {
+      publish(front);
+      [&]() noexcept { sync_key( instances_[front], back, k ); }();
+    }
+    return res;
+  }
+
+  /**
+   *  Читатели переводятся на экземпляр 1 - front, после чего
+   *  дожидаемся всех, кто мог войти в front. Версия переключается в два
+   *  шага: сначала ждем опустения счетчика следующей версии (там могли
+   *  остаться опоздавшие с прошлого раза), затем - текущей.
+   */
+  void publish(int front)
+  {
+    read_side_.store(1 - front);
+    const int prev = version_.load(std::memory_order_relaxed);
+    const int next = 1 - prev;
+    wait_empty( indicators_[next] );
+    version_.store(next);
+    wait_empty( indicators_[prev] );
+  }
+
+  static void wait_empty(const read_indicator& indicator)
+  {
+    t::lock_detail::backoff wait;
+    while ( !indicator.empty() )
+      wait();
+  }
+
+  template<typename K>
+  static void sync_key(_T& to, const _T& from, const K& k)
+  {
+    auto src = from.find(k);
+    auto dst = to.find(k);
+    if ( src == from.end() ) {
+      if ( dst != to.end() )
+        to.erase(dst);
+    } else if ( dst != to.end() ) {
+      dst->second = src->second;
+    } else {
+      to.insert(*src);
+    }
+  }
+
+  template<typename K>
+  static const K& key_of(const K& k)
+  { return k; }
+
+  template<typename K>
+  static const K& key_of(const t::prehashed_key<K>& k)
+  { return k.key(); }
+
+  _T instances_[2];
+  std::atomic<int> read_side_;          //куда идут читатели
+  std::atomic<int> version_;            //в чей счетчик они отмечаются
+  mutable read_indicator indicators_[2];
+  _Mutex_type writer_;
+};
+
+/**
+ *  t3::map в режиме left-right.
+ */
+template <typename __Key, typename __Value, typename mutex_type=std::mutex,
+          typename hash_type=t::transparent_hash<__Key>,
+          typename alloc_type=std::allocator< std::pair<const __Key, __Value> > >
+using left_right_map = left_right_adapter< std::unordered_map<__Key, __Value, hash_type, t::transparent_equal, alloc_type>,
+                                           mutex_type >;
+
+}
+
+#endif // LEFT_RIGHT_HPP
@@ -0,0 +1,437 @@
+#ifndef LOCKS_HPP
+#define LOCKS_HPP
+
+#include <atomic>
+#include <thread>
+#include <deque>
+#include <cstdint>
+#include <cstddef>
+#include <algorithm>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace t
+{
+
+/**
+ *  Блокировки для параметра _Mutex_type (t1::map, t3::map): все умеют
+ *  lock/try_lock/unlock (Lockable, try_lock нужен t1::lock_stats),
+ *  reader_biased_lock - еще и lock_shared/unlock_shared.
+ *
+ *  ttas_spinlock   - test-and-test-and-set с экспоненциальной паузой;
+ *  ticket_lock     - очередь по номерам, честный порядок (FIFO);
+ *  mcs_lock        - очередь MCS, каждый ждет на своей кэш-линии;
+ *  adaptive_mutex  - недолго крутится, потом засыпает (futex через
+ *                    std::atomic::wait);
+ *  reader_biased_lock - читатели отмечаются в разных кэш-линиях,
+ *                    писатель ждет, пока все уйдут.
+ *
+ *  На одном ядре ждать кручением бессмысленно - владелец не работает,
+ *  пока мы крутимся, поэтому там все ожидания сразу отдают квант.
+ */
+namespace lock_detail
+{
+
+inline void pause() noexcept
+{
+#if defined(__SSE2__)
+  _mm_pause();
+#else
+  std::this_thread::yield();
+#endif
+}
+
+inline bool single_core() noexcept
+{
+  static const bool res = std::thread::hardware_concurrency() <= 1;
+  return res;
+}
+
+/**
+ *  Номер потока в порядке первого обращения: по нему потоки
+ *  раскладываются по слотам счетчиков читателей.
+ */
+inline size_t thread_index() noexcept
+{
+  static std::atomic<size_t> next(0);
+  thread_local const size_t res = next.fetch_add(1, std::memory_order_relaxed);
+  return res;
+}
+
+/**
+ *  Экспоненциальная пауза: 1, 2, 4 ... 2^max_shift pause подряд, после
+ *  yield_after шагов - yield (владелец, вероятно, вытеснен).
+ */
+class backoff
+{
+public:
+  backoff() : step_(0)
+  { }
+
+  void operator()() noexcept
+  {
+    if ( single_core() || step_ >= yield_after ) {
+      std::this_thread::yield();
+      return;
+    }
+    for (size_t i = size_t(1) << std::min(step_, max_shift); i; --i)
+      pause();
+    ++step_;
+  }
+
+private:
+  static constexpr size_t max_shift = 6;
+  static constexpr size_t yield_after = 16;
+
+  size_t step_;
+};
+
+}
+
+class ttas_spinlock
+{
+public:
+  ttas_spinlock() : locked_(false)
+  { }
+
+  ttas_spinlock(const ttas_spinlock&) = delete;
+  ttas_spinlock& operator=(const ttas_spinlock&) = delete;
+
+  void lock() noexcept
+  {
+    lock_detail::backoff wait;
+    //exchange только когда свободно: пока занято, читаем свою копию линии
+    while ( locked_.exchange(true, std::memory_order_acquire) ) {
+      do
+        wait();
+      while ( locked_.load(std::memory_order_relaxed) );
+    }
+  }
+
+  bool try_lock() noexcept
+  {
+    return !locked_.load(std::memory_order_relaxed) &&
+           !locked_.exchange(true, std::memory_order_acquire);
+  }
+
+  void unlock() noexcept
+  { locked_.store(false, std::memory_order_release); }
+
+private:
+  std::atomic<bool> locked_;
+};
+
+class ticket_lock
+{
+public:
+  ticket_lock() : next_(0), serving_(0)
+  { }
+
+  ticket_lock(const ticket_lock&) = delete;
+  ticket_lock& operator=(const ticket_lock&) = delete;
+
+  void lock() noexcept
+  {
+    const uint32_t ticket = next_.fetch_add(1, std::memory_order_relaxed);
+    for (;;) {
+      const uint32_t serving = serving_.load(std::memory_order_acquire);
+      if (serving == ticket)
+        return;
+      if ( lock_detail::single_core() ) {
+        std::this_thread::yield();
+        continue;
+      }
+      //пауза пропорциональна числу стоящих впереди
+      for (uint32_t i = std::min<uint32_t>(ticket - serving, 64) * 16; i; --i)
+        lock_detail::pause();
+    }
+  }
+
+  bool try_lock() noexcept
+  {
+    uint32_t serving = serving_.load(std::memory_order_relaxed);
+    return next_.compare_exchange_strong(serving, serving + 1, std::memory_order_acquire,
+                                         std::memory_order_relaxed);
+  }
+
+  void unlock() noexcept
+  { serving_.store(serving_.load(std::memory_order_relaxed) + 1, std::memory_order_release); }
+
+private:
+  std::atomic<uint32_t> next_;
+  std::atomic<uint32_t> serving_;
+};
+
+/**
+ *  Узлы очереди берутся из пула потока: lock()/unlock() без аргументов,
+ *  как у std::mutex, и поток может держать сразу несколько mcs_lock
+ *  (t1::map::snapshot() берет все сегменты). Узел владельца запоминается
+ *  в owner_ - его читает и пишет только тот, кто держит блокировку.
+ *  lock() и unlock() должны вызываться из одного потока.
+ */
+class mcs_lock
+{
+public:
+  mcs_lock() : tail_(nullptr), owner_(nullptr)
+  { }
+
+  mcs_lock(const mcs_lock&) = delete;
+  mcs_lock& operator=(const mcs_lock&) = delete;
+
+  void lock() noexcept
+  {
+    node* me = acquire_node();
+    node* prev = tail_.exchange(me, std::memory_order_acq_rel);
+    if (prev) {
+      prev->next.store(me, std::memory_order_release);
+      lock_detail::backoff wait;
+      while ( me->waiting.load(std::memory_order_acquire) )
+        wait();
+    }
+    owner_ = me;
+  }
+
+  bool try_lock() noexcept
+  {
+    node* me = acquire_node();
+    node* expected = nullptr;
+    if ( !tail_.compare_exchange_strong(expected, me, std::memory_order_acquire,
+                                        std::memory_order_relaxed) ) {
+      release_node(me);
+      return false;
+    }
+    owner_ = me;
+    return true;
+  }
+
+  void unlock() noexcept
+  {
+    node* me = owner_;
+    node* next = me->next.load(std::memory_order_acquire);
+    if (!next) {
+      node* expected = me;
+      if ( tail_.compare_exchange_strong(expected, nullptr, std::memory_order_release,
+                                         std::memory_order_relaxed) ) {
+        release_node(me);
+        return;
+      }
+      //следующий уже встал в хвост, но еще не связал себя с нами
+      while ( !(next = me->next.load(std::memory_order_acquire)) )
+        lock_detail::pause();
+    }
+    next->waiting.store(false, std::memory_order_release);
+    release_node(me);
+  }
+
+private:
+  struct alignas(64) node
+  {
+    std::atomic<node*> next;
+    std::atomic<bool>  waiting;
+    node*              free_next;
+
+    node() : next(nullptr), waiting(true), free_next(nullptr)
+    { }
+  };
+
+  struct node_pool
+  {
+    std::deque<node> nodes; //адреса узлов не меняются
+    node* free = nullptr;
+  };
+
+  static node_pool& pool()
+  {
+    thread_local node_pool res;
+    return res;
+  }
+
+  static node* acquire_node()
+  {
+    node_pool& p = pool();
+    node* res = p.free;
+    if (res)
+      p.free = res->free_next;
+    else
+      res = &p.nodes.emplace_back();
+    res->next.store(nullptr, std::memory_order_relaxed);
+    res->waiting.store(true, std::memory_order_relaxed);
+    return res;
+  }
+
+  //после unlock() узел никому не виден: преемник ждет на своем узле
+  static void release_node(node* n) noexcept
+  {
+    node_pool& p = pool();
+    n->free_next = p.free;
+    p.free = n;
+  }
+
+  std::atomic<node*> tail_;
+  node* owner_;
+};
+
+/**
+ *  Spin-then-park: первая попытка - CAS, затем кручение, ограниченное
+ *  скользящим средним того, сколько кручений понадобилось раньше (как
+ *  PTHREAD_MUTEX_ADAPTIVE_NP), затем сон в ядре до unlock().
+ *  state_: 0 - свободен, 1 - занят, 2 - занят и, возможно, есть спящие.
+ */
+class adaptive_mutex
+{
+public:
+  adaptive_mutex() : state_(0), spin_estimate_(0)
+  { }
+
+  adaptive_mutex(const adaptive_mutex&) = delete;
+  adaptive_mutex& operator=(const adaptive_mutex&) = delete;
+
+  void lock() noexcept
+  {
+    if ( try_lock() )
+      return;
+
+    if ( !lock_detail::single_core() ) {
+      const uint32_t estimate = spin_estimate_.load(std::memory_order_relaxed);
+      const uint32_t max_spins = std::min<uint32_t>(2 * estimate + 16, max_spin_limit);
+      for (uint32_t spins = 1; spins <= max_spins; ++spins) {
+        lock_detail::pause();
+        if ( state_.load(std::memory_order_relaxed) == 0 && try_lock() ) {
+          update_estimate(estimate, spins);
+          return;
+        }
+      }
+      update_estimate(estimate, max_spins);
+    }
+
+    while ( state_.exchange(2, std::memory_order_acquire) != 0 )
+      state_.wait(2, std::memory_order_relaxed);
+  }
+
+  bool try_lock() noexcept
+  {
+    uint32_t expected = 0;
+    return state_.compare_exchange_strong(expected, 1, std::memory_order_acquire,
+                                          std::memory_order_relaxed);
+  }
+
+  void unlock() noexcept
+  {
+    if ( state_.exchange(0, std::memory_order_release) == 2 )
+      state_.notify_one();
+  }
+
+private:
+  static constexpr uint32_t max_spin_limit = 1000;
+
+  void update_estimate(uint32_t estimate, uint32_t spins) noexcept
+  {
+    const int32_t delta = (static_cast<int32_t>(spins) - static_cast<int32_t>(estimate)) / 8;
+    spin_estimate_.store(estimate + delta, std::memory_order_relaxed);
+  }
+
+  std::atomic<uint32_t> state_;
+  std::atomic<uint32_t> spin_estimate_; //приблизительное, гонки не страшны
+};
+
+/**
+ *  Разделяемая блокировка с уклоном в сторону читателей: читатель
+ *  увеличивает счетчик в своей кэш-линии (слот выбирается по потоку) и
+ *  проверяет флаг писателя - без общей линии, на которую пишут все
+ *  читатели, как у std::shared_mutex. Писатель ставит флаг (новые
+ *  читатели отступают) и ждет, пока обнулятся все слоты, так что запись
+ *  дорогая: reader_slots линий на каждый захват.
+ *
+ *  Флаг и счетчики - seq_cst с обеих сторон: либо читатель видит флаг,
+ *  либо писатель видит его счетчик.
+ */
+class reader_biased_lock
+{
+public:
+  static const size_t reader_slots = 16;
+
+  reader_biased_lock() : writer_(false)
+  {
+    for (auto& it : slots_)
+      it.readers.store(0, std::memory_order_relaxed);
+  }
+
+  reader_biased_lock(const reader_biased_lock&) = delete;
+  reader_biased_lock& operator=(const reader_biased_lock&) = delete;
+
+  void lock() noexcept
+  {
+    lock_detail::backoff wait;
+    while ( writer_.exchange(true) ) {
+      do
+        wait();
+      while ( writer_.load(std::memory_order_relaxed) );
+    }
+    for (auto& it : slots_) {
+      while ( it.readers.load() != 0 )
+        wait();
+    }
+  }
+
+  bool try_lock() noexcept
+  {
+    if ( writer_.load(std::memory_order_relaxed) || writer_.exchange(true) )
+      return false;
+    for (auto& it : slots_) {
+      if ( it.readers.load() != 0 ) {
+        writer_.store(false, std::memory_order_release);
+        return false;
+      }
+    }
+    return true;
+  }
+
+  void unlock() noexcept
+  { writer_.store(false, std::memory_order_release); }
+
+  void lock_shared() noexcept
+  {
+    std::atomic<uint32_t>& readers = slots_[ slot_index() ].readers;
+    lock_detail::backoff wait;
+    for (;;) {
+      readers.fetch_add(1);
+      if ( !writer_.load() )
+        return;
+      readers.fetch_sub(1, std::memory_order_release);
+      do
+        wait();
+      while ( writer_.load(std::memory_order_relaxed) );
+    }
+  }
+
+  bool try_lock_shared() noexcept
+  {
+    std::atomic<uint32_t>& readers = slots_[ slot_index() ].readers;
+    readers.fetch_add(1);
+    if ( !writer_.load() )
+      return true;
+    readers.fetch_sub(1, std::memory_order_release);
+    return false;
+  }
+
+  void unlock_shared() noexcept
+  { slots_[ slot_index() ].readers.fetch_sub(1, std::memory_order_release); }
+
+private:
+  struct alignas(64) slot
+  {
+    std::atomic<uint32_t> readers;
+  };
+
+  static size_t slot_index() noexcept
+  { return lock_detail::thread_index() % reader_slots; }
+
+  alignas(64) std::atomic<bool> writer_;
+  slot slots_[reader_slots];
+};
+
+}
+
+#endif // LOCKS_HPP
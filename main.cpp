@@ -2,9 +2,20 @@
 #include <iostream>
 #include <string>
 #include <map>
+#include <vector>
+#include <algorithm>
+#include <thread>
+#include <cstdio>
 
 #include "map1.hpp"
+#include "map2.hpp"
 #include "map3.hpp"
+#include "map.hpp"
+#include "map4.hpp"
+#include "pool_allocator.hpp"
+#include "thread_pool.hpp"
+#include "locks.hpp"
+#include "left_right.hpp"
 #include "test.hpp"
 
 
@@ -25,9 +36,38 @@ int main( int /*argc*/, char*[]/*argv[]*/ )
   run_test(test_multithreading_insert, t1_m, NUMBER_OF_MAP_ELEMENTS);
   std::cout << std::endl;
 
+  static const size_t INSERT_BATCH = 1024;
+  test_insert_batch test_multithreading_insert_batch(NUMBER_OF_THREADS, INSERT_BATCH);
+
+  std::cout << "t1::map (insert_batch)" << std::endl;
+  t1::map<std::string, size_t> t1_batch_m;
+  run_test(test_multithreading_insert_batch, t1_batch_m, NUMBER_OF_MAP_ELEMENTS);
+  std::cout << std::endl;
+
+  std::cout << "t2::map" << std::endl;
+  t2::map<std::string, size_t> t2_m;
+  run_test(test_multithreading_insert, t2_m, NUMBER_OF_MAP_ELEMENTS);
+  std::cout << std::endl;
+
   std::cout << "t3::map" << std::endl;
   t3::map<std::string, size_t> t3_m;
   run_test(test_multithreading_insert, t3_m, NUMBER_OF_MAP_ELEMENTS);
+  std::cout << std::endl;
+
+  std::cout << "t3::map (flat combining)" << std::endl;
+  t3::map<std::string, size_t, t3::flat_combining> t3_fc_m;
+  run_test(test_multithreading_insert, t3_fc_m, NUMBER_OF_MAP_ELEMENTS);
+  std::cout << std::endl;
+
+  std::cout << "t3::map (pool_allocator)" << std::endl;
+  t3::map<std::string, size_t, std::mutex, t::transparent_hash<std::string>,
+          t::pool_allocator< std::pair<const std::string, size_t> > > t3_pool_m;
+  run_test(test_multithreading_insert, t3_pool_m, NUMBER_OF_MAP_ELEMENTS);
+  std::cout << std::endl;
+
+  std::cout << "t4::map (lock-free skip list)" << std::endl;
+  t4::map<std::string, size_t> t4_m;
+  run_test(test_multithreading_insert, t4_m, NUMBER_OF_MAP_ELEMENTS);
   std::cout << "****************************************" << std::endl;
 
   static const size_t VALUE_TO_SET = 0xFF;
@@ -41,8 +81,16 @@ int main( int /*argc*/, char*[]/*argv[]*/ )
   run_test(test_multithreading_access, t1_m, VALUE_TO_SET);
   std::cout << std::endl;
 
+  std::cout << "t2::map" << std::endl;
+  run_test(test_multithreading_access, t2_m, VALUE_TO_SET);
+  std::cout << std::endl;
+
   std::cout << "t3::map" << std::endl;
   run_test(test_multithreading_access, t3_m, VALUE_TO_SET);
+  std::cout << std::endl;
+
+  std::cout << "t4::map" << std::endl;
+  run_test(test_multithreading_access, t4_m, VALUE_TO_SET);
   std::cout << "****************************************" << std::endl;
 
   test_access_erase test_multithreading_access_erase(NUMBER_OF_THREADS);
@@ -55,8 +103,306 @@ int main( int /*argc*/, char*[]/*argv[]*/ )
   run_test(test_multithreading_access_erase, t1_m, 0);
   std::cout << std::endl;
 
+  std::cout << "t2::map" << std::endl;
+  run_test(test_multithreading_access_erase, t2_m, 0);
+  std::cout << std::endl;
+
   std::cout << "t3::map" << std::endl;
   run_test(test_multithreading_access_erase, t3_m, 0);
+  std::cout << std::endl;
+
+  std::cout << "t4::map" << std::endl;
+  run_test(test_multithreading_access_erase, t4_m, 0);
+  std::cout << "****************************************" << std::endl;
+
+  static const size_t SNAPSHOT_WRITERS  = 7;
+  static const size_t SNAPSHOT_ELEMENTS = 100000;
+  test_snapshot_scan test_multithreading_snapshot( SNAPSHOT_WRITERS + 1, std::chrono::milliseconds(50) );
+
+  std::cout << "t1::map (snapshot scan)" << std::endl;
+  t1::map<std::string, size_t> t1_snapshot_m;
+  for (size_t i = 0; i < SNAPSHOT_WRITERS * SNAPSHOT_ELEMENTS; ++i)
+    t1_snapshot_m["task" + std::to_string(i)] = i;
+  run_test(test_multithreading_snapshot, t1_snapshot_m, SNAPSHOT_ELEMENTS);
+  std::cout << "****************************************" << std::endl;
+
+  static const size_t SHARD_ELEMENTS     = 1000000;
+  static const size_t SHARD_LOOKUP_ROUNDS = 10;
+  test_shard_lookup test_shard(SHARD_LOOKUP_ROUNDS);
+
+  std::cout << "shard storage: std::unordered_map (node-based)" << std::endl;
+  node_shard node_sh;
+  run_test(test_shard, node_sh, SHARD_ELEMENTS);
+  std::cout << std::endl;
+
+  std::cout << "shard storage: t1::flat_table" << std::endl;
+  flat_shard flat_sh;
+  run_test(test_shard, flat_sh, SHARD_ELEMENTS);
+  std::cout << "****************************************" << std::endl;
+
+  static const size_t READ_MOSTLY_OPERATIONS = 200000;
+  test_read_mostly test_multithreading_read_mostly(NUMBER_OF_THREADS);
+
+  std::cout << "t1::map<size_t, size_t> (optimistic find)" << std::endl;
+  t1::map<size_t, size_t> t1_int_m;
+  for (size_t i = 0; i < NUMBER_OF_MAP_ELEMENTS; ++i)
+    t1_int_m[i] = i;
+  run_test(test_multithreading_read_mostly, t1_int_m, READ_MOSTLY_OPERATIONS);
+  std::cout << std::endl;
+
+  std::cout << "t1::map<std::string, size_t> (optimistic find)" << std::endl;
+  t1::map<std::string, size_t> t1_str_m;
+  for (size_t i = 0; i < NUMBER_OF_MAP_ELEMENTS; ++i)
+    t1_str_m["task" + std::to_string(i)] = i;
+  run_test(test_multithreading_read_mostly, t1_str_m, READ_MOSTLY_OPERATIONS);
+  std::cout << std::endl;
+
+  std::cout << "t3::map<std::string, size_t> (mutex)" << std::endl;
+  run_test(test_multithreading_read_mostly, t3_m, READ_MOSTLY_OPERATIONS);
+  std::cout << std::endl;
+
+  std::cout << "t3::map<std::string, size_t> (flat combining)" << std::endl;
+  run_test(test_multithreading_read_mostly, t3_fc_m, READ_MOSTLY_OPERATIONS);
+  std::cout << "****************************************" << std::endl;
+
+  static const size_t FULL_SCAN_ELEMENTS = 5000000;
+  static const size_t FULL_SCAN_ROUNDS   = 5;
+  test_full_sum test_sequential_sum(false);
+  test_full_sum test_parallel_sum(true);
+
+  std::cout << "t1::map<size_t, size_t> full-map aggregation, "
+            << t::thread_pool::instance().size() << " pool threads" << std::endl;
+  t1::map<size_t, size_t> t1_full_m;
+  t1_full_m.reserve(FULL_SCAN_ELEMENTS);
+  for (size_t i = 0; i < FULL_SCAN_ELEMENTS; ++i)
+    t1_full_m[i] = i;
+  run_test(test_sequential_sum, t1_full_m, FULL_SCAN_ROUNDS);
+  run_test(test_parallel_sum, t1_full_m, FULL_SCAN_ROUNDS);
+  std::cout << "****************************************" << std::endl;
+
+  static const size_t FILE_LOOKUPS = 1000000;
+  const std::string file_path = "t1_map_bench.bin";
+  test_file_start test_open(file_path, true);
+  test_file_start test_rebuild(file_path, false);
+
+  std::cout << "t1::map<size_t, size_t> start from file, " << FULL_SCAN_ELEMENTS << " elements" << std::endl;
+  t1_full_m.save(file_path);
+  run_test(test_open, t1_full_m, FILE_LOOKUPS);
+  run_test(test_rebuild, t1_full_m, FILE_LOOKUPS);
+  std::remove( file_path.c_str() );
+  std::cout << "****************************************" << std::endl;
+
+  static const size_t FROZEN_ELEMENTS = 5000000;
+  static const size_t FROZEN_LOOKUPS  = 2000000;
+  typedef std::pair<size_t, size_t> counted_value;
+  typedef t1::map< size_t, size_t, std::mutex, 0, t::transparent_hash<size_t>,
+                   counting_allocator<counted_value> > counted_t1;
+  test_concurrent_lookup test_lookups(4);
+
+  std::cout << "t1::map<size_t, size_t> vs frozen_map, " << FROZEN_ELEMENTS << " elements" << std::endl;
+  const long long t1_bytes_before = allocation_counter::bytes();
+  counted_t1 t1_counted_m;
+  for (size_t i = 0; i < FROZEN_ELEMENTS; ++i)
+    t1_counted_m[i] = i;
+  std::cout << "t1::map bytes per entry: "
+            << double(allocation_counter::bytes() - t1_bytes_before) / FROZEN_ELEMENTS << std::endl;
+
+  const long long frozen_bytes_before = allocation_counter::bytes();
+  std::chrono::steady_clock::time_point freeze_start = std::chrono::steady_clock::now();
+  const counted_t1::frozen_type frozen_m = t1_counted_m.freeze();
+  std::cout << "freeze: " << std::chrono::duration_cast<std::chrono::milliseconds>(
+                 std::chrono::steady_clock::now() - freeze_start ).count() << " milliseconds"
+            << ", frozen_map bytes per entry: "
+            << double(allocation_counter::bytes() - frozen_bytes_before) / FROZEN_ELEMENTS << std::endl;
+
+  run_test(test_lookups, t1_counted_m, FROZEN_LOOKUPS);
+  run_test(test_lookups, frozen_m, FROZEN_LOOKUPS);
+  std::cout << "****************************************" << std::endl;
+
+  static const size_t SCALING_ELEMENTS = 1000000;
+  const size_t max_threads = 2 * std::max(1u, std::thread::hardware_concurrency());
+
+  std::cout << "t1::map scaling, fixed 8 super buckets" << std::endl;
+  run_scaling_test< t1::map<std::string, size_t> >(8, max_threads, SCALING_ELEMENTS);
+  std::cout << std::endl;
+
+  std::cout << "t1::map scaling, default super buckets" << std::endl;
+  run_scaling_test< t1::map<std::string, size_t> >(0, max_threads, SCALING_ELEMENTS);
+  std::cout << "****************************************" << std::endl;
+
+  static const size_t LOCK_KEYS       = 100000;
+  static const size_t LOCK_OPERATIONS = 400000;
+  const std::vector<size_t> lock_writes = { 1, 10, 50 };
+
+  std::cout << "lock matrix, t3::map<size_t, size_t> (one lock per map)" << std::endl;
+  run_lock_matrix< t3::map<size_t, size_t, std::mutex> >("std::mutex", max_threads, LOCK_KEYS, LOCK_OPERATIONS, lock_writes);
+  run_lock_matrix< t3::map<size_t, size_t, std::shared_mutex> >("std::shared_mutex", max_threads, LOCK_KEYS, LOCK_OPERATIONS, lock_writes);
+  run_lock_matrix< t3::map<size_t, size_t, t::ttas_spinlock> >("ttas_spinlock", max_threads, LOCK_KEYS, LOCK_OPERATIONS, lock_writes);
+  run_lock_matrix< t3::map<size_t, size_t, t::ticket_lock> >("ticket_lock", max_threads, LOCK_KEYS, LOCK_OPERATIONS, lock_writes);
+  run_lock_matrix< t3::map<size_t, size_t, t::mcs_lock> >("mcs_lock", max_threads, LOCK_KEYS, LOCK_OPERATIONS, lock_writes);
+  run_lock_matrix< t3::map<size_t, size_t, t::adaptive_mutex> >("adaptive_mutex", max_threads, LOCK_KEYS, LOCK_OPERATIONS, lock_writes);
+  run_lock_matrix< t3::map<size_t, size_t, t::reader_biased_lock> >("reader_biased_lock", max_threads, LOCK_KEYS, LOCK_OPERATIONS, lock_writes);
+  std::cout << std::endl;
+
+  std::cout << "lock matrix, t1::map<size_t, size_t> (one lock per super bucket)" << std::endl;
+  run_lock_matrix< t1::map<size_t, size_t, std::mutex> >("std::mutex", max_threads, LOCK_KEYS, LOCK_OPERATIONS, lock_writes);
+  run_lock_matrix< t1::map<size_t, size_t, t::ttas_spinlock> >("ttas_spinlock", max_threads, LOCK_KEYS, LOCK_OPERATIONS, lock_writes);
+  run_lock_matrix< t1::map<size_t, size_t, t::ticket_lock> >("ticket_lock", max_threads, LOCK_KEYS, LOCK_OPERATIONS, lock_writes);
+  run_lock_matrix< t1::map<size_t, size_t, t::mcs_lock> >("mcs_lock", max_threads, LOCK_KEYS, LOCK_OPERATIONS, lock_writes);
+  run_lock_matrix< t1::map<size_t, size_t, t::adaptive_mutex> >("adaptive_mutex", max_threads, LOCK_KEYS, LOCK_OPERATIONS, lock_writes);
+  run_lock_matrix< t1::map<size_t, size_t, t::reader_biased_lock> >("reader_biased_lock", max_threads, LOCK_KEYS, LOCK_OPERATIONS, lock_writes);
+  std::cout << "****************************************" << std::endl;
+
+  static const size_t LEFT_RIGHT_KEYS       = 100000;
+  static const size_t LEFT_RIGHT_OPERATIONS = 2000000;
+  static const size_t LEFT_RIGHT_WRITES     = 1; //на 1000
+
+  std::cout << "read scaling, 99.9% visit / 0.1% upsert, " << LEFT_RIGHT_OPERATIONS << " operations" << std::endl;
+  for (size_t th = 1; th <= max_threads; th *= 2) {
+    test_visit_mix test_read_scaling(th, LEFT_RIGHT_KEYS, LEFT_RIGHT_WRITES);
+    std::cout << "threads: " << th << std::endl;
+
+    std::cout << "t3::map" << std::endl;
+    t3::map<size_t, size_t> t3_read_m;
+    for (size_t i = 0; i < LEFT_RIGHT_KEYS; ++i)
+      t3_read_m[i] = i;
+    run_test(test_read_scaling, t3_read_m, LEFT_RIGHT_OPERATIONS / th);
+
+    std::cout << "t3::left_right_map" << std::endl;
+    t3::left_right_map<size_t, size_t> lr_read_m;
+    lr_read_m.write( [](auto& m) {
+      for (size_t i = 0; i < LEFT_RIGHT_KEYS; ++i)
+        m[i] = i;
+    } );
+    run_test(test_read_scaling, lr_read_m, LEFT_RIGHT_OPERATIONS / th);
+
+    std::cout << "t1::map" << std::endl;
+    t1::map<size_t, size_t> t1_read_m;
+    for (size_t i = 0; i < LEFT_RIGHT_KEYS; ++i)
+      t1_read_m[i] = i;
+    run_test(test_read_scaling, t1_read_m, LEFT_RIGHT_OPERATIONS / th);
+    std::cout << std::endl;
+  }
+  std::cout << "****************************************" << std::endl;
+
+  static const size_t CACHE_KEYS       = 1000000;
+  static const size_t CACHE_OPERATIONS = 4000000;
+
+  std::cout << "t1::map<size_t, size_t> as zipfian cache, " << CACHE_KEYS << " keys, "
+            << CACHE_OPERATIONS << " operations" << std::endl;
+  for (size_t percent : {1, 5, 20}) {
+    for (size_t th = 1; th <= max_threads; th *= 2) {
+      test_cache_zipf test_cache(th, CACHE_KEYS);
+      t1::map<size_t, size_t> cache_m;
+      cache_m.set_capacity(CACHE_KEYS * percent / 100);
+      std::cout << "capacity: " << percent << "% of keys, threads: " << th << std::endl;
+      run_test(test_cache, cache_m, CACHE_OPERATIONS / th);
+      const t1::cache_stats st = cache_m.cache_statistics();
+      std::cout << "hit rate: " << st.hit_rate() << ", evictions: " << st.evictions << std::endl;
+    }
+  }
+  std::cout << "****************************************" << std::endl;
+
+  static const size_t SESSIONS     = 1000000;
+  static const size_t SESSIONS_DUE = SESSIONS / 100;
+
+  std::cout << "t1::map<size_t, size_t> session expiry, " << SESSIONS << " sessions, "
+            << SESSIONS_DUE << " due" << std::endl;
+  {
+    //отдельный чистильщик: срок в значении, обход всей таблицы
+    t1::map<size_t, size_t> sweep_m;
+    const size_t now = std::chrono::steady_clock::now().time_since_epoch().count();
+    for (size_t i = 0; i < SESSIONS; ++i)
+      sweep_m.insert( {i, i % (SESSIONS / SESSIONS_DUE) ? now + 3600000000000ull : now} );
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    size_t removed = 0;
+    for (auto it = sweep_m.begin(); it != sweep_m.end(); ) {
+      if (it->second <= now) {
+        it = sweep_m.erase(it);
+        ++removed;
+      } else {
+        ++it;
+      }
+    }
+    std::cout << "full scan sweep: " << std::chrono::duration_cast<std::chrono::microseconds>(
+                   std::chrono::steady_clock::now() - start ).count() << " microseconds, removed "
+              << removed << std::endl;
+  }
+  {
+    t1::map<size_t, size_t> ttl_m;
+    for (size_t i = 0; i < SESSIONS; ++i)
+      ttl_m.insert_with_ttl( {i, i}, std::chrono::hours(1) );
+    for (size_t i = 0; i < SESSIONS; i += SESSIONS / SESSIONS_DUE)
+      ttl_m.expire_after( i, std::chrono::milliseconds(1) );
+    std::this_thread::sleep_for( std::chrono::milliseconds(2) );
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    const size_t removed = ttl_m.expire();
+    std::cout << "timer wheel expire(): " << std::chrono::duration_cast<std::chrono::microseconds>(
+                   std::chrono::steady_clock::now() - start ).count() << " microseconds, removed "
+              << removed << std::endl;
+  }
+  std::cout << "****************************************" << std::endl;
+
+  static const size_t GROWTH_ELEMENTS = 10000000;
+  test_insert_latency test_growth;
+
+  std::cout << "t1::map<size_t, size_t> growth from empty, 1 super bucket" << std::endl;
+  t1::map<size_t, size_t> t1_growth_m(1);
+  run_test(test_growth, t1_growth_m, GROWTH_ELEMENTS);
+  std::cout << "****************************************" << std::endl;
+
+  static const size_t ORDERED_ELEMENTS   = 10000000;
+  static const size_t ORDERED_OPERATIONS = 1000000;
+  test_ordered_scan test_lookup(1);
+  test_ordered_scan test_scan(100);
+
+  test_sorted_load test_load;
+  std::vector< std::pair<size_t, size_t> > ordered_items;
+  for (size_t i = 0; i < ORDERED_ELEMENTS; ++i)
+    ordered_items.emplace_back(i, i);
+
+  std::map<size_t, size_t> std_ordered_m;
+  t::map<size_t, size_t> t_ordered_m;
+
+  std::cout << "std::map<size_t, size_t>" << std::endl;
+  run_test(test_load, std_ordered_m, ordered_items);
+  run_test(test_lookup, std_ordered_m, ORDERED_OPERATIONS);
+  run_test(test_scan, std_ordered_m, ORDERED_OPERATIONS / 10);
+  std::cout << std::endl;
+
+  std::cout << "t::map<size_t, size_t> (B+ tree)" << std::endl;
+  run_test(test_load, t_ordered_m, ordered_items);
+  run_test(test_lookup, t_ordered_m, ORDERED_OPERATIONS);
+  run_test(test_scan, t_ordered_m, ORDERED_OPERATIONS / 10);
+  std::cout << "****************************************" << std::endl;
+
+  static const size_t SKEW_ELEMENTS      = 200000;
+  static const size_t SKEW_SUPER_BUCKETS = 64;
+  auto int_key    = [](size_t i) { return i << 12; };
+  auto string_key = [](size_t i) { return "task" + std::to_string(i); };
+
+  std::cout << "shard skew: size_t keys (i << 12), std::hash" << std::endl;
+  run_shard_skew_test< t1::map<size_t, size_t, std::mutex, 0, std::hash<size_t> > >(
+    SKEW_SUPER_BUCKETS, SKEW_ELEMENTS, int_key );
+  std::cout << std::endl;
+
+  std::cout << "shard skew: size_t keys (i << 12), t::avalanche_hash" << std::endl;
+  run_shard_skew_test< t1::map<size_t, size_t, std::mutex, 0, t::avalanche_hash<size_t> > >(
+    SKEW_SUPER_BUCKETS, SKEW_ELEMENTS, int_key );
+  std::cout << std::endl;
+
+  std::cout << "shard skew: string keys, std::hash" << std::endl;
+  run_shard_skew_test< t1::map<std::string, size_t> >( SKEW_SUPER_BUCKETS, SKEW_ELEMENTS, string_key );
+  std::cout << std::endl;
+
+  std::cout << "shard skew: string keys, t::djb2_hash" << std::endl;
+  run_shard_skew_test< t1::map<std::string, size_t, std::mutex, 0, t::djb2_hash> >(
+    SKEW_SUPER_BUCKETS, SKEW_ELEMENTS, string_key );
+  std::cout << std::endl;
+
+  std::cout << "shard skew: string keys, t::wy_hash" << std::endl;
+  run_shard_skew_test< t1::map<std::string, size_t, std::mutex, 0, t::wy_hash> >(
+    SKEW_SUPER_BUCKETS, SKEW_ELEMENTS, string_key );
   std::cout << "****************************************" << std::endl;
 
   return  0;
@@ -1,17 +1,76 @@
 #ifndef MAP_HPP
 #define MAP_HPP
 
+#include <memory>
+#include <utility>
+#include <iterator>
+#include <algorithm>
+#include <functional>
+#include <stdexcept>
+#include <type_traits>
+#include <initializer_list>
+
+#include "bplus_tree.hpp"
+
 namespace t
 {
 
-template < typename _Key, typename _Tp >
+/**
+ *  Упорядоченный контейнер с интерфейсом std::map поверх B+дерева
+ *  (bplus_tree.hpp). В отличие от std::map вставка и удаление делают
+ *  недействительными итераторы и ссылки на элементы.
+ */
+template < typename _Key, typename _Tp, typename _Compare = std::less<_Key>,
+           typename _Alloc = std::allocator<std::pair<const _Key, _Tp> > >
   class map
   {
+    typedef bplus_tree<_Key, _Tp, _Compare, _Alloc> _Rep_type;
+
+  public:
+    typedef _Key                                          key_type;
+    typedef _Tp                                           mapped_type;
+    typedef std::pair<const _Key, _Tp>                    value_type;
+    typedef _Compare                                      key_compare;
+    typedef _Alloc                                        allocator_type;
+    typedef value_type&                                   reference;
+    typedef const value_type&                             const_reference;
+    typedef typename _Rep_type::iterator                  iterator;
+    typedef typename _Rep_type::const_iterator            const_iterator;
+    typedef std::reverse_iterator<iterator>               reverse_iterator;
+    typedef std::reverse_iterator<const_iterator>         const_reverse_iterator;
+    typedef typename _Rep_type::size_type                 size_type;
+    typedef typename _Rep_type::difference_type           difference_type;
+
+    class value_compare
+    {
+      friend class map;
+
+    protected:
+      _Compare comp;
+
+      value_compare(_Compare __c) : comp(__c) { }
+
+    public:
+      bool operator()(const value_type& __x, const value_type& __y) const
+      { return comp(__x.first, __y.first); }
+    };
+
+  private:
+    _Rep_type _M_t;
 
   public:
 
     map() : _M_t() { }
 
+    /**
+     *  @brief  Creates a %map with no elements.
+     *  @param  __comp  A comparison object.
+     *  @param  __a  An allocator object.
+     */
+    explicit map(const _Compare& __comp,
+                 const allocator_type& __a = allocator_type())
+    : _M_t(__comp, __a) { }
+
     /**
      *  @brief  %Map copy constructor.
      *  @param  __x  A %map of identical element and allocator types.
@@ -29,9 +88,24 @@ template < typename _Key, typename _Tp >
      *  The contents of @a __x are a valid, but unspecified %map.
      */
     map(map&& __x)
-    noexcept(is_nothrow_copy_constructible<_Compare>::value)
+    noexcept(std::is_nothrow_copy_constructible<_Compare>::value)
     : _M_t(std::move(__x._M_t)) { }
 
+    /**
+     *  @brief  Builds a %map from an initializer_list.
+     *  @param  __l  An initializer_list.
+     *  @param  __comp  A comparison object.
+     *  @param  __a  An allocator object.
+     *
+     *  Create a %map consisting of copies of the elements in the
+     *  initializer_list @a __l.
+     */
+    map(std::initializer_list<value_type> __l,
+        const _Compare& __comp = _Compare(),
+        const allocator_type& __a = allocator_type())
+    : _M_t(__comp, __a)
+    { insert(__l.begin(), __l.end()); }
+
     /**
      *  @brief  Builds a %map from a range.
      *  @param  __first  An input iterator.
@@ -44,7 +118,7 @@ template < typename _Key, typename _Tp >
      */
     template<typename _InputIterator>
     map(_InputIterator __first, _InputIterator __last) : _M_t()
-      {  }
+      { insert(__first, __last); }
 
     /**
      *  @brief  Builds a %map from a range.
@@ -61,8 +135,8 @@ template < typename _Key, typename _Tp >
     template<typename _InputIterator>
       map(_InputIterator __first, _InputIterator __last,
     const _Compare& __comp,
-    const allocator_type& __a = allocator_type()) : _M_t(__comp, _Pair_alloc_type(__a))
-      { }
+    const allocator_type& __a = allocator_type()) : _M_t(__comp, __a)
+      { insert(__first, __last); }
 
     /**
      *  @brief  %Map assignment operator.
@@ -91,12 +165,17 @@ template < typename _Key, typename _Tp >
      *  that the resulting %map's size is the same as the number
      *  of elements assigned.  Old data may be lost.
      */
-    map& operator=(initializer_list<value_type> __l)
+    map& operator=(std::initializer_list<value_type> __l)
     {
-      _M_t._M_assign_unique(__l.begin(), __l.end());
+      _M_t.clear();
+      insert(__l.begin(), __l.end());
       return *this;
     }
 
+    /// Get a copy of the memory allocation object.
+    allocator_type get_allocator() const noexcept
+    { return _M_t.get_allocator(); }
+
     // iterators
     /**
      *  Returns a read/write iterator that points to the first pair in the
@@ -136,7 +215,7 @@ template < typename _Key, typename _Tp >
      *  keys.
      */
     reverse_iterator rbegin()
-    { return _M_t.rbegin(); }
+    { return reverse_iterator(end()); }
 
     /**
      *  Returns a read-only (constant) reverse iterator that points to the
@@ -144,14 +223,14 @@ template < typename _Key, typename _Tp >
      *  according to the keys.
      */
     const_reverse_iterator rbegin() const
-    { return _M_t.rbegin(); }
+    { return const_reverse_iterator(end()); }
 
     /**
      *  Returns a read/write reverse iterator that points to one before the
      *  first pair in the %map.  Iteration is done in descending order
      *  according to the keys.
      */
-    reverse_iterator rend() { return _M_t.rend(); }
+    reverse_iterator rend() { return reverse_iterator(begin()); }
 
     /**
      *  Returns a read-only (constant) reverse iterator that points to one
@@ -159,7 +238,7 @@ template < typename _Key, typename _Tp >
      *  order according to the keys.
      */
     const_reverse_iterator rend() const
-    { return _M_t.rend(); }
+    { return const_reverse_iterator(begin()); }
 
     /**
      *  Returns a read-only (constant) iterator that points to the first pair
@@ -186,7 +265,7 @@ template < typename _Key, typename _Tp >
      */
     const_reverse_iterator
     crbegin() const noexcept
-    { return _M_t.rbegin(); }
+    { return rbegin(); }
 
     /**
      *  Returns a read-only (constant) reverse iterator that points to one
@@ -195,7 +274,7 @@ template < typename _Key, typename _Tp >
      */
     const_reverse_iterator
     crend() const noexcept
-    { return _M_t.rend(); }
+    { return rend(); }
 
 
     // capacity
@@ -224,14 +303,10 @@ template < typename _Key, typename _Tp >
      *  Lookup requires logarithmic time.
      */
     mapped_type& operator[](const key_type& __k)
-    {
-
-    }
+    { return _M_t.try_emplace(__k).first->second; }
 
     mapped_type& operator[](key_type&& __k)
-    {
-
-    }
+    { return _M_t.try_emplace(std::move(__k)).first->second; }
 
     /**
      *  @brief  Access to %map data.
@@ -242,12 +317,18 @@ template < typename _Key, typename _Tp >
      */
     mapped_type& at(const key_type& __k)
     {
-
+      iterator __i = _M_t.find(__k);
+      if (__i == end())
+        throw std::out_of_range("t::map::at");
+      return __i->second;
     }
 
     const mapped_type& at(const key_type& __k) const
     {
-
+      const_iterator __i = _M_t.find(__k);
+      if (__i == end())
+        throw std::out_of_range("t::map::at");
+      return __i->second;
     }
 
     // modifiers
@@ -271,7 +352,7 @@ template < typename _Key, typename _Tp >
      */
     template<typename... _Args>
     std::pair<iterator, bool> emplace(_Args&&... __args)
-    {  }
+    { return _M_t.emplace_unique(std::forward<_Args>(__args)...); }
 
     /**
      *  @brief Attempts to build and insert a std::pair into the %map.
@@ -300,9 +381,7 @@ template < typename _Key, typename _Tp >
      */
     template<typename... _Args>
     iterator emplace_hint(const_iterator __pos, _Args&&... __args)
-    {
-
-    }
+    { return _M_t.emplace_hint_unique(__pos, std::forward<_Args>(__args)...); }
 
     /**
      *  @brief Attempts to insert a std::pair into the %map.
@@ -321,12 +400,12 @@ template < typename _Key, typename _Tp >
      *  Insertion requires logarithmic time.
      */
     std::pair<iterator, bool> insert(const value_type& __x)
-    {  }
+    { return _M_t.emplace_unique(__x); }
 
     template<typename _Pair, typename = typename
     std::enable_if<std::is_constructible<value_type, _Pair&&>::value>::type>
     std::pair<iterator, bool> insert(_Pair&& __x)
-    { }
+    { return _M_t.emplace_unique(std::forward<_Pair>(__x)); }
 
     /**
      *  @brief Attempts to insert a list of std::pairs into the %map.
@@ -336,7 +415,7 @@ template < typename _Key, typename _Tp >
      *  Complexity similar to that of the range constructor.
      */
     void insert(std::initializer_list<value_type> __list)
-    {  }
+    { insert(__list.begin(), __list.end()); }
 
     /**
      *  @brief Attempts to insert a std::pair into the %map.
@@ -362,7 +441,7 @@ template < typename _Key, typename _Tp >
      *  Insertion requires logarithmic time (if the hint is not taken).
      */
     iterator insert(const_iterator __position, const value_type& __x)
-    { return _M_t._M_insert_unique_(__position, __x); }
+    { return emplace_hint(__position, __x); }
 
 
     /**
@@ -375,7 +454,11 @@ template < typename _Key, typename _Tp >
      */
     template<typename _InputIterator>
     void insert(_InputIterator __first, _InputIterator __last)
-    { }
+    {
+      //с подсказкой end() отсортированный вход собирается за O(n)
+      for (; __first != __last; ++__first)
+        _M_t.emplace_hint_unique(_M_t.end(), *__first);
+    }
 
     /**
      *  @brief Erases an element from a %map.
@@ -438,6 +521,16 @@ template < typename _Key, typename _Tp >
     void clear()
     { _M_t.clear(); }
 
+    /**
+     *  @brief  Swaps data with another %map.
+     *  @param  __x  A %map of the same element and allocator types.
+     *
+     *  This exchanges the elements between two maps in constant
+     *  time.
+     */
+    void swap(map& __x) noexcept
+    { _M_t.swap(__x._M_t); }
+
     // observers
     /**
      *  Returns the key comparison object out of which the %map was
@@ -462,7 +555,29 @@ template < typename _Key, typename _Tp >
      *  either be 0 (not present) or 1 (present).
      */
     size_type  count(const key_type& __x) const
-    {  }
+    { return _M_t.find(__x) == _M_t.end() ? 0 : 1; }
+
+    /**
+     *  @brief Tries to locate an element in a %map.
+     *  @param  __x  Key of (key, value) %pair to be located.
+     *  @return  Iterator pointing to sought-after element, or end() if not
+     *           found.
+     *
+     *  Lookup requires logarithmic time.
+     */
+    iterator find(const key_type& __x)
+    { return _M_t.find(__x); }
+
+    const_iterator find(const key_type& __x) const
+    { return _M_t.find(__x); }
+
+    /**
+     *  @brief  Finds whether an element with the given key exists.
+     *  @param  __x  Key of (key, value) pairs to be located.
+     *  @return  True if there is an element with the specified key.
+     */
+    bool contains(const key_type& __x) const
+    { return _M_t.find(__x) != _M_t.end(); }
 
     /**
      *  @brief Finds the beginning of a subsequence matching given key.
@@ -476,7 +591,7 @@ template < typename _Key, typename _Tp >
      *  or end() if no such element exists.
      */
     iterator lower_bound(const key_type& __x)
-    { }
+    { return _M_t.lower_bound(__x); }
 
     /**
      *  @brief Finds the beginning of a subsequence matching given key.
@@ -499,7 +614,7 @@ template < typename _Key, typename _Tp >
      *          greater than key, or end().
      */
     iterator upper_bound(const key_type& __x)
-    {  }
+    { return _M_t.upper_bound(__x); }
 
     /**
      *  @brief Finds the end of a subsequence matching given key.
@@ -526,7 +641,22 @@ template < typename _Key, typename _Tp >
      *  This function probably only makes sense for multimaps.
      */
     std::pair<iterator, iterator> equal_range(const key_type& __x)
-    { return _M_t.equal_range(__x); }
+    {
+      iterator __i = _M_t.lower_bound(__x);
+      iterator __j = __i;
+      if (__j != end() && !key_comp()(__x, __j->first))
+        ++__j;
+      return std::make_pair(__i, __j);
+    }
+
+    std::pair<const_iterator, const_iterator> equal_range(const key_type& __x) const
+    {
+      const_iterator __i = _M_t.lower_bound(__x);
+      const_iterator __j = __i;
+      if (__j != end() && !key_comp()(__x, __j->first))
+        ++__j;
+      return std::make_pair(__i, __j);
+    }
 
     template<typename _K1, typename _T1, typename _C1, typename _A1>
       friend bool
@@ -553,7 +683,10 @@ template<typename _Key, typename _Tp, typename _Compare, typename _Alloc>
   inline bool
   operator==(const map<_Key, _Tp, _Compare, _Alloc>& __x,
              const map<_Key, _Tp, _Compare, _Alloc>& __y)
-  { return __x._M_t == __y._M_t; }
+  {
+    return __x.size() == __y.size()
+           && std::equal(__x.begin(), __x.end(), __y.begin());
+  }
 
 /**
  *  @brief  Map ordering relation.
@@ -570,7 +703,10 @@ template<typename _Key, typename _Tp, typename _Compare, typename _Alloc>
   inline bool
   operator<(const map<_Key, _Tp, _Compare, _Alloc>& __x,
             const map<_Key, _Tp, _Compare, _Alloc>& __y)
-  { return __x._M_t < __y._M_t; }
+  {
+    return std::lexicographical_compare(__x.begin(), __x.end(),
+                                        __y.begin(), __y.end());
+  }
 
 /// Based on operator==
 template<typename _Key, typename _Tp, typename _Compare, typename _Alloc>
@@ -607,7 +743,7 @@ template<typename _Key, typename _Tp, typename _Compare, typename _Alloc>
  map<_Key, _Tp, _Compare, _Alloc>& __y)
   { __x.swap(__y); }
 
-} // namespace std
+} // namespace t
 
 #endif // MAP_HPP
 
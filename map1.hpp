@@ -2,13 +2,145 @@
 #define TMAP1_H
 
 #include <mutex>
-#include <unordered_map>
+#include <shared_mutex>
 #include <vector>
 #include <atomic>
+#include <iterator>
+#include <tuple>
+#include <thread>
+#include <type_traits>
+#include <span>
+#include <memory>
+#include <algorithm>
+#include <optional>
+#include <chrono>
+
+#include "flat_table.hpp"
+#include "string_hash.h"
+#include "thread_pool.hpp"
+#include "mapped_file.hpp"
+#include "frozen_map.hpp"
+#include "timer_wheel.hpp"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 namespace t1
 {
 
+static const size_t cache_line_size = 64;
+
+inline void cpu_relax()
+{
+#if defined(__SSE2__)
+  _mm_pause();
+#endif
+}
+
+/**
+ *  Политики статистики блокировок super_bucket (параметр _Stats у map).
+ *  no_stats - по умолчанию: пустая, захват - просто m.lock().
+ *  lock_stats считает захваты, захваты с ожиданием (try_lock не удался)
+ *  и суммарное время ожидания; счетчики меняются под самим мьютексом,
+ *  поэтому обычные store, а атомарны они только ради чтения из stats().
+ */
+struct no_stats
+{
+  static const bool enabled = false;
+
+  template<typename M>
+  void lock(M& m)
+  { m.lock(); }
+
+  uint64_t acquisitions() const noexcept { return 0; }
+  uint64_t contended() const noexcept { return 0; }
+  uint64_t wait_ns() const noexcept { return 0; }
+};
+
+struct lock_stats
+{
+  static const bool enabled = true;
+
+  lock_stats() : acquisitions_(0), contended_(0), wait_ns_(0)
+  { }
+
+  template<typename M>
+  void lock(M& m)
+  {
+    if ( !m.try_lock() ) {
+      const std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+      m.lock();
+      const uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - t0 ).count();
+      add(contended_, 1);
+      add(wait_ns_, ns);
+    }
+    add(acquisitions_, 1);
+  }
+
+  uint64_t acquisitions() const noexcept { return acquisitions_.load(std::memory_order_relaxed); }
+  uint64_t contended() const noexcept { return contended_.load(std::memory_order_relaxed); }
+  uint64_t wait_ns() const noexcept { return wait_ns_.load(std::memory_order_relaxed); }
+
+private:
+  static void add(std::atomic<uint64_t>& c, uint64_t v)
+  { c.store(c.load(std::memory_order_relaxed) + v, std::memory_order_relaxed); }
+
+  std::atomic<uint64_t> acquisitions_;
+  std::atomic<uint64_t> contended_;
+  std::atomic<uint64_t> wait_ns_;
+};
+
+/**
+ *  Состояние одного super_bucket, см. map::stats(). Счетчики блокировок
+ *  ненулевые только с lock_stats; поиски без блокировки (seqlock) в них не
+ *  попадают.
+ */
+struct shard_stats
+{
+  uint64_t lock_acquisitions;
+  uint64_t contended_acquisitions;
+  uint64_t wait_ns;
+  size_t   size;
+  size_t   capacity;
+  float    load_factor;
+  size_t   max_probe_length; //в группах, 1 - все записи в своей группе
+  size_t   retired;          //удаленное, но еще не освобожденное
+};
+
+/**
+ *  Счетчики режима кэша одного super_bucket (map::set_capacity). В своей
+ *  кэш-линии: попадания считают и поиски без блокировки, и линия с
+ *  version от этого не должна страдать.
+ */
+struct alignas(64) cache_counters
+{
+  std::atomic<uint64_t> hits;
+  std::atomic<uint64_t> misses;
+  std::atomic<uint64_t> evictions;
+
+  cache_counters() : hits(0), misses(0), evictions(0)
+  { }
+};
+
+/**
+ *  Итог режима кэша по всему map, см. map::cache_statistics().
+ *  Попадание/промах - find, find_batch, get, contains, visit и
+ *  compute_if_absent; bytes - оценка памяти записей в памяти.
+ */
+struct cache_stats
+{
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t evictions;
+  size_t   entries;
+  size_t   bytes;
+
+  double hit_rate() const noexcept
+  { return hits + misses ? static_cast<double>(hits) / static_cast<double>(hits + misses) : 0.0; }
+};
+
 /**
  *  Первый вариант трактовки условия:
  *  Необходимо реализовать контейнер, который бы превосходил своего
@@ -18,130 +150,436 @@ namespace t1
  */
 template<typename _Key, typename _Value,
          typename _Mutex_type=std::mutex,
-         size_t _NUMBER_SUPER_BUCKETS=10>
+         size_t _NUMBER_SUPER_BUCKETS=0,
+         typename _Hash=t::transparent_hash<_Key>,
+         typename _Alloc=std::allocator< std::pair<_Key, _Value> >,
+         typename _Stats=no_stats >
 class map
 {
 public:
   typedef std::pair<_Key, _Value> value_type;
-  typedef std::unordered_map<size_t, value_type> bucket_data_model;
-  typedef typename bucket_data_model::iterator::iterator_category  bucket_iterator_category;
-  typedef typename bucket_data_model::const_iterator::iterator_category  bucket_const_iterator_category;
+  typedef _Hash hasher;
+  typedef _Alloc allocator_type;
+  typedef _Stats stats_policy;
+  typedef flat_table<_Key, _Value, _Alloc> bucket_data_model;
+  typedef typename bucket_data_model::index_type index_type;
+  typedef mapped_file<_Key, _Value, _Hash> file_type;
+  typedef frozen_map<_Key, _Value, _Hash, _Alloc> frozen_type;
+
+  /**
+   *  find идет без блокировки под seqlock, закрепившись в эпохе: удаленные
+   *  записи и старые блоки индекса освобождаются отложенно, поэтому
+   *  сравнение ключей безопасно и для ключей с указателями (std::string).
+   */
+  static const size_t max_optimistic_attempts = 8;
+
+  /**
+   *  Копия одного super_bucket для snapshot(): пары (хэш, элемент) в
+   *  порядке слотов и открытая адресация по хэшу поверх них (номер пары + 1,
+   *  0 - пусто), таблица не реже чем наполовину пуста. Заполняется один раз
+   *  под мьютексом сегмента - писателем перед первым изменением после
+   *  снимка или читателем снимка при первом обращении к сегменту, если его
+   *  никто не менял.
+   */
+  struct snapshot_cell
+  {
+    typedef std::pair<size_t, value_type> item_type;
+    typedef typename std::allocator_traits<_Alloc>::template rebind_alloc<item_type> item_allocator;
+    typedef typename std::allocator_traits<_Alloc>::template rebind_alloc<uint32_t>  slot_allocator;
 
-  struct super_bucket
+    struct frozen_shard
+    {
+      std::vector<item_type, item_allocator> items;
+      std::vector<uint32_t, slot_allocator>  slots;
+
+      template<typename K>
+      const item_type* find(size_t hash, const K& k) const
+      {
+        if ( slots.empty() )
+          return nullptr;
+        const size_t mask = slots.size() - 1;
+        for (size_t i = hash & mask; slots[i]; i = (i + 1) & mask) {
+          const item_type& it = items[ slots[i] - 1 ];
+          if (it.first == hash && it.second.first == k)
+            return &it;
+        }
+        return nullptr;
+      }
+    };
+
+    std::atomic<const frozen_shard*> data;
+    const uint64_t now; //записи, истекшие к этому моменту, в копию не идут
+
+    explicit snapshot_cell(uint64_t now) : data(nullptr), now(now)
+    { }
+
+    snapshot_cell(const snapshot_cell&) = delete;
+    snapshot_cell& operator=(const snapshot_cell&) = delete;
+
+    ~snapshot_cell()
+    { delete data.load(std::memory_order_relaxed); }
+
+    void fill(const bucket_data_model& v)
+    {
+      if ( data.load(std::memory_order_relaxed) )
+        return;
+
+      frozen_shard* res = new frozen_shard;
+      res->items.reserve( v.size() );
+      for_each_entry( v, [res](size_t hash, value_type& e) { res->items.emplace_back(hash, e); }, now );
+
+      if ( !res->items.empty() ) {
+        size_t cap = 2;
+        while ( cap < 2 * res->items.size() )
+          cap <<= 1;
+        res->slots.assign(cap, 0);
+        for (size_t n = 0; n < res->items.size(); ++n) {
+          size_t i = res->items[n].first & (cap - 1);
+          while ( res->slots[i] )
+            i = (i + 1) & (cap - 1);
+          res->slots[i] = static_cast<uint32_t>(n + 1);
+        }
+      }
+      data.store(res, std::memory_order_release);
+    }
+
+  };
+
+  /**
+   *  Элемент колеса сроков: запись ищется по адресу (flat_table::locate),
+   *  без обращения к ней самой.
+   */
+  struct expiry_item
+  {
+    size_t            hash;
+    const value_type* entry;
+  };
+
+  typedef timer_wheel<expiry_item> expiry_wheel;
+
+  /**
+   *  Каждый super_bucket занимает свои кэш-линии, чтобы захват мьютекса
+   *  одного сегмента не вытеснял линию соседнего (false sharing).
+   */
+  struct alignas(cache_line_size) super_bucket
   {
-    std::atomic<size_t> reference_counter;
     mutable _Mutex_type  m;
+    std::atomic<size_t> version; //seqlock, нечетная - идет запись
     bucket_data_model    v;
-
-    super_bucket() : reference_counter(0)
+    std::weak_ptr<snapshot_cell> frozen; //копия на момент последнего snapshot()
+    bool dirty;                          //менялся ли сегмент после него
+    [[no_unique_address]] _Stats stats;
+    std::atomic<size_t> entry_limit;     //режим кэша, 0 - без предела
+    std::atomic<size_t> byte_limit;
+    size_t clock_hand;                   //CLOCK, под m
+    size_t bytes;                        //оценка памяти, ведется только с пределом
+    cache_counters counters;
+    std::unique_ptr<expiry_wheel> wheel; //сроки записей, под m, создается с первым сроком
+
+    super_bucket() : version(0), dirty(true), entry_limit(0), byte_limit(0), clock_hand(0), bytes(0)
     {}
 
-    inline bool is_busy()
-    { return reference_counter.load(); }
+    bool bounded() const noexcept
+    { return entry_limit.load(std::memory_order_relaxed) || byte_limit.load(std::memory_order_relaxed); }
+
+    /**
+     *  Захват m через политику статистики, чтобы писать
+     *  std::lock_guard<super_bucket>.
+     */
+    void lock()
+    { stats.lock(m); }
+
+    void unlock()
+    { m.unlock(); }
+
+    /**
+     *  Для путей только на чтение (std::shared_lock<super_bucket>):
+     *  разделяемо, если _Mutex_type это умеет (t::reader_biased_lock,
+     *  std::shared_mutex), иначе как lock(). В статистику не попадает.
+     */
+    void lock_shared()
+    {
+      if constexpr ( requires { m.lock_shared(); } )
+        m.lock_shared();
+      else
+        lock();
+    }
+
+    void unlock_shared()
+    {
+      if constexpr ( requires { m.unlock_shared(); } )
+        m.unlock_shared();
+      else
+        unlock();
+    }
 
-    inline void inc_ref()
-    { ++reference_counter; }
+    /**
+     *  Вызывается под m перед любым изменением сегмента: если он не менялся
+     *  с последнего snapshot(), а снимок еще жив, сначала отдает снимку
+     *  копию (copy-on-write). Без живых снимков - одна проверка флага.
+     */
+    void before_write()
+    {
+      if (dirty)
+        return;
+      dirty = true;
+      if ( std::shared_ptr<snapshot_cell> c = frozen.lock() )
+        c->fill(v);
+      frozen.reset();
+    }
 
-    inline void dec_ref()
-    { --reference_counter; }
+    /**
+     *  Изменение структуры таблицы, вызывается под m.
+     */
+    struct write_section
+    {
+      super_bucket& sb;
+
+      explicit write_section(super_bucket& b) : sb(b)
+      {
+        sb.before_write();
+        sb.version.store(sb.version.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+      }
+
+      ~write_section()
+      { sb.version.store(sb.version.load(std::memory_order_relaxed) + 1, std::memory_order_release); }
+    };
+
+    /**
+     *  Вызывается в закрепленной эпохе, block - блок индекса, в котором
+     *  найдена запись (во время перестроения это может быть старый блок).
+     */
+    template<typename K>
+    value_type* lookup(size_t hash, const K& k, size_t& slot, const index_type*& block)
+    {
+      for (size_t attempt = 0; attempt < max_optimistic_attempts; ++attempt) {
+        const size_t v1 = version.load(std::memory_order_acquire);
+        if (v1 & 1) {
+          cpu_relax();
+          continue;
+        }
+
+        value_type* res = v.find(hash, k, block, slot);
+        const uint64_t deadline = res ? bucket_data_model::deadline_at(block, slot) : 0;
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if ( version.load(std::memory_order_relaxed) == v1 )
+          return past(deadline) ? nullptr : res;
+      }
+
+      //писатель занят дольше, чем стоит ждать
+      std::shared_lock<super_bucket> lock(*this);
+      value_type* res = v.find(hash, k, block, slot);
+      return res && !expired(block, slot) ? res : nullptr;
+    }
   };
 
+  /**
+   *  Базовый слой из файла save(): записи читаются прямо из отображенного
+   *  файла. Запись, которую изменили (copy-up в память) или удалили,
+   *  помечается в hidden; бит ставится под мьютексом сегмента ключа и
+   *  только после вставки копии в память, так что поиск без блокировки,
+   *  увидевший бит, найдет копию повторным поиском в памяти. Ключ всегда
+   *  либо в памяти, либо видим в базе, но не в обоих.
+   */
+  struct base_layer
+  {
+    std::shared_ptr<const file_type> file;
+    std::unique_ptr< std::atomic<uint64_t>[] > hidden;
+    std::atomic<size_t> hidden_count;
+
+    explicit base_layer(std::shared_ptr<const file_type> f) :
+      file( std::move(f) ), hidden( new std::atomic<uint64_t>[ words() ]() ), hidden_count(0)
+    { }
+
+    size_t words() const noexcept
+    { return (file->size() + 63) / 64; }
+
+    size_t visible() const noexcept
+    { return file->size() - hidden_count.load(std::memory_order_relaxed); }
+
+    bool is_hidden(size_t i) const noexcept
+    { return ( hidden[i / 64].load(std::memory_order_acquire) >> (i % 64) ) & 1; }
+
+    void hide(size_t i) noexcept
+    {
+      const uint64_t bit = uint64_t(1) << (i % 64);
+      if ( !(hidden[i / 64].fetch_or(bit, std::memory_order_acq_rel) & bit) )
+        hidden_count.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    /**
+     *  Номер видимой записи с ключом k либо file_type::npos.
+     */
+    template<typename K>
+    size_t find(size_t hash, const K& k) const
+    {
+      const size_t i = file->find(hash, k);
+      return i != file_type::npos && !is_hidden(i) ? i : file_type::npos;
+    }
+  };
+
+  /**
+   *  Итератор не берет мьютексы: он держит закрепление в эпохе и идет по
+   *  блоку индекса, опубликованному на момент входа в super_bucket (а если
+   *  в нем идет перестроение - сначала по неперенесенной части старого).
+   *  Записи, на которые он указывает, не освобождаются, пока он жив, даже
+   *  если их удалили из другого потока. Обход слабо согласован: элементы,
+   *  вставленные или удаленные во время обхода, могут как попасть в него,
+   *  так и нет, а элемент, перенесенный из старого блока во время обхода,
+   *  может встретиться дважды. Пока итератор жив, отложенная память не
+   *  освобождается, поэтому долго хранить итераторы не стоит.
+   *  После всех super_bucket идут видимые записи базового слоя: итератор
+   *  держит их декодированную копию, изменения через нее в map не попадают
+   *  (менять такие записи - через operator[], visit или insert).
+   */
   class iterator
   {
     public:
-      typedef  typename bucket_data_model::iterator        self_type;
-      typedef  typename bucket_data_model::value_type      value_type;
-      typedef  typename bucket_data_model::value_type&     reference;
-      typedef  typename bucket_data_model::iterator        pointer;
-      typedef  bucket_iterator_category                    iterator_category;
-      typedef  typename bucket_data_model::difference_type difference_type;
-
-      iterator(map* base, size_t interval, pointer ptr) :
-        base_(base), super_bucket_index_(interval), ptr_(ptr)
-      { }
-
-      iterator(const iterator& v) :
-        base_( v.base() ),
-        super_bucket_index_( v.interval() ),
-        ptr_( v.get_internal_iterator() )
+      typedef  std::forward_iterator_tag  iterator_category;
+      typedef  map::value_type            value_type;
+      typedef  map::value_type&           reference;
+      typedef  map::value_type*           pointer;
+      typedef  std::ptrdiff_t             difference_type;
+
+      iterator(map* base, size_t interval, const index_type* block, const index_type* next_block,
+               size_t slot, pointer ptr) :
+        base_(base), super_bucket_index_(interval), block_(block), next_block_(next_block),
+        slot_(slot), ptr_(ptr), guard_(ptr != nullptr)
       { }
 
-      iterator& operator=(const iterator& v)
+      /**
+       *  Первый элемент, начиная с super_bucket interval, либо end().
+       */
+      iterator(map* base, size_t interval) :
+        base_(base), super_bucket_index_(interval), block_(nullptr), next_block_(nullptr),
+        slot_(0), ptr_(nullptr), guard_(true)
       {
-        base_ = v.base();
-        ptr_ = v.get_internal_iterator();
-        super_bucket_index_ = v.interval();
-        return *this;
+        if ( enter(0) )
+          seek(slot_);
       }
 
+      iterator(const iterator& v) = default;
+      iterator& operator=(const iterator& v) = default;
+
       ~iterator()
       {   }
 
-      iterator& operator=(iterator&& v)
+      iterator& operator++()
       {
-        this->base_ = std::move(v.base_);
-        this->ptr_ = std::move(v.ptr_);
-        this->super_bucket_index_ = std::move(v.super_bucket_index_);
+        if (cache_)
+          seek_base(slot_ + 1);
+        else
+          seek(slot_ + 1);
         return *this;
       }
 
-      iterator operator++()
+      iterator operator++(int)
       {
-        bool next{false};
-        size_t inervals_n;
-        do
-        {
-          {//searching in current super_bucket
-            auto& sb = base_->get_super_bucket(super_bucket_index_);
-            inervals_n = base_->bucket_count();
-            std::lock_guard<_Mutex_type> lock(sb.m);
+        iterator i = *this;
+        operator++();
+        return i;
+      }
 
-            if (next)
-              ptr_= sb.v.begin();
+      map::value_type* operator->(){ return ptr_; }
+      map::value_type& operator*() { return *ptr_; }
+      bool operator==(const iterator& rhs) const
+      { return ptr_ == rhs.ptr_ || (cache_ && rhs.cache_ && slot_ == rhs.slot_); }
+      bool operator!=(const iterator& rhs) const { return !(*this == rhs); }
 
-            if ( ptr_ != sb.v.end() ) {
+      pointer get_internal_iterator() const { return ptr_; }
+      size_t slot() const { return slot_; }
+      size_t hash() const
+      { return cache_ ? base_->base_->file->hash(slot_) : bucket_data_model::hash_at(block_, slot_); }
+      size_t interval() const { return super_bucket_index_; }
+      map* base() const { return base_; }
+      bool in_base_layer() const { return cache_ != nullptr; }
 
-              if (next)
-                return *this;
+    private:
+      /**
+       *  Берет блоки super_bucket с номером super_bucket_index_ + step.
+       */
+      bool enter(size_t step)
+      {
+        super_bucket_index_ += step;
+        if ( super_bucket_index_ >= base_->bucket_count() )
+          return false;
+
+        const index_type* h = base_->get_super_bucket(super_bucket_index_).v.index();
+        const index_type* p = bucket_data_model::prev_of(h);
+        if (p) {
+          block_ = p;
+          next_block_ = h;
+          slot_ = bucket_data_model::first_unmigrated(h);
+        } else {
+          block_ = h;
+          next_block_ = nullptr;
+          slot_ = 0;
+        }
+        return true;
+      }
 
-              ++ptr_;
-              if ( ptr_ != sb.v.end() )
-                return *this;
+      void seek(size_t slot)
+      {
+        for (;;) {
+          //searching in current super_bucket
+          slot = bucket_data_model::next_full(block_, slot);
+          if ( slot != bucket_data_model::capacity_of(block_) ) {
+            pointer entry = bucket_data_model::published_entry(block_, slot);
+            if ( !entry || map::expired(block_, slot) ) {
+              ++slot;
+              continue;
             }
+            slot_ = slot;
+            ptr_ = entry;
+            return;
           }
 
-          //goto next super_bucket
-          if (super_bucket_index_ < inervals_n-1) {
-            ++super_bucket_index_;
-            next = true;
-          } else {
-            return *this;
+          if (next_block_) {
+            block_ = next_block_;
+            next_block_ = nullptr;
+            slot = 0;
+            continue;
           }
-        } while (next);
 
-        return *this;
+          //goto next super_bucket
+          if ( !enter(1) )
+            break;
+          slot = slot_;
+        }
+
+        seek_base(0);
       }
 
-      iterator operator++(int)
+      /**
+       *  Видимая запись базового слоя с номером не меньше i, либо end().
+       */
+      void seek_base(size_t i)
       {
-        iterator i = *this;
-        operator++();
-        return i;
+        if ( const base_layer* b = base_->base_.get() ) {
+          for (; i < b->file->size(); ++i) {
+            if ( b->is_hidden(i) )
+              continue;
+            if ( cache_ && cache_.use_count() == 1 )
+              *cache_ = b->file->materialize(i);
+            else
+              cache_ = std::make_shared<value_type>( b->file->materialize(i) );
+            slot_ = i;
+            ptr_ = cache_.get();
+            return;
+          }
+        }
+        *this = base_->end();
       }
 
-      map::value_type* operator->(){ return &ptr_->second; }
-      map::value_type& operator*() { return ptr_->second; }
-      bool operator==(const iterator& rhs) const { return ptr_ == rhs.ptr_; }
-      bool operator!=(const iterator& rhs) const { return ptr_ != rhs.ptr_; }
-
-      pointer get_internal_iterator() const { return ptr_; }
-      size_t interval() const { return super_bucket_index_; }
-      map* base() const { return base_; }
-
-    private:
       map* base_;
       size_t super_bucket_index_;
+      const index_type* block_;
+      const index_type* next_block_;
+      size_t slot_;
       pointer ptr_;
+      ebr::guard guard_;
+      std::shared_ptr<value_type> cache_; //запись базового слоя
   };
 
   typedef const iterator const_iterator;
@@ -149,9 +587,238 @@ public:
   typedef _Key key_type;
   typedef size_t size_type;
 
-  map() : super_buckets(super_bucket_count_)
+  /**
+   *  Снимок map на момент вызова snapshot(), только для чтения. Сам снимок
+   *  ничего не копирует: сегмент копируется один раз - писателем перед
+   *  первым изменением после снимка либо при первом обращении снимка к
+   *  сегменту, если его так никто и не изменил. Дальше поиск и обход идут
+   *  по копии без блокировок и не мешают писателям. Снимки, между которыми
+   *  сегмент не менялся, делят одну копию. Значения, которые меняют по
+   *  ссылке из operator[] или итератора, попадают в снимок по состоянию на
+   *  момент записи. Снимок не должен пережить map. Базовый слой в снимке -
+   *  тот же файл и копия битов hidden на момент снимка.
+   */
+  class snapshot_view
+  {
+    typedef typename snapshot_cell::item_type  item_type;
+    typedef typename snapshot_cell::frozen_shard frozen_shard;
+
+  public:
+    typedef map::value_type value_type;
+    typedef map::key_type   key_type;
+    typedef map::size_type  size_type;
+
+    class const_iterator
+    {
+      public:
+        typedef  std::forward_iterator_tag  iterator_category;
+        typedef  map::value_type            value_type;
+        typedef  const map::value_type&     reference;
+        typedef  const map::value_type*     pointer;
+        typedef  std::ptrdiff_t             difference_type;
+
+        const_iterator() :
+          view_(nullptr), shard_(0), frozen_(nullptr), pos_(0)
+        { }
+
+        const_iterator(const snapshot_view* view, size_t shard, const frozen_shard* frozen, size_t pos) :
+          view_(view), shard_(shard), frozen_(frozen), pos_(pos)
+        { skip(); }
+
+        /**
+         *  Запись базового слоя с номером не меньше pos.
+         */
+        const_iterator(const snapshot_view* view, size_t pos) :
+          view_(view), shard_( view->cells_.size() ), frozen_(nullptr), pos_(0)
+        { seek_base(pos); }
+
+        const_iterator& operator++()
+        {
+          if (cache_) {
+            seek_base(pos_ + 1);
+          } else {
+            ++pos_;
+            skip();
+          }
+          return *this;
+        }
+
+        const_iterator operator++(int)
+        {
+          const_iterator i = *this;
+          operator++();
+          return i;
+        }
+
+        reference operator*() const { return cache_ ? *cache_ : frozen_->items[pos_].second; }
+        pointer operator->() const { return &**this; }
+        bool operator==(const const_iterator& rhs) const
+        { return frozen_ == rhs.frozen_ && pos_ == rhs.pos_ && !cache_ == !rhs.cache_; }
+        bool operator!=(const const_iterator& rhs) const { return !(*this == rhs); }
+
+      private:
+        void skip()
+        {
+          while ( frozen_ && pos_ == frozen_->items.size() ) {
+            if ( ++shard_ == view_->cells_.size() ) {
+              frozen_ = nullptr;
+              seek_base(0);
+              return;
+            }
+            frozen_ = &view_->shard(shard_);
+            pos_ = 0;
+          }
+        }
+
+        void seek_base(size_t i)
+        {
+          if (view_->file_) {
+            for (; i < view_->file_->size(); ++i) {
+              if ( view_->is_hidden(i) )
+                continue;
+              if ( cache_ && cache_.use_count() == 1 )
+                *cache_ = view_->file_->materialize(i);
+              else
+                cache_ = std::make_shared<value_type>( view_->file_->materialize(i) );
+              pos_ = i;
+              return;
+            }
+          }
+          cache_.reset();
+          pos_ = 0;
+        }
+
+        const snapshot_view* view_;
+        size_t shard_;
+        const frozen_shard* frozen_;
+        size_t pos_;
+        std::shared_ptr<value_type> cache_; //запись базового слоя
+    };
+
+    typedef const_iterator iterator;
+
+    const_iterator begin() const
+    { return cells_.empty() ? end() : const_iterator(this, 0, &shard(0), 0); }
+
+    const_iterator end() const
+    { return const_iterator(); }
+
+    const_iterator cbegin() const
+    { return begin(); }
+
+    const_iterator cend() const
+    { return end(); }
+
+    size_type size() const noexcept
+    { return size_; }
+
+    bool empty() const noexcept
+    { return size_ == 0; }
+
+    const_iterator find(const key_type& k) const
+    { return find_hashed( hash_of(k), k ); }
+
+    template<typename K>
+    const_iterator find(const K& k) const
+    { return find_hashed( hash_of(k), key_of(k) ); }
+
+    template<typename K>
+    size_type count(const K& k) const
+    { return find(k) != end(); }
+
+    template<typename K>
+    bool contains(const K& k) const
+    { return find(k) != end(); }
+
+  private:
+    friend class map;
+
+    explicit snapshot_view(map* base) :
+      base_(base), size_(0)
+    { }
+
+    const frozen_shard& shard(size_t i) const
+    {
+      snapshot_cell& c = *cells_[i];
+      const frozen_shard* res = c.data.load(std::memory_order_acquire);
+      if (!res) {
+        //сегмент не менялся со снимка, копируем его текущее состояние
+        super_bucket& sb = base_->super_buckets[i];
+        std::lock_guard<super_bucket> lock(sb);
+        c.fill(sb.v);
+        res = c.data.load(std::memory_order_relaxed);
+      }
+      return *res;
+    }
+
+    template<typename K>
+    const_iterator find_hashed(size_t hash, const K& k) const
+    {
+      const size_t i = base_->bucket_index(hash);
+      const frozen_shard& f = shard(i);
+      const item_type* res = f.find(hash, k);
+      if (res)
+        return const_iterator( this, i, &f, res - f.items.data() );
+
+      if (file_) {
+        const size_t pos = file_->find(hash, k);
+        if ( pos != file_type::npos && !is_hidden(pos) )
+          return const_iterator(this, pos);
+      }
+      return end();
+    }
+
+    bool is_hidden(size_t i) const noexcept
+    { return (hidden_[i / 64] >> (i % 64)) & 1; }
+
+    map* base_;
+    std::vector< std::shared_ptr<snapshot_cell> > cells_;
+    size_type size_;
+    std::shared_ptr<const file_type> file_;
+    std::vector<uint64_t> hidden_;
+  };
+
+  /**
+   *  Число super_bucket округляется вверх до степени двойки, чтобы сегмент
+   *  выбирался маской, а не делением. 0 - взять _NUMBER_SUPER_BUCKETS,
+   *  если и он 0 - default_super_bucket_count().
+   */
+  explicit map(size_t super_bucket_count = _NUMBER_SUPER_BUCKETS) :
+    super_buckets( round_up_pow2( super_bucket_count ? super_bucket_count
+                                                     : default_super_bucket_count() ) ),
+    super_bucket_mask_( super_buckets.size() - 1 ),
+    super_bucket_shift_( super_bucket_mask_ ? 64 - log2(super_buckets.size()) : 63 )
   {  }
 
+  /**
+   *  map поверх файла, записанного save(): файл не разбирается, записи
+   *  читаются из отображенной памяти, так что время открытия зависит от
+   *  числа страниц, к которым обратились, а не от числа записей. Запись
+   *  копируется в память (copy-up), когда к ней нужна изменяемая ссылка:
+   *  find, operator[], visit, upsert. insert и erase копии не делают.
+   *  Только для чтения без map - сам file_type.
+   */
+  map(std::shared_ptr<const file_type> base, size_t super_bucket_count = _NUMBER_SUPER_BUCKETS) :
+    map(super_bucket_count)
+  {
+    if (base)
+      base_.reset( new base_layer( std::move(base) ) );
+  }
+
+  /**
+   *  Открывает файл save() для map(base) или для чтения; бросает
+   *  std::runtime_error, если файл не читается или записан для других
+   *  типов либо другим хэшером.
+   */
+  static std::shared_ptr<const file_type> open(const std::string& path)
+  { return std::make_shared<const file_type>(path); }
+
+  static size_t default_super_bucket_count()
+  {
+    const size_t hw = std::thread::hardware_concurrency();
+    return 4 * (hw ? hw : 1);
+  }
+
   map(const map&) = delete;
   map& operator=(const map&) = delete;
 
@@ -161,116 +828,560 @@ public:
   virtual ~map()
   {  }
 
+  /**
+   *  Хэш считается один раз, handle можно передавать в find, insert,
+   *  erase и operator[] вместо ключа.
+   */
+  template<typename K>
+  static t::prehashed_key<K> prehash(const K& k)
+  { return t::prehashed_key<K>( k, hash_of(k) ); }
+
   //Element lookup
-  iterator find ( const key_type& k ) {
-    size_t hash_level1 = std::hash<key_type>{}(k);
-    size_t n_interval = hash_level1 % super_bucket_count_;
-    auto& super_bucket = super_buckets[n_interval];
-    auto res = super_bucket.v.find(hash_level1);
+  iterator find ( const key_type& k )
+  { return find_hashed( hash_of(k), k ); }
 
-    if ( res != super_bucket.v.end() ) {
-      return iterator(this, n_interval, res);
-    }
+  /**
+   *  Поиск по ключу другого типа (std::string_view, const char* для
+   *  std::string) без создания временного key_type, либо по prehashed_key.
+   */
+  template<typename K>
+  iterator find ( const K& k )
+  { return find_hashed( hash_of(k), key_of(k) ); }
 
-    return end();
-  }
+  iterator find_first()
+  { return iterator(this, 0); }
 
-  iterator find_first() noexcept
+  //Iterators:
+  iterator begin()
+  { return find_first(); }
+
+  iterator end() noexcept
+  { return iterator(this, super_buckets.size(), nullptr, nullptr, 0, nullptr); }
+
+  const_iterator cbegin()
+  { return find_first(); }
+
+  const_iterator cend()  noexcept
+  { return end(); }
+
+  //Snapshots:
+  /**
+   *  Согласованный снимок всего map: мьютексы всех super_bucket берутся
+   *  разом лишь на время, нужное, чтобы пометить сегменты, копирование
+   *  отложено (см. snapshot_view).
+   */
+  snapshot_view snapshot()
   {
-    for (auto it = super_buckets.begin(); it != super_buckets.end(); ++it) {
-      if ( it->v.begin() != it->v.end() ) {
-        return iterator(
-                         this, std::distance(super_buckets.begin(), it),
-                         it->v.begin()
-                       );
+    snapshot_view res(this);
+    res.cells_.reserve( super_buckets.size() );
+    //выделяем заранее: под мьютексами ничего не должно бросать исключений
+    std::vector< std::shared_ptr<snapshot_cell> > spare;
+    spare.reserve( super_buckets.size() );
+    const uint64_t now = now_ns();
+    for (size_t i = 0; i < super_buckets.size(); ++i)
+      spare.push_back( std::make_shared<snapshot_cell>(now) );
+
+    if (base_) {
+      res.file_ = base_->file;
+      res.hidden_.resize( base_->words() );
+    }
+
+    for (auto& it : super_buckets)
+      it.lock();
+    //подошедшие сроки - до снимка; истекшие в текущем тике остаются в
+    //таблице, их отсекает now при копировании
+    for (auto& it : super_buckets)
+      expire_due(it, false);
+
+    //биты hidden ставятся под мьютексами сегментов, здесь они не меняются
+    for (size_t i = 0; i < res.hidden_.size(); ++i)
+      res.hidden_[i] = base_->hidden[i].load(std::memory_order_relaxed);
+    if (base_)
+      res.size_ = base_->visible();
+
+    for (size_t i = 0; i < super_buckets.size(); ++i) {
+      super_bucket& sb = super_buckets[i];
+      //со сроками копия прошлого снимка могла устареть и без изменений
+      const bool ttl = sb.wheel && !sb.wheel->empty();
+      std::shared_ptr<snapshot_cell> c;
+      if (!sb.dirty && !ttl)
+        c = sb.frozen.lock();
+      if (!c) {
+        c = std::move( spare[i] );
+        sb.frozen = c;
+        sb.dirty = false;
       }
+      res.cells_.push_back( std::move(c) );
+      if (ttl)
+        for_each_entry( sb.v, [&res](size_t, value_type&) { ++res.size_; }, now );
+      else
+        res.size_ += sb.v.size();
     }
 
-    return end();
+    for (auto& it : super_buckets)
+      it.unlock();
+    return res;
   }
 
-  //Iterators:
-  iterator begin() noexcept
-  { return find_first(); }
-
-  iterator end() noexcept
+  /**
+   *  Неизменяемая копия согласованного снимка map (вместе с базовым слоем)
+   *  для данных, которые дальше только читают, см. frozen_map.
+   */
+  frozen_type freeze()
   {
-    return iterator( this,
-                     std::distance( super_buckets.begin(), super_buckets.end() )-1,
-                     super_buckets.end()->v.end() );
+    snapshot_view s = snapshot();
+    return frozen_type( s.begin(), s.end() );
   }
 
-  const_iterator cbegin()  noexcept
-  { return find_first(); }
-
-  const_iterator cend()  noexcept
+  /**
+   *  Пишет согласованный снимок map (вместе с базовым слоем) в файл для
+   *  open(), по сегменту файла на super_bucket. Пишется во временный файл
+   *  и переименовывается, так что сохранять можно и поверх своей базы.
+   */
+  void save(const std::string& path)
   {
-    return const_iterator( this,
-                           std::distance( super_buckets.begin(), super_buckets.end() )-1,
-                           super_buckets.end()->v.end() );
+    snapshot_view s = snapshot();
+    std::vector< std::vector<typename file_type::item_type> > shards( s.cells_.size() );
+    for (size_t i = 0; i < s.cells_.size(); ++i) {
+      for (auto& it : s.shard(i).items)
+        shards[ file_type::shard_index( it.first, shards.size() ) ].emplace_back( it.first, &it.second );
+    }
+
+    std::vector<value_type> decoded;
+    if (s.file_) {
+      decoded.reserve( s.size_ );
+      for (size_t i = 0; i < s.file_->size(); ++i) {
+        if ( s.is_hidden(i) )
+          continue;
+        decoded.push_back( s.file_->materialize(i) );
+        const size_t h = s.file_->hash(i);
+        shards[ file_type::shard_index( h, shards.size() ) ].emplace_back( h, &decoded.back() );
+      }
+    }
+    file_type::write(path, shards);
   }
 
   //Modifiers:
   void insert(const value_type& val)
-  {
-    size_t hash_level1 = std::hash<_Key>{}(val.first);
-    size_t n_interval = hash_level1 % super_bucket_count_;
-    auto& super_bucket = super_buckets[n_interval];
+  { insert_hashed( hash_of(val.first), val.first, val.second ); }
 
-    std::lock_guard<_Mutex_type> lock(super_bucket.m);
-    super_bucket.v[hash_level1] = val;
-  }
+  template<typename K>
+  void insert(const t::prehashed_key<K>& k, const _Value& val)
+  { insert_hashed( k.hash(), k.key(), val ); }
 
   iterator erase(const_iterator position)
   {
+    if ( position.in_base_layer() ) {
+      std::lock_guard<super_bucket> lock( super_buckets[ bucket_index( position.hash() ) ] );
+      base_->hide( position.slot() );
+      iterator result_it(position);
+      ++result_it;
+      return result_it;
+    }
+
     auto& sb = get_super_bucket( position.interval() );
-    auto it = position.get_internal_iterator();
 
     {
-      std::lock_guard<_Mutex_type> lock(sb.m);
-      it = sb.v.erase( position.get_internal_iterator() );
+      std::lock_guard<super_bucket> lock(sb);
+      const index_type* block = nullptr;
+      size_t slot = 0;
+      //the element may be already erased or moved to a new block
+      if ( sb.v.find(position.hash(), position.get_internal_iterator()->first, block, slot) ==
+           position.get_internal_iterator() ) {
+        typename super_bucket::write_section ws(sb);
+        erase_entry(sb, block, slot);
+      }
     }
 
-    iterator result_it(this, position.interval(), it);
-
-    if ( it == sb.v.end() )
-      ++result_it;
-
+    iterator result_it(position);
+    ++result_it;
     return result_it;
   }
 
   size_type erase(const key_type& val)
-  {
-    size_t hash_level1 = std::hash<_Key>{}(val);
-    size_t n_interval = hash_level1 % super_bucket_count_;
-    auto& super_bucket = super_buckets[n_interval];
+  { return erase_hashed( hash_of(val), val ); }
 
-    std::lock_guard<_Mutex_type> lock(super_bucket.m);
-    size_t n_el = super_bucket.v.erase(hash_level1);
-    return n_el;
-  }
+  template<typename K>
+  size_type erase(const K& val)
+  { return erase_hashed( hash_of(val), key_of(val) ); }
 
   iterator erase ( const_iterator first, const_iterator last )
   {
-    auto it = first;
-    for (; it != last; ++it) {
+    iterator it = first;
+    while (it != last) {
       it = erase(it);
     }
     return it;
   }
 
   //Element access:
+  /**
+   *  Ссылка действительна, пока запись не удалена. В режиме кэша
+   *  (set_capacity) ее может вытеснить вставка в тот же сегмент из другого
+   *  потока, и ссылка повиснет сразу после возврата, поэтому при
+   *  параллельных писателях значение там меняют через upsert/insert/visit,
+   *  а читают через get/visit.
+   */
   _Value& operator[](const key_type& k)
+  { return access_hashed( hash_of(k), k ); }
+
+  template<typename K>
+  _Value& operator[](const K& k)
+  { return access_hashed( hash_of(k), key_of(k) ); }
+
+  /**
+   *  Копия значения под мьютексом сегмента; запись базового слоя при этом
+   *  не копируется в память, в отличие от find.
+   */
+  template<typename K>
+  std::optional<_Value> get(const K& k)
+  {
+    const size_t hash_level1 = hash_of(k);
+    auto& sb = super_buckets[ bucket_index(hash_level1) ];
+
+    std::shared_lock<super_bucket> lock(sb);
+    const index_type* block;
+    size_t slot;
+    const value_type* entry = sb.v.find( hash_level1, key_of(k), block, slot );
+    if ( entry && !expired(block, slot) ) {
+      note_hit(sb, block, slot);
+      return entry->second;
+    }
+    if (base_) {
+      const size_t i = base_->find( hash_level1, key_of(k) );
+      if (i != file_type::npos) {
+        note_hit(sb);
+        return file_type::value_codec::materialize( base_->file->value(i) );
+      }
+    }
+    note_miss(sb);
+    return std::nullopt;
+  }
+
+  template<typename K>
+  bool contains(const K& k)
+  {
+    const size_t hash_level1 = hash_of(k);
+    super_bucket& sb = super_buckets[ bucket_index(hash_level1) ];
+    size_t slot;
+    const index_type* block;
+    ebr::guard guard;
+    if ( sb.lookup(hash_level1, key_of(k), slot, block) ) {
+      note_hit(sb, block, slot);
+      return true;
+    }
+    if (base_) {
+      const size_t i = base_->file->find( hash_level1, key_of(k) );
+      if ( i != file_type::npos && !base_->is_hidden(i) ) {
+        note_hit(sb);
+        return true;
+      }
+      //скрыта: либо удалена, либо уже скопирована в память после первого поиска
+      if ( i != file_type::npos && sb.lookup(hash_level1, key_of(k), slot, block) ) {
+        note_hit(sb, block, slot);
+        return true;
+      }
+    }
+    note_miss(sb);
+    return false;
+  }
+
+  //Compute in place:
+  /**
+   *  Вызывают функцию под мьютексом super_bucket, найдя ключ одним хэшем и
+   *  одной пробой, так что read-modify-write не требует внешней блокировки.
+   *  Функция не должна менять ключ и обращаться к этому же map.
+   */
+
+  /**
+   *  fn(value_type&) для найденного элемента, false - ключа нет.
+   */
+  template<typename K, typename F>
+  bool visit(const K& k, F fn)
+  {
+    const size_t hash_level1 = hash_of(k);
+    auto& sb = super_buckets[ bucket_index(hash_level1) ];
+
+    std::lock_guard<super_bucket> lock(sb);
+    value_type* entry = find_local( sb, hash_level1, key_of(k) );
+    if ( !entry ) {
+      note_miss(sb);
+      return false;
+    }
+    note_hit(sb);
+    sb.before_write();
+    modify_entry(sb, *entry, fn);
+    trim_outside(sb, entry);
+    return true;
+  }
+
+  /**
+   *  Вставляет val, если ключа нет (true), иначе вызывает fn(mapped&).
+   */
+  template<typename K, typename F>
+  bool upsert(const K& k, const _Value& val, F fn)
+  {
+    const size_t hash_level1 = hash_of(k);
+    auto& sb = super_buckets[ bucket_index(hash_level1) ];
+
+    std::lock_guard<super_bucket> lock(sb);
+    value_type* entry = find_local( sb, hash_level1, key_of(k) );
+    if ( entry ) {
+      sb.before_write();
+      modify_entry( sb, *entry, [&fn](value_type& e) { fn(e.second); } );
+      trim_outside(sb, entry);
+      return false;
+    }
+
+    typename map::super_bucket::write_section ws(sb);
+    emplace_entry( sb, hash_level1, std::piecewise_construct,
+                   std::forward_as_tuple( key_of(k) ), std::forward_as_tuple(val) );
+    return true;
+  }
+
+  /**
+   *  Значение по ключу; если ключа нет - вставляет factory().
+   */
+  template<typename K, typename F>
+  _Value compute_if_absent(const K& k, F factory)
+  {
+    const size_t hash_level1 = hash_of(k);
+    auto& sb = super_buckets[ bucket_index(hash_level1) ];
+
+    std::lock_guard<super_bucket> lock(sb);
+    value_type* entry = find_local( sb, hash_level1, key_of(k) );
+    if ( entry ) {
+      note_hit(sb);
+    } else {
+      note_miss(sb);
+      typename map::super_bucket::write_section ws(sb);
+      entry = emplace_entry( sb, hash_level1, std::piecewise_construct,
+                             std::forward_as_tuple( key_of(k) ), std::forward_as_tuple( factory() ) );
+    }
+    return entry->second;
+  }
+
+  /**
+   *  Удаляет элемент, если pred(const value_type&) вернул true.
+   */
+  template<typename K, typename P>
+  bool erase_if(const K& k, P pred)
+  {
+    const size_t hash_level1 = hash_of(k);
+    auto& sb = super_buckets[ bucket_index(hash_level1) ];
+
+    std::lock_guard<super_bucket> lock(sb);
+    const index_type* block;
+    size_t slot;
+    value_type* entry = find_alive( sb, hash_level1, key_of(k), block, slot, false );
+    if ( !entry && base_ ) {
+      const size_t i = base_->find( hash_level1, key_of(k) );
+      if ( i == file_type::npos || !pred( static_cast<const value_type&>( base_->file->materialize(i) ) ) )
+        return false;
+      base_->hide(i);
+      return true;
+    }
+    if ( !entry || !pred( static_cast<const value_type&>(*entry) ) )
+      return false;
+
+    typename map::super_bucket::write_section ws(sb);
+    erase_entry(sb, block, slot);
+    return true;
+  }
+
+  //Batch operations:
+  /**
+   *  Пакетные операции: все хэши считаются заранее, ключи группируются по
+   *  super_bucket, мьютекс (или seqlock у find_batch) берется один раз на
+   *  группу, а группа и слоты следующих ключей подтягиваются в кэш за
+   *  batch_prefetch_distance ключей до поиска.
+   */
+  void insert_batch(std::span<const value_type> items)
+  {
+    batch_plan plan;
+    make_plan(plan, items.size(), [&](size_t i) { return hash_of(items[i].first); });
+
+    for_each_shard(plan, [&](super_bucket& sb, const size_t* first, const size_t* last) {
+      std::lock_guard<super_bucket> lock(sb);
+      typename map::super_bucket::write_section ws(sb);
+      for (const size_t* it = first; it != last; ++it) {
+        if (it + batch_prefetch_distance < last)
+          sb.v.prefetch( plan.hash[ it[batch_prefetch_distance] ] );
+
+        const value_type& val = items[*it];
+        const index_type* block;
+        size_t slot;
+        value_type* entry = find_alive(sb, plan.hash[*it], val.first, block, slot, true);
+        if ( entry ) {
+          modify_entry( sb, *entry, [&val](value_type& e) { e.second = val.second; } );
+          trim(sb, entry);
+        } else {
+          emplace_entry(sb, plan.hash[*it], val);
+          hide_base(plan.hash[*it], val.first);
+        }
+      }
+    });
+  }
+
+  /**
+   *  Результат i соответствует keys[i], end() - ключа нет.
+   */
+  std::vector<iterator> find_batch(std::span<const key_type> keys)
   {
-    size_t hash_level1 = std::hash<_Key>{}(k);
-    size_t n_interval = hash_level1 % super_bucket_count_;
+    batch_plan plan;
+    make_plan(plan, keys.size(), [&](size_t i) { return hash_of(keys[i]); });
+
+    std::vector<iterator> res( keys.size(), end() );
+    std::vector<const index_type*> blocks( keys.size() );
+    std::vector<size_t> slots( keys.size() );
+    std::vector<value_type*> entries( keys.size() );
+    ebr::guard guard;
+
+    for_each_shard(plan, [&](super_bucket& sb, const size_t* first, const size_t* last) {
+      auto probe_all = [&]() {
+        const index_type* h = sb.v.index();
+        for (const size_t* it = first; it != last; ++it) {
+          if (it + batch_prefetch_distance < last)
+            bucket_data_model::prefetch( h, plan.hash[ it[batch_prefetch_distance] ] );
+          entries[*it] = bucket_data_model::find(h, plan.hash[*it], keys[*it], blocks[*it], slots[*it]);
+          if ( entries[*it] && expired(blocks[*it], slots[*it]) )
+            entries[*it] = nullptr;
+        }
+        return h;
+      };
+
+      const index_type* h = nullptr;
+      bool valid = false;
+      for (size_t attempt = 0; attempt < max_optimistic_attempts && !valid; ++attempt) {
+        const size_t v1 = sb.version.load(std::memory_order_acquire);
+        if (v1 & 1) {
+          cpu_relax();
+          continue;
+        }
+        h = probe_all();
+        std::atomic_thread_fence(std::memory_order_acquire);
+        valid = sb.version.load(std::memory_order_relaxed) == v1;
+      }
+      if (!valid) {
+        std::lock_guard<super_bucket> lock(sb);
+        h = probe_all();
+      }
 
-    std::lock_guard<_Mutex_type> lock(super_buckets[n_interval].m);
-    std::pair<size_t, value_type> p;
-    p.first = hash_level1;
-    p.second.first = k;
-    auto it = super_buckets[n_interval].v.insert(p);
-    return (it.first)->second.second;
+      const size_t n_interval = &sb - super_buckets.data();
+      for (const size_t* it = first; it != last; ++it) {
+        if ( entries[*it] ) {
+          note_hit(sb, blocks[*it], slots[*it]);
+          res[*it] = iterator( this, n_interval, blocks[*it], blocks[*it] != h ? h : nullptr,
+                               slots[*it], entries[*it] );
+        } else if (base_) {
+          res[*it] = find_hashed( plan.hash[*it], keys[*it] );
+        } else {
+          note_miss(sb);
+        }
+      }
+    });
+    return res;
+  }
+
+  size_type erase_batch(std::span<const key_type> keys)
+  {
+    batch_plan plan;
+    make_plan(plan, keys.size(), [&](size_t i) { return hash_of(keys[i]); });
+
+    size_type erased = 0;
+    for_each_shard(plan, [&](super_bucket& sb, const size_t* first, const size_t* last) {
+      std::lock_guard<super_bucket> lock(sb);
+      typename map::super_bucket::write_section ws(sb);
+      for (const size_t* it = first; it != last; ++it) {
+        if (it + batch_prefetch_distance < last)
+          sb.v.prefetch( plan.hash[ it[batch_prefetch_distance] ] );
+
+        const index_type* block;
+        size_t slot;
+        if ( find_alive(sb, plan.hash[*it], keys[*it], block, slot, true) ) {
+          erase_entry(sb, block, slot);
+          ++erased;
+        } else if ( hide_base(plan.hash[*it], keys[*it]) ) {
+          ++erased;
+        }
+      }
+    });
+    return erased;
+  }
+
+  //Parallel operations:
+  /**
+   *  Обход всего map на пуле потоков: задача - один super_bucket, его
+   *  мьютекс берется один раз на весь сегмент. fn(value_type&) может менять
+   *  значения, но не ключи, и не должна обращаться к этому же map.
+   *  Сегменты идут в произвольном порядке и параллельно. Записи базового
+   *  слоя сначала копируются в память, раз fn может их менять.
+   */
+  template<typename F>
+  void parallel_for_each(F fn, t::thread_pool& pool = t::thread_pool::instance())
+  {
+    pool.parallel_for( super_buckets.size(), [this, &fn](size_t n) {
+      super_bucket& sb = super_buckets[n];
+      std::lock_guard<super_bucket> lock(sb);
+      sb.before_write();
+      if (base_) {
+        typename super_bucket::write_section ws(sb);
+        for_each_base(n, [&](size_t i) {
+          emplace_entry( sb, base_->file->hash(i), base_->file->materialize(i) );
+          base_->hide(i);
+        });
+      }
+      for_each_entry( sb.v, [&fn](size_t, value_type& e) { fn(e); }, now_ns() );
+    });
+  }
+
+  /**
+   *  Свертка всего map: в каждом сегменте reduce_fn сворачивает результаты
+   *  map_fn(const value_type&), затем init и итоги сегментов сворачиваются
+   *  по порядку сегментов. reduce_fn должна быть ассоциативной. Записи
+   *  базового слоя декодируются на время вызова map_fn.
+   */
+  template<typename T, typename M, typename R>
+  T parallel_reduce(T init, M map_fn, R reduce_fn, t::thread_pool& pool = t::thread_pool::instance())
+  {
+    std::vector< std::optional<T> > partial( super_buckets.size() );
+    pool.parallel_for( super_buckets.size(), [&](size_t n) {
+      super_bucket& sb = super_buckets[n];
+      std::lock_guard<super_bucket> lock(sb);
+      std::optional<T>& acc = partial[n];
+      auto fold = [&](const value_type& e) {
+        if (acc)
+          *acc = reduce_fn( std::move(*acc), map_fn(e) );
+        else
+          acc.emplace( map_fn(e) );
+      };
+      for_each_entry( sb.v, [&](size_t, const value_type& e) { fold(e); }, now_ns() );
+      for_each_base( n, [&](size_t i) { fold( base_->file->materialize(i) ); } );
+    });
+
+    for (auto& it : partial) {
+      if (it)
+        init = reduce_fn( std::move(init), std::move(*it) );
+    }
+    return init;
+  }
+
+  /**
+   *  Каждый super_bucket отдает свою арену (блок индекса и пул записей)
+   *  целиком, без удаления записей по одной; записи базового слоя
+   *  скрываются.
+   */
+  void clear()
+  {
+    for (size_t n = 0; n < super_buckets.size(); ++n) {
+      super_bucket& sb = super_buckets[n];
+      std::lock_guard<super_bucket> lock(sb);
+      typename super_bucket::write_section ws(sb);
+      sb.v.clear();
+      sb.bytes = 0;
+      sb.wheel.reset();
+      for_each_base( n, [this](size_t i) { base_->hide(i); } );
+    }
   }
 
   super_bucket& get_super_bucket(size_t n)
@@ -290,24 +1401,182 @@ public:
     for (auto& it : super_buckets) {
       s+= it.v.size();
     }
+    if (base_)
+      s += base_->visible();
 
     return s;
   }
 
   //Buckets:
   size_t bucket_count() const noexcept
+  { return super_buckets.size(); }
+
+  /**
+   *  Внутри super_bucket место задают младшие биты хэша, поэтому сегмент
+   *  выбирается по старшим битам хэша, свернутого пополам и умноженного на
+   *  2^64/phi (Фибоначчиево хэширование): они зависят от всех битов хэша,
+   *  а не от тех же младших.
+   */
+  size_t bucket_index(size_t hash) const noexcept
   {
-    std::lock_guard<_Mutex_type> lock(total_mutex_);
-    return super_buckets.size();
+    const uint64_t h = (hash ^ (static_cast<uint64_t>(hash) >> 32)) * 0x9E3779B97F4A7C15ull;
+    return (h >> super_bucket_shift_) & super_bucket_mask_;
+  }
+
+  /**
+   *  Число элементов в каждом super_bucket, для оценки перекоса.
+   */
+  std::vector<size_t> shard_sizes() const
+  {
+    std::vector<size_t> res;
+    res.reserve( super_buckets.size() );
+    for (auto& it : super_buckets) {
+      std::lock_guard<_Mutex_type> lock(it.m);
+      res.push_back( it.v.size() );
+    }
+    return res;
+  }
+
+  /**
+   *  Снимок статистики по каждому super_bucket. Мьютекс сегмента берется
+   *  на время подсчета max_probe_length (проход по всему блоку индекса),
+   *  так что это инструмент мониторинга, а не горячего пути.
+   */
+  std::vector<shard_stats> stats() const
+  {
+    std::vector<shard_stats> res;
+    res.reserve( super_buckets.size() );
+    for (auto& it : super_buckets) {
+      std::lock_guard<_Mutex_type> lock(it.m);
+      res.push_back( shard_stats{ it.stats.acquisitions(), it.stats.contended(), it.stats.wait_ns(),
+                                  it.v.size(), it.v.capacity(), it.v.load_factor(),
+                                  it.v.max_probe_length(), it.v.retired() } );
+    }
+    return res;
+  }
+
+  //Cache mode:
+  /**
+   *  Режим кэша: в памяти не больше max_entries записей и (или) примерно
+   *  max_bytes байт (см. entry_bytes), 0 - без предела; set_capacity(0)
+   *  выключает режим. Пределы делятся поровну между super_bucket, и при
+   *  вставке в полный сегмент вытесняется по CLOCK запись этого же
+   *  сегмента, к которой дольше не обращались, - под его мьютексом, без
+   *  общей блокировки. Попадание только ставит бит обращения в блоке
+   *  индекса. Записи базового слоя (open()) в пределы входят после
+   *  копирования в память.
+   *
+   *  Вытесненная запись освобождается, как удаленная: итераторы ее
+   *  удерживают, а ссылка из operator[] - нет. С параллельными писателями
+   *  вместо m[k] = v - upsert/insert, вместо чтения по ссылке - get/visit.
+   */
+  void set_capacity(size_t max_entries, size_t max_bytes = 0)
+  {
+    const size_t n = super_buckets.size();
+    for (auto& sb : super_buckets) {
+      std::lock_guard<super_bucket> lock(sb);
+      typename super_bucket::write_section ws(sb);
+      sb.entry_limit.store( max_entries ? std::max<size_t>(1, max_entries / n) : 0, std::memory_order_relaxed );
+      sb.byte_limit.store( max_bytes ? std::max<size_t>(1, max_bytes / n) : 0, std::memory_order_relaxed );
+      sb.bytes = 0;
+      if ( sb.bounded() ) {
+        for_each_entry( sb.v, [&sb](size_t, const value_type& e) { sb.bytes += entry_bytes(e); } );
+        trim(sb, nullptr);
+      }
+    }
+  }
+
+  cache_stats cache_statistics() const
+  {
+    cache_stats res = { 0, 0, 0, 0, 0 };
+    for (auto& it : super_buckets) {
+      res.hits += it.counters.hits.load(std::memory_order_relaxed);
+      res.misses += it.counters.misses.load(std::memory_order_relaxed);
+      res.evictions += it.counters.evictions.load(std::memory_order_relaxed);
+      std::lock_guard<_Mutex_type> lock(it.m);
+      res.entries += it.v.size();
+      res.bytes += it.bytes;
+    }
+    return res;
+  }
+
+  /**
+   *  Оценка памяти записи для предела в байтах: пара, слот индекса с
+   *  управляющим байтом и битом обращения (при заполнении 7/8) и буферы
+   *  строк в куче. Пересчитывается при вставке, удалении, insert, visit и
+   *  upsert; изменение значения по ссылке из operator[] в оценку не
+   *  попадает до следующей из этих операций с тем же ключом.
+   */
+  static size_t entry_bytes(const value_type& e) noexcept
+  {
+    static const size_t slot_bytes = (sizeof(size_t) + sizeof(value_type*) + 2) * 8 / 7;
+    return sizeof(value_type) + slot_bytes + heap_bytes(e.first) + heap_bytes(e.second);
+  }
+
+  //Expiration:
+  /**
+   *  Срок жизни записи (TTL). Срок хранится рядом со слотом записи, и
+   *  истекшая запись сразу перестает находиться (find, get, contains,
+   *  visit, обход), хотя физически еще лежит в таблице и учитывается в
+   *  size(). Удаляет такие записи колесо сроков своего super_bucket
+   *  (timer_wheel, тик - 1 мс): при каждой вставке в сегмент и в expire()
+   *  проходятся только ячейки, срок которых подошел, без обхода map и
+   *  без мьютексов других сегментов. insert, operator[] и другие
+   *  изменения срок не трогают; запись, вставленная на место истекшей, -
+   *  без срока.
+   */
+  template<typename Rep, typename Period>
+  void insert_with_ttl(const value_type& val, std::chrono::duration<Rep, Period> ttl)
+  { insert_hashed( hash_of(val.first), val.first, val.second, deadline_after(ttl) ); }
+
+  template<typename K, typename Rep, typename Period>
+  void insert_with_ttl(const t::prehashed_key<K>& k, const _Value& val, std::chrono::duration<Rep, Period> ttl)
+  { insert_hashed( k.hash(), k.key(), val, deadline_after(ttl) ); }
+
+  /**
+   *  Новый срок существующей записи, отсчитанный от текущего момента
+   *  (продление или сокращение); false - ключа нет или он уже истек.
+   *  Запись базового слоя при этом копируется в память.
+   */
+  template<typename K, typename Rep, typename Period>
+  bool expire_after(const K& k, std::chrono::duration<Rep, Period> ttl)
+  {
+    const size_t hash_level1 = hash_of(k);
+    auto& sb = super_buckets[ bucket_index(hash_level1) ];
+
+    std::lock_guard<super_bucket> lock(sb);
+    const index_type* block;
+    size_t slot;
+    if ( !find_local( sb, hash_level1, key_of(k), block, slot ) )
+      return false;
+    set_deadline( sb, block, slot, deadline_after(ttl) );
+    return true;
+  }
+
+  /**
+   *  Удаляет записи, срок которых подошел, во всех super_bucket, беря
+   *  мьютексы по одному. Нужна, только если вставок долго нет. Возвращает
+   *  число удаленных.
+   */
+  size_t expire()
+  {
+    size_t res = 0;
+    for (auto& sb : super_buckets) {
+      std::lock_guard<super_bucket> lock(sb);
+      res += expire_due(sb, false);
+    }
+    return res;
   }
 
   //Hash policy
   void reserve ( size_t n )
   {
+    const size_t per_bucket = (n + super_bucket_mask_) / super_buckets.size();
     for (auto& it : super_buckets) {
       {
-        std::lock_guard<_Mutex_type> lock(it.m);
-        it.v.reserve(n);
+        std::lock_guard<super_bucket> lock(it);
+        typename super_bucket::write_section ws(it);
+        it.v.reserve(per_bucket);
       }
     }
   }
@@ -317,18 +1586,510 @@ public:
 
   void rehash( size_t n )
   {
+    const size_t per_bucket = (n + super_bucket_mask_) / super_buckets.size();
     for (auto& it : super_buckets) {
       {
-        std::lock_guard<_Mutex_type> lock(it.m);
-        it.v.rehash(n);
+        std::lock_guard<super_bucket> lock(it);
+        typename super_bucket::write_section ws(it);
+        it.v.rehash(per_bucket);
       }
     }
   }
 
 private:
-  static const size_t super_bucket_count_ = _NUMBER_SUPER_BUCKETS;
+  static const size_t batch_prefetch_distance = 8;
+
+  /**
+   *  Ключи пакета, упорядоченные по super_bucket (сортировка подсчетом):
+   *  order[first[s] .. first[s + 1]) - номера ключей сегмента s.
+   */
+  struct batch_plan
+  {
+    std::vector<size_t> hash;
+    std::vector<size_t> order;
+    std::vector<size_t> first;
+  };
+
+  template<typename F>
+  void make_plan(batch_plan& plan, size_t n, F hash_at) const
+  {
+    plan.hash.resize(n);
+    plan.order.resize(n);
+    plan.first.assign(super_buckets.size() + 1, 0);
+
+    for (size_t i = 0; i < n; ++i) {
+      plan.hash[i] = hash_at(i);
+      ++plan.first[ bucket_index(plan.hash[i]) + 1 ];
+    }
+    for (size_t s = 1; s < plan.first.size(); ++s)
+      plan.first[s] += plan.first[s - 1];
+
+    std::vector<size_t> pos( plan.first.begin(), plan.first.end() - 1 );
+    for (size_t i = 0; i < n; ++i)
+      plan.order[ pos[ bucket_index(plan.hash[i]) ]++ ] = i;
+  }
+
+  template<typename F>
+  void for_each_shard(const batch_plan& plan, F f)
+  {
+    for (size_t s = 0; s < super_buckets.size(); ++s) {
+      if ( plan.first[s] != plan.first[s + 1] )
+        f( super_buckets[s], plan.order.data() + plan.first[s], plan.order.data() + plan.first[s + 1] );
+    }
+  }
+
+  /**
+   *  f(hash, value_type&) для каждой записи сегмента, вызывается под его
+   *  мьютексом: сначала неперенесенная часть старого блока, потом текущий.
+   *  now != 0 - без записей, истекших к этому моменту.
+   */
+  template<typename F>
+  static void for_each_entry(const bucket_data_model& v, F f, uint64_t now = 0)
+  {
+    auto visit_block = [&](const index_type* b, size_t from) {
+      const size_t cap = bucket_data_model::capacity_of(b);
+      for (size_t i = bucket_data_model::next_full(b, from); i < cap; i = bucket_data_model::next_full(b, i + 1)) {
+        const uint64_t deadline = now ? bucket_data_model::deadline_at(b, i) : 0;
+        if ( !deadline || deadline > now )
+          f( bucket_data_model::hash_at(b, i), *bucket_data_model::entry_at(b, i) );
+      }
+    };
+    const index_type* h = v.index();
+    if ( const index_type* p = bucket_data_model::prev_of(h) )
+      visit_block( p, bucket_data_model::first_unmigrated(h) );
+    visit_block(h, 0);
+  }
+
+  /**
+   *  f(номер записи) для видимых записей базового слоя, попадающих в
+   *  super_bucket n, вызывается под его мьютексом. И map, и файл выбирают
+   *  сегмент старшими битами одного и того же хэша, поэтому записи
+   *  сегмента лежат в идущих подряд сегментах файла.
+   */
+  template<typename F>
+  void for_each_base(size_t n, F f) const
+  {
+    if (!base_)
+      return;
+    const file_type& file = *base_->file;
+    const size_t fs = file.shard_count(), ms = super_buckets.size();
+    const size_t first = fs >= ms ? n * (fs / ms) : n / (ms / fs);
+    const size_t last = fs >= ms ? first + fs / ms : first + 1;
+    for (size_t i = file.shard_begin(first), end = file.shard_begin(last); i < end; ++i) {
+      if ( !base_->is_hidden(i) && bucket_index( file.hash(i) ) == n )
+        f(i);
+    }
+  }
+
+  /**
+   *  Запись сегмента под его мьютексом; видимая запись базового слоя
+   *  сначала копируется в память.
+   */
+  template<typename K>
+  value_type* find_local(super_bucket& sb, size_t hash, const K& k)
+  {
+    const index_type* block;
+    size_t slot;
+    return find_local(sb, hash, k, block, slot);
+  }
+
+  template<typename K>
+  value_type* find_local(super_bucket& sb, size_t hash, const K& k, const index_type*& block, size_t& slot)
+  {
+    value_type* res = find_alive(sb, hash, k, block, slot, false);
+    if (res) {
+      note_access(sb, block, slot);
+      return res;
+    }
+    if (!base_)
+      return nullptr;
+
+    const size_t i = base_->find(hash, k);
+    if (i == file_type::npos)
+      return nullptr;
+    typename super_bucket::write_section ws(sb);
+    res = emplace_entry( sb, hash, base_->file->materialize(i) );
+    base_->hide(i);
+    sb.v.find(hash, k, block, slot);
+    return res;
+  }
+
+  //Cache mode internals (все, кроме note_*, - под мьютексом сегмента):
+  /**
+   *  Обращение к записи в режиме кэша: бит обращения CLOCK. Байт в блоке
+   *  индекса пишется, только если бит сброшен, так что горячие записи
+   *  не гоняют кэш-линию между ядрами.
+   */
+  static void note_access(super_bucket& sb, const index_type* block, size_t slot) noexcept
+  {
+    if ( sb.bounded() )
+      bucket_data_model::touch(block, slot);
+  }
+
+  static void note_hit(super_bucket& sb, const index_type* block, size_t slot) noexcept
+  {
+    if ( sb.bounded() ) {
+      bucket_data_model::touch(block, slot);
+      sb.counters.hits.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+
+  //попадание в базовый слой: записи в памяти нет, бит ставить некуда
+  static void note_hit(super_bucket& sb) noexcept
+  {
+    if ( sb.bounded() )
+      sb.counters.hits.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  static void note_miss(super_bucket& sb) noexcept
+  {
+    if ( sb.bounded() )
+      sb.counters.misses.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  /**
+   *  Новая запись, внутри write_section. С пределом сегмента затем
+   *  вытесняет лишнее (саму новую запись - нет), и удаляет записи, срок
+   *  которых подошел.
+   */
+  template<typename... Args>
+  static value_type* emplace_entry(super_bucket& sb, size_t hash, Args&&... args)
+  {
+    value_type* res = sb.v.emplace_new( hash, std::forward<Args>(args)... );
+    if ( sb.bounded() ) {
+      sb.bytes += entry_bytes(*res);
+      trim(sb, res);
+    }
+    expire_due(sb, true);
+    return res;
+  }
+
+  static void erase_entry(super_bucket& sb, const index_type* block, size_t slot)
+  {
+    if ( sb.bounded() )
+      sb.bytes -= std::min( sb.bytes, entry_bytes( *bucket_data_model::entry_at(block, slot) ) );
+    sb.v.erase(block, slot);
+  }
+
+  /**
+   *  Изменение значения на месте: fn(value_type&), оценка памяти
+   *  пересчитывается. Если значение выросло сверх предела, лишнее
+   *  вытесняет вызывающий: trim внутри write_section или trim_outside.
+   */
+  template<typename F>
+  static void modify_entry(super_bucket& sb, value_type& e, F fn)
+  {
+    if ( !sb.bounded() ) {
+      fn(e);
+      return;
+    }
+    sb.bytes -= std::min( sb.bytes, entry_bytes(e) );
+    fn(e);
+    sb.bytes += entry_bytes(e);
+  }
+
+  static bool over_limit(const super_bucket& sb) noexcept
+  {
+    const size_t max_entries = sb.entry_limit.load(std::memory_order_relaxed);
+    const size_t max_bytes = sb.byte_limit.load(std::memory_order_relaxed);
+    return (max_entries && sb.v.size() > max_entries) || (max_bytes && sb.bytes > max_bytes);
+  }
+
+  /**
+   *  Вытеснение по CLOCK, пока сегмент не уложится в пределы, внутри
+   *  write_section.
+   */
+  static void trim(super_bucket& sb, const value_type* keep)
+  {
+    while ( over_limit(sb) ) {
+      const size_t i = sb.v.clock_victim(sb.clock_hand, keep);
+      if (i == bucket_data_model::npos)
+        break;
+      erase_entry( sb, sb.v.index(), i );
+      sb.counters.evictions.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+
+  //то же после изменения на месте, вне write_section
+  static void trim_outside(super_bucket& sb, const value_type* keep)
+  {
+    if ( over_limit(sb) ) {
+      typename super_bucket::write_section ws(sb);
+      trim(sb, keep);
+    }
+  }
+
+  template<typename T>
+  static size_t heap_bytes(const T&) noexcept
+  { return 0; }
+
+  static size_t heap_bytes(const std::string& v) noexcept
+  {
+    //короткая строка лежит внутри самого объекта
+    const uintptr_t p = reinterpret_cast<uintptr_t>( v.data() );
+    const uintptr_t self = reinterpret_cast<uintptr_t>( &v );
+    return p >= self && p < self + sizeof(v) ? 0 : v.capacity() + 1;
+  }
+
+  //Expiration internals:
+  static const uint64_t expiry_tick_ns = 1000000; //тик колеса сроков - 1 мс
+  static const uint64_t keep_deadline = UINT64_MAX;
+
+  /**
+   *  Сроки - наносекунды steady_clock, 0 - без срока. Часы читаются,
+   *  только если у записи есть срок.
+   */
+  static uint64_t now_ns() noexcept
+  {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch() ).count();
+  }
+
+  static bool past(uint64_t deadline) noexcept
+  { return deadline && deadline <= now_ns(); }
+
+  static bool expired(const index_type* block, size_t slot) noexcept
+  { return past( bucket_data_model::deadline_at(block, slot) ); }
+
+  //тик, к которому срок уже наступил
+  static uint64_t tick_of(uint64_t deadline) noexcept
+  { return (deadline + expiry_tick_ns - 1) / expiry_tick_ns; }
+
+  template<typename Rep, typename Period>
+  static uint64_t deadline_after(std::chrono::duration<Rep, Period> ttl) noexcept
+  {
+    //не дальше ~30 лет, чтобы не переполнить наносекунды
+    const double ns = std::chrono::duration<double, std::nano>(ttl).count();
+    return now_ns() + static_cast<uint64_t>( std::clamp(ns, 0.0, 1e18) );
+  }
+
+  /**
+   *  Поиск под мьютексом сегмента для изменяющих операций: истекшая, но
+   *  еще не удаленная запись удаляется сразу и не находится.
+   *  in_section - вызывающий уже внутри write_section.
+   */
+  template<typename K>
+  static value_type* find_alive(super_bucket& sb, size_t hash, const K& k,
+                                const index_type*& block, size_t& slot, bool in_section)
+  {
+    value_type* res = sb.v.find(hash, k, block, slot);
+    if ( !res || !expired(block, slot) )
+      return res;
+    if (in_section) {
+      erase_entry(sb, block, slot);
+    } else {
+      typename super_bucket::write_section ws(sb);
+      erase_entry(sb, block, slot);
+    }
+    return nullptr;
+  }
+
+  /**
+   *  Новый срок записи, под мьютексом сегмента. В колесе всегда есть
+   *  элемент записи не позже ее срока: при продлении старый элемент
+   *  остается, и при срабатывании expire_due переставляет его.
+   */
+  static void set_deadline(super_bucket& sb, const index_type* block, size_t slot, uint64_t deadline)
+  {
+    const uint64_t old = bucket_data_model::deadline_at(block, slot);
+    bucket_data_model::set_deadline(block, slot, deadline);
+    if ( !deadline || (old && old <= deadline) )
+      return;
+    if ( !sb.wheel )
+      sb.wheel.reset( new expiry_wheel( now_ns() / expiry_tick_ns ) );
+    sb.wheel->schedule( tick_of(deadline), expiry_item{ bucket_data_model::hash_at(block, slot),
+                                                        bucket_data_model::entry_at(block, slot) } );
+  }
+
+  /**
+   *  Проходит колесо сегмента до текущего тика, под мьютексом сегмента:
+   *  истекшие записи удаляются, продленные встают в колесо на новый срок,
+   *  удаленные другим путем выпадают. Трогаются только подошедшие ячейки.
+   *  in_section - вызывающий уже внутри write_section. Возвращает число
+   *  удаленных.
+   */
+  static size_t expire_due(super_bucket& sb, bool in_section)
+  {
+    if ( !sb.wheel )
+      return 0;
+    const uint64_t now = now_ns();
+    expiry_wheel& w = *sb.wheel;
+    if ( !w.pending(now / expiry_tick_ns) )
+      return 0;
+
+    std::optional<typename super_bucket::write_section> ws;
+    if (!in_section)
+      ws.emplace(sb);
+    size_t res = 0;
+    w.advance( now / expiry_tick_ns, [&](const expiry_item& it) {
+      const index_type* block;
+      size_t slot;
+      if ( !sb.v.locate(it.hash, it.entry, block, slot) )
+        return;
+      const uint64_t deadline = bucket_data_model::deadline_at(block, slot);
+      if (!deadline)
+        return;
+      if (deadline <= now) {
+        erase_entry(sb, block, slot);
+        ++res;
+      } else {
+        w.schedule( tick_of(deadline), it );
+      }
+    } );
+    return res;
+  }
+
+  /**
+   *  Скрывает запись базового слоя с ключом k, под мьютексом сегмента и
+   *  после вставки нового значения в память.
+   */
+  template<typename K>
+  bool hide_base(size_t hash, const K& k)
+  {
+    if (!base_)
+      return false;
+    const size_t i = base_->find(hash, k);
+    if (i == file_type::npos)
+      return false;
+    base_->hide(i);
+    return true;
+  }
+
+  template<typename K>
+  static size_t hash_of(const K& k)
+  { return hasher{}(k); }
+
+  template<typename K>
+  static size_t hash_of(const t::prehashed_key<K>& k)
+  { return k.hash(); }
+
+  template<typename K>
+  static const K& key_of(const K& k)
+  { return k; }
+
+  template<typename K>
+  static const K& key_of(const t::prehashed_key<K>& k)
+  { return k.key(); }
+
+  template<typename K>
+  iterator find_hashed(size_t hash_level1, const K& k)
+  {
+    size_t n_interval = bucket_index(hash_level1);
+    size_t slot = 0;
+    const index_type* block = nullptr;
+    ebr::guard guard;
+    value_type* res = super_buckets[n_interval].lookup(hash_level1, k, slot, block);
+
+    if ( res ) {
+      note_hit(super_buckets[n_interval], block, slot);
+      const index_type* next_block = nullptr;
+      if ( block != super_buckets[n_interval].v.index() )
+        next_block = super_buckets[n_interval].v.index();
+      return iterator(this, n_interval, block, next_block, slot, res);
+    }
+
+    if ( base_ && base_->file->find(hash_level1, k) != file_type::npos ) {
+      //copy-up: итератор дает изменяемую ссылку
+      super_bucket& sb = super_buckets[n_interval];
+      std::lock_guard<super_bucket> lock(sb);
+      if ( find_local(sb, hash_level1, k) ) {
+        note_hit(sb);
+        res = sb.v.find(hash_level1, k, block, slot);
+        return iterator(this, n_interval, block, block != sb.v.index() ? sb.v.index() : nullptr, slot, res);
+      }
+    }
+
+    note_miss(super_buckets[n_interval]);
+    return end();
+  }
+
+  /**
+   *  deadline - новый срок записи, keep_deadline - срок не менять (у новой
+   *  записи его нет).
+   */
+  template<typename K>
+  void insert_hashed(size_t hash_level1, const K& k, const _Value& val, uint64_t deadline = keep_deadline)
+  {
+    size_t n_interval = bucket_index(hash_level1);
+    auto& super_bucket = super_buckets[n_interval];
+
+    std::lock_guard<typename map::super_bucket> lock(super_bucket);
+    const index_type* block;
+    size_t slot;
+    value_type* entry = find_alive(super_bucket, hash_level1, k, block, slot, false);
+    if ( entry ) {
+      note_access(super_bucket, block, slot);
+      super_bucket.before_write();
+      modify_entry( super_bucket, *entry, [&val](value_type& e) { e.second = val; } );
+      if (deadline != keep_deadline)
+        set_deadline(super_bucket, block, slot, deadline);
+      trim_outside(super_bucket, entry);
+    } else {
+      typename map::super_bucket::write_section ws(super_bucket);
+      emplace_entry( super_bucket, hash_level1, std::piecewise_construct,
+                     std::forward_as_tuple(k), std::forward_as_tuple(val) );
+      hide_base(hash_level1, k);
+      if ( deadline != keep_deadline && super_bucket.v.find(hash_level1, k, block, slot) )
+        set_deadline(super_bucket, block, slot, deadline);
+    }
+  }
+
+  template<typename K>
+  size_type erase_hashed(size_t hash_level1, const K& k)
+  {
+    size_t n_interval = bucket_index(hash_level1);
+    auto& super_bucket = super_buckets[n_interval];
+
+    std::lock_guard<typename map::super_bucket> lock(super_bucket);
+    const index_type* block;
+    size_t slot;
+    if ( !find_alive(super_bucket, hash_level1, k, block, slot, false) )
+      return hide_base(hash_level1, k) ? 1 : 0;
+
+    typename map::super_bucket::write_section ws(super_bucket);
+    erase_entry(super_bucket, block, slot);
+    return 1;
+  }
+
+  template<typename K>
+  _Value& access_hashed(size_t hash_level1, const K& k)
+  {
+    size_t n_interval = bucket_index(hash_level1);
+    auto& super_bucket = super_buckets[n_interval];
+
+    std::lock_guard<typename map::super_bucket> lock(super_bucket);
+    //значение меняют по ссылке уже после выхода отсюда
+    super_bucket.before_write();
+    value_type* entry = find_local(super_bucket, hash_level1, k);
+    if ( !entry ) {
+      typename map::super_bucket::write_section ws(super_bucket);
+      entry = emplace_entry( super_bucket, hash_level1, std::piecewise_construct,
+                             std::forward_as_tuple(k), std::forward_as_tuple() );
+    }
+    return entry->second;
+  }
+
+  static size_t round_up_pow2(size_t n)
+  {
+    size_t p = 1;
+    while (p < n)
+      p <<= 1;
+    return p;
+  }
+
+  static size_t log2(size_t n)
+  {
+    size_t b = 0;
+    while ( (size_t(1) << b) < n )
+      ++b;
+    return b;
+  }
+
   std::vector< super_bucket > super_buckets;
+  size_t super_bucket_mask_;
+  size_t super_bucket_shift_;
   mutable _Mutex_type total_mutex_;
+  std::unique_ptr<base_layer> base_;
 };
 
 }
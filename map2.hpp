@@ -0,0 +1,514 @@
+#ifndef MAP2_HPP
+#define MAP2_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <iterator>
+#include <tuple>
+#include <utility>
+
+#include "ebr.hpp"
+
+namespace t2
+{
+
+/**
+ *  Второй вариант трактовки условия:
+ *  Контейнер вообще без блокировок. Split-ordered list (Shalev, Shavit):
+ *  все элементы лежат в одном lock-free списке Харриса-Майкла, упорядоченном
+ *  по битам хэша, записанным задом наперед, а массив бакетов - лишь
+ *  указатели на фиктивные узлы внутри этого списка. Удвоение числа бакетов
+ *  ничего не переносит: новый бакет инициализируется лениво, вставкой своего
+ *  фиктивного узла сразу за фиктивным узлом родителя. Сам массив бакетов
+ *  растет сегментами, уже выделенные сегменты не копируются.
+ *  Удаленные узлы освобождаются по эпохам (ebr): поиск, вставка и
+ *  удаление закрепляют поток на время операции, итератор - пока указывает
+ *  на узел, поэтому и он, и параллельные читатели смотрят в живую память.
+ *  Ссылка из operator[] действительна до удаления элемента.
+ */
+template<typename _Key, typename _Value>
+class map
+{
+public:
+  typedef _Key key_type;
+  typedef _Value mapped_type;
+  typedef std::pair<_Key, _Value> value_type;
+  typedef size_t size_type;
+  typedef std::hash<_Key> hasher;
+
+private:
+  struct node_base
+  {
+    const uint64_t          so_key;
+    std::atomic<uintptr_t>  next;
+    node_base*              retired_next;
+    uint64_t                retired_epoch;
+
+    explicit node_base(uint64_t k) : so_key(k), next(0), retired_next(nullptr), retired_epoch(0)
+    { }
+
+    bool is_dummy() const
+    { return (so_key & 1) == 0; }
+  };
+
+  struct node : node_base
+  {
+    value_type value;
+
+    template<typename... Args>
+    explicit node(uint64_t k, Args&&... args) :
+      node_base(k), value( std::forward<Args>(args)... )
+    { }
+  };
+
+public:
+  class iterator
+  {
+    public:
+      typedef  std::forward_iterator_tag  iterator_category;
+      typedef  map::value_type            value_type;
+      typedef  map::value_type&           reference;
+      typedef  map::value_type*           pointer;
+      typedef  std::ptrdiff_t             difference_type;
+
+      iterator(map* base, node* n) : base_(base), node_(n), guard_(n != nullptr)
+      { }
+
+      iterator& operator++()
+      {
+        node_ = map::next_live(node_);
+        if (!node_)
+          guard_ = ebr::guard(false);
+        return *this;
+      }
+
+      iterator operator++(int)
+      {
+        iterator i = *this;
+        operator++();
+        return i;
+      }
+
+      map::value_type* operator->() { return &node_->value; }
+      map::value_type& operator*() { return node_->value; }
+      bool operator==(const iterator& rhs) const { return node_ == rhs.node_; }
+      bool operator!=(const iterator& rhs) const { return node_ != rhs.node_; }
+
+      node* get_internal_iterator() const { return node_; }
+      map* base() const { return base_; }
+
+    private:
+      map* base_;
+      node* node_;
+      ebr::guard guard_;
+  };
+
+  typedef const iterator const_iterator;
+
+  map() : size_(0), bucket_count_(initial_bucket_count), retired_(nullptr), retired_count_(0)
+  {
+    for (auto& it : segments_)
+      it.store(nullptr, std::memory_order_relaxed);
+    head_ = new node_base(0);
+    bucket_slot(0).store(head_, std::memory_order_release);
+  }
+
+  map(const map&) = delete;
+  map& operator=(const map&) = delete;
+
+  virtual ~map()
+  {
+    node_base* p = head_;
+    while (p) {
+      node_base* next = ptr( p->next.load(std::memory_order_relaxed) );
+      destroy_node(p);
+      p = next;
+    }
+
+    p = retired_.load(std::memory_order_relaxed);
+    while (p) {
+      node_base* next = p->retired_next;
+      destroy_node(p);
+      p = next;
+    }
+
+    for (size_t s = 0; s < max_segments; ++s)
+      delete[] segments_[s].load(std::memory_order_relaxed);
+  }
+
+  //Element lookup
+  iterator find ( const key_type& k )
+  {
+    const size_t hash = hasher{}(k);
+    std::atomic<uintptr_t>* prev;
+    node_base* curr;
+    ebr::guard guard;
+
+    if ( search(bucket_of(hash), regular_key(hash), &k, prev, curr) )
+      return iterator( this, static_cast<node*>(curr) );
+
+    return end();
+  }
+
+  //Iterators:
+  iterator begin() noexcept
+  {
+    ebr::guard guard;
+    return iterator( this, next_live(head_) );
+  }
+
+  iterator end() noexcept
+  { return iterator(this, nullptr); }
+
+  const_iterator cbegin() noexcept
+  { return begin(); }
+
+  const_iterator cend() noexcept
+  { return end(); }
+
+  //Modifiers:
+  void insert(const value_type& val)
+  {
+    //значение существующего элемента перезаписывается так же, как через
+    //operator[]: это не атомарно относительно других писателей этого ключа
+    operator[](val.first) = val.second;
+  }
+
+  iterator erase(const_iterator position)
+  {
+    iterator result_it(position);
+    ++result_it;
+
+    if ( node* n = position.get_internal_iterator() )
+      erase_node(n);
+
+    return result_it;
+  }
+
+  size_type erase(const key_type& val)
+  {
+    const size_t hash = hasher{}(val);
+    std::atomic<uintptr_t>* prev;
+    node_base* curr;
+    ebr::guard guard;
+
+    if ( !search(bucket_of(hash), regular_key(hash), &val, prev, curr) )
+      return 0;
+
+    return erase_node( static_cast<node*>(curr) ) ? 1 : 0;
+  }
+
+  iterator erase ( const_iterator first, const_iterator last )
+  {
+    iterator it = first;
+    while (it != last) {
+      it = erase(it);
+    }
+    return it;
+  }
+
+  //Element access:
+  _Value& operator[](const key_type& k)
+  {
+    const size_t hash = hasher{}(k);
+    const uint64_t so_key = regular_key(hash);
+    //bucket_of может вставлять фиктивные узлы, а значит, и вырезать чужие
+    ebr::guard guard;
+    node_base* start = bucket_of(hash);
+    std::atomic<uintptr_t>* prev;
+    node_base* curr;
+
+    if ( search(start, so_key, &k, prev, curr) )
+      return static_cast<node*>(curr)->value.second;
+
+    node* n = new node( so_key, std::piecewise_construct,
+                        std::forward_as_tuple(k), std::forward_as_tuple() );
+    node_base* res = insert_node(start, n, &n->value.first);
+    if (res != n) {
+      //другой поток успел вставить этот ключ
+      delete n;
+    } else {
+      grow_if_needed( size_.fetch_add(1, std::memory_order_relaxed) + 1 );
+    }
+
+    return static_cast<node*>(res)->value.second;
+  }
+
+  _Value& operator[](key_type&& k)
+  { return operator[]( static_cast<const key_type&>(k) ); }
+
+  //Capacity:
+  bool empty() const noexcept
+  { return size() == 0; }
+
+  size_t size() const noexcept
+  { return size_.load(std::memory_order_relaxed); }
+
+  //Buckets:
+  size_t bucket_count() const noexcept
+  { return bucket_count_.load(std::memory_order_relaxed); }
+
+  //Hash policy
+  void reserve ( size_t n )
+  { rehash( (n + max_load_factor - 1) / max_load_factor ); }
+
+  float load_factor() const noexcept
+  { return static_cast<float>( size() ) / static_cast<float>( bucket_count() ); }
+
+  /**
+   *  Число бакетов только растет: уменьшение потребовало бы убирать
+   *  фиктивные узлы из списка под читателями.
+   */
+  void rehash( size_t n )
+  {
+    size_t bc = bucket_count_.load(std::memory_order_relaxed);
+    size_t target = bc;
+    while (target < n && target < max_bucket_count)
+      target <<= 1;
+
+    while ( bc < target &&
+            !bucket_count_.compare_exchange_weak(bc, target, std::memory_order_relaxed) )
+    { }
+  }
+
+private:
+  static const size_t    initial_bucket_count = 16;
+  static const size_t    max_load_factor = 2;
+  static const size_t    max_segments = 48;
+  static const size_t    max_bucket_count = (size_t(1) << (max_segments - 1));
+  static const uintptr_t mark_bit = 1;
+  static const size_t    reclaim_batch = 64;
+
+  static node_base* ptr(uintptr_t p)
+  { return reinterpret_cast<node_base*>(p & ~mark_bit); }
+
+  static bool marked(uintptr_t p)
+  { return (p & mark_bit) != 0; }
+
+  static uintptr_t raw(node_base* p)
+  { return reinterpret_cast<uintptr_t>(p); }
+
+  static uint64_t reverse_bits(uint64_t x)
+  {
+    x = ((x >> 1) & 0x5555555555555555ull) | ((x & 0x5555555555555555ull) << 1);
+    x = ((x >> 2) & 0x3333333333333333ull) | ((x & 0x3333333333333333ull) << 2);
+    x = ((x >> 4) & 0x0F0F0F0F0F0F0F0Full) | ((x & 0x0F0F0F0F0F0F0F0Full) << 4);
+    return __builtin_bswap64(x);
+  }
+
+  //у обычных узлов младший бит ключа 1, у фиктивных 0
+  static uint64_t regular_key(size_t hash)
+  { return reverse_bits( static_cast<uint64_t>(hash) | (uint64_t(1) << 63) ); }
+
+  static uint64_t dummy_key(size_t bucket)
+  { return reverse_bits(bucket); }
+
+  static node* next_live(node_base* p)
+  {
+    while (p) {
+      const uintptr_t next = p->next.load(std::memory_order_acquire);
+      p = ptr(next);
+      if ( p && !p->is_dummy() && !marked( p->next.load(std::memory_order_acquire) ) )
+        return static_cast<node*>(p);
+    }
+    return nullptr;
+  }
+
+  static void destroy_node(node_base* p)
+  {
+    if ( p->is_dummy() )
+      delete p;
+    else
+      delete static_cast<node*>(p);
+  }
+
+  /**
+   *  Поиск Харриса-Майкла от узла start: curr - первый узел с ключом
+   *  (so_key, k), либо первый узел с большим so_key. Помеченные на удаление
+   *  узлы по пути вырезаются из списка. k == nullptr - ищется фиктивный узел.
+   */
+  bool search(node_base* start, uint64_t so_key, const key_type* k,
+              std::atomic<uintptr_t>*& prev, node_base*& curr)
+  {
+  try_again:
+    prev = &start->next;
+    curr = ptr( prev->load(std::memory_order_acquire) );
+
+    for (;;) {
+      if (!curr)
+        return false;
+
+      const uintptr_t next = curr->next.load(std::memory_order_acquire);
+      if ( prev->load(std::memory_order_acquire) != raw(curr) )
+        goto try_again;
+
+      if ( marked(next) ) {
+        uintptr_t expected = raw(curr);
+        if ( !prev->compare_exchange_strong(expected, next & ~mark_bit,
+                                            std::memory_order_acq_rel) )
+          goto try_again;
+
+        retire(curr);
+        curr = ptr(next);
+        continue;
+      }
+
+      if (curr->so_key > so_key)
+        return false;
+
+      if (curr->so_key == so_key) {
+        if (!k || static_cast<node*>(curr)->value.first == *k)
+          return true;
+      }
+
+      prev = &curr->next;
+      curr = ptr(next);
+    }
+  }
+
+  node_base* insert_node(node_base* start, node_base* n, const key_type* k)
+  {
+    std::atomic<uintptr_t>* prev;
+    node_base* curr;
+
+    for (;;) {
+      if ( search(start, n->so_key, k, prev, curr) )
+        return curr;
+
+      n->next.store(raw(curr), std::memory_order_relaxed);
+      uintptr_t expected = raw(curr);
+      if ( prev->compare_exchange_strong(expected, raw(n), std::memory_order_acq_rel) )
+        return n;
+    }
+  }
+
+  bool erase_node(node* n)
+  {
+    uintptr_t next = n->next.load(std::memory_order_acquire);
+    while ( !marked(next) ) {
+      if ( n->next.compare_exchange_weak(next, next | mark_bit, std::memory_order_acq_rel) ) {
+        size_.fetch_sub(1, std::memory_order_relaxed);
+
+        //физическое удаление: поиск вырезает помеченные узлы
+        const size_t hash = hasher{}(n->value.first);
+        std::atomic<uintptr_t>* prev;
+        node_base* curr;
+        search(bucket_of(hash), n->so_key, &n->value.first, prev, curr);
+        return true;
+      }
+    }
+    return false;
+  }
+
+  /**
+   *  Вырезанный из списка узел откладывается с текущей эпохой, каждые
+   *  reclaim_batch отложенных - попытка освободить накопленное.
+   */
+  void retire(node_base* p)
+  {
+    p->retired_epoch = ebr::domain::global().epoch();
+    push_retired(p, p);
+    if ( (retired_count_.fetch_add(1, std::memory_order_relaxed) + 1) % reclaim_batch == 0 )
+      reclaim();
+  }
+
+  void push_retired(node_base* first, node_base* last)
+  {
+    node_base* head = retired_.load(std::memory_order_relaxed);
+    do {
+      last->retired_next = head;
+    } while ( !retired_.compare_exchange_weak(head, first, std::memory_order_release,
+                                              std::memory_order_relaxed) );
+  }
+
+  /**
+   *  Забирает весь список отложенных (другие потоки тем временем копят
+   *  новый), освобождает то, что уже никому не видно, остальное
+   *  возвращает.
+   */
+  void reclaim()
+  {
+    ebr::domain& d = ebr::domain::global();
+    d.try_advance();
+
+    node_base* p = retired_.exchange(nullptr, std::memory_order_acquire);
+    node_base* keep = nullptr;
+    node_base* keep_last = nullptr;
+    while (p) {
+      node_base* next = p->retired_next;
+      if ( d.is_safe(p->retired_epoch) ) {
+        destroy_node(p);
+      } else {
+        p->retired_next = keep;
+        keep = p;
+        if (!keep_last)
+          keep_last = p;
+      }
+      p = next;
+    }
+    if (keep)
+      push_retired(keep, keep_last);
+  }
+
+  void grow_if_needed(size_t size)
+  {
+    size_t bc = bucket_count_.load(std::memory_order_relaxed);
+    if ( size > bc * max_load_factor && bc < max_bucket_count )
+      bucket_count_.compare_exchange_strong(bc, bc * 2, std::memory_order_relaxed);
+  }
+
+  /**
+   *  Сегмент s хранит бакеты [2^s - 1, 2^(s+1) - 1).
+   */
+  std::atomic<node_base*>& bucket_slot(size_t b)
+  {
+    const size_t idx = b + 1;
+    const size_t s = 63 - static_cast<size_t>( __builtin_clzll(idx) );
+    const size_t off = idx - (size_t(1) << s);
+
+    std::atomic<node_base*>* seg = segments_[s].load(std::memory_order_acquire);
+    if (!seg) {
+      std::atomic<node_base*>* fresh = new std::atomic<node_base*>[size_t(1) << s]();
+      if ( segments_[s].compare_exchange_strong(seg, fresh, std::memory_order_acq_rel) )
+        seg = fresh;
+      else
+        delete[] fresh;
+    }
+    return seg[off];
+  }
+
+  node_base* bucket_of(size_t hash)
+  { return bucket( hash & (bucket_count() - 1) ); }
+
+  node_base* bucket(size_t b)
+  {
+    std::atomic<node_base*>& slot = bucket_slot(b);
+    node_base* d = slot.load(std::memory_order_acquire);
+    if (d)
+      return d;
+
+    //родитель - бакет без старшего бита, его фиктивный узел стоит раньше
+    const size_t parent = b & ~( size_t(1) << (63 - __builtin_clzll(b)) );
+    node_base* start = bucket(parent);
+
+    node_base* dummy = new node_base( dummy_key(b) );
+    d = insert_node(start, dummy, nullptr);
+    if (d != dummy)
+      delete dummy;
+
+    slot.store(d, std::memory_order_release);
+    return d;
+  }
+
+  std::atomic<size_t>                     size_;
+  std::atomic<size_t>                     bucket_count_;
+  std::atomic<std::atomic<node_base*>*>   segments_[max_segments];
+  std::atomic<node_base*>                 retired_;
+  std::atomic<size_t>                     retired_count_;
+  node_base*                              head_;
+};
+
+}
+
+#endif // MAP2_HPP
@@ -3,10 +3,48 @@
 
 #include <unordered_map>
 #include <mutex>
+#include <shared_mutex>
+#include <tuple>
+#include <type_traits>
+
+#include "string_hash.h"
+#include "flat_combining.hpp"
 
 namespace t3
 {
 
+/**
+ *  Исключительный доступ для threadsafe_adapter: обычный мьютекс
+ *  берется на время вызова, flat_combining выполняет вызов пачкой
+ *  вместе с операциями других потоков.
+ */
+template<typename _Mutex_type, typename F>
+auto run_exclusive(_Mutex_type& m, F&& f) -> decltype( f() )
+{
+  std::lock_guard<_Mutex_type> lock(m);
+  return f();
+}
+
+template<typename F>
+auto run_exclusive(flat_combining& m, F&& f) -> decltype( f() )
+{ return m.execute( std::forward<F>(f) ); }
+
+/**
+ *  Доступ только на чтение: мьютекс с lock_shared (std::shared_mutex,
+ *  t::reader_biased_lock) берется разделяемо, остальные - как в
+ *  run_exclusive.
+ */
+template<typename _Mutex_type, typename F>
+auto run_shared(_Mutex_type& m, F&& f) -> decltype( f() )
+{
+  if constexpr ( requires { m.lock_shared(); } ) {
+    std::shared_lock<_Mutex_type> lock(m);
+    return f();
+  } else {
+    return run_exclusive( m, std::forward<F>(f) );
+  }
+}
+
 /**
  *  Трейти вариант трактовки условия, формальный:
  *  Реализация потокобезопасного контейнера, превосходящего по производительности только std::map.
@@ -25,64 +63,100 @@ public:
   //Iterators:
   typename _T::iterator begin() const noexcept
   {
-    std::lock_guard<_Mutex_type> lock(total_mutex);
-    return data.begin();
+    return exclusive( [&]() -> typename _T::iterator {
+      return data.begin();
+    } );
   }
 
   typename _T::iterator end() const noexcept
   {
-    std::lock_guard<_Mutex_type> lock(total_mutex);
-    return data.end();
+    return exclusive( [&]() -> typename _T::iterator {
+      return data.end();
+    } );
   }
 
   typename _T::const_iterator cbegin() const noexcept
   {
-    std::lock_guard<_Mutex_type> lock(total_mutex);
-    return data.cbegin();
+    return exclusive( [&]() -> typename _T::const_iterator {
+      return data.cbegin();
+    } );
   }
 
   typename _T::const_iterator cbegin ( typename _T::size_type n )
   {
-    std::lock_guard<_Mutex_type> lock(total_mutex);
-    return data.cbegin(n);
+    return exclusive( [&]() -> typename _T::const_iterator {
+      return data.cbegin(n);
+    } );
   }
 
   typename _T::const_iterator cend() const noexcept
   {
-    std::lock_guard<_Mutex_type> lock(total_mutex);
-    return data.cend();
+    return exclusive( [&]() -> typename _T::const_iterator {
+      return data.cend();
+    } );
   }
 
   typename _T::const_iterator cend ( typename _T::size_type n )
   {
-    std::lock_guard<_Mutex_type> lock(total_mutex);
-    return cend(n);
+    return exclusive( [&]() -> typename _T::const_iterator {
+      return data.cend(n);
+    } );
   }
 
   template <class... Args>
   std::pair<typename _T::iterator, bool> emplace ( Args&&... args )
   {
-    std::lock_guard<_Mutex_type> lock(total_mutex);
-    return data.emplace( args ...  );
+    return exclusive( [&]() -> std::pair<typename _T::iterator, bool> {
+      return data.emplace( args ...  );
+    } );
   }
 
   //Modifiers:
   void insert( const typename _T::value_type& val )
   {
-    std::lock_guard<_Mutex_type> lock(total_mutex);
-    return data.insert(val);
+    exclusive( [&]() -> void {
+      data.insert(val);
+    } );
+  }
+
+  template<typename K>
+  void insert( const t::prehashed_key<K>& k, const typename _T::mapped_type& val )
+  {
+    return exclusive( [&]() -> void {
+      auto it = data.find(k);
+      if ( it == data.end() )
+        data.emplace( std::piecewise_construct, std::forward_as_tuple( k.key() ),
+                      std::forward_as_tuple(val) );
+      else
+        it->second = val;
+    } );
   }
 
   typename _T::size_type erase(const typename _T::key_type& val)
   {
-    std::lock_guard<_Mutex_type> lock(total_mutex);
-    return data.erase(val);
+    return exclusive( [&]() -> typename _T::size_type {
+      return data.erase(val);
+    } );
+  }
+
+  template<typename K, typename = typename std::enable_if<
+                          !std::is_convertible<K, typename _T::const_iterator>::value >::type>
+  typename _T::size_type erase(const K& k)
+  {
+    return exclusive( [&]() -> typename _T::size_type {
+      auto it = data.find(k);
+      if ( it == data.end() )
+        return 0;
+      data.erase(it);
+      return 1;
+    } );
   }
 
   typename _T::iterator erase(typename _T::const_iterator position)
   {
-    std::lock_guard<_Mutex_type> lock(total_mutex);
-    return data.erase(position);
+    return exclusive( [&]() -> typename _T::iterator {
+      return data.erase(position);
+    } );
   }
 
   typename _T::iterator erase(typename _T::iterator first, typename _T::iterator last)
@@ -97,97 +171,230 @@ public:
   //Element lookup
   typename _T::iterator find ( const typename _T::key_type& k )
   {
-    std::lock_guard<_Mutex_type> lock(total_mutex);
-    return data.find(k);
+    return shared( [&]() -> typename _T::iterator {
+      return data.find(k);
+    } );
+  }
+
+  /**
+   *  Гетерогенный поиск, _T должен иметь прозрачные hasher и key_equal.
+   *  prehashed_key передается в контейнер как есть: его хэш не пересчитывается.
+   */
+  template<typename K>
+  typename _T::iterator find ( const K& k )
+  {
+    return shared( [&]() -> typename _T::iterator {
+      return data.find(k);
+    } );
   }
 
+  template<typename K>
+  static t::prehashed_key<K> prehash(const K& k)
+  { return t::prehashed_key<K>( k, typename _T::hasher{}(k) ); }
+
   //Element access:
   typename _T::mapped_type& operator[](const typename _T::key_type& k)
   {
-    std::lock_guard<_Mutex_type> lock(total_mutex);
-    return data[k];
+    return exclusive( [&]() -> typename _T::mapped_type& {
+      return data[k];
+    } );
   }
 
   typename _T::mapped_type& operator[](typename _T::key_type&& k)
   {
-    std::lock_guard<_Mutex_type> lock(total_mutex);
-    return data[k];
+    return exclusive( [&]() -> typename _T::mapped_type& {
+      return data[k];
+    } );
+  }
+
+  /**
+   *  Ключ создается, только если его нет в контейнере.
+   */
+  template<typename K>
+  typename _T::mapped_type& operator[](const K& k)
+  {
+    return exclusive( [&]() -> typename _T::mapped_type& {
+      auto it = data.find(k);
+      if ( it == data.end() )
+        it = data.emplace( std::piecewise_construct, std::forward_as_tuple( key_of(k) ),
+                           std::forward_as_tuple() ).first;
+      return it->second;
+    } );
+  }
+
+  typename _T::mapped_type& at ( const typename _T::key_type& k )
+  {
+    return shared( [&]() -> typename _T::mapped_type& {
+      return data.at(k);
+    } );
+  }
+
+  const typename _T::mapped_type& at ( const typename _T::key_type& k ) const
+  {
+    return shared( [&]() -> const typename _T::mapped_type& {
+      return data.at(k);
+    } );
+  }
+
+  //Compute in place:
+  /**
+   *  То же, что у t1::map: функция выполняется под блокировкой,
+   *  ключ ищется один раз.
+   */
+  template<typename K, typename F>
+  bool visit(const K& k, F fn)
+  {
+    return exclusive( [&]() -> bool {
+      auto it = data.find(k);
+      if ( it == data.end() )
+        return false;
+      fn(*it);
+      return true;
+    } );
+  }
+
+  template<typename K, typename F>
+  bool upsert(const K& k, const typename _T::mapped_type& val, F fn)
+  {
+    return exclusive( [&]() -> bool {
+      auto it = data.find(k);
+      if ( it != data.end() ) {
+        fn(it->second);
+        return false;
+      }
+      data.emplace( std::piecewise_construct, std::forward_as_tuple( key_of(k) ),
+                    std::forward_as_tuple(val) );
+      return true;
+    } );
+  }
+
+  template<typename K, typename F>
+  typename _T::mapped_type compute_if_absent(const K& k, F factory)
+  {
+    return exclusive( [&]() -> typename _T::mapped_type {
+      auto it = data.find(k);
+      if ( it == data.end() )
+        it = data.emplace( std::piecewise_construct, std::forward_as_tuple( key_of(k) ),
+                           std::forward_as_tuple( factory() ) ).first;
+      return it->second;
+    } );
   }
 
-  typename _T::mapped_type& at ( const typename _T::value_type& k )
+  template<typename K, typename P>
+  bool erase_if(const K& k, P pred)
   {
-    std::lock_guard<_Mutex_type> lock(total_mutex);
-    return data.at(k);
+    return exclusive( [&]() -> bool {
+      auto it = data.find(k);
+      if ( it == data.end() || !pred( static_cast<const typename _T::value_type&>(*it) ) )
+        return false;
+      data.erase(it);
+      return true;
+    } );
   }
 
-  const typename _T::mapped_type& at ( const typename _T::value_type& k ) const
+  void clear()
   {
-    std::lock_guard<_Mutex_type> lock(total_mutex);
-    return data.at(k);
+    exclusive( [&]() -> void {
+      data.clear();
+    } );
   }
 
   //Capacity:
   bool empty() const noexcept
   {
-    std::lock_guard<_Mutex_type> lock(total_mutex);
-    return data.empty();
+    return shared( [&]() -> bool {
+      return data.empty();
+    } );
   }
 
   typename _T::size_type size() const noexcept
   {
-    std::lock_guard<_Mutex_type> lock(total_mutex);
-    return data.size();
+    return shared( [&]() -> typename _T::size_type {
+      return data.size();
+    } );
   }
 
   typename _T::size_type max_size() const noexcept
   {
-    std::lock_guard<_Mutex_type> lock(total_mutex);
-    return data.max_size();
+    return exclusive( [&]() -> typename _T::size_type {
+      return data.max_size();
+    } );
   }
 
   //Buckets:
   typename _T::size_type bucket_count() const noexcept
   {
-    std::lock_guard<_Mutex_type> lock(total_mutex);
-    return data.bucket_count();
+    return shared( [&]() -> typename _T::size_type {
+      return data.bucket_count();
+    } );
   }
 
   typename _T::size_type max_bucket_count() const noexcept
   {
-    std::lock_guard<_Mutex_type> lock(total_mutex);
-    return data.max_bucket_count();
+    return exclusive( [&]() -> typename _T::size_type {
+      return data.max_bucket_count();
+    } );
   }
 
   //Hash policy
   void reserve ( size_t n )
   {
-    std::lock_guard<_Mutex_type> lock(total_mutex);
-    data.reserve(n);
+    return exclusive( [&]() -> void {
+      data.reserve(n);
+    } );
   }
 
   float load_factor() const noexcept
   {
-    std::lock_guard<_Mutex_type> lock(total_mutex);
-    return data.load_factor();
+    return shared( [&]() -> float {
+      return data.load_factor();
+    } );
   }
 
   void rehash( typename _T::size_type n )
   {
-    std::lock_guard<_Mutex_type> lock(total_mutex);
-    return data.rehash(n);
+    return exclusive( [&]() -> void {
+      return data.rehash(n);
+    } );
   }
 
 private:
+  template<typename F>
+  auto exclusive(F&& f) const -> decltype( f() )
+  { return run_exclusive( total_mutex, std::forward<F>(f) ); }
+
+  template<typename F>
+  auto shared(F&& f) const -> decltype( f() )
+  { return run_shared( total_mutex, std::forward<F>(f) ); }
+
+  template<typename K>
+  static const K& key_of(const K& k)
+  { return k; }
+
+  template<typename K>
+  static const K& key_of(const t::prehashed_key<K>& k)
+  { return k.key(); }
+
   _T& data;
   mutable _Mutex_type total_mutex;
 };
 
-template <typename __Key, typename __Value, typename mutex_type=std::mutex>
-class map : public threadsafe_adapter< std::unordered_map<__Key,__Value>, mutex_type >
+template <typename __Key, typename __Value, typename mutex_type=std::mutex,
+          typename hash_type=t::transparent_hash<__Key>,
+          typename alloc_type=std::allocator< std::pair<const __Key, __Value> > >
+class map : public threadsafe_adapter< std::unordered_map<__Key, __Value, hash_type, t::transparent_equal, alloc_type>,
+                                       mutex_type >
 {
 public:
+  typedef std::unordered_map<__Key, __Value, hash_type, t::transparent_equal, alloc_type> container_type;
+  typedef alloc_type allocator_type;
+
   map() :
-    threadsafe_adapter<std::unordered_map<__Key,__Value>, mutex_type>::threadsafe_adapter(m)
+    threadsafe_adapter<container_type, mutex_type>::threadsafe_adapter(m)
+  {  }
+
+  explicit map(const allocator_type& a) :
+    threadsafe_adapter<container_type, mutex_type>::threadsafe_adapter(m), m(a)
   {  }
 
   virtual ~map()
@@ -202,7 +409,7 @@ public:
   map& operator=(map&& v) = default;
 
 private:
-  std::unordered_map<__Key,__Value> m;
+  container_type m;
 };
 
 }
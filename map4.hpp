@@ -0,0 +1,588 @@
+#ifndef MAP4_HPP
+#define MAP4_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <iterator>
+#include <new>
+#include <thread>
+#include <tuple>
+#include <utility>
+
+#include "ebr.hpp"
+
+namespace t4
+{
+
+/**
+ *  Упорядоченный контейнер без блокировок: skip list (Fraser,
+ *  Herlihy-Shavit). Нижний уровень - список Харриса-Майкла со всеми
+ *  элементами по порядку ключей, каждый следующий уровень - разреженный
+ *  (в среднем каждый четвертый узел) индекс над предыдущим. Удаление
+ *  помечает ссылки узла сверху вниз, узел логически удален, когда помечена
+ *  ссылка нижнего уровня, а вырезают его из уровней последующие поиски.
+ *  find/lower_bound/upper_bound ничего не пишут и не повторяются.
+ *  Обход слабо согласован: итератор видит все элементы, которые были в
+ *  контейнере все время обхода, и может увидеть или пропустить вставленные
+ *  и удаленные параллельно. Как и в t2::map, удаленные узлы освобождаются
+ *  по эпохам (ebr): операции закрепляют поток, итераторы и курсоры из
+ *  lower_bound/upper_bound - пока указывают на узел, поэтому остаются
+ *  рабочими при любых писателях. Ссылка из operator[] действительна до
+ *  удаления элемента.
+ */
+template<typename _Key, typename _Value, typename _Compare = std::less<_Key> >
+class map
+{
+public:
+  typedef _Key key_type;
+  typedef _Value mapped_type;
+  typedef std::pair<const _Key, _Value> value_type;
+  typedef _Compare key_compare;
+  typedef size_t size_type;
+
+  static const size_t max_level = 16;
+
+private:
+  /**
+   *  За узлом в той же памяти лежат level ссылок next (башня узла).
+   *  У головного узла значения нет.
+   */
+  struct node
+  {
+    const size_t         level;
+    std::atomic<uint8_t> state;  //unlinked_bit | built_bit
+    node*                retired_next;
+    uint64_t             retired_epoch;
+    alignas(value_type) unsigned char storage[sizeof(value_type)];
+
+    explicit node(size_t l) : level(l), state(0), retired_next(nullptr), retired_epoch(0)
+    { }
+
+    value_type& value()
+    { return *reinterpret_cast<value_type*>(storage); }
+
+    const key_type& key()
+    { return value().first; }
+
+    std::atomic<uintptr_t>& next(size_t i)
+    { return reinterpret_cast<std::atomic<uintptr_t>*>(this + 1)[i]; }
+  };
+
+public:
+  class iterator
+  {
+    public:
+      typedef  std::forward_iterator_tag  iterator_category;
+      typedef  map::value_type            value_type;
+      typedef  map::value_type&           reference;
+      typedef  map::value_type*           pointer;
+      typedef  std::ptrdiff_t             difference_type;
+
+      iterator(map* base, node* n) : base_(base), node_(n), guard_(n != nullptr)
+      { }
+
+      iterator& operator++()
+      {
+        node_ = map::next_live(node_);
+        if (!node_)
+          guard_ = ebr::guard(false);
+        return *this;
+      }
+
+      iterator operator++(int)
+      {
+        iterator i = *this;
+        operator++();
+        return i;
+      }
+
+      map::value_type* operator->() { return &node_->value(); }
+      map::value_type& operator*() { return node_->value(); }
+      bool operator==(const iterator& rhs) const { return node_ == rhs.node_; }
+      bool operator!=(const iterator& rhs) const { return node_ != rhs.node_; }
+
+      node* get_internal_iterator() const { return node_; }
+      map* base() const { return base_; }
+
+    private:
+      map* base_;
+      node* node_;
+      ebr::guard guard_;
+  };
+
+  typedef const iterator const_iterator;
+
+  explicit map(const _Compare& comp = _Compare()) :
+    size_(0), retired_(nullptr), retired_count_(0), comp_(comp)
+  { head_ = allocate(max_level); }
+
+  map(const map&) = delete;
+  map& operator=(const map&) = delete;
+
+  virtual ~map()
+  {
+    node* p = ptr( head_->next(0).load(std::memory_order_relaxed) );
+    while (p) {
+      node* next = ptr( p->next(0).load(std::memory_order_relaxed) );
+      destroy_node(p);
+      p = next;
+    }
+
+    p = retired_.load(std::memory_order_relaxed);
+    while (p) {
+      node* next = p->retired_next;
+      destroy_node(p);
+      p = next;
+    }
+
+    deallocate(head_);
+  }
+
+  //Element lookup
+  iterator find ( const key_type& k )
+  {
+    ebr::guard guard;
+    node* n = seek<false>(k);
+    if ( n && !comp_(k, n->key()) )
+      return iterator(this, n);
+    return end();
+  }
+
+  /**
+   *  Курсор на первый элемент >= k, дальше по нему можно идти ++ при
+   *  работающих писателях.
+   */
+  iterator lower_bound ( const key_type& k )
+  {
+    ebr::guard guard;
+    return iterator( this, seek<false>(k) );
+  }
+
+  /**
+   *  Курсор на первый элемент > k.
+   */
+  iterator upper_bound ( const key_type& k )
+  {
+    ebr::guard guard;
+    return iterator( this, seek<true>(k) );
+  }
+
+  //Iterators:
+  iterator begin() noexcept
+  {
+    ebr::guard guard;
+    return iterator( this, next_live(head_) );
+  }
+
+  iterator end() noexcept
+  { return iterator(this, nullptr); }
+
+  const_iterator cbegin() noexcept
+  { return begin(); }
+
+  const_iterator cend() noexcept
+  { return end(); }
+
+  //Modifiers:
+  /**
+   *  Как у std::map: существующий элемент не перезаписывается.
+   */
+  std::pair<iterator, bool> insert(const value_type& val)
+  {
+    ebr::guard guard;
+    if ( node* n = seek_equal(val.first) )
+      return std::make_pair( iterator(this, n), false );
+
+    node* n = create_node( random_level(), val );
+    node* res = insert_node(n);
+    if (res != n) {
+      destroy_node(n);
+      return std::make_pair( iterator(this, res), false );
+    }
+    return std::make_pair( iterator(this, n), true );
+  }
+
+  iterator erase(const_iterator position)
+  {
+    iterator result_it(position);
+    ++result_it;
+
+    if ( node* n = position.get_internal_iterator() )
+      erase_node(n);
+
+    return result_it;
+  }
+
+  size_type erase(const key_type& val)
+  {
+    ebr::guard guard;
+    node* n = seek_equal(val);
+    if (!n)
+      return 0;
+
+    return erase_node(n) ? 1 : 0;
+  }
+
+  iterator erase ( const_iterator first, const_iterator last )
+  {
+    iterator it = first;
+    while (it != last) {
+      it = erase(it);
+    }
+    return it;
+  }
+
+  //Element access:
+  _Value& operator[](const key_type& k)
+  {
+    ebr::guard guard;
+    if ( node* n = seek_equal(k) )
+      return n->value().second;
+
+    node* n = create_node( random_level(), std::piecewise_construct,
+                           std::forward_as_tuple(k), std::forward_as_tuple() );
+    node* res = insert_node(n);
+    if (res != n) {
+      //другой поток успел вставить этот ключ
+      destroy_node(n);
+    }
+
+    return res->value().second;
+  }
+
+  _Value& operator[](key_type&& k)
+  { return operator[]( static_cast<const key_type&>(k) ); }
+
+  //Capacity:
+  bool empty() const noexcept
+  { return size() == 0; }
+
+  size_t size() const noexcept
+  { return size_.load(std::memory_order_relaxed); }
+
+  //Observers:
+  key_compare key_comp() const
+  { return comp_; }
+
+private:
+  static const uintptr_t mark_bit = 1;
+  static const size_t    reclaim_batch = 64;
+  static const uint8_t   unlinked_bit = 1; //вырезан со всех уровней
+  static const uint8_t   built_bit = 2;    //вставка закончила достраивать башню
+
+  static node* ptr(uintptr_t p)
+  { return reinterpret_cast<node*>(p & ~mark_bit); }
+
+  static bool marked(uintptr_t p)
+  { return (p & mark_bit) != 0; }
+
+  static uintptr_t raw(node* p)
+  { return reinterpret_cast<uintptr_t>(p); }
+
+  static node* allocate(size_t level)
+  {
+    void* p = ::operator new( sizeof(node) + level * sizeof(std::atomic<uintptr_t>) );
+    node* n = ::new (p) node(level);
+    for (size_t i = 0; i < level; ++i)
+      ::new ( &n->next(i) ) std::atomic<uintptr_t>(0);
+    return n;
+  }
+
+  static void deallocate(node* n)
+  {
+    n->~node();
+    ::operator delete(n);
+  }
+
+  template<typename... Args>
+  static node* create_node(size_t level, Args&&... args)
+  {
+    node* n = allocate(level);
+    try {
+      ::new ( n->storage ) value_type( std::forward<Args>(args)... );
+    } catch (...) {
+      deallocate(n);
+      throw;
+    }
+    return n;
+  }
+
+  static void destroy_node(node* n)
+  {
+    n->value().~value_type();
+    deallocate(n);
+  }
+
+  /**
+   *  Высота башни: каждый следующий уровень с вероятностью 1/4.
+   */
+  static size_t random_level()
+  {
+    static thread_local uint64_t state =
+      std::hash<std::thread::id>{}( std::this_thread::get_id() ) | 1;
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+    const uint64_t r = (state * 0x2545F4914F6CDD1Dull) | (uint64_t(1) << (2 * (max_level - 1)));
+    return 1 + static_cast<size_t>( __builtin_ctzll(r) ) / 2;
+  }
+
+  static node* next_live(node* p)
+  {
+    while (p) {
+      p = ptr( p->next(0).load(std::memory_order_acquire) );
+      if ( p && !marked( p->next(0).load(std::memory_order_acquire) ) )
+        return p;
+    }
+    return nullptr;
+  }
+
+  /**
+   *  Спуск без записи: первый живой узел с ключом >= k (upper - > k).
+   *  Помеченные узлы просто перешагиваются.
+   */
+  template<bool upper>
+  node* seek(const key_type& k)
+  {
+    node* pred = head_;
+    node* curr = nullptr;
+    for (size_t level = max_level; level-- > 0; ) {
+      curr = ptr( pred->next(level).load(std::memory_order_acquire) );
+      while (curr) {
+        uintptr_t succ = curr->next(level).load(std::memory_order_acquire);
+        while ( marked(succ) ) {
+          curr = ptr(succ);
+          if (!curr)
+            break;
+          succ = curr->next(level).load(std::memory_order_acquire);
+        }
+        if ( !curr || !( upper ? !comp_(k, curr->key()) : comp_(curr->key(), k) ) )
+          break;
+        pred = curr;
+        curr = ptr(succ);
+      }
+    }
+    return curr;
+  }
+
+  node* seek_equal(const key_type& k)
+  {
+    node* n = seek<false>(k);
+    return n && !comp_(k, n->key()) ? n : nullptr;
+  }
+
+  /**
+   *  Поиск Харриса-Майкла на каждом уровне: preds[i] - последний узел
+   *  с ключом < k, succs[i] - следующий за ним. Помеченные узлы по пути
+   *  вырезаются.
+   */
+  bool search(const key_type& k, node** preds, node** succs)
+  {
+  try_again:
+    node* pred = head_;
+    for (size_t level = max_level; level-- > 0; ) {
+      node* curr = ptr( pred->next(level).load(std::memory_order_acquire) );
+      while (curr) {
+        uintptr_t succ = curr->next(level).load(std::memory_order_acquire);
+        while ( marked(succ) ) {
+          uintptr_t expected = raw(curr);
+          if ( !pred->next(level).compare_exchange_strong(expected, succ & ~mark_bit,
+                                                          std::memory_order_acq_rel) )
+            goto try_again;
+
+          curr = ptr(succ);
+          if (!curr)
+            break;
+          succ = curr->next(level).load(std::memory_order_acquire);
+        }
+        if ( !curr || !comp_(curr->key(), k) )
+          break;
+        pred = curr;
+        curr = ptr(succ);
+      }
+      preds[level] = pred;
+      succs[level] = curr;
+    }
+    return succs[0] && !comp_( k, succs[0]->key() );
+  }
+
+  /**
+   *  Узел становится видимым, когда вставлен в нижний уровень, верхние
+   *  уровни достраиваются после. Если узел тем временем удаляют,
+   *  достраивание прекращается.
+   */
+  node* insert_node(node* n)
+  {
+    node* preds[max_level];
+    node* succs[max_level];
+    const key_type& k = n->key();
+
+    for (;;) {
+      if ( search(k, preds, succs) )
+        return succs[0];
+
+      for (size_t i = 0; i < n->level; ++i)
+        n->next(i).store( raw(succs[i]), std::memory_order_relaxed );
+
+      uintptr_t expected = raw(succs[0]);
+      if ( preds[0]->next(0).compare_exchange_strong(expected, raw(n), std::memory_order_acq_rel) )
+        break;
+    }
+    size_.fetch_add(1, std::memory_order_relaxed);
+
+    link_tower(n, preds, succs);
+    //удаленный во время достраивания узел мог быть снова привязан
+    //на верхнем уровне уже после того, как его вырезали
+    if ( marked( n->next(0).load(std::memory_order_acquire) ) )
+      unlink_tower(n);
+    release(n, built_bit);
+    return n;
+  }
+
+  void link_tower(node* n, node** preds, node** succs)
+  {
+    const key_type& k = n->key();
+    for (size_t i = 1; i < n->level; ++i) {
+      for (;;) {
+        uintptr_t next = n->next(i).load(std::memory_order_acquire);
+        if ( marked(next) )
+          return;
+        if ( ptr(next) != succs[i] &&
+             !n->next(i).compare_exchange_strong(next, raw(succs[i]), std::memory_order_acq_rel) )
+          return;
+
+        uintptr_t expected = raw(succs[i]);
+        if ( preds[i]->next(i).compare_exchange_strong(expected, raw(n), std::memory_order_acq_rel) )
+          break;
+
+        if ( !search(k, preds, succs) || succs[0] != n )
+          return;
+      }
+    }
+  }
+
+  /**
+   *  Убирает удаленный n со всех уровней. Обычный поиск по его ключу
+   *  может остановиться раньше: перед n, привязанным с опозданием, могла
+   *  встать новая запись с тем же ключом, поэтому узлы с равным ключом
+   *  проходятся до самого n.
+   */
+  void unlink_tower(node* n)
+  {
+    node* preds[max_level];
+    node* succs[max_level];
+    const key_type& k = n->key();
+
+  try_again:
+    search(k, preds, succs);
+    for (size_t i = 1; i < n->level; ++i) {
+      node* pred = preds[i];
+      node* curr = ptr( pred->next(i).load(std::memory_order_acquire) );
+      while ( curr && curr != n && !comp_(k, curr->key()) ) {
+        pred = curr;
+        curr = ptr( curr->next(i).load(std::memory_order_acquire) );
+      }
+      if (curr != n)
+        continue;
+      uintptr_t expected = raw(n);
+      const uintptr_t succ = n->next(i).load(std::memory_order_acquire) & ~mark_bit;
+      if ( !pred->next(i).compare_exchange_strong(expected, succ, std::memory_order_acq_rel) )
+        goto try_again;
+    }
+  }
+
+  bool erase_node(node* n)
+  {
+    for (size_t i = n->level; i-- > 1; ) {
+      uintptr_t next = n->next(i).load(std::memory_order_acquire);
+      while ( !marked(next) )
+        n->next(i).compare_exchange_weak(next, next | mark_bit, std::memory_order_acq_rel);
+    }
+
+    uintptr_t next = n->next(0).load(std::memory_order_acquire);
+    while ( !marked(next) ) {
+      if ( n->next(0).compare_exchange_weak(next, next | mark_bit, std::memory_order_acq_rel) ) {
+        size_.fetch_sub(1, std::memory_order_relaxed);
+
+        //физическое удаление: поиск вырезает помеченные узлы. Чужой поиск
+        //мог вырезать n снизу раньше, но на верхних уровнях он остается,
+        //пока сверху вниз не пройдет поиск по его ключу
+        node* preds[max_level];
+        node* succs[max_level];
+        search(n->key(), preds, succs);
+        release(n, unlinked_bit);
+        return true;
+      }
+    }
+    return false;
+  }
+
+  /**
+   *  Узел отдается ebr, когда удаливший его поток прошел поиск по его
+   *  ключу (узел вырезан со всех уровней) и вставка закончила
+   *  достраивать его башню: до этого она еще могла привязать его на
+   *  верхнем уровне. Каждое из двух событий ставит свой бит, откладывает
+   *  тот, кто пришел вторым.
+   */
+  void release(node* p, uint8_t bit)
+  {
+    if ( (p->state.fetch_or(bit, std::memory_order_acq_rel) | bit) == (unlinked_bit | built_bit) )
+      retire(p);
+  }
+
+  void retire(node* p)
+  {
+    p->retired_epoch = ebr::domain::global().epoch();
+    push_retired(p, p);
+    if ( (retired_count_.fetch_add(1, std::memory_order_relaxed) + 1) % reclaim_batch == 0 )
+      reclaim();
+  }
+
+  void push_retired(node* first, node* last)
+  {
+    node* head = retired_.load(std::memory_order_relaxed);
+    do {
+      last->retired_next = head;
+    } while ( !retired_.compare_exchange_weak(head, first, std::memory_order_release,
+                                              std::memory_order_relaxed) );
+  }
+
+  /**
+   *  Как у t2::map: забирает весь список отложенных, освобождает то, что
+   *  уже никому не видно, остальное возвращает.
+   */
+  void reclaim()
+  {
+    ebr::domain& d = ebr::domain::global();
+    d.try_advance();
+
+    node* p = retired_.exchange(nullptr, std::memory_order_acquire);
+    node* keep = nullptr;
+    node* keep_last = nullptr;
+    while (p) {
+      node* next = p->retired_next;
+      if ( d.is_safe(p->retired_epoch) ) {
+        destroy_node(p);
+      } else {
+        p->retired_next = keep;
+        keep = p;
+        if (!keep_last)
+          keep_last = p;
+      }
+      p = next;
+    }
+    if (keep)
+      push_retired(keep, keep_last);
+  }
+
+  std::atomic<size_t>  size_;
+  std::atomic<node*>   retired_;
+  std::atomic<size_t>  retired_count_;
+  node*                head_;
+  _Compare             comp_;
+};
+
+}
+
+#endif // MAP4_HPP
@@ -0,0 +1,434 @@
+#ifndef MAPPED_FILE_HPP
+#define MAPPED_FILE_HPP
+
+#include <cstdint>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <utility>
+#include <optional>
+#include <algorithm>
+#include <stdexcept>
+#include <type_traits>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "string_hash.h"
+
+namespace t1
+{
+
+/**
+ *  Как тип лежит в файле mapped_file. Тривиально копируемые типы хранятся
+ *  как есть, std::string - смещением и длиной в общем блоке строк, а при
+ *  чтении отдается std::string_view прямо в отображенную память.
+ *  probe() - ключ, по хэшу которого при открытии проверяется, что файл
+ *  записан с тем же хэшером.
+ */
+template<typename T, typename = void>
+struct file_codec;
+
+template<typename T>
+struct file_codec< T, typename std::enable_if< std::is_trivially_copyable<T>::value >::type >
+{
+  typedef T stored_type;
+  typedef T view_type;
+  static const uint32_t tag = 1;
+
+  static stored_type encode(const T& v, std::string&)
+  { return v; }
+
+  static view_type view(const stored_type& s, const char*)
+  { return s; }
+
+  static T materialize(const view_type& v)
+  { return v; }
+
+  static T probe()
+  {
+    T res;
+    std::memset( static_cast<void*>(&res), 0x5A, sizeof(T) );
+    return res;
+  }
+};
+
+template<>
+struct file_codec<std::string>
+{
+  struct stored_type
+  {
+    uint64_t offset;
+    uint64_t size;
+  };
+  typedef std::string_view view_type;
+  static const uint32_t tag = 2;
+
+  static stored_type encode(const std::string& v, std::string& blob)
+  {
+    const stored_type res{ blob.size(), v.size() };
+    blob.append(v);
+    return res;
+  }
+
+  static view_type view(const stored_type& s, const char* blob)
+  { return view_type(blob + s.offset, s.size); }
+
+  static std::string materialize(view_type v)
+  { return std::string(v); }
+
+  static std::string probe()
+  { return "t1::mapped_file"; }
+};
+
+/**
+ *  Неизменяемый снимок map в файле, который открывается отображением в
+ *  память (mmap) и читается без разбора: время открытия не зависит от
+ *  числа записей, страницы подгружаются при первом обращении.
+ *
+ *  Файл: заголовок, каталог сегментов (первая запись и число записей),
+ *  массив хэшей, массив записей фиксированного размера и блок строк.
+ *  Внутри сегмента хэши и записи упорядочены по хэшу, поиск - двоичный
+ *  по массиву хэшей. Сегмент выбирается так же, как super_bucket в
+ *  t1::map, но по числу сегментов файла. Формат - в порядке байт и с
+ *  выравниванием машины, которая его записала; заголовок это проверяет.
+ */
+template<typename _Key, typename _Value, typename _Hash = t::transparent_hash<_Key> >
+class mapped_file
+{
+public:
+  typedef _Key key_type;
+  typedef _Value mapped_type;
+  typedef std::pair<_Key, _Value> value_type;
+  typedef _Hash hasher;
+  typedef file_codec<_Key> key_codec;
+  typedef file_codec<_Value> value_codec;
+  typedef typename key_codec::view_type key_view;
+  typedef typename value_codec::view_type value_view;
+
+  static const size_t npos = static_cast<size_t>(-1);
+
+  struct record
+  {
+    typename key_codec::stored_type   key;
+    typename value_codec::stored_type value;
+  };
+
+  static_assert(std::is_trivially_copyable<record>::value, "file record must be trivially copyable");
+
+  /**
+   *  (хэш, запись) для write().
+   */
+  typedef std::pair<size_t, const value_type*> item_type;
+
+  explicit mapped_file(const std::string& path) :
+    data_(nullptr), length_(0)
+  {
+    const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+      throw std::runtime_error("mapped_file: cannot open " + path);
+
+    struct stat st;
+    if (::fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(header)) {
+      ::close(fd);
+      throw std::runtime_error("mapped_file: " + path + " is too short");
+    }
+
+    length_ = static_cast<size_t>(st.st_size);
+    void* p = ::mmap(nullptr, length_, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (p == MAP_FAILED)
+      throw std::runtime_error("mapped_file: cannot map " + path);
+    data_ = static_cast<const char*>(p);
+
+    try {
+      validate(path);
+    } catch (...) {
+      ::munmap(const_cast<char*>(data_), length_);
+      throw;
+    }
+
+    const header& h = head();
+    dir_ = reinterpret_cast<const shard_entry*>(data_ + h.directory_offset);
+    hashes_ = reinterpret_cast<const uint64_t*>(data_ + h.hashes_offset);
+    records_ = reinterpret_cast<const record*>(data_ + h.records_offset);
+    blob_ = data_ + h.blob_offset;
+  }
+
+  mapped_file(const mapped_file&) = delete;
+  mapped_file& operator=(const mapped_file&) = delete;
+
+  ~mapped_file()
+  { ::munmap(const_cast<char*>(data_), length_); }
+
+  //Capacity:
+  size_t size() const noexcept
+  { return head().size; }
+
+  bool empty() const noexcept
+  { return size() == 0; }
+
+  size_t shard_count() const noexcept
+  { return head().shard_count; }
+
+  /**
+   *  Номер первой записи сегмента s; записи сегментов идут подряд,
+   *  shard_begin(shard_count()) == size().
+   */
+  size_t shard_begin(size_t s) const noexcept
+  { return s < shard_count() ? dir_[s].first : size(); }
+
+  /**
+   *  Сегмент для hash при shards сегментах (степень двойки), как
+   *  t1::map::bucket_index.
+   */
+  static size_t shard_index(size_t hash, size_t shards)
+  {
+    if (shards < 2)
+      return 0;
+    size_t bits = 0;
+    while ( (size_t(1) << bits) < shards )
+      ++bits;
+    const uint64_t h = (hash ^ (static_cast<uint64_t>(hash) >> 32)) * 0x9E3779B97F4A7C15ull;
+    return (h >> (64 - bits)) & (shards - 1);
+  }
+
+  //Element lookup:
+  /**
+   *  Номер записи с ключом k либо npos.
+   */
+  template<typename K>
+  size_t find(size_t hash, const K& k) const
+  {
+    const shard_entry& s = dir_[ shard_index(hash, shard_count()) ];
+    const uint64_t* first = hashes_ + s.first;
+    const uint64_t* last = first + s.count;
+    for (const uint64_t* it = search(first, last, hash); it != last && *it == hash; ++it) {
+      const size_t i = it - hashes_;
+      if ( key(i) == k )
+        return i;
+    }
+    return npos;
+  }
+
+  template<typename K>
+  size_t find(const K& k) const
+  { return find( hasher{}(k), k ); }
+
+  template<typename K>
+  bool contains(const K& k) const
+  { return find(k) != npos; }
+
+  template<typename K>
+  std::optional<_Value> get(const K& k) const
+  {
+    const size_t i = find(k);
+    if (i == npos)
+      return std::nullopt;
+    return value_codec::materialize( value(i) );
+  }
+
+  //Record access:
+  size_t hash(size_t i) const
+  { return hashes_[i]; }
+
+  key_view key(size_t i) const
+  { return key_codec::view(records_[i].key, blob_); }
+
+  value_view value(size_t i) const
+  { return value_codec::view(records_[i].value, blob_); }
+
+  value_type materialize(size_t i) const
+  { return value_type( key_codec::materialize( key(i) ), value_codec::materialize( value(i) ) ); }
+
+  /**
+   *  Пишет файл: shards[s] - записи сегмента s, число сегментов - степень
+   *  двойки, каждая запись уже в сегменте shard_index(hash, shards.size()).
+   *  Пишет во временный файл и переименовывает, так что открытый по тому
+   *  же пути файл не портится.
+   */
+  static void write(const std::string& path, std::vector< std::vector<item_type> >& shards)
+  {
+    header h;
+    std::memset( static_cast<void*>(&h), 0, sizeof(h) );
+    std::memcpy(h.magic, magic, sizeof(h.magic));
+    h.version = version;
+    h.endian = endian;
+    h.key_tag = key_codec::tag;
+    h.value_tag = value_codec::tag;
+    h.record_size = sizeof(record);
+    h.shard_count = shards.size();
+    h.hash_check = hasher{}( key_codec::probe() );
+
+    std::vector<shard_entry> dir( shards.size() );
+    std::vector<uint64_t> hashes;
+    std::vector<record> records;
+    std::string blob;
+    for (size_t s = 0; s < shards.size(); ++s) {
+      std::sort( shards[s].begin(), shards[s].end(),
+                 [](const item_type& a, const item_type& b) { return a.first < b.first; } );
+      dir[s].first = hashes.size();
+      dir[s].count = shards[s].size();
+      for (auto& it : shards[s]) {
+        hashes.push_back(it.first);
+        records.push_back( record{ key_codec::encode(it.second->first, blob),
+                                   value_codec::encode(it.second->second, blob) } );
+      }
+    }
+    h.size = hashes.size();
+    h.directory_offset = align( sizeof(header) );
+    h.hashes_offset = align( h.directory_offset + dir.size() * sizeof(shard_entry) );
+    h.records_offset = align( h.hashes_offset + hashes.size() * sizeof(uint64_t) );
+    h.blob_offset = align( h.records_offset + records.size() * sizeof(record) );
+    h.blob_size = blob.size();
+    h.file_size = h.blob_offset + blob.size();
+
+    const std::string tmp = path + ".tmp";
+    std::FILE* f = std::fopen(tmp.c_str(), "wb");
+    if (!f)
+      throw std::runtime_error("mapped_file: cannot create " + tmp);
+
+    bool ok = true;
+    size_t pos = 0;
+    auto put = [&](size_t offset, const void* p, size_t n) {
+      static const char zeros[section_align] = {};
+      while (ok && pos < offset) {
+        const size_t pad = std::min(offset - pos, sizeof(zeros));
+        ok = std::fwrite(zeros, 1, pad, f) == pad;
+        pos += pad;
+      }
+      if (ok && n)
+        ok = std::fwrite(p, 1, n, f) == n;
+      pos += n;
+    };
+    put(0, &h, sizeof(h));
+    put(h.directory_offset, dir.data(), dir.size() * sizeof(shard_entry));
+    put(h.hashes_offset, hashes.data(), hashes.size() * sizeof(uint64_t));
+    put(h.records_offset, records.data(), records.size() * sizeof(record));
+    put(h.blob_offset, blob.data(), blob.size());
+
+    ok = (std::fclose(f) == 0) && ok;
+    if ( !ok || std::rename(tmp.c_str(), path.c_str()) != 0 ) {
+      std::remove( tmp.c_str() );
+      throw std::runtime_error("mapped_file: cannot write " + path);
+    }
+  }
+
+private:
+  static const size_t   section_align = 64;
+  static const uint32_t version = 1;
+  static const uint32_t endian = 0x01020304;
+  static constexpr char magic[8] = { 't', '1', 'm', 'a', 'p', 0, 0, 0 };
+
+  struct header
+  {
+    char     magic[8];
+    uint32_t version;
+    uint32_t endian;
+    uint32_t key_tag;
+    uint32_t value_tag;
+    uint64_t record_size;
+    uint64_t hash_check;
+    uint64_t shard_count;
+    uint64_t size;
+    uint64_t directory_offset;
+    uint64_t hashes_offset;
+    uint64_t records_offset;
+    uint64_t blob_offset;
+    uint64_t blob_size;
+    uint64_t file_size;
+  };
+
+  struct shard_entry
+  {
+    uint64_t first;
+    uint64_t count;
+  };
+
+  /**
+   *  lower_bound по хэшам сегмента. Хэши распределены почти равномерно,
+   *  поэтому место сначала угадывается интерполяцией, затем вилка
+   *  расширяется от догадки удвоением шага и сужается двоичным поиском:
+   *  обращения идут к соседним строкам кэша и страницам, а не через весь
+   *  массив, как у чистого двоичного поиска.
+   */
+  static const uint64_t* search(const uint64_t* first, const uint64_t* last, uint64_t h)
+  {
+    const size_t n = last - first;
+    if ( n <= 16 || h <= first[0] || h > last[-1] )
+      return std::lower_bound(first, last, h);
+
+    //first[0] < h <= first[n - 1]
+    const double x = static_cast<double>(h - first[0]) / static_cast<double>(last[-1] - first[0]);
+    const size_t pos = std::min( static_cast<size_t>( x * (n - 1) ), n - 1 );
+    size_t lo = pos, hi = pos;
+    if (first[pos] < h) {
+      for (size_t step = 1; first[hi] < h; step *= 2) {
+        lo = hi;
+        hi = std::min(pos + step, n - 1);
+      }
+    } else {
+      for (size_t step = 1; lo > 0 && first[lo] >= h; step *= 2) {
+        hi = lo;
+        lo = pos > step ? pos - step : 0;
+      }
+    }
+    return std::lower_bound(first + lo, first + hi + 1, h);
+  }
+
+  static uint64_t align(uint64_t n)
+  { return (n + section_align - 1) & ~static_cast<uint64_t>(section_align - 1); }
+
+  const header& head() const noexcept
+  { return *reinterpret_cast<const header*>(data_); }
+
+  void validate(const std::string& path) const
+  {
+    const header& h = head();
+    auto fail = [&path](const char* what) {
+      throw std::runtime_error("mapped_file: " + path + ": " + what);
+    };
+
+    if ( std::memcmp(h.magic, magic, sizeof(h.magic)) != 0 )
+      fail("not a t1::map file");
+    if (h.version != version || h.endian != endian)
+      fail("unsupported version or byte order");
+    if (h.key_tag != key_codec::tag || h.value_tag != value_codec::tag || h.record_size != sizeof(record))
+      fail("key or value type does not match");
+    if ( h.hash_check != hasher{}( key_codec::probe() ) )
+      fail("written with a different hash function");
+    if ( h.shard_count == 0 || (h.shard_count & (h.shard_count - 1)) != 0 )
+      fail("bad shard count");
+    if ( h.file_size > length_ || h.blob_offset + h.blob_size > h.file_size ||
+         h.directory_offset + h.shard_count * sizeof(shard_entry) > h.hashes_offset ||
+         h.hashes_offset + h.size * sizeof(uint64_t) > h.records_offset ||
+         h.records_offset + h.size * sizeof(record) > h.blob_offset )
+      fail("truncated or corrupt");
+
+    const shard_entry* dir = reinterpret_cast<const shard_entry*>(data_ + h.directory_offset);
+    uint64_t next = 0;
+    for (size_t s = 0; s < h.shard_count; ++s) {
+      if ( dir[s].first != next || dir[s].count > h.size - next )
+        fail("corrupt shard directory");
+      next += dir[s].count;
+    }
+    if (next != h.size)
+      fail("corrupt shard directory");
+  }
+
+  const char*        data_;
+  size_t             length_;
+  const shard_entry* dir_;
+  const uint64_t*    hashes_;
+  const record*      records_;
+  const char*        blob_;
+};
+
+}
+
+#endif // MAPPED_FILE_HPP
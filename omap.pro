@@ -7,7 +7,7 @@ CONFIG -= app_bundle
 
 TEMPLATE = app
 
-QMAKE_CXXFLAGS += -std=c++11
+QMAKE_CXXFLAGS += -std=c++20
 
 SOURCES += main.cpp
 
@@ -15,5 +15,21 @@ HEADERS += \
     test.hpp \
     map3.hpp \
     map1.hpp \
+    map2.hpp \
+    flat_table.hpp \
+    ebr.hpp \
+    string_hash.h \
+    flat_combining.hpp \
+    map.hpp \
+    bplus_tree.hpp \
+    map4.hpp \
+    pool_allocator.hpp \
+    thread_pool.hpp \
+    locks.hpp \
+    left_right.hpp \
+    mapped_file.hpp \
+    frozen_map.hpp \
+    timer_wheel.hpp \
+    bench.hpp \
 
 
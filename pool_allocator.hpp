@@ -0,0 +1,292 @@
+#ifndef POOL_ALLOCATOR_HPP
+#define POOL_ALLOCATOR_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include <mutex>
+#include <atomic>
+#include <type_traits>
+
+#if defined(__linux__)
+#include <sys/mman.h>
+#endif
+
+namespace t
+{
+
+namespace pool_detail
+{
+
+/**
+ *  Классы размеров: до 256 байт шагом 16, дальше по четыре класса на
+ *  каждую степень двойки до 4096. Все классы больше 256 кратны 64, а
+ *  блоки режутся от выровненного на кэш-линию начала span, поэтому
+ *  блок выровнен так же, как выровнен тип, если alignof(T) <= 64.
+ */
+static const size_t class_count = 32;
+static const size_t max_block   = 4096;
+static const size_t max_align   = 64;
+
+inline size_t size_class(size_t n)
+{
+  if (n <= 256)
+    return n ? (n + 15) / 16 - 1 : 0;
+  const size_t b = 63 - static_cast<size_t>( __builtin_clzll(n - 1) );
+  return 16 + (b - 8) * 4 + ( (n - 1 - (size_t(1) << b)) >> (b - 2) );
+}
+
+inline size_t class_size(size_t c)
+{
+  if (c < 16)
+    return 16 * (c + 1);
+  const size_t b = 8 + (c - 16) / 4;
+  return (size_t(1) << b) + ( (c - 16) % 4 + 1 ) * ( size_t(1) << (b - 2) );
+}
+
+/**
+ *  Сколько блоков поток берет из общего пула за раз и сколько держит у
+ *  себя: примерно 16 КБ на класс.
+ */
+inline size_t batch_of(size_t c)
+{
+  const size_t n = 16384 / class_size(c);
+  return n < 4 ? 4 : n;
+}
+
+struct free_block
+{
+  free_block* next;
+};
+
+/**
+ *  Общий пул: по списку свободных блоков на класс и текущий span, от
+ *  которого блоки отрезаются. Память span-ов системе не возвращается.
+ */
+class central
+{
+public:
+  static central& instance()
+  {
+    //не разрушается: контейнеры со статическим временем жизни могут
+    //освобождать память после разрушения статиков этой единицы
+    static central* c = new central;
+    return *c;
+  }
+
+  void set_huge_pages(bool v)
+  { huge_pages_.store(v, std::memory_order_relaxed); }
+
+  bool huge_pages() const
+  { return huge_pages_.load(std::memory_order_relaxed); }
+
+  /**
+   *  Забирает до n блоков класса c одним списком, возвращает их число.
+   */
+  size_t take(size_t c, size_t n, free_block*& head)
+  {
+    size_class_pool& p = pools_[c];
+    std::lock_guard<std::mutex> lock(p.m);
+
+    size_t got = 0;
+    head = nullptr;
+    while (got < n && p.free) {
+      free_block* b = p.free;
+      p.free = b->next;
+      b->next = head;
+      head = b;
+      ++got;
+    }
+
+    const size_t sz = class_size(c);
+    while (got < n) {
+      if (p.cursor + sz > p.limit) {
+        if ( !new_span(p) )
+          break;
+      }
+      free_block* b = reinterpret_cast<free_block*>(p.cursor);
+      p.cursor += sz;
+      b->next = head;
+      head = b;
+      ++got;
+    }
+    return got;
+  }
+
+  /**
+   *  Возвращает список из блоков класса c (от head до tail).
+   */
+  void give(size_t c, free_block* head, free_block* tail)
+  {
+    size_class_pool& p = pools_[c];
+    std::lock_guard<std::mutex> lock(p.m);
+    tail->next = p.free;
+    p.free = head;
+  }
+
+private:
+  static const size_t span_size      = size_t(256) << 10;
+  static const size_t huge_span_size = size_t(2) << 20;
+
+  struct alignas(64) size_class_pool
+  {
+    std::mutex  m;
+    free_block* free = nullptr;
+    char*       cursor = nullptr;
+    char*       limit = nullptr;
+  };
+
+  central() : huge_pages_(false)
+  { }
+
+  bool new_span(size_class_pool& p)
+  {
+    const bool huge = huge_pages();
+    const size_t size = huge ? huge_span_size : span_size;
+    void* s = std::aligned_alloc(huge ? huge_span_size : max_align, size);
+    if (!s)
+      return false;
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+    if (huge)
+      ::madvise(s, size, MADV_HUGEPAGE);
+#endif
+    p.cursor = static_cast<char*>(s);
+    p.limit = p.cursor + size;
+    return true;
+  }
+
+  std::atomic<bool> huge_pages_;
+  size_class_pool   pools_[class_count];
+};
+
+/**
+ *  Кэш потока: свои списки блоков по классам, общий пул (и его мьютекс)
+ *  нужен только когда список пуст или слишком вырос. При завершении
+ *  потока все отдается обратно.
+ */
+class thread_cache
+{
+public:
+  static thread_cache& local()
+  {
+    static thread_local thread_cache c;
+    return c;
+  }
+
+  ~thread_cache()
+  {
+    for (size_t c = 0; c < class_count; ++c)
+      if (lists_[c].count)
+        release(c, lists_[c].count);
+  }
+
+  void* allocate(size_t c)
+  {
+    list& l = lists_[c];
+    if (!l.head) {
+      l.count = central::instance().take(c, batch_of(c), l.head);
+      if (!l.head)
+        throw std::bad_alloc();
+    }
+    free_block* b = l.head;
+    l.head = b->next;
+    --l.count;
+    return b;
+  }
+
+  void deallocate(void* p, size_t c)
+  {
+    list& l = lists_[c];
+    free_block* b = static_cast<free_block*>(p);
+    b->next = l.head;
+    l.head = b;
+    if (++l.count > 2 * batch_of(c))
+      release(c, batch_of(c));
+  }
+
+private:
+  struct list
+  {
+    free_block* head = nullptr;
+    size_t      count = 0;
+  };
+
+  void release(size_t c, size_t n)
+  {
+    list& l = lists_[c];
+    free_block* head = l.head;
+    free_block* tail = head;
+    for (size_t i = 1; i < n; ++i)
+      tail = tail->next;
+    l.head = tail->next;
+    l.count -= n;
+    central::instance().give(c, head, tail);
+  }
+
+  list lists_[class_count];
+};
+
+}
+
+/**
+ *  Аллокатор узлов с классами размеров и кэшем на поток (в духе tcmalloc):
+ *  выделение и освобождение - операции со списком своего потока, без
+ *  глобальной блокировки malloc. Без состояния, все экземпляры равны,
+ *  поэтому годится и для t1::map, и для t3::map, и для t::map.
+ *  Блоки больше 4 КБ и типы с выравниванием больше кэш-линии идут в
+ *  operator new. С pool_allocator<>::use_huge_pages(true) новые span-ы
+ *  берутся по 2 МБ и помечаются для прозрачных больших страниц.
+ */
+template<typename _Tp>
+class pool_allocator
+{
+public:
+  typedef _Tp value_type;
+  typedef std::true_type is_always_equal;
+  typedef std::true_type propagate_on_container_move_assignment;
+
+  pool_allocator() noexcept
+  { }
+
+  template<typename _Up>
+  pool_allocator(const pool_allocator<_Up>&) noexcept
+  { }
+
+  static void use_huge_pages(bool v)
+  { pool_detail::central::instance().set_huge_pages(v); }
+
+  _Tp* allocate(size_t n)
+  {
+    const size_t bytes = n * sizeof(_Tp);
+    if ( !pooled(bytes) )
+      return static_cast<_Tp*>( ::operator new( bytes, std::align_val_t(alignof(_Tp)) ) );
+    return static_cast<_Tp*>( pool_detail::thread_cache::local().allocate( pool_detail::size_class(bytes) ) );
+  }
+
+  void deallocate(_Tp* p, size_t n) noexcept
+  {
+    const size_t bytes = n * sizeof(_Tp);
+    if ( !pooled(bytes) ) {
+      ::operator delete( p, std::align_val_t(alignof(_Tp)) );
+      return;
+    }
+    pool_detail::thread_cache::local().deallocate( p, pool_detail::size_class(bytes) );
+  }
+
+  template<typename _Up>
+  bool operator==(const pool_allocator<_Up>&) const noexcept
+  { return true; }
+
+  template<typename _Up>
+  bool operator!=(const pool_allocator<_Up>&) const noexcept
+  { return false; }
+
+private:
+  static bool pooled(size_t bytes)
+  { return bytes && bytes <= pool_detail::max_block && alignof(_Tp) <= pool_detail::max_align; }
+};
+
+}
+
+#endif // POOL_ALLOCATOR_HPP
@@ -1,26 +1,252 @@
 #ifndef STRING_HASH_H
 #define STRING_HASH_H
 
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
 #include <string>
+#include <string_view>
 #include <functional>
-/*
-namespace std
+
+namespace t
 {
-template<>
-  struct hash<string> : public __hash_base<size_t, _Tp*>
-  {
-    unsigned constexpr const_hash(char const *input)
-    {
-        return *input ?
-            static_cast<unsigned int>(*input) + 33 * const_hash(input + 1) :
-            5381;
-    }
 
-    size_t operator()(const string&  v) const noexcept
-    {
-      return const_hash( v.c_str() );
+/**
+ *  Ключ с заранее посчитанным хэшем. Не владеет ключом: ссылка должна
+ *  жить, пока жив handle. Получается через map::prehash(k) и передается в
+ *  find/insert/erase/operator[] вместо ключа, когда к одному ключу
+ *  обращаются несколько раз.
+ */
+template<typename _Key>
+class prehashed_key
+{
+public:
+  prehashed_key(const _Key& k, size_t hash) noexcept : key_(&k), hash_(hash)
+  {  }
+
+  const _Key& key() const noexcept
+  { return *key_; }
+
+  size_t hash() const noexcept
+  { return hash_; }
+
+private:
+  const _Key* key_;
+  size_t hash_;
+};
+
+namespace hash_detail
+{
+
+/**
+ *  Финализатор murmur3 (fmix64): каждый бит входа влияет на каждый бит
+ *  выхода, в том числе на старшие.
+ */
+constexpr uint64_t avalanche(uint64_t h) noexcept
+{
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdull;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ull;
+  h ^= h >> 33;
+  return h;
+}
+
+/**
+ *  Исходный const_hash: c[0] + 33 * (c[1] + 33 * (... + 33 * 5381)).
+ */
+constexpr uint64_t djb2(const char* s, size_t n) noexcept
+{
+  uint64_t h = 5381;
+  while (n)
+    h = static_cast<unsigned char>(s[--n]) + 33 * h;
+  return h;
+}
+
+inline void mul128(uint64_t a, uint64_t b, uint64_t& lo, uint64_t& hi) noexcept
+{
+#if defined(__SIZEOF_INT128__)
+  const __uint128_t r = static_cast<__uint128_t>(a) * b;
+  lo = static_cast<uint64_t>(r);
+  hi = static_cast<uint64_t>(r >> 64);
+#else
+  const uint64_t ha = a >> 32, hb = b >> 32, la = static_cast<uint32_t>(a), lb = static_cast<uint32_t>(b);
+  const uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+  const uint64_t t = rl + (rm0 << 32);
+  lo = t + (rm1 << 32);
+  hi = rh + (rm0 >> 32) + (rm1 >> 32) + (t < rl) + (lo < t);
+#endif
+}
+
+inline uint64_t wymix(uint64_t a, uint64_t b) noexcept
+{
+  mul128(a, b, a, b);
+  return a ^ b;
+}
+
+inline uint64_t read8(const unsigned char* p) noexcept
+{
+  uint64_t v;
+  std::memcpy(&v, p, 8);
+  return v;
+}
+
+inline uint64_t read4(const unsigned char* p) noexcept
+{
+  uint32_t v;
+  std::memcpy(&v, p, 4);
+  return v;
+}
+
+/**
+ *  wyhash (final4): 16 байт за одно 128-битное умножение.
+ */
+inline uint64_t wyhash(const void* key, size_t len, uint64_t seed = 0) noexcept
+{
+  static const uint64_t s0 = 0xa0761d6478bd642full, s1 = 0xe7037ed1a0b428dbull,
+                        s2 = 0x8ebc6af09c88c6e3ull, s3 = 0x589965cc75374cc3ull;
+
+  const unsigned char* p = static_cast<const unsigned char*>(key);
+  seed ^= wymix(seed ^ s0, s1);
+  uint64_t a, b;
+  if (len <= 16) {
+    if (len >= 4) {
+      a = (read4(p) << 32) | read4(p + ((len >> 3) << 2));
+      b = (read4(p + len - 4) << 32) | read4(p + len - 4 - ((len >> 3) << 2));
+    } else if (len > 0) {
+      a = (static_cast<uint64_t>(p[0]) << 16) | (static_cast<uint64_t>(p[len >> 1]) << 8) | p[len - 1];
+      b = 0;
+    } else {
+      a = b = 0;
     }
-  };
+  } else {
+    size_t i = len;
+    if (i > 48) {
+      uint64_t see1 = seed, see2 = seed;
+      do {
+        seed = wymix(read8(p) ^ s1, read8(p + 8) ^ seed);
+        see1 = wymix(read8(p + 16) ^ s2, read8(p + 24) ^ see1);
+        see2 = wymix(read8(p + 32) ^ s3, read8(p + 40) ^ see2);
+        p += 48;
+        i -= 48;
+      } while (i > 48);
+      seed ^= see1 ^ see2;
+    }
+    while (i > 16) {
+      seed = wymix(read8(p) ^ s1, read8(p + 8) ^ seed);
+      i -= 16;
+      p += 16;
+    }
+    a = read8(p + i - 16);
+    b = read8(p + i - 8);
+  }
+
+  mul128(a ^ s1, b ^ seed, a, b);
+  return wymix(a ^ s0 ^ len, b ^ s1);
+}
+
+}
+
+/**
+ *  Политики хэширования для t1::map и t3::map. Все прозрачные
+ *  (is_transparent) и возвращают готовый хэш у prehashed_key.
+ *  t1::map берет хэш целиком: младшие биты - место внутри super_bucket,
+ *  а super_bucket выбирается по старшим битам перемешанного хэша, поэтому
+ *  политика должна давать хорошие и младшие, и старшие биты.
+ */
+
+/**
+ *  std::hash с финализатором: для целых и указателей std::hash
+ *  тождественный, и без перемешивания соседние ключи ложатся в одну группу.
+ */
+template<typename _Key>
+struct avalanche_hash
+{
+  typedef void is_transparent;
+
+  size_t operator()(const _Key& k) const noexcept
+  { return hash_detail::avalanche( std::hash<_Key>{}(k) ); }
+
+  template<typename K>
+  size_t operator()(const prehashed_key<K>& k) const noexcept
+  { return k.hash(); }
+};
+
+/**
+ *  djb2 для строк, считается и во время компиляции (const_hash).
+ *  Быстр на коротких ключах, но старшие биты у них почти пустые.
+ */
+struct djb2_hash
+{
+  typedef void is_transparent;
+
+  static constexpr size_t const_hash(const char* s, size_t n) noexcept
+  { return hash_detail::djb2(s, n); }
+
+  size_t operator()(std::string_view k) const noexcept
+  { return const_hash( k.data(), k.size() ); }
+
+  template<typename K>
+  size_t operator()(const prehashed_key<K>& k) const noexcept
+  { return k.hash(); }
+};
+
+/**
+ *  wyhash для строк: 64-битный хэш класса xxh3, на длинных ключах
+ *  заметно быстрее std::hash.
+ */
+struct wy_hash
+{
+  typedef void is_transparent;
+
+  size_t operator()(std::string_view k) const noexcept
+  { return hash_detail::wyhash( k.data(), k.size() ); }
+
+  template<typename K>
+  size_t operator()(const prehashed_key<K>& k) const noexcept
+  { return k.hash(); }
+};
+
+/**
+ *  Политика по умолчанию: avalanche_hash, а для std::string -
+ *  std::hash<std::string_view> (std::string, std::string_view и
+ *  const char* хэшируются одинаково).
+ */
+template<typename _Key>
+struct transparent_hash : avalanche_hash<_Key>
+{ };
+
+template<>
+struct transparent_hash<std::string>
+{
+  typedef void is_transparent;
+
+  size_t operator()(std::string_view k) const noexcept
+  { return std::hash<std::string_view>{}(k); }
+
+  template<typename K>
+  size_t operator()(const prehashed_key<K>& k) const noexcept
+  { return k.hash(); }
+};
+
+struct transparent_equal
+{
+  typedef void is_transparent;
+
+  template<typename A, typename B>
+  bool operator()(const A& a, const B& b) const
+  { return unwrap(a) == unwrap(b); }
+
+private:
+  template<typename K>
+  static const K& unwrap(const K& k)
+  { return k; }
+
+  template<typename K>
+  static const K& unwrap(const prehashed_key<K>& k)
+  { return k.key(); }
+};
+
+}
 
-}*/
 #endif // STRING_HASH_H
@@ -3,6 +3,19 @@
 
 #include <future>
 #include <chrono>
+#include <thread>
+#include <atomic>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <functional>
+#include <type_traits>
+#include <algorithm>
+#include <cmath>
+#include <memory>
+
+#include "flat_table.hpp"
+#include "bench.hpp"
 
 struct test_insert
 {
@@ -31,8 +44,9 @@ struct test_insert
   template <typename T>
   bool insertion(T& m, const std::string& name, size_t offset, size_t n)
   {
+    std::string k = name;
     for (size_t i = offset; i < (n+offset); ++i) {
-      std::string k = name;
+      k.resize( name.size() );
       k+= std::to_string(i);
       m[k] = i;
     }
@@ -40,6 +54,50 @@ struct test_insert
   }
 };
 
+/**
+ *  То же, что test_insert, но ключи потока уходят в insert_batch пачками.
+ */
+struct test_insert_batch
+{
+  std::vector< std::future<bool> > tasks;
+  size_t batch;
+
+  test_insert_batch( size_t thn, size_t b ) : tasks(thn), batch(b)
+  {  }
+
+  ~test_insert_batch() = default;
+
+  std::string caption()
+  { return "Test batch insertion"; }
+
+  template <typename T>
+  void run(T& m, size_t s)
+  {
+    size_t i = 0;
+    for (auto& it: tasks) {
+      it = std::async(std::launch::async, &test_insert_batch::insertion<T>, this, std::ref(m), std::string("task"), (i++)*s, s);
+    }
+
+    for (auto& it: tasks)
+      it.get();
+  }
+
+  template <typename T>
+  bool insertion(T& m, const std::string& name, size_t offset, size_t n)
+  {
+    std::vector<typename T::value_type> items;
+    items.reserve(batch);
+    for (size_t i = offset; i < (n+offset); ++i) {
+      items.emplace_back(name + std::to_string(i), i);
+      if ( items.size() == batch || i + 1 == n + offset ) {
+        m.insert_batch(items);
+        items.clear();
+      }
+    }
+    return true;
+  }
+};
+
 struct test_access
 {
   std::vector< std::future<bool> > tasks;
@@ -121,6 +179,567 @@ struct test_access_erase
   }
 };
 
+/**
+ *  Отчетные проходы под записью: первый поток раз в period обходит
+ *  snapshot() целиком, остальные переписывают и удаляют свои ключи.
+ *  Печатает, сколько полных проходов успел сделать читатель.
+ */
+struct test_snapshot_scan
+{
+  std::vector< std::future<size_t> > tasks;
+  std::chrono::milliseconds period;
+  size_t checksum;
+
+  test_snapshot_scan( size_t thn, std::chrono::milliseconds p ) : tasks(thn), period(p), checksum(0)
+  {  }
+
+  ~test_snapshot_scan() = default;
+
+  std::string caption()
+  { return "Test snapshot scan under writers"; }
+
+  template <typename T>
+  void run(T& m, size_t n)
+  {
+    std::atomic<size_t> writers( tasks.size() - 1 );
+    auto it = tasks.begin();
+    *it = std::async( std::launch::async, &test_snapshot_scan::scan<T>, this, std::ref(m), std::ref(writers) );
+
+    size_t i = 0;
+    for (++it; it != tasks.end(); ++it) {
+      *it = std::async( std::launch::async, &test_snapshot_scan::write<T>, this, std::ref(m), std::ref(writers),
+                        (i++)*n, n );
+    }
+
+    const size_t scans = tasks.front().get();
+    for (it = tasks.begin() + 1; it != tasks.end(); ++it)
+      it->get();
+    std::cout << "snapshot scans: " << scans << ", checksum: " << checksum << std::endl;
+  }
+
+  template <typename T>
+  size_t scan(T& m, std::atomic<size_t>& writers)
+  {
+    size_t scans = 0;
+    while ( writers.load() ) {
+      auto s = m.snapshot();
+      for (auto& it : s)
+        checksum += it.second;
+      ++scans;
+      std::this_thread::sleep_for(period);
+    }
+    return scans;
+  }
+
+  template <typename T>
+  size_t write(T& m, std::atomic<size_t>& writers, size_t offset, size_t n)
+  {
+    for (size_t i = offset; i < n + offset; ++i)
+      m[ "task" + std::to_string(i) ] = i;
+    for (size_t i = offset; i < n + offset; i += 2)
+      m.erase( "task" + std::to_string(i) );
+    --writers;
+    return n;
+  }
+};
+
+/**
+ *  Сумма значений всего map, rounds раз: итератором в одном потоке или
+ *  parallel_reduce по сегментам.
+ */
+struct test_full_sum
+{
+  bool parallel;
+
+  test_full_sum( bool p ) : parallel(p)
+  {  }
+
+  ~test_full_sum() = default;
+
+  std::string caption()
+  { return parallel ? "Test full-map sum (parallel_reduce)" : "Test full-map sum (iterator)"; }
+
+  template <typename T>
+  void run(T& m, size_t rounds)
+  {
+    size_t sum = 0;
+    for (size_t r = 0; r < rounds; ++r) {
+      if (parallel) {
+        sum += m.parallel_reduce( size_t(0), [](const typename T::value_type& it) { return it.second; },
+                                  std::plus<size_t>() );
+      } else {
+        for (auto& it : m)
+          sum += it.second;
+      }
+    }
+    std::cout << "checksum: " << sum << std::endl;
+  }
+};
+
+/**
+ *  Аллокатор, который ведет общий счет выделенных байт, чтобы сравнить
+ *  память контейнеров с одинаковым содержимым.
+ */
+struct allocation_counter
+{
+  static std::atomic<long long>& bytes()
+  {
+    static std::atomic<long long> b(0);
+    return b;
+  }
+};
+
+template<typename T>
+struct counting_allocator
+{
+  typedef T value_type;
+
+  counting_allocator() = default;
+
+  template<typename U>
+  counting_allocator(const counting_allocator<U>&) noexcept
+  {  }
+
+  T* allocate(size_t n)
+  {
+    allocation_counter::bytes() += n * sizeof(T);
+    return std::allocator<T>().allocate(n);
+  }
+
+  void deallocate(T* p, size_t n) noexcept
+  {
+    allocation_counter::bytes() -= n * sizeof(T);
+    std::allocator<T>().deallocate(p, n);
+  }
+
+  template<typename U>
+  bool operator==(const counting_allocator<U>&) const noexcept
+  { return true; }
+
+  template<typename U>
+  bool operator!=(const counting_allocator<U>&) const noexcept
+  { return false; }
+};
+
+/**
+ *  Только поиски, по n на поток, ключи 0 .. size() - 1 вразброс.
+ */
+struct test_concurrent_lookup
+{
+  std::vector< std::future<size_t> > tasks;
+
+  test_concurrent_lookup( size_t thn ) : tasks(thn)
+  {  }
+
+  ~test_concurrent_lookup() = default;
+
+  std::string caption()
+  { return "Test concurrent lookup"; }
+
+  template <typename T>
+  void run(T& m, size_t n)
+  {
+    size_t i = 0;
+    for (auto& it: tasks) {
+      it = std::async(std::launch::async, &test_concurrent_lookup::lookup<T>, this, std::ref(m), i++, n);
+    }
+
+    size_t found = 0;
+    for (auto& it: tasks)
+      found += it.get();
+    std::cout << "found: " << found << std::endl;
+  }
+
+  template <typename T>
+  size_t lookup(T& m, size_t seed, size_t n)
+  {
+    const size_t keys = m.size() ? m.size() : 1;
+    size_t found = 0;
+    for (size_t i = 0; i < n; ++i)
+      found += ( m.find( (seed * 7919 + i * 104729) % keys ) != m.end() );
+    return found;
+  }
+};
+
+/**
+ *  Запуск с файла save(): map поверх отображенного файла (open) или
+ *  разбор файла со вставкой всех записей в новый map (rebuild), затем
+ *  lookups случайных get.
+ */
+struct test_file_start
+{
+  std::string path;
+  bool layered;
+
+  test_file_start( const std::string& p, bool l ) : path(p), layered(l)
+  {  }
+
+  ~test_file_start() = default;
+
+  std::string caption()
+  { return layered ? "Test start from file (open as base layer)" : "Test start from file (rebuild)"; }
+
+  template <typename T>
+  void run(T& source, size_t lookups)
+  {
+    using namespace std::chrono;
+    const size_t n = source.size();
+    steady_clock::time_point tp1 = steady_clock::now();
+
+    std::unique_ptr<T> m;
+    if (layered) {
+      m.reset( new T( T::open(path) ) );
+    } else {
+      std::shared_ptr<const typename T::file_type> f = T::open(path);
+      m.reset( new T );
+      m->reserve( f->size() );
+      for (size_t i = 0; i < f->size(); ++i)
+        m->insert( f->materialize(i) );
+    }
+    steady_clock::time_point tp2 = steady_clock::now();
+
+    size_t sum = 0;
+    for (size_t i = 0; i < lookups; ++i)
+      sum += m->get( (i * 0x9E3779B97F4A7C15ull) % n ).value_or(0);
+
+    std::cout << "ready in: " << duration_cast<microseconds>(tp2 - tp1).count() << " microseconds"
+              << ", checksum: " << sum << std::endl;
+  }
+};
+
+/**
+ *  Смешанная нагрузка: на 19 поисков одна запись (95/5).
+ */
+struct test_read_mostly
+{
+  std::vector< std::future<size_t> > tasks;
+
+  test_read_mostly( size_t thn ) : tasks(thn)
+  {  }
+
+  ~test_read_mostly() = default;
+
+  std::string caption()
+  { return "Test read-mostly 95/5"; }
+
+  template <typename T>
+  void run(T& m, size_t n)
+  {
+    size_t i = 0;
+    for (auto& it: tasks) {
+      it = std::async(std::launch::async, &test_read_mostly::read_mostly<T>, this, std::ref(m), i++, n);
+    }
+
+    for (auto& it: tasks)
+      it.get();
+  }
+
+  template <typename T>
+  size_t read_mostly(T& m, size_t seed, size_t n)
+  {
+    typedef typename std::decay<decltype(m.begin()->first)>::type key_type;
+    const size_t keys = m.size() ? m.size() : 1;
+    size_t found = 0;
+    for (size_t i = 0; i < n; ++i) {
+      const size_t k = (seed * 7919 + i * 104729) % keys;
+      if (i % 20 == 0)
+        m[ make_key<key_type>(k) ] = i;
+      else
+        found += ( m.find( make_key<key_type>(k) ) != m.end() );
+    }
+    return found;
+  }
+
+  template <typename K>
+  static typename std::enable_if<std::is_integral<K>::value, K>::type make_key(size_t k)
+  { return static_cast<K>(k); }
+
+  template <typename K>
+  static typename std::enable_if<!std::is_integral<K>::value, K>::type make_key(size_t k)
+  { return "task" + std::to_string(k); }
+};
+
+/**
+ *  Смешанная нагрузка с заданной долей записей (в процентах) по ключам
+ *  size_t: для сравнения блокировок в _Mutex_type при разных соотношениях
+ *  чтения и записи.
+ */
+struct test_lock_mix
+{
+  std::vector< std::future<size_t> > tasks;
+  size_t write_percent;
+
+  test_lock_mix( size_t thn, size_t writes ) : tasks(thn), write_percent(writes)
+  {  }
+
+  ~test_lock_mix() = default;
+
+  std::string caption()
+  { return "Test lock mix " + std::to_string(100 - write_percent) + "/" + std::to_string(write_percent); }
+
+  template <typename T>
+  void run(T& m, size_t n)
+  {
+    size_t i = 0;
+    for (auto& it: tasks) {
+      it = std::async(std::launch::async, &test_lock_mix::mix<T>, this, std::ref(m), i++, n);
+    }
+
+    for (auto& it: tasks)
+      it.get();
+  }
+
+  template <typename T>
+  size_t mix(T& m, size_t seed, size_t n)
+  {
+    const size_t keys = m.size() ? m.size() : 1;
+    size_t found = 0;
+    for (size_t i = 0; i < n; ++i) {
+      const size_t k = (seed * 7919 + i * 104729) % keys;
+      if ( (seed + i * 37) % 100 < write_percent )
+        m[k] = i;
+      else
+        found += ( m.find(k) != m.end() );
+    }
+    return found;
+  }
+};
+
+/**
+ *  Почти одни поиски: на write_permille операций из 1000 - upsert, на
+ *  остальные visit с копированием значения. Работает с любым контейнером,
+ *  у которого есть visit/upsert (t1::map, t3::map, t3::left_right_map).
+ */
+struct test_visit_mix
+{
+  std::vector< std::future<size_t> > tasks;
+  size_t keys;
+  size_t write_permille;
+
+  test_visit_mix( size_t thn, size_t key_count, size_t writes ) : tasks(thn), keys(key_count), write_permille(writes)
+  {  }
+
+  ~test_visit_mix() = default;
+
+  std::string caption()
+  { return "Test visit mix, writes " + std::to_string(write_permille) + " per 1000"; }
+
+  template <typename T>
+  void run(T& m, size_t n)
+  {
+    size_t i = 0;
+    for (auto& it: tasks) {
+      it = std::async(std::launch::async, &test_visit_mix::mix<T>, this, std::ref(m), i++, n);
+    }
+
+    for (auto& it: tasks)
+      it.get();
+  }
+
+  template <typename T>
+  size_t mix(T& m, size_t seed, size_t n)
+  {
+    size_t sum = 0;
+    for (size_t i = 0; i < n; ++i) {
+      const size_t k = (seed * 7919 + i * 104729) % keys;
+      if ( (seed + i * 37) % 1000 < write_permille )
+        m.upsert( k, i, [i](size_t& v) { v = i; } );
+      else
+        m.visit( k, [&sum](const auto& v) { sum += v.second; } );
+    }
+    return sum;
+  }
+};
+
+/**
+ *  Кэш перед "медленным источником": ключи по Zipf (bench::key_chooser),
+ *  на каждый - compute_if_absent, при промахе значение вычисляется.
+ *  Доля попаданий и вытеснения - по map::cache_statistics().
+ */
+struct test_cache_zipf
+{
+  std::vector< std::future<size_t> > tasks;
+  bench::key_chooser chooser;
+
+  test_cache_zipf( size_t thn, size_t keys ) : tasks(thn), chooser(bench::distribution::zipfian, keys)
+  {  }
+
+  ~test_cache_zipf() = default;
+
+  std::string caption()
+  { return "Test zipfian cache"; }
+
+  template <typename T>
+  void run(T& m, size_t n)
+  {
+    size_t i = 0;
+    for (auto& it: tasks) {
+      it = std::async(std::launch::async, &test_cache_zipf::lookup<T>, this, std::ref(m), i++, n);
+    }
+
+    for (auto& it: tasks)
+      it.get();
+  }
+
+  template <typename T>
+  size_t lookup(T& m, size_t seed, size_t n)
+  {
+    bench::rng r(seed + 1);
+    size_t sum = 0;
+    for (size_t i = 0; i < n; ++i) {
+      const size_t k = bench::key_of( chooser.next(r) );
+      sum += m.compute_if_absent( k, [k]() { return k * 31; } );
+    }
+    return sum;
+  }
+};
+
+/**
+ *  Хранилище одного super_bucket без блокировок: прежняя узловая модель
+ *  std::unordered_map<size_t, value_type> (ключ - только хэш).
+ */
+struct node_shard
+{
+  typedef std::pair<std::string, size_t> value_type;
+  std::unordered_map<size_t, value_type> v;
+
+  size_t size() const
+  { return v.size(); }
+
+  void insert(size_t hash, const std::string& k, size_t val)
+  { v[hash] = value_type(k, val); }
+
+  bool contains(size_t hash, const std::string&) const
+  { return v.find(hash) != v.end(); }
+};
+
+/**
+ *  Хранилище одного super_bucket без блокировок: t1::flat_table.
+ */
+struct flat_shard
+{
+  t1::flat_table<std::string, size_t> v;
+
+  size_t size() const
+  { return v.size(); }
+
+  void insert(size_t hash, const std::string& k, size_t val)
+  { v.emplace_new(hash, k, val); }
+
+  bool contains(size_t hash, const std::string& k) const
+  { return v.find(hash, k) != nullptr; }
+};
+
+struct test_shard_lookup
+{
+  size_t rounds;
+  size_t hits;
+
+  test_shard_lookup( size_t r ) : rounds(r), hits(0)
+  {  }
+
+  ~test_shard_lookup() = default;
+
+  std::string caption()
+  { return "Test shard insert+lookup"; }
+
+  template <typename T>
+  void run(T& m, size_t n)
+  {
+    std::vector<std::string> keys(2*n);
+    std::vector<size_t> hashes(2*n);
+    for (size_t i = 0; i < keys.size(); ++i) {
+      keys[i] = "task" + std::to_string(i);
+      hashes[i] = std::hash<std::string>{}(keys[i]);
+    }
+
+    for (size_t i = 0; i < n; ++i)
+      m.insert(hashes[i], keys[i], i);
+
+    //half of the lookups are misses
+    for (size_t r = 0; r < rounds; ++r) {
+      for (size_t i = 0; i < keys.size(); ++i)
+        hits += m.contains(hashes[i], keys[i]);
+    }
+  }
+};
+
+/**
+ *  Загрузка уже отсортированных пар в пустой контейнер одним insert.
+ */
+struct test_sorted_load
+{
+  std::string caption()
+  { return "Test sorted bulk load"; }
+
+  template <typename T, typename V>
+  void run(T& m, const V& sorted)
+  { m.insert( sorted.begin(), sorted.end() ); }
+};
+
+/**
+ *  Упорядоченный доступ в одном потоке: lower_bound по случайным ключам
+ *  и после каждого поиска проход по scan следующим элементам.
+ */
+struct test_ordered_scan
+{
+  size_t scan;
+
+  test_ordered_scan(size_t s) : scan(s)
+  {  }
+
+  ~test_ordered_scan() = default;
+
+  std::string caption()
+  { return "Test ordered lookup + scan " + std::to_string(scan); }
+
+  template <typename T>
+  void run(T& m, size_t n)
+  {
+    size_t sum = 0;
+    const size_t range = m.size();
+    for (size_t i = 0; i < n; ++i) {
+      auto it = m.lower_bound( i * 0x9E3779B97F4A7C15ull % range );
+      for (size_t j = 0; j < scan && it != m.end(); ++j, ++it)
+        sum += it->second;
+    }
+    std::cout << "checksum: " << sum << std::endl;
+  }
+};
+
+/**
+ *  Рост контейнера с нуля в одном потоке, печатает самую долгую вставку:
+ *  перестроение всей таблицы разом видно здесь как выброс.
+ */
+struct test_insert_latency
+{
+  std::chrono::nanoseconds worst;
+
+  test_insert_latency() : worst(0)
+  {  }
+
+  ~test_insert_latency() = default;
+
+  std::string caption()
+  { return "Test insert latency"; }
+
+  template <typename T>
+  void run(T& m, size_t n)
+  {
+    using namespace std::chrono;
+    for (size_t i = 0; i < n; ++i) {
+      //std::hash<size_t> - тождественное, ключи перемешиваются умножением
+      const size_t k = i * 0x9E3779B97F4A7C15ull;
+      steady_clock::time_point tp1 = steady_clock::now();
+      m[k] = i;
+      nanoseconds d = steady_clock::now() - tp1;
+      if (d > worst)
+        worst = d;
+    }
+    std::cout << "worst insert: " << duration_cast<microseconds>(worst).count() << " microseconds" << std::endl;
+  }
+};
+
 template< typename test_type,
           typename container_type,
           typename... Args>
@@ -128,14 +747,84 @@ void run_test(test_type& test, container_type& m, Args... args)
 {
   using namespace std::chrono;
 
-  system_clock::time_point tp1 = system_clock::now();
+  steady_clock::time_point tp1 = steady_clock::now();
 
   {
      test.run(m, args...);
   }
 
-  system_clock::time_point tp2 = system_clock::now();
+  steady_clock::time_point tp2 = steady_clock::now();
   std::cout << "members : " << m.size() << std::endl;
   std::cout << test.caption() << " duration: " << duration_cast<milliseconds>(tp2-tp1).count() << " milliseconds" << std::endl;
 }
+
+/**
+ *  Вставка одного и того же числа элементов на 1, 2, 4 ... max_threads
+ *  потоках в контейнер с заданным числом super_bucket.
+ */
+template< typename container_type >
+void run_scaling_test(size_t super_buckets, size_t max_threads, size_t total)
+{
+  for (size_t th = 1; th <= max_threads; th *= 2) {
+    test_insert scaling_insert(th);
+    container_type m(super_buckets);
+    std::cout << "threads: " << th << ", super buckets: " << m.bucket_count() << std::endl;
+    run_test(scaling_insert, m, total / th);
+  }
+}
+
+/**
+ *  Одна строка матрицы блокировок: контейнер с данной блокировкой на 1, 2,
+ *  4 ... max_threads потоках при каждой доле записей из write_percents.
+ *  Общее число операций не зависит от числа потоков.
+ */
+template< typename container_type >
+void run_lock_matrix(const std::string& lock_name, size_t max_threads, size_t keys, size_t total,
+                     const std::vector<size_t>& write_percents)
+{
+  using namespace std::chrono;
+
+  for (size_t writes : write_percents) {
+    for (size_t th = 1; th <= max_threads; th *= 2) {
+      container_type m;
+      for (size_t i = 0; i < keys; ++i)
+        m[i] = i;
+      test_lock_mix mix(th, writes);
+
+      steady_clock::time_point tp1 = steady_clock::now();
+      mix.run(m, total / th);
+      steady_clock::time_point tp2 = steady_clock::now();
+      std::cout << lock_name << ", threads: " << th << ", writes: " << writes << "%, duration: "
+                << duration_cast<milliseconds>(tp2-tp1).count() << " milliseconds" << std::endl;
+    }
+  }
+}
+
+/**
+ *  Перекос распределения ключей по super_bucket: min/max/среднее,
+ *  стандартное отклонение и отношение самого большого к среднему
+ *  (1.0 - идеально ровно).
+ */
+template< typename container_type, typename key_factory >
+void run_shard_skew_test(size_t super_buckets, size_t n, key_factory make_key)
+{
+  container_type m(super_buckets);
+  for (size_t i = 0; i < n; ++i)
+    m[ make_key(i) ] = i;
+
+  const std::vector<size_t> sizes = m.shard_sizes();
+  const double mean = static_cast<double>( m.size() ) / sizes.size();
+  double var = 0;
+  for (size_t it : sizes)
+    var += (it - mean) * (it - mean);
+  const size_t max = *std::max_element( sizes.begin(), sizes.end() );
+
+  std::cout << "super buckets: " << sizes.size()
+            << ", min: " << *std::min_element( sizes.begin(), sizes.end() )
+            << ", max: " << max
+            << ", mean: " << mean
+            << ", stddev: " << std::sqrt( var / sizes.size() )
+            << ", max/mean: " << max / mean << std::endl;
+}
+
 #endif // TEST_HPP
@@ -0,0 +1,220 @@
+#ifndef THREAD_POOL_HPP
+#define THREAD_POOL_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#include <thread>
+#include <vector>
+
+namespace t
+{
+
+/**
+ *  Пул потоков с перехватом работы (work stealing). У каждого рабочего
+ *  своя очередь: свои задачи он берет с конца (последние положенные еще
+ *  в кэше), а опустевший рабочий забирает задачи с начала чужих очередей.
+ *  parallel_for раскладывает индексы по очередям и сам тоже выполняет
+ *  задачи, пока не выполнены все, поэтому вложенный parallel_for из
+ *  задачи не приводит к взаимной блокировке.
+ */
+class thread_pool
+{
+public:
+  explicit thread_pool(size_t threads = default_thread_count()) :
+    queues_(threads ? threads : 1), pending_(0), stop_(false)
+  {
+    workers_.reserve( queues_.size() );
+    for (size_t i = 0; i < queues_.size(); ++i)
+      workers_.emplace_back(&thread_pool::work, this, i);
+  }
+
+  thread_pool(const thread_pool&) = delete;
+  thread_pool& operator=(const thread_pool&) = delete;
+
+  ~thread_pool()
+  {
+    {
+      std::lock_guard<std::mutex> lock(sleep_m_);
+      stop_ = true;
+    }
+    wake_.notify_all();
+    for (auto& it : workers_)
+      it.join();
+  }
+
+  /**
+   *  Общий пул на процесс.
+   */
+  static thread_pool& instance()
+  {
+    static thread_pool p;
+    return p;
+  }
+
+  static size_t default_thread_count()
+  {
+    const size_t hw = std::thread::hardware_concurrency();
+    return hw ? hw : 1;
+  }
+
+  size_t size() const noexcept
+  { return workers_.size(); }
+
+  /**
+   *  fn(i) для каждого i из [0, n), возвращает управление, когда все
+   *  вызовы завершены. Первое исключение из fn пробрасывается после этого.
+   */
+  template<typename F>
+  void parallel_for(size_t n, F fn)
+  {
+    if (n == 0)
+      return;
+
+    job<F> j(fn, n);
+    //счетчик раньше очередей: иначе взятая задача уведет его ниже нуля
+    pending_.fetch_add(n, std::memory_order_release);
+    for (size_t i = 0; i < n; ++i) {
+      worker_queue& q = queues_[i % queues_.size()];
+      std::lock_guard<std::mutex> lock(q.m);
+      q.items.push_back( item{&j, i} );
+    }
+    {
+      std::lock_guard<std::mutex> lock(sleep_m_);
+    }
+    wake_.notify_all();
+
+    //помогаем, пока остались задачи, затем ждем уже взятые рабочими
+    while ( j.remaining.load(std::memory_order_acquire) ) {
+      if ( !run_one(0) )
+        break;
+    }
+    j.wait();
+    if (j.error)
+      std::rethrow_exception(j.error);
+  }
+
+private:
+  struct job_base
+  {
+    std::atomic<size_t>     remaining;
+    std::mutex              m;
+    std::condition_variable done;
+    std::exception_ptr      error;
+
+    explicit job_base(size_t n) : remaining(n)
+    { }
+
+    virtual ~job_base() = default;
+
+    virtual void call(size_t i) = 0;
+
+    void run(size_t i)
+    {
+      try {
+        call(i);
+      } catch (...) {
+        std::lock_guard<std::mutex> lock(m);
+        if (!error)
+          error = std::current_exception();
+      }
+      //под мьютексом: ждущий в wait() не разрушит job, пока мы его держим
+      std::lock_guard<std::mutex> lock(m);
+      if (remaining.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        done.notify_all();
+    }
+
+    void wait()
+    {
+      std::unique_lock<std::mutex> lock(m);
+      done.wait(lock, [this]() { return remaining.load(std::memory_order_acquire) == 0; });
+    }
+  };
+
+  template<typename F>
+  struct job : job_base
+  {
+    F& fn;
+
+    job(F& f, size_t n) : job_base(n), fn(f)
+    { }
+
+    void call(size_t i) override
+    { fn(i); }
+  };
+
+  struct item
+  {
+    job_base* j;
+    size_t    index;
+  };
+
+  struct alignas(64) worker_queue
+  {
+    std::mutex        m;
+    std::deque<item>  items;
+  };
+
+  /**
+   *  Одна задача: своя очередь с конца, иначе чужие с начала.
+   */
+  bool run_one(size_t self)
+  {
+    item it;
+    if ( !pop(self, it) )
+      return false;
+    pending_.fetch_sub(1, std::memory_order_relaxed);
+    it.j->run(it.index);
+    return true;
+  }
+
+  bool pop(size_t self, item& res)
+  {
+    {
+      worker_queue& q = queues_[self];
+      std::lock_guard<std::mutex> lock(q.m);
+      if ( !q.items.empty() ) {
+        res = q.items.back();
+        q.items.pop_back();
+        return true;
+      }
+    }
+    for (size_t k = 1; k < queues_.size(); ++k) {
+      worker_queue& q = queues_[ (self + k) % queues_.size() ];
+      std::lock_guard<std::mutex> lock(q.m);
+      if ( !q.items.empty() ) {
+        res = q.items.front();
+        q.items.pop_front();
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void work(size_t self)
+  {
+    for (;;) {
+      if ( run_one(self) )
+        continue;
+
+      std::unique_lock<std::mutex> lock(sleep_m_);
+      wake_.wait(lock, [this]() { return stop_ || pending_.load(std::memory_order_acquire) != 0; });
+      if ( stop_ && pending_.load(std::memory_order_acquire) == 0 )
+        return;
+    }
+  }
+
+  std::vector<worker_queue> queues_;
+  std::vector<std::thread>  workers_;
+  std::atomic<size_t>       pending_;
+  std::mutex                sleep_m_;
+  std::condition_variable   wake_;
+  bool                      stop_;
+};
+
+}
+
+#endif // THREAD_POOL_HPP
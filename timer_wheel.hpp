@@ -0,0 +1,205 @@
+#ifndef TIMER_WHEEL_HPP
+#define TIMER_WHEEL_HPP
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <utility>
+#include <algorithm>
+
+namespace t1
+{
+
+/**
+ *  Иерархическое колесо таймеров (Varghese, Lauck): levels уровней по
+ *  slots ячеек, ячейка уровня L покрывает slots^L тиков. Элемент кладется
+ *  на самый низкий уровень, где его тик отличается от текущего только в
+ *  разрядах этого уровня, и опускается уровнем ниже, когда стрелка доходит
+ *  до начала его ячейки. advance(t) трогает только ячейки, подошедшие к
+ *  тику t, а пустые перескакивает по битовой маске уровня, так что простой
+ *  между вызовами ничего не стоит.
+ *
+ *  Отмены нет: при срабатывании владелец сам проверяет, актуален ли
+ *  элемент. Тики за пределами текущего оборота верхнего уровня
+ *  (slots^levels тиков) ждут в отдельном списке и раскладываются по
+ *  колесу в начале каждого оборота.
+ *
+ *  Модификации не синхронизированы, защита - забота владельца.
+ */
+template<typename _Tp>
+class timer_wheel
+{
+public:
+  static const size_t level_bits = 6;
+  static const size_t slots = size_t(1) << level_bits;
+  static const size_t levels = 6;
+
+  explicit timer_wheel(uint64_t now) : now_(now), size_(0)
+  {
+    for (auto& it : bitmap_)
+      it = 0;
+  }
+
+  size_t size() const noexcept
+  { return size_; }
+
+  bool empty() const noexcept
+  { return size_ == 0; }
+
+  /**
+   *  Последний пройденный тик.
+   */
+  uint64_t now() const noexcept
+  { return now_; }
+
+  /**
+   *  Есть ли работа для advance(now): подошедшие элементы или ячейки,
+   *  которые пора опускать.
+   */
+  bool pending(uint64_t now) const noexcept
+  { return !due_.empty() || (now > now_ && next_event() <= now); }
+
+  /**
+   *  Сработает в первом advance до тика не меньше tick; уже прошедший
+   *  тик - в следующем advance.
+   */
+  void schedule(uint64_t tick, const _Tp& v)
+  {
+    ++size_;
+    if (tick <= now_)
+      due_.push_back( node{tick, v} );
+    else if ( (tick ^ now_) >> total_bits )
+      overflow_.push_back( node{tick, v} );
+    else
+      place( node{tick, v}, now_ );
+  }
+
+  /**
+   *  Проходит тики до now включительно, fire(_Tp&) для каждого подошедшего
+   *  элемента. fire может вызывать schedule. Возвращает число сработавших.
+   */
+  template<typename F>
+  size_t advance(uint64_t now, F fire)
+  {
+    size_t res = 0;
+    if ( !due_.empty() ) {
+      std::vector<node> ready;
+      ready.swap(due_);
+      res += run(ready, fire);
+    }
+
+    while (now_ < now) {
+      const uint64_t t = next_event();
+      if (t > now) {
+        now_ = now;
+        break;
+      }
+
+      //новый оборот: дальние элементы, которые в него попали
+      if ( (t & rotation_mask) == 0 && !overflow_.empty() ) {
+        std::vector<node> far;
+        far.swap(overflow_);
+        for (auto& it : far) {
+          if ( (it.tick ^ t) >> total_bits )
+            overflow_.push_back(it);
+          else
+            place(it, t);
+        }
+      }
+
+      //ячейки, начинающиеся с t, опускаются сверху вниз
+      for (size_t level = levels - 1; level > 0; --level) {
+        const size_t shift = level * level_bits;
+        const size_t idx = (t >> shift) & slot_mask;
+        if ( (t & ( (uint64_t(1) << shift) - 1 )) == 0 && (bitmap_[level] >> idx) & 1 ) {
+          std::vector<node> cell;
+          take(level, idx, cell);
+          for (auto& it : cell)
+            place(it, t);
+        }
+      }
+
+      now_ = t;
+      const size_t idx = t & slot_mask;
+      if ( (bitmap_[0] >> idx) & 1 ) {
+        std::vector<node> ready;
+        take(0, idx, ready);
+        res += run(ready, fire);
+      }
+    }
+    return res;
+  }
+
+private:
+  static const uint64_t slot_mask = slots - 1;
+  static const size_t   total_bits = levels * level_bits;
+  static const uint64_t rotation_mask = (uint64_t(1) << total_bits) - 1;
+
+  struct node
+  {
+    uint64_t tick;
+    _Tp      value;
+  };
+
+  /**
+   *  Ближайший тик после now_, на котором есть что опускать или
+   *  запускать; UINT64_MAX - колесо пусто. На каждом уровне элементы
+   *  лежат только в ячейках после текущей.
+   */
+  uint64_t next_event() const noexcept
+  {
+    uint64_t res = overflow_.empty() ? UINT64_MAX : ( (now_ >> total_bits) + 1 ) << total_bits;
+    for (size_t level = 0; level < levels; ++level) {
+      const size_t shift = level * level_bits;
+      const size_t cur = (now_ >> shift) & slot_mask;
+      if (cur == slot_mask)
+        continue;
+      const uint64_t m = bitmap_[level] >> (cur + 1);
+      if (m) {
+        const uint64_t base = (now_ >> (shift + level_bits)) << (shift + level_bits);
+        const uint64_t idx = cur + 1 + __builtin_ctzll(m);
+        res = std::min( res, base + (idx << shift) );
+      }
+    }
+    return res;
+  }
+
+  /**
+   *  Кладет элемент относительно тика ref (tick >= ref).
+   */
+  void place(const node& n, uint64_t ref)
+  {
+    size_t level = 0;
+    while ( level + 1 < levels && ( (n.tick ^ ref) >> ((level + 1) * level_bits) ) )
+      ++level;
+    const size_t idx = (n.tick >> (level * level_bits)) & slot_mask;
+    cells_[level][idx].push_back(n);
+    bitmap_[level] |= uint64_t(1) << idx;
+  }
+
+  void take(size_t level, size_t idx, std::vector<node>& to)
+  {
+    to.swap( cells_[level][idx] );
+    bitmap_[level] &= ~(uint64_t(1) << idx);
+  }
+
+  template<typename F>
+  size_t run(std::vector<node>& ready, F& fire)
+  {
+    size_ -= ready.size();
+    for (auto& it : ready)
+      fire(it.value);
+    return ready.size();
+  }
+
+  uint64_t          now_;
+  size_t            size_;
+  uint64_t          bitmap_[levels];
+  std::vector<node> cells_[levels][slots];
+  std::vector<node> due_;
+  std::vector<node> overflow_;
+};
+
+}
+
+#endif // TIMER_WHEEL_HPP
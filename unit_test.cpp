@@ -4,11 +4,29 @@
 #include <boost/test/unit_test.hpp>
 #include <iostream>
 #include <string>
+#include <string_view>
 #include <map>
 #include <algorithm>
+#include <thread>
+#include <future>
+#include <atomic>
+#include <random>
+#include <memory>
+#include <stdexcept>
+#include <filesystem>
 
 #include "map1.hpp"
+#include "mapped_file.hpp"
+#include "frozen_map.hpp"
+#include "map2.hpp"
 #include "map3.hpp"
+#include "map.hpp"
+#include "map4.hpp"
+#include "pool_allocator.hpp"
+#include "thread_pool.hpp"
+#include "locks.hpp"
+#include "left_right.hpp"
+#include "bench.hpp"
 
 using namespace std;
 
@@ -36,6 +54,17 @@ BOOST_AUTO_TEST_CASE(MapSimpleInsertErase)
     test_insert_erase(.5, .6, m2);
   }
 
+  {
+    t2::map<string, string> m;
+    test_insert_erase( string("new_key"), string("new_value"), m);
+
+    t2::map<int, int> m1;
+    test_insert_erase(5, 6, m1);
+
+    t2::map<double, double> m2;
+    test_insert_erase(.5, .6, m2);
+  }
+
   {
     t3::map<string, string> m;
     test_insert_erase( string("new_key"), string("new_value"), m);
@@ -70,9 +99,1550 @@ BOOST_AUTO_TEST_CASE(MapSimpleIterator)
     test_iterators(m);
   }
 
+  {
+    t2::map<string, string> m;
+    test_iterators(m);
+  }
+
   {
     t3::map<string, string> m;
     test_iterators(m);
   }
 
 }
+
+BOOST_AUTO_TEST_CASE(FlatTableInsertEraseRehash)
+{
+  typedef t1::flat_table<int, int> table_type;
+  table_type t;
+  std::hash<int> h;
+
+  for (int i = 0; i < 10000; ++i) {
+    BOOST_REQUIRE( t.find(h(i), i) == nullptr );
+    t.emplace_new(h(i), i, i*2);
+  }
+  BOOST_CHECK( t.size() == 10000 );
+  BOOST_CHECK( t.load_factor() <= 0.875f );
+
+  for (int i = 0; i < 10000; i += 2)
+    BOOST_CHECK( t.erase(h(i), i) );
+  BOOST_CHECK( t.size() == 5000 );
+
+  t.finish_migration();
+  BOOST_CHECK( !t.migrating() );
+
+  size_t n = 0;
+  for (size_t i = t.next_full(0); i < t.capacity(); i = t.next_full(i + 1)) {
+    BOOST_CHECK( t.slot(i).first % 2 == 1 );
+    BOOST_CHECK( t.slot(i).second == t.slot(i).first * 2 );
+    ++n;
+  }
+  BOOST_CHECK( n == 5000 );
+
+  t.rehash(0);
+  for (int i = 0; i < 10000; ++i)
+    BOOST_CHECK( (t.find(h(i), i) != nullptr) == (i % 2 == 1) );
+}
+
+BOOST_AUTO_TEST_CASE(FlatTableIncrementalRehash)
+{
+  typedef t1::flat_table<int, int> table_type;
+  table_type t;
+  std::hash<int> h;
+
+  size_t migrations = 0;
+  for (int i = 0; i < 100000; ++i) {
+    t.emplace_new(h(i), i, i);
+    if ( t.migrating() ) {
+      ++migrations;
+      //both blocks are consulted while the old one is drained
+      BOOST_REQUIRE( t.find(h(i / 2), i / 2) != nullptr );
+      BOOST_REQUIRE( t.find(h(0), 0) != nullptr );
+    }
+  }
+  BOOST_CHECK( migrations > 0 );
+  BOOST_CHECK( t.size() == 100000 );
+
+  t.reserve(400000);
+  BOOST_CHECK( t.migrating() );
+  for (int i = 0; i < 100000; i += 2)
+    BOOST_CHECK( t.erase(h(i), i) );
+  BOOST_CHECK( t.size() == 50000 );
+  for (int i = 0; i < 100000; ++i)
+    BOOST_CHECK( (t.find(h(i), i) != nullptr) == (i % 2 == 1) );
+}
+
+BOOST_AUTO_TEST_CASE(MapManyKeysIterateErase)
+{
+  t1::map<string, size_t> m;
+  for (size_t i = 0; i < 5000; ++i)
+    m["task" + std::to_string(i)] = i;
+  BOOST_CHECK( m.size() == 5000 );
+
+  size_t n = 0;
+  for (auto& it : m) {
+    BOOST_CHECK( it.first == "task" + std::to_string(it.second) );
+    ++n;
+  }
+  BOOST_CHECK( n == 5000 );
+
+  auto it = m.cbegin();
+  while ( it != m.cend() )
+    it = m.erase(it);
+  BOOST_CHECK( m.empty() );
+  BOOST_CHECK( m.find("task1") == m.end() );
+}
+
+BOOST_AUTO_TEST_CASE(MapSuperBucketCount)
+{
+  typedef t1::map<int, int> map_type;
+  map_type m(10);
+  BOOST_CHECK( m.bucket_count() == 16 );
+  BOOST_CHECK( m.bucket_index(0x1234) < 16 );
+  //shard comes from high bits: keys equal in the low bits still spread
+  std::vector<bool> used(16);
+  for (size_t i = 0; i < 64; ++i)
+    used[ m.bucket_index(i << 32) ] = true;
+  BOOST_CHECK( std::count(used.begin(), used.end(), true) > 8 );
+
+  map_type m_default;
+  size_t n = m_default.bucket_count();
+  BOOST_CHECK( n >= map_type::default_super_bucket_count() );
+  BOOST_CHECK( (n & (n - 1)) == 0 );
+
+  BOOST_CHECK( alignof(map_type::super_bucket) == t1::cache_line_size );
+
+  for (int i = 0; i < 1000; ++i)
+    m[i] = i;
+  BOOST_CHECK( m.size() == 1000 );
+}
+
+BOOST_AUTO_TEST_CASE(MapOptimisticFindUnderWriters)
+{
+  typedef t1::map<size_t, size_t> map_type;
+  map_type m(4);
+  for (size_t i = 0; i < 1000; ++i)
+    m[i] = i;
+
+  std::atomic<bool> stop(false);
+  std::atomic<size_t> misses(0);
+
+  std::thread writer([&]() {
+    for (size_t r = 0; r < 50; ++r) {
+      for (size_t k = 1000; k < 5000; ++k)
+        m[k] = k;
+      for (size_t k = 1000; k < 5000; ++k)
+        m.erase(k);
+    }
+    stop = true;
+  });
+
+  std::vector<std::thread> readers;
+  for (size_t t = 0; t < 3; ++t) {
+    readers.emplace_back([&]() {
+      do {
+        for (size_t i = 0; i < 1000; ++i) {
+          auto it = m.find(i);
+          if ( it == m.end() || it->second != i )
+            ++misses;
+        }
+      } while (!stop);
+    });
+  }
+
+  writer.join();
+  for (auto& it : readers)
+    it.join();
+
+  BOOST_CHECK( misses == 0 );
+  BOOST_CHECK( m.size() == 1000 );
+}
+
+BOOST_AUTO_TEST_CASE(MapIterateUnderErase)
+{
+  typedef t1::map<std::string, size_t> map_type;
+  map_type m(4);
+  for (size_t i = 0; i < 2000; ++i)
+    m[std::to_string(i)] = i;
+
+  std::atomic<bool> stop(false);
+  std::atomic<size_t> broken(0);
+
+  std::thread writer([&]() {
+    for (size_t r = 0; r < 20; ++r) {
+      for (size_t i = 0; i < 2000; ++i)
+        m.erase( std::to_string(i) );
+      for (size_t i = 0; i < 2000; ++i)
+        m.insert( map_type::value_type(std::to_string(i), i) );
+    }
+    stop = true;
+  });
+
+  std::vector<std::thread> readers;
+  for (size_t t = 0; t < 2; ++t) {
+    readers.emplace_back([&]() {
+      do {
+        for (auto it = m.begin(); it != m.end(); ++it) {
+          if ( it->first != std::to_string(it->second) )
+            ++broken;
+        }
+        auto it = m.find("1000");
+        if ( it != m.end() && it->first != "1000" )
+          ++broken;
+      } while (!stop);
+    });
+  }
+
+  writer.join();
+  for (auto& it : readers)
+    it.join();
+
+  BOOST_CHECK( broken == 0 );
+  BOOST_CHECK( m.size() == 2000 );
+
+  auto it = m.cbegin();
+  while ( it != m.cend() )
+    it = m.erase(it);
+  BOOST_CHECK( m.empty() );
+}
+
+BOOST_AUTO_TEST_CASE(MapHeterogeneousLookup)
+{
+  typedef t1::map<std::string, size_t> t1_type;
+  typedef t3::map<std::string, size_t> t3_type;
+  t1_type m1;
+  t3_type m3;
+
+  m1[std::string_view("alpha")] = 1;
+  m1["beta"] = 2;
+  m3[std::string_view("alpha")] = 1;
+  m3["beta"] = 2;
+
+  BOOST_CHECK( m1.find(std::string_view("alpha"))->second == 1 );
+  BOOST_CHECK( m1.find("beta")->second == 2 );
+  BOOST_CHECK( m1.find(std::string_view("gamma")) == m1.end() );
+  BOOST_CHECK( m3.find(std::string_view("alpha"))->second == 1 );
+  BOOST_CHECK( m3.find("beta")->second == 2 );
+
+  std::string gamma("gamma");
+  auto k1 = t1_type::prehash(gamma);
+  BOOST_CHECK( k1.hash() == std::hash<std::string>{}(gamma) );
+  m1.insert(k1, 3);
+  BOOST_CHECK( m1.find(k1)->second == 3 );
+  BOOST_CHECK( m1[k1] == 3 );
+  BOOST_CHECK( m1.find(std::string_view("gamma")) != m1.end() );
+  BOOST_CHECK( m1.erase(k1) == 1 );
+  BOOST_CHECK( m1.find(gamma) == m1.end() );
+
+  //handle не владеет ключом, string_view должен пережить его
+  const std::string_view gamma_view(gamma);
+  auto k3 = t3_type::prehash(gamma_view);
+  m3.insert(k3, 3);
+  BOOST_CHECK( m3.find(k3)->second == 3 );
+  BOOST_CHECK( m3[k3] == 3 );
+  BOOST_CHECK( m3.erase(k3) == 1 );
+  BOOST_CHECK( m3.erase("beta") == 1 );
+  BOOST_CHECK( m3.size() == 1 );
+
+  BOOST_CHECK( m1.erase("beta") == 1 );
+  BOOST_CHECK( m1.size() == 1 );
+}
+
+BOOST_AUTO_TEST_CASE(HashPolicies)
+{
+  static_assert( t::djb2_hash::const_hash("abc", 3) == 'a' + 33 * ('b' + 33 * ('c' + 33 * 5381ull)),
+                 "djb2 must be usable at compile time" );
+
+  BOOST_CHECK( t::wy_hash{}("task1") == t::wy_hash{}(std::string("task1")) );
+  BOOST_CHECK( t::wy_hash{}("task1") != t::wy_hash{}("task2") );
+  BOOST_CHECK( t::wy_hash{}("") != t::wy_hash{}(std::string(1, '\0')) );
+  BOOST_CHECK( t::wy_hash{}(std::string(100, 'x')) != t::wy_hash{}(std::string(101, 'x')) );
+  BOOST_CHECK( t::avalanche_hash<size_t>{}(1) >> 32 != 0 );
+
+  t1::map<std::string, size_t, std::mutex, 8, t::wy_hash> m1;
+  t3::map<std::string, size_t, std::mutex, t::djb2_hash> m3;
+  for (size_t i = 0; i < 1000; ++i) {
+    m1["task" + std::to_string(i)] = i;
+    m3["task" + std::to_string(i)] = i;
+  }
+  BOOST_CHECK( m1.size() == 1000 && m3.size() == 1000 );
+  BOOST_CHECK( m1.find(std::string_view("task10"))->second == 10 );
+  BOOST_CHECK( m3.find(std::string_view("task10"))->second == 10 );
+
+  std::vector<size_t> sizes = m1.shard_sizes();
+  BOOST_CHECK( sizes.size() == 8 );
+  BOOST_CHECK( *std::min_element(sizes.begin(), sizes.end()) > 0 );
+}
+
+BOOST_AUTO_TEST_CASE(MapBatchOperations)
+{
+  typedef t1::map<std::string, size_t> map_type;
+  map_type m(8);
+
+  std::vector<map_type::value_type> items;
+  for (size_t i = 0; i < 10000; ++i)
+    items.emplace_back("task" + std::to_string(i), i);
+  items.emplace_back("task0", 42); //the later duplicate wins
+  m.insert_batch(items);
+  BOOST_CHECK( m.size() == 10000 );
+
+  std::vector<std::string> keys;
+  for (size_t i = 0; i < 20000; i += 2)
+    keys.push_back("task" + std::to_string(i));
+  std::vector<map_type::iterator> found = m.find_batch(keys);
+  BOOST_REQUIRE( found.size() == keys.size() );
+  for (size_t i = 0; i < keys.size(); ++i) {
+    if ( i < 5000 ) {
+      BOOST_REQUIRE( found[i] != m.end() );
+      BOOST_CHECK( found[i]->first == keys[i] );
+      BOOST_CHECK( found[i]->second == (i ? 2 * i : 42) );
+    } else {
+      BOOST_CHECK( found[i] == m.end() );
+    }
+  }
+  found.clear();
+
+  BOOST_CHECK( m.erase_batch(keys) == 5000 );
+  BOOST_CHECK( m.size() == 5000 );
+  BOOST_CHECK( m.find("task1") != m.end() );
+  BOOST_CHECK( m.find("task2") == m.end() );
+}
+
+BOOST_AUTO_TEST_CASE(FlatCombiningMap)
+{
+  typedef t3::map<std::string, size_t, t3::flat_combining> map_type;
+  map_type m;
+
+  std::vector<std::thread> th;
+  for (size_t t = 0; t < 8; ++t) {
+    th.emplace_back([&m, t]() {
+      for (size_t i = t * 1000; i < (t + 1) * 1000; ++i)
+        m["task" + std::to_string(i)] = i;
+      for (size_t i = t * 1000; i < (t + 1) * 1000; i += 2)
+        m.erase("task" + std::to_string(i));
+    });
+  }
+  for (auto& it : th)
+    it.join();
+
+  BOOST_CHECK( m.size() == 4000 );
+  BOOST_CHECK( m.find("task1")->second == 1 );
+  BOOST_CHECK( m.find("task2") == m.end() );
+  BOOST_CHECK( m.at("task3") == 3 );
+  BOOST_CHECK_THROW( m.at("task4"), std::out_of_range );
+}
+
+template<typename map_type>
+static void check_compute_in_place(map_type& m)
+{
+  std::vector<std::thread> th;
+  for (size_t t = 0; t < 4; ++t) {
+    th.emplace_back([&m]() {
+      for (size_t i = 0; i < 10000; ++i)
+        m.upsert("counter" + std::to_string(i % 10), 1, [](size_t& v) { ++v; });
+    });
+  }
+  for (auto& it : th)
+    it.join();
+
+  size_t total = 0;
+  for (size_t i = 0; i < 10; ++i) {
+    BOOST_CHECK( m.visit("counter" + std::to_string(i), [&total](auto& v) { total += v.second; }) );
+  }
+  BOOST_CHECK( total == 40000 );
+  BOOST_CHECK( !m.visit("missing", [](auto&) {}) );
+
+  size_t calls = 0;
+  BOOST_CHECK( m.compute_if_absent(std::string_view("lazy"), [&calls]() { ++calls; return size_t(7); }) == 7 );
+  BOOST_CHECK( m.compute_if_absent("lazy", [&calls]() { ++calls; return size_t(8); }) == 7 );
+  BOOST_CHECK( calls == 1 );
+
+  BOOST_CHECK( !m.erase_if("lazy", [](const auto& v) { return v.second != 7; }) );
+  BOOST_CHECK( m.erase_if("lazy", [](const auto& v) { return v.second == 7; }) );
+  BOOST_CHECK( !m.visit("lazy", [](auto&) {}) );
+  BOOST_CHECK( m.size() == 10 );
+}
+
+BOOST_AUTO_TEST_CASE(MapComputeInPlace)
+{
+  t1::map<std::string, size_t> m1(4);
+  check_compute_in_place(m1);
+
+  t3::map<std::string, size_t> m3;
+  check_compute_in_place(m3);
+}
+
+BOOST_AUTO_TEST_CASE(LockFreeMapConcurrentInsertErase)
+{
+  t2::map<size_t, size_t> m;
+  std::atomic<size_t> erased(0);
+
+  std::vector<std::thread> th;
+  for (size_t t = 0; t < 4; ++t) {
+    th.emplace_back([&m, &erased, t]() {
+      for (size_t i = t * 10000; i < (t + 1) * 10000; ++i)
+        m[i] = i;
+      for (size_t i = t * 10000; i < (t + 1) * 10000; i += 2)
+        erased += m.erase(i);
+    });
+  }
+  for (auto& it : th)
+    it.join();
+
+  BOOST_CHECK( erased == 20000 );
+  BOOST_CHECK( m.size() == 20000 );
+  BOOST_CHECK( m.bucket_count() >= 20000 / 2 );
+
+  size_t n = 0;
+  for (auto& it : m) {
+    BOOST_CHECK( it.first % 2 == 1 );
+    BOOST_CHECK( it.second == it.first );
+    ++n;
+  }
+  BOOST_CHECK( n == 20000 );
+
+  for (size_t i = 0; i < 40000; ++i)
+    BOOST_CHECK( (m.find(i) != m.end()) == (i % 2 == 1) );
+
+  auto it = m.cbegin();
+  while ( it != m.cend() )
+    it = m.erase(it);
+  BOOST_CHECK( m.empty() );
+
+  //вставки в еще не тронутые бакеты (ленивые фиктивные узлы) идут,
+  //пока другие потоки удаляют и освобождают узлы
+  t2::map<size_t, size_t> g;
+  std::atomic<bool> stop(false);
+  std::vector<std::thread> churn;
+  for (size_t t = 0; t < 2; ++t) {
+    churn.emplace_back([&g, &stop, t]() {
+      //у каждого потока свои ключи: ссылка из operator[] живет до удаления
+      for (size_t i = 0; !stop; ++i) {
+        g[t * 32 + i % 32] = i;
+        g.erase( t * 32 + (i + 7) % 32 );
+      }
+    });
+  }
+  std::vector<std::thread> growers;
+  for (size_t t = 0; t < 2; ++t) {
+    growers.emplace_back([&g, t]() {
+      for (size_t i = 0; i < 20000; ++i)
+        g[1000 + i * 2 + t] = i;
+    });
+  }
+  for (auto& it : growers)
+    it.join();
+  stop = true;
+  for (auto& it : churn)
+    it.join();
+
+  n = 0;
+  for (auto& it : g)
+    n += it.first >= 1000;
+  BOOST_CHECK( n == 40000 );
+  BOOST_CHECK( g.bucket_count() >= 40000 / 2 );
+}
+
+/**
+ *  Значение, которое считает свои живые экземпляры.
+ */
+struct live_counted
+{
+  static std::atomic<long> live;
+
+  live_counted() { ++live; }
+  live_counted(const live_counted&) { ++live; }
+  ~live_counted() { --live; }
+  live_counted& operator=(const live_counted&) = default;
+};
+
+std::atomic<long> live_counted::live(0);
+
+BOOST_AUTO_TEST_CASE(LockFreeMapReclaimsErased)
+{
+  {
+    t2::map<size_t, live_counted> m;
+    //удаленные узлы освобождаются по ходу, а не в деструкторе
+    for (size_t i = 0; i < 200000; ++i) {
+      m[i % 16];
+      m.erase(i % 16);
+    }
+    BOOST_CHECK( m.empty() );
+    BOOST_CHECK( live_counted::live < 1000 );
+
+    //узел под итератором живет, пока итератор на нем стоит
+    m[1];
+    auto it = m.find(1);
+    std::thread eraser([&m]() {
+      for (size_t i = 0; i < 20000; ++i) {
+        m[i % 16 + 2];
+        m.erase(i % 16 + 2);
+      }
+      m.erase(1);
+    });
+    eraser.join();
+    BOOST_CHECK( it->first == 1 );
+    BOOST_CHECK( m.find(1) == m.end() );
+  }
+  BOOST_CHECK( live_counted::live == 0 );
+}
+
+template<typename _Key, typename _MakeKey>
+void check_ordered_map(size_t n, _MakeKey make_key)
+{
+  t::map<_Key, size_t> m;
+  std::map<_Key, size_t> ref;
+  std::mt19937 rnd(7);
+
+  for (size_t i = 0; i < n; ++i) {
+    const _Key k = make_key( rnd() % n );
+    if (rnd() % 3 == 0) {
+      BOOST_CHECK( m.erase(k) == ref.erase(k) );
+    } else {
+      auto r = m.emplace(k, i);
+      BOOST_CHECK( r.second == ref.emplace(k, i).second );
+      BOOST_CHECK( r.first->first == k );
+    }
+  }
+  BOOST_REQUIRE( m.size() == ref.size() );
+  BOOST_CHECK( std::equal(m.begin(), m.end(), ref.begin(), ref.end()) );
+  BOOST_CHECK( std::equal(m.rbegin(), m.rend(), ref.rbegin(), ref.rend()) );
+
+  for (size_t i = 0; i < n; ++i) {
+    const _Key k = make_key(i);
+    auto lb = m.lower_bound(k);
+    auto ub = m.upper_bound(k);
+    BOOST_CHECK( (lb == m.end()) == (ref.lower_bound(k) == ref.end()) );
+    BOOST_CHECK( (ub == m.end()) == (ref.upper_bound(k) == ref.end()) );
+    if ( lb != m.end() )
+      BOOST_CHECK( lb->first == ref.lower_bound(k)->first );
+    if ( ub != m.end() )
+      BOOST_CHECK( ub->first == ref.upper_bound(k)->first );
+    BOOST_CHECK( m.count(k) == ref.count(k) );
+    BOOST_CHECK( std::distance(m.equal_range(k).first, m.equal_range(k).second) ==
+                 std::distance(ref.equal_range(k).first, ref.equal_range(k).second) );
+  }
+
+  //erase возвращает следующий элемент даже после слияния листьев
+  auto it = m.begin();
+  auto rit = ref.begin();
+  while ( it != m.end() ) {
+    BOOST_REQUIRE( rit != ref.end() );
+    BOOST_CHECK( it->first == rit->first );
+    if (it->second % 2) {
+      it = m.erase(it);
+      rit = ref.erase(rit);
+    } else {
+      ++it;
+      ++rit;
+    }
+  }
+  BOOST_CHECK( std::equal(m.begin(), m.end(), ref.begin(), ref.end()) );
+
+  t::map<_Key, size_t> c(m);
+  BOOST_CHECK( c == m );
+  c.erase( c.begin(), c.end() );
+  BOOST_CHECK( c.empty() && c.begin() == c.end() );
+  BOOST_CHECK( c < m || m.empty() );
+}
+
+BOOST_AUTO_TEST_CASE(OrderedMapAgainstStdMap)
+{
+  check_ordered_map<size_t>(20000, [](size_t i) { return i; });
+  check_ordered_map<std::string>(5000, [](size_t i) { return std::to_string(i); });
+
+  t::map<int, std::string> m = { {3, "c"}, {1, "a"}, {2, "b"} };
+  BOOST_CHECK( m.begin()->second == "a" && m.rbegin()->second == "c" );
+  m[4] = "d";
+  BOOST_CHECK( m.at(4) == "d" && m.size() == 4 );
+  BOOST_CHECK_THROW( m.at(5), std::out_of_range );
+  BOOST_CHECK( m.emplace_hint(m.end(), 5, "e")->second == "e" );
+  BOOST_CHECK( --m.end() == m.find(5) );
+
+  //слоты сдвигаются перемещением, а запись через итератор попадает в сам слот
+  t::map< size_t, std::unique_ptr<size_t> > u;
+  for (size_t i = 1000; i-- > 0; )
+    u.emplace( i * 2, std::make_unique<size_t>(i) );
+  for (size_t i = 0; i < 1000; i += 3)
+    u.erase(i * 2);
+  for (auto& e : u)
+    *e.second += e.first;
+  size_t i = 0;
+  for (const auto& e : u) {
+    if (i % 3 == 0)
+      ++i;
+    BOOST_CHECK( e.first == i * 2 && *e.second == i * 3 );
+    ++i;
+  }
+  BOOST_CHECK( u.size() == 666 );
+}
+
+BOOST_AUTO_TEST_CASE(OrderedMapBulkLoadAndHints)
+{
+  std::vector< std::pair<size_t, size_t> > sorted;
+  for (size_t i = 0; i < 100000; ++i)
+    sorted.emplace_back(i * 2, i);
+
+  t::map<size_t, size_t> m( sorted.begin(), sorted.end() );
+  std::map<size_t, size_t> ref( sorted.begin(), sorted.end() );
+  BOOST_REQUIRE( m.size() == ref.size() );
+  BOOST_CHECK( std::equal(m.begin(), m.end(), ref.begin(), ref.end()) );
+
+  //плотно упакованное дерево должно нормально перестраиваться при удалениях
+  std::mt19937 rnd(11);
+  for (size_t i = 0; i < 100000; ++i) {
+    const size_t k = rnd() % 200000;
+    BOOST_CHECK( m.erase(k) == ref.erase(k) );
+  }
+  BOOST_CHECK( std::equal(m.begin(), m.end(), ref.begin(), ref.end()) );
+
+  //убывающие ключи с подсказкой begin(), случайные ключи со случайной подсказкой
+  t::map<size_t, size_t> d;
+  for (size_t i = 50000; i-- > 0; )
+    BOOST_CHECK( d.emplace_hint(d.begin(), i, i)->first == i );
+  BOOST_CHECK( d.size() == 50000 && d.begin()->first == 0 );
+
+  for (size_t i = 0; i < 50000; ++i) {
+    const size_t k = rnd() % 200000;
+    auto hint = m.lower_bound( rnd() % 200000 );
+    auto it = m.insert( hint, std::make_pair(k, i) );
+    BOOST_CHECK( it->first == k );
+    ref.insert( std::make_pair(k, i) );
+  }
+  BOOST_CHECK( std::equal(m.begin(), m.end(), ref.begin(), ref.end()) );
+}
+
+BOOST_AUTO_TEST_CASE(PoolAllocatorMaps)
+{
+  namespace pd = t::pool_detail;
+  for (size_t n = 1; n <= pd::max_block; ++n) {
+    const size_t c = pd::size_class(n);
+    BOOST_REQUIRE( c < pd::class_count );
+    BOOST_CHECK( pd::class_size(c) >= n );
+    BOOST_CHECK( c == 0 || pd::class_size(c - 1) < n );
+  }
+
+  typedef t::pool_allocator< std::pair<std::string, size_t> > t1_alloc;
+  typedef t::pool_allocator< std::pair<const std::string, size_t> > node_alloc;
+  t1::map<std::string, size_t, std::mutex, 0, t::transparent_hash<std::string>, t1_alloc> m1;
+  t3::map<std::string, size_t, std::mutex, t::transparent_hash<std::string>, node_alloc> m3;
+  t::map<std::string, size_t, std::less<std::string>, node_alloc> m;
+
+  //память, освобожденная в одном потоке, переиспользуется в другом
+  std::vector<std::thread> th;
+  for (size_t t = 0; t < 4; ++t) {
+    th.emplace_back([&m1, &m3, t]() {
+      for (size_t i = t * 5000; i < (t + 1) * 5000; ++i) {
+        m1["task" + std::to_string(i)] = i;
+        m3["task" + std::to_string(i)] = i;
+      }
+      for (size_t i = t * 5000; i < (t + 1) * 5000; i += 2) {
+        m1.erase("task" + std::to_string(i));
+        m3.erase("task" + std::to_string(i));
+      }
+    });
+  }
+  for (auto& it : th)
+    it.join();
+  for (size_t i = 0; i < 20000; ++i)
+    m["task" + std::to_string(i)] = i;
+
+  BOOST_CHECK( m1.size() == 10000 && m3.size() == 10000 && m.size() == 20000 );
+  for (size_t i = 0; i < 20000; ++i) {
+    const std::string k = "task" + std::to_string(i);
+    BOOST_CHECK( (m1.find(k) != m1.end()) == (i % 2 == 1) );
+    BOOST_CHECK( (m3.find(k) != m3.end()) == (i % 2 == 1) );
+    BOOST_CHECK( m.at(k) == i );
+  }
+
+  //clear отдает арену целиком, но живой итератор еще видит старые записи
+  auto it = m1.begin();
+  BOOST_REQUIRE( it != m1.end() );
+  const std::string first = it->first;
+  m1.clear();
+  m3.clear();
+  m.clear();
+  BOOST_CHECK( it->first == first );
+  BOOST_CHECK( m1.empty() && m1.find(first) == m1.end() );
+  BOOST_CHECK( m3.empty() && m.empty() );
+
+  m1[first] = 1;
+  BOOST_CHECK( m1.size() == 1 && m1.find(first)->second == 1 );
+}
+
+BOOST_AUTO_TEST_CASE(SkipListConcurrentInsertEraseScan)
+{
+  t4::map<size_t, size_t> m;
+  std::atomic<size_t> erased(0);
+  std::atomic<size_t> scan_errors(0);
+  std::atomic<bool> stop(false);
+
+  //курсор lower_bound идет по возрастанию ключей при работающих писателях
+  std::thread scanner([&m, &scan_errors, &stop]() {
+    while ( !stop.load() ) {
+      size_t prev = 0;
+      bool first = true;
+      for (auto it = m.lower_bound(1000); it != m.end(); ++it) {
+        if ( it->first < 1000 || (!first && it->first <= prev) )
+          ++scan_errors;
+        prev = it->first;
+        first = false;
+      }
+    }
+  });
+
+  std::vector<std::thread> th;
+  for (size_t t = 0; t < 4; ++t) {
+    th.emplace_back([&m, &erased, t]() {
+      for (size_t i = t; i < 40000; i += 4)
+        m[i] = i;
+      //каждый поток удаляет свои ключи с i % 8 < 4
+      for (size_t i = t; i < 40000; i += 8)
+        erased += m.erase(i);
+    });
+  }
+  for (auto& it : th)
+    it.join();
+  stop = true;
+  scanner.join();
+
+  BOOST_CHECK( scan_errors == 0 );
+  BOOST_CHECK( erased == 20000 );
+  BOOST_CHECK( m.size() == 20000 );
+
+  size_t n = 0, prev = 0;
+  for (auto& it : m) {
+    BOOST_CHECK( it.first % 8 >= 4 );
+    BOOST_CHECK( it.second == it.first );
+    BOOST_CHECK( n == 0 || it.first > prev );
+    prev = it.first;
+    ++n;
+  }
+  BOOST_CHECK( n == 20000 );
+
+  for (size_t i = 0; i < 40000; ++i)
+    BOOST_CHECK( (m.find(i) != m.end()) == (i % 8 >= 4) );
+  BOOST_CHECK( m.lower_bound(100)->first == 100 );
+  BOOST_CHECK( m.lower_bound(97)->first == 100 );
+  BOOST_CHECK( m.upper_bound(103)->first == 108 );
+  BOOST_CHECK( m.upper_bound(39999) == m.end() );
+  BOOST_CHECK( !m.insert( std::make_pair(size_t(100), size_t(0)) ).second );
+  BOOST_CHECK( m.insert( std::make_pair(size_t(99), size_t(0)) ).second );
+
+  auto it = m.cbegin();
+  while ( it != m.cend() )
+    it = m.erase(it);
+  BOOST_CHECK( m.empty() );
+}
+
+BOOST_AUTO_TEST_CASE(SkipListReclaimsErased)
+{
+  {
+    t4::map<size_t, live_counted> m;
+    //удаленные узлы освобождаются по ходу, а не в деструкторе
+    for (size_t i = 0; i < 200000; ++i) {
+      m[i % 16];
+      m.erase(i % 16);
+    }
+    BOOST_CHECK( m.empty() );
+    BOOST_CHECK( live_counted::live < 1000 );
+
+    //вставки и удаления одних и тех же ключей из нескольких потоков:
+    //удаление попадает и на недостроенные башни
+    std::vector<std::thread> th;
+    for (size_t t = 0; t < 4; ++t) {
+      th.emplace_back([&m, t]() {
+        for (size_t i = 0; i < 50000; ++i) {
+          m[(i + t) % 8];
+          m.erase( (i + 2 * t) % 8 );
+        }
+      });
+    }
+    {
+      //курсор держит свой узел (и освобождение вообще), пока на нем стоит
+      m[100];
+      auto cursor = m.lower_bound(100);
+      m.erase(100);
+      for (auto& it : th)
+        it.join();
+      BOOST_CHECK( cursor->first == 100 );
+      BOOST_CHECK( m.find(100) == m.end() );
+    }
+    for (size_t i = 0; i < 1000; ++i) {
+      m[i % 16];
+      m.erase(i % 16);
+    }
+    BOOST_CHECK( live_counted::live < 1000 );
+  }
+  BOOST_CHECK( live_counted::live == 0 );
+}
+
+BOOST_AUTO_TEST_CASE(MapSnapshotUnderWriters)
+{
+  t1::map<size_t, size_t> m(8);
+  for (size_t i = 0; i < 20000; ++i)
+    m[i] = i;
+
+  auto s = m.snapshot();
+  BOOST_CHECK( s.size() == 20000 );
+
+  std::atomic<bool> stop(false);
+  std::atomic<size_t> scan_errors(0);
+  std::thread reader([&s, &stop, &scan_errors]() {
+    while ( !stop.load() ) {
+      size_t n = 0, sum = 0;
+      for (auto& it : s) {
+        if (it.second != it.first)
+          ++scan_errors;
+        ++n;
+        sum += it.first;
+      }
+      if ( n != 20000 || sum != 20000 * 19999 / 2 )
+        ++scan_errors;
+    }
+  });
+
+  //удаления, перезапись, вставка новых ключей и clear в одном писателе
+  for (size_t i = 0; i < 20000; i += 2)
+    m.erase(i);
+  for (size_t i = 1; i < 20000; i += 2)
+    m[i] = 0;
+  m.insert_batch( std::vector< std::pair<size_t, size_t> >{ {20000, 1}, {20001, 1} } );
+  m.upsert(size_t(3), 0, [](size_t& v) { v = 7; });
+  auto s2 = m.snapshot();
+  m.clear();
+  stop = true;
+  reader.join();
+
+  BOOST_CHECK( scan_errors == 0 );
+  BOOST_CHECK( s.find(size_t(4)) != s.end() && s.find(size_t(4))->second == 4 );
+  BOOST_CHECK( !s.contains(size_t(20000)) );
+
+  BOOST_CHECK( s2.size() == 10002 );
+  BOOST_CHECK( !s2.contains(size_t(4)) );
+  BOOST_CHECK( s2.find(size_t(3))->second == 7 );
+  BOOST_CHECK( s2.find(size_t(5))->second == 0 );
+  BOOST_CHECK( s2.contains(size_t(20001)) );
+  BOOST_CHECK( std::distance( s2.begin(), s2.end() ) == 10002 );
+
+  BOOST_CHECK( m.size() == 0 );
+  BOOST_CHECK( m.snapshot().empty() );
+}
+
+BOOST_AUTO_TEST_CASE(MapParallelForEachReduce)
+{
+  t::thread_pool pool(4);
+
+  std::vector<std::atomic<size_t>> hits(1000);
+  pool.parallel_for( hits.size(), [&hits](size_t i) { ++hits[i]; } );
+  BOOST_CHECK( std::all_of( hits.begin(), hits.end(), [](const std::atomic<size_t>& h) { return h == 1; } ) );
+
+  //вложенный parallel_for из задачи
+  std::atomic<size_t> nested(0);
+  pool.parallel_for( 8, [&pool, &nested](size_t) {
+    pool.parallel_for( 8, [&nested](size_t) { ++nested; } );
+  });
+  BOOST_CHECK( nested == 64 );
+
+  BOOST_CHECK_THROW( pool.parallel_for( 16, [](size_t i) {
+    if (i == 7)
+      throw std::runtime_error("task");
+  }), std::runtime_error );
+
+  t1::map<size_t, size_t> m(16);
+  const size_t n = 100000;
+  for (size_t i = 0; i < n; ++i)
+    m[i] = i;
+
+  m.parallel_for_each( [](std::pair<size_t, size_t>& it) { it.second *= 2; }, pool );
+  BOOST_CHECK( m[size_t(12345)] == 24690 );
+
+  const size_t sum = m.parallel_reduce( size_t(1), [](const std::pair<size_t, size_t>& it) { return it.second; },
+                                        std::plus<size_t>(), pool );
+  BOOST_CHECK( sum == 1 + n * (n - 1) );
+
+  const size_t max = m.parallel_reduce( size_t(0), [](const std::pair<size_t, size_t>& it) { return it.first; },
+                                        [](size_t a, size_t b) { return std::max(a, b); } );
+  BOOST_CHECK( max == n - 1 );
+
+  t1::map<size_t, size_t> empty_m;
+  BOOST_CHECK( empty_m.parallel_reduce( size_t(42), [](const std::pair<size_t, size_t>& it) { return it.second; },
+                                        std::plus<size_t>() ) == 42 );
+}
+
+BOOST_AUTO_TEST_CASE(MapFileSaveOpenAndBaseLayer)
+{
+  typedef t1::map<std::string, size_t> map_type;
+  const std::string path = ( std::filesystem::temp_directory_path() / "t1_map_unit_test.bin" ).string();
+
+  std::map<std::string, size_t> expected;
+  map_type m(8);
+  for (size_t i = 0; i < 1000; ++i) {
+    m["k" + std::to_string(i)] = i;
+    expected["k" + std::to_string(i)] = i;
+  }
+  m.save(path);
+
+  //только чтение
+  std::shared_ptr<const map_type::file_type> f = map_type::open(path);
+  BOOST_CHECK( f->size() == 1000 );
+  BOOST_CHECK( f->shard_count() == 8 );
+  BOOST_CHECK( f->get("k5") == std::optional<size_t>(5) );
+  BOOST_CHECK( f->key( f->find(std::string_view("k6")) ) == "k6" );
+  BOOST_CHECK( !f->contains("nope") );
+  BOOST_CHECK_THROW( (t1::mapped_file<size_t, size_t>(path)), std::runtime_error );
+  BOOST_CHECK_THROW( map_type::open(path + ".missing"), std::runtime_error );
+
+  //базовый слой с другим числом сегментов
+  for (size_t shards : { 2, 32 }) {
+    map_type b(f, shards);
+    std::map<std::string, size_t> e = expected;
+    BOOST_CHECK( b.size() == 1000 );
+    BOOST_CHECK( b.get("k7") == std::optional<size_t>(7) );
+    BOOST_CHECK( b.contains("k7") && !b.contains("nope") );
+    BOOST_CHECK( b.find("k8")->second == 8 );
+    BOOST_CHECK( b.contains("k8") && b.size() == 1000 );
+
+    b["k9"] += 100;
+    e["k9"] += 100;
+    b.insert( std::make_pair(std::string("k10"), size_t(0)) );
+    e["k10"] = 0;
+    BOOST_CHECK( b.erase("k11") == 1 && b.erase("k11") == 0 );
+    e.erase("k11");
+    BOOST_CHECK( b.erase_if("k12", [](const map_type::value_type& it) { return it.second == 12; }) );
+    e.erase("k12");
+    b["new"] = 1;
+    e["new"] = 1;
+    BOOST_CHECK( b.get("k9") == std::optional<size_t>(109) );
+    BOOST_CHECK( !b.get("k11") && !b.contains("k12") );
+    BOOST_CHECK( b.size() == e.size() );
+
+    std::map<std::string, size_t> seen;
+    for (auto it = b.begin(); it != b.end(); ++it)
+      seen.insert(*it);
+    BOOST_CHECK( seen == e );
+    BOOST_CHECK( b.parallel_reduce( size_t(0), [](const map_type::value_type& it) { return it.second; },
+                                    std::plus<size_t>() ) == 1000 * 999 / 2 + 100 - 10 - 11 - 12 + 1 );
+
+    map_type::snapshot_view s = b.snapshot();
+    b.erase("k13");
+    b["k14"] = 0;
+    BOOST_CHECK( s.size() == e.size() && s.contains("k13") && s.find("k14")->second == 14 );
+    seen.clear();
+    for (auto& it : s)
+      seen.insert(it);
+    BOOST_CHECK( seen == e );
+    e.erase("k13");
+    e["k14"] = 0;
+
+    const std::string saved = path + ".layered";
+    b.save(saved);
+    map_type c( map_type::open(saved), 4 );
+    seen.clear();
+    for (auto it = c.begin(); it != c.end(); ++it)
+      seen.insert(*it);
+    BOOST_CHECK( seen == e );
+    std::filesystem::remove(saved);
+
+    b.clear();
+    BOOST_CHECK( b.size() == 0 && b.begin() == b.end() && !b.contains("k1") );
+  }
+
+  //параллельный copy-up: поиск без блокировки не теряет ключ
+  map_type b(f, 4);
+  std::atomic<size_t> missing(0);
+  std::vector<std::thread> th;
+  for (size_t t = 0; t < 4; ++t) {
+    th.emplace_back([&b, &missing, t]() {
+      for (size_t i = 0; i < 1000; ++i) {
+        const std::string k = "k" + std::to_string( (i + t * 250) % 1000 );
+        b.upsert( k, 0, [](size_t& v) { ++v; } );
+        missing += !b.contains( "k" + std::to_string( (i + t * 250 + 500) % 1000 ) );
+      }
+    });
+  }
+  for (auto& it : th)
+    it.join();
+  BOOST_CHECK( missing == 0 && b.size() == 1000 );
+  BOOST_CHECK( b.get("k123") == std::optional<size_t>(127) );
+
+  map_type empty_m;
+  empty_m.save(path);
+  map_type d( map_type::open(path) );
+  BOOST_CHECK( d.size() == 0 && d.begin() == d.end() );
+  //старое отображение остается рабочим после перезаписи файла
+  BOOST_CHECK( f->get("k5") == std::optional<size_t>(5) );
+  std::filesystem::remove(path);
+}
+
+BOOST_AUTO_TEST_CASE(FrozenMapPerfectHash)
+{
+  t1::frozen_map<std::string, size_t> small{ {"a", 1}, {"b", 2}, {"a", 3} };
+  BOOST_CHECK( small.size() == 2 );
+  BOOST_CHECK( small.at("a") == 1 && small.find(std::string_view("b"))->second == 2 );
+  BOOST_CHECK( !small.contains("c") );
+  BOOST_CHECK_THROW( small.at("c"), std::out_of_range );
+
+  t1::frozen_map<size_t, size_t> empty_m;
+  BOOST_CHECK( empty_m.empty() && empty_m.find(size_t(1)) == empty_m.end() );
+
+  //тождественный std::hash и размеры от 1 до нескольких корзин
+  for (size_t n : { 1, 2, 3, 17, 1000, 100000 }) {
+    std::vector< std::pair<size_t, size_t> > items;
+    for (size_t i = 0; i < n; ++i)
+      items.emplace_back(i << 12, i);
+    t1::frozen_map<size_t, size_t, std::hash<size_t> > f( items.begin(), items.end() );
+    BOOST_CHECK( f.size() == n );
+    size_t found = 0;
+    for (size_t i = 0; i < n; ++i)
+      found += f.count(i << 12) && f.at(i << 12) == i;
+    BOOST_CHECK( found == n );
+    BOOST_CHECK( !f.contains( (n << 12) + 1 ) );
+    BOOST_CHECK( n < 100000 || f.memory_usage() < n * ( sizeof(std::pair<size_t, size_t>) + 4 ) );
+  }
+
+  t1::map<std::string, size_t> m(8);
+  const size_t n = 50000;
+  for (size_t i = 0; i < n; ++i)
+    m["key" + std::to_string(i)] = i;
+  const t1::map<std::string, size_t>::frozen_type f = m.freeze();
+  m["key1"] = 0;
+  BOOST_CHECK( f.size() == n && f.at("key1") == 1 );
+  BOOST_CHECK( f.find( m.prehash( std::string("key2") ) )->second == 2 );
+
+  size_t sum = 0;
+  for (auto& it : f)
+    sum += it.second;
+  BOOST_CHECK( sum == n * (n - 1) / 2 );
+
+  //чтение из нескольких потоков без синхронизации
+  std::atomic<size_t> wrong(0);
+  std::vector<std::thread> th;
+  for (size_t t = 0; t < 4; ++t) {
+    th.emplace_back([&f, &wrong, t, n]() {
+      for (size_t i = t; i < 2 * n; i += 4) {
+        auto it = f.find( "key" + std::to_string(i) );
+        wrong += i < n ? (it == f.end() || it->second != i) : it != f.end();
+      }
+    });
+  }
+  for (auto& it : th)
+    it.join();
+  BOOST_CHECK( wrong == 0 );
+}
+
+BOOST_AUTO_TEST_CASE(BenchHistogramAndKeyChoosers)
+{
+  bench::histogram h;
+  for (uint64_t v = 1; v <= 1000; ++v)
+    h.record(v);
+  BOOST_CHECK( h.count() == 1000 && h.max() == 1000 );
+  //погрешность интервала не больше 1/32
+  BOOST_CHECK( h.percentile(0.5) >= 500 && h.percentile(0.5) <= 500 + 500 / 32 );
+  BOOST_CHECK( h.percentile(0.99) >= 990 && h.percentile(0.99) <= 990 + 990 / 32 );
+  BOOST_CHECK( h.percentile(1.0) == 1000 );
+  for (size_t i = 0; i < bench::histogram::buckets; ++i)
+    BOOST_CHECK( bench::histogram::index_of( bench::histogram::upper_of(i) ) == i );
+
+  bench::histogram other;
+  other.record(1000000);
+  h.merge(other);
+  BOOST_CHECK( h.count() == 1001 && h.max() == 1000000 );
+
+  const uint64_t n = 10000;
+  bench::rng r(1);
+  bench::key_chooser uniform(bench::distribution::uniform, n);
+  bench::key_chooser zipf(bench::distribution::zipfian, n);
+  bench::key_chooser hot(bench::distribution::hotset, n, 0.99, 0.1, 0.9);
+  size_t zipf_top = 0, hot_in = 0, uniform_top = 0;
+  for (size_t i = 0; i < 100000; ++i) {
+    const uint64_t u = uniform.next(r), z = zipf.next(r), hs = hot.next(r);
+    BOOST_CHECK( u < n && z < n && hs < n );
+    uniform_top += u < 10;
+    zipf_top += z < 10;
+    hot_in += hs < n / 10;
+  }
+  //у zipf(0.99) на 10 самых частых из 10000 приходится около трети обращений
+  BOOST_CHECK( zipf_top > 25000 && uniform_top < 500 );
+  BOOST_CHECK( hot_in > 88000 && hot_in < 92000 );
+
+  bench::workload w;
+  BOOST_CHECK( bench::workload::preset("E", w) && w.valid() );
+  BOOST_CHECK( !bench::workload::preset("Z", w) );
+}
+
+BOOST_AUTO_TEST_CASE(MapShardStats)
+{
+  typedef t1::map<size_t, size_t, std::mutex, 0, t::avalanche_hash<size_t>,
+                  std::allocator< std::pair<size_t, size_t> >, t1::lock_stats> stats_map;
+  static_assert( sizeof(t1::map<size_t, size_t>::super_bucket) <= sizeof(stats_map::super_bucket) );
+
+  stats_map m(4);
+  std::vector<std::thread> th;
+  for (size_t t = 0; t < 4; ++t) {
+    th.emplace_back([&m, t]() {
+      for (size_t i = t; i < 40000; i += 4)
+        m[i] = i;
+    });
+  }
+  for (auto& it : th)
+    it.join();
+
+  const std::vector<t1::shard_stats> s = m.stats();
+  BOOST_CHECK( s.size() == 4 );
+  uint64_t acquisitions = 0, contended = 0, wait = 0;
+  size_t size = 0;
+  for (auto& it : s) {
+    acquisitions += it.lock_acquisitions;
+    contended += it.contended_acquisitions;
+    wait += it.wait_ns;
+    size += it.size;
+    BOOST_CHECK( it.capacity >= it.size );
+    BOOST_CHECK( it.load_factor > 0 && it.load_factor <= 1 );
+    BOOST_CHECK( it.max_probe_length >= 1 );
+  }
+  BOOST_CHECK( acquisitions == 40000 );
+  BOOST_CHECK( size == 40000 );
+  BOOST_CHECK( contended <= acquisitions );
+  BOOST_CHECK( contended == 0 || wait > 0 );
+
+  //без политики счетчики нулевые, заполненность считается
+  t1::map<size_t, size_t> plain(2);
+  plain[size_t(1)] = 1;
+  size_t plain_size = 0;
+  for (auto& it : plain.stats()) {
+    BOOST_CHECK( it.lock_acquisitions == 0 );
+    plain_size += it.size;
+  }
+  BOOST_CHECK( plain_size == 1 );
+}
+
+template<typename lock_type>
+static void check_mutual_exclusion()
+{
+  lock_type l;
+  size_t counter = 0;
+  std::vector<std::thread> th;
+  for (size_t t = 0; t < 4; ++t) {
+    th.emplace_back([&l, &counter]() {
+      for (size_t i = 0; i < 20000; ++i) {
+        std::lock_guard<lock_type> lock(l);
+        ++counter;
+      }
+    });
+  }
+  for (auto& it : th)
+    it.join();
+  BOOST_CHECK( counter == 80000 );
+
+  BOOST_CHECK( l.try_lock() );
+  BOOST_CHECK( !std::async(std::launch::async, [&l]() { return l.try_lock(); }).get() );
+  l.unlock();
+  BOOST_CHECK( std::async(std::launch::async, [&l]() { bool res = l.try_lock(); if (res) l.unlock(); return res; }).get() );
+}
+
+BOOST_AUTO_TEST_CASE(LockPolicies)
+{
+  check_mutual_exclusion<t::ttas_spinlock>();
+  check_mutual_exclusion<t::ticket_lock>();
+  check_mutual_exclusion<t::mcs_lock>();
+  check_mutual_exclusion<t::adaptive_mutex>();
+  check_mutual_exclusion<t::reader_biased_lock>();
+
+  //читатели не мешают друг другу, писатель ждет всех
+  t::reader_biased_lock rw;
+  rw.lock_shared();
+  BOOST_CHECK( std::async(std::launch::async, [&rw]() {
+    bool res = rw.try_lock_shared();
+    if (res)
+      rw.unlock_shared();
+    return res && !rw.try_lock();
+  }).get() );
+  rw.unlock_shared();
+
+  size_t a = 0, b = 0;
+  std::atomic<bool> torn(false);
+  std::vector<std::thread> th;
+  for (size_t t = 0; t < 4; ++t) {
+    th.emplace_back([&, t]() {
+      for (size_t i = 0; i < 20000; ++i) {
+        if (t == 0 && i % 10 == 0) {
+          std::lock_guard<t::reader_biased_lock> lock(rw);
+          ++a;
+          ++b;
+        } else {
+          std::shared_lock<t::reader_biased_lock> lock(rw);
+          if (a != b)
+            torn = true;
+        }
+      }
+    });
+  }
+  for (auto& it : th)
+    it.join();
+  BOOST_CHECK( !torn );
+  BOOST_CHECK( a == 2000 && b == 2000 );
+
+  //как _Mutex_type контейнеров
+  t1::map<std::string, size_t, t::mcs_lock> m1(4);
+  check_compute_in_place(m1);
+  BOOST_CHECK( m1.snapshot().size() == 10 );
+  t1::map<std::string, size_t, t::reader_biased_lock> m1_rw(4);
+  check_compute_in_place(m1_rw);
+  BOOST_CHECK( m1_rw.get("counter3") == size_t(4000) );
+
+  t3::map<std::string, size_t, t::adaptive_mutex> m3;
+  check_compute_in_place(m3);
+  t3::map<std::string, size_t, t::reader_biased_lock> m3_rw;
+  check_compute_in_place(m3_rw);
+  BOOST_CHECK( m3_rw.at("counter3") == 4000 );
+}
+
+BOOST_AUTO_TEST_CASE(LeftRightMap)
+{
+  typedef t3::left_right_map<std::string, size_t> map_type;
+  map_type m;
+  check_compute_in_place(m);
+  BOOST_CHECK( m.get("counter1") == size_t(4000) );
+  BOOST_CHECK( m.at(map_type::prehash(std::string("counter2"))) == 4000 );
+  BOOST_CHECK_THROW( m.at("missing"), std::out_of_range );
+  BOOST_CHECK( m.insert( map_type::value_type("one", 1) ) );
+  BOOST_CHECK( !m.insert( map_type::value_type("one", 2) ) );
+  m.insert( map_type::prehash(std::string("one")), 3 );
+  BOOST_CHECK( m.count("one") == 1 && m.get("one") == size_t(3) );
+  BOOST_CHECK( m.erase("one") == 1 && m.erase("one") == 0 );
+
+  //обе копии одинаковы: после любого числа переключений видно одно и то же
+  m.write( [](auto& c) { c["batch"] = 5; } );
+  for (size_t i = 0; i < 3; ++i) {
+    BOOST_CHECK( m.size() == 11 );
+    BOOST_CHECK( m.get("batch") == size_t(5) );
+    m.upsert( "flip", 0, [](size_t&) {} );
+    m.erase("flip");
+  }
+
+  //читатель не ждет писателя, даже если тот застрял посреди записи
+  std::atomic<bool> writer_inside(false), reader_done(false);
+  std::thread writer([&]() {
+    m.write( [&](auto& c) {
+      writer_inside = true;
+      while ( !reader_done )
+        std::this_thread::yield();
+      c["late"] = 1;
+    } );
+  });
+  while ( !writer_inside )
+    std::this_thread::yield();
+  BOOST_CHECK( m.get("batch") == size_t(5) );
+  BOOST_CHECK( !m.contains("late") );
+  reader_done = true;
+  writer.join();
+  BOOST_CHECK( m.contains("late") );
+
+  //читатели видят только целые записи
+  t3::left_right_map<size_t, std::pair<size_t, size_t>> pairs;
+  std::atomic<bool> stop(false), torn(false);
+  std::vector<std::thread> readers;
+  for (size_t t = 0; t < 3; ++t) {
+    readers.emplace_back([&]() {
+      while ( !stop ) {
+        for (size_t k = 0; k < 16; ++k)
+          pairs.visit( k, [&torn](const auto& v) { torn = torn || v.second.first != v.second.second; } );
+      }
+    });
+  }
+  for (size_t i = 0; i < 20000; ++i) {
+    if (i % 3 == 2)
+      pairs.erase(i % 16);
+    else
+      pairs.upsert( i % 16, std::make_pair(i, i), [i](auto& v) { v = std::make_pair(i, i); } );
+  }
+  stop = true;
+  for (auto& it : readers)
+    it.join();
+  BOOST_CHECK( !torn );
+  BOOST_CHECK( pairs.read( [](const auto& c) { return c.size(); } ) == pairs.size() );
+}
+
+BOOST_AUTO_TEST_CASE(MapCacheModeClock)
+{
+  //предел числа записей делится между сегментами
+  t1::map<size_t, size_t> m(4);
+  m.set_capacity(400);
+  for (size_t i = 0; i < 10000; ++i)
+    m[i] = i;
+  t1::cache_stats s = m.cache_statistics();
+  BOOST_CHECK( m.size() <= 400 && m.size() > 300 );
+  BOOST_CHECK( s.entries == m.size() );
+  BOOST_CHECK( s.evictions == 10000 - m.size() );
+
+  //к горячим ключам обращаются чаще, чем проходит стрелка CLOCK
+  for (size_t i = 0; i < 20; ++i)
+    m[i] = i;
+  for (size_t i = 100000; i < 110000; ++i) {
+    m.insert( std::make_pair(i, i) );
+    BOOST_CHECK( m.get(i % 20) );
+  }
+  for (size_t i = 0; i < 20; ++i)
+    BOOST_CHECK( m.contains(i) );
+  BOOST_CHECK( m.size() <= 400 );
+
+  //попадания и промахи
+  t1::map<size_t, size_t> counted(2);
+  counted.set_capacity(1000);
+  for (size_t i = 0; i < 10; ++i)
+    counted[i] = i;
+  for (size_t i = 0; i < 15; ++i)
+    counted.find(i);
+  BOOST_CHECK( counted.compute_if_absent(size_t(3), []() { return size_t(0); }) == 3 );
+  BOOST_CHECK( counted.compute_if_absent(size_t(30), []() { return size_t(30); }) == 30 );
+  s = counted.cache_statistics();
+  BOOST_CHECK( s.hits == 11 && s.misses == 6 && s.evictions == 0 );
+  BOOST_CHECK( s.hit_rate() > 0.64 && s.hit_rate() < 0.65 );
+
+  //уменьшение предела вытесняет сразу, 0 - режим выключен
+  counted.set_capacity(4);
+  BOOST_CHECK( counted.size() == 4 );
+  counted.set_capacity(0);
+  for (size_t i = 100; i < 200; ++i)
+    counted[i] = i;
+  BOOST_CHECK( counted.size() == 104 );
+  BOOST_CHECK( counted.cache_statistics().evictions == 7 );
+
+  //предел в байтах, строки в куче учитываются
+  typedef t1::map<std::string, std::string> string_map;
+  string_map sm(2);
+  const size_t budget = 64 * 1024;
+  sm.set_capacity(0, budget);
+  for (size_t i = 0; i < 2000; ++i)
+    sm.upsert( "key" + std::to_string(i), std::string(100 + i % 50, 'x'), [](std::string&) {} );
+  s = sm.cache_statistics();
+  BOOST_CHECK( s.bytes <= budget && s.bytes > budget / 2 );
+  BOOST_CHECK( s.entries > 0 && s.entries < 2000 );
+  BOOST_CHECK( string_map::entry_bytes( string_map::value_type("k", std::string(1000, 'y')) ) > 1000 );
+  //значение, выросшее на месте, тоже вытесняет лишнее
+  BOOST_CHECK( sm.visit( "key1999", [](auto& e) { e.second.assign(4000, 'z'); } ) );
+  const size_t after_visit = sm.cache_statistics().bytes;
+  BOOST_CHECK( after_visit <= budget && sm.contains("key1999") );
+  sm.set_capacity(0, budget); //пересчет с нуля совпадает с тем, что велось
+  BOOST_CHECK( sm.cache_statistics().bytes == after_visit );
+
+  //конкурентная загрузка через compute_if_absent
+  t1::map<size_t, size_t> cache(8);
+  cache.set_capacity(800);
+  std::vector<std::thread> th;
+  std::atomic<bool> wrong(false);
+  for (size_t t = 0; t < 4; ++t) {
+    th.emplace_back([&cache, &wrong, t]() {
+      bench::rng r(t + 1);
+      bench::key_chooser zipf(bench::distribution::zipfian, 10000);
+      for (size_t i = 0; i < 20000; ++i) {
+        const size_t k = zipf.next(r);
+        if ( cache.compute_if_absent(k, [k]() { return k; }) != k )
+          wrong = true;
+      }
+    });
+  }
+  for (auto& it : th)
+    it.join();
+  BOOST_CHECK( !wrong );
+  s = cache.cache_statistics();
+  BOOST_CHECK( cache.size() <= 800 );
+  BOOST_CHECK( s.hits + s.misses == 80000 );
+  BOOST_CHECK( s.misses == s.evictions + s.entries );
+
+  //с параллельными писателями запись может быть вытеснена сразу после
+  //вставки: пишут через upsert/insert/visit, читают через get/visit, а не
+  //по ссылке из operator[]
+  t1::map<size_t, std::string> shared(2);
+  shared.set_capacity(64);
+  std::atomic<bool> stop(false);
+  th.clear();
+  for (size_t t = 0; t < 2; ++t) {
+    th.emplace_back([&shared, t]() {
+      for (size_t i = 0; i < 20000; ++i) {
+        const size_t k = (i * 7 + t) % 512;
+        if (i % 3)
+          shared.upsert( k, std::to_string(k), [k](std::string& v) { v = std::to_string(k); } );
+        else
+          shared.insert( std::make_pair( k, std::to_string(k) ) );
+        shared.visit( (k + 1) % 512, [](auto& e) { e.second = std::to_string(e.first); } );
+      }
+    });
+  }
+  std::thread reader([&shared, &stop, &wrong]() {
+    while ( !stop ) {
+      for (size_t k = 0; k < 512; ++k) {
+        const std::optional<std::string> v = shared.get(k);
+        if ( v && *v != std::to_string(k) )
+          wrong = true;
+      }
+    }
+  });
+  for (auto& it : th)
+    it.join();
+  stop = true;
+  reader.join();
+  BOOST_CHECK( !wrong );
+  BOOST_CHECK( shared.size() <= 64 );
+  BOOST_CHECK( shared.cache_statistics().evictions > 0 );
+}
+
+BOOST_AUTO_TEST_CASE(TimerWheel)
+{
+  //каждый элемент срабатывает один раз, в первом advance до его тика,
+  //в том числе тики за оборотом верхнего уровня
+  std::mt19937_64 rnd(7);
+  static const uint64_t ranges[] = { 70, 5000, uint64_t(1) << 30, uint64_t(1) << 38 };
+  uint64_t now = uint64_t(1) << 40;
+  t1::timer_wheel<size_t> w(now);
+  std::vector<uint64_t> ticks;
+  std::vector<size_t> fired;
+  bool early = false;
+  for (size_t step = 0; step < 2000; ++step) {
+    for (size_t j = rnd() % 4; j; --j) {
+      ticks.push_back( now + rnd() % ranges[rnd() % 4] );
+      fired.push_back(0);
+      w.schedule( ticks.back(), ticks.size() - 1 );
+    }
+    now += rnd() % ( step % 3 ? 300 : uint64_t(1) << 26 );
+    w.advance( now, [&](size_t i) { ++fired[i]; early = early || ticks[i] > now; } );
+  }
+  BOOST_CHECK( !early );
+  size_t waiting = 0;
+  bool missed = false, twice = false;
+  for (size_t i = 0; i < ticks.size(); ++i) {
+    missed = missed || (!fired[i] && ticks[i] <= now);
+    twice = twice || fired[i] > 1;
+    waiting += !fired[i];
+  }
+  BOOST_CHECK( !missed && !twice );
+  BOOST_CHECK( w.size() == waiting );
+
+  //прошедший тик - в следующем advance
+  BOOST_CHECK( !w.pending(now) );
+  w.schedule(now - 5, 0);
+  BOOST_CHECK( w.pending(now) );
+  BOOST_CHECK( w.advance( now, [](size_t) {} ) == 1 );
+}
+
+BOOST_AUTO_TEST_CASE(MapTtlExpiration)
+{
+  using std::chrono::milliseconds;
+  using std::chrono::hours;
+
+  //истекшая запись не находится, хотя еще лежит в таблице
+  t1::map<std::string, size_t> m(4);
+  m.insert_with_ttl( std::make_pair(std::string("gone"), size_t(1)), milliseconds(-1) );
+  BOOST_CHECK( m.size() == 1 );
+  BOOST_CHECK( m.find("gone") == m.end() );
+  BOOST_CHECK( !m.contains("gone") && !m.get("gone") );
+  BOOST_CHECK( m.begin() == m.end() );
+  const std::vector<std::string> keys = { "gone" };
+  BOOST_CHECK( m.find_batch(keys)[0] == m.end() );
+  BOOST_CHECK( m.size() == 1 );
+  //колесо удаляет с точностью до своего тика
+  std::this_thread::sleep_for( milliseconds(2) );
+  BOOST_CHECK( m.expire() == 1 );
+  BOOST_CHECK( m.size() == 0 && m.expire() == 0 );
+
+  //на месте истекшей - новая запись без срока
+  m.insert_with_ttl( m.prehash( std::string("again") ), 1, milliseconds(0) );
+  BOOST_CHECK( !m.visit("again", [](auto&) {}) && m.size() == 0 );
+  m.insert_with_ttl( std::make_pair(std::string("again"), size_t(1)), milliseconds(0) );
+  m["again"] = 5;
+  BOOST_CHECK( !m.expire_after("missing", hours(1)) );
+
+  //сессии: половина короткие
+  for (size_t i = 0; i < 1000; ++i)
+    m.insert_with_ttl( std::make_pair("s" + std::to_string(i), i), i % 2 ? milliseconds(hours(1)) : milliseconds(20) );
+  //продление, сокращение; insert срок не меняет
+  m.insert_with_ttl( std::make_pair(std::string("extended"), size_t(1)), milliseconds(20) );
+  BOOST_CHECK( m.expire_after("extended", hours(1)) );
+  m.insert_with_ttl( std::make_pair(std::string("shortened"), size_t(1)), hours(1) );
+  BOOST_CHECK( m.expire_after("shortened", milliseconds(20)) );
+  m.insert_with_ttl( std::make_pair(std::string("kept"), size_t(1)), milliseconds(20) );
+  m.insert( std::make_pair(std::string("kept"), size_t(2)) );
+  BOOST_CHECK( m.get("kept") == size_t(2) );
+
+  std::this_thread::sleep_for( milliseconds(40) );
+  size_t visible = 0;
+  for (auto it = m.begin(); it != m.end(); ++it)
+    ++visible;
+  BOOST_CHECK( visible == 502 );
+  BOOST_CHECK( !m.contains("s0") && m.contains("s1") );
+  BOOST_CHECK( m.contains("extended") && !m.contains("shortened") && !m.contains("kept") );
+  BOOST_CHECK( m.get("again") == size_t(5) );
+  BOOST_CHECK( !m.expire_after("s0", hours(1)) );
+  m.expire();
+  BOOST_CHECK( m.size() == 502 );
+  BOOST_CHECK( m.parallel_reduce( size_t(0), [](const auto&) { return size_t(1); },
+                                  [](size_t a, size_t b) { return a + b; } ) == 502 );
+
+  //вставки с короткими сроками под поисками без блокировки
+  t1::map<size_t, size_t> c(4);
+  std::atomic<bool> stop(false), stale(false);
+  std::thread reader([&]() {
+    while ( !stop ) {
+      for (size_t k = 0; k < 64; ++k) {
+        auto it = c.find(k);
+        stale = stale || (it != c.end() && it->second != k);
+      }
+    }
+  });
+  std::vector<std::thread> writers;
+  for (size_t t = 0; t < 2; ++t) {
+    writers.emplace_back([&c, t]() {
+      for (size_t i = 0; i < 5000; ++i)
+        c.insert_with_ttl( std::make_pair( (i * 2 + t) % 64, (i * 2 + t) % 64 ), milliseconds(i % 3) );
+    });
+  }
+  for (auto& it : writers)
+    it.join();
+  stop = true;
+  reader.join();
+  std::this_thread::sleep_for( milliseconds(5) );
+  c.expire();
+  BOOST_CHECK( !stale );
+  BOOST_CHECK( c.size() == 0 );
+}
+
+BOOST_AUTO_TEST_CASE(MapTtlSnapshot)
+{
+  using std::chrono::milliseconds;
+  using std::chrono::hours;
+  typedef t1::map<std::string, size_t> map_type;
+  const std::string path = ( std::filesystem::temp_directory_path() / "t1_map_ttl_unit_test.bin" ).string();
+
+  //истекшая в текущем тике запись: колесо ее еще не убрало
+  map_type m(4);
+  m.insert_with_ttl( std::make_pair(std::string("gone"), size_t(1)), milliseconds(-1) );
+  m.insert_with_ttl( std::make_pair(std::string("session"), size_t(2)), hours(1) );
+  m["plain"] = 3;
+
+  map_type::snapshot_view s = m.snapshot();
+  BOOST_CHECK( s.size() == 2 );
+  BOOST_CHECK( !s.contains("gone") && s.contains("session") && s.contains("plain") );
+  size_t n = 0;
+  for (auto& it : s) {
+    BOOST_CHECK( it.first != "gone" );
+    ++n;
+  }
+  BOOST_CHECK( n == 2 );
+
+  map_type::frozen_type f = m.freeze();
+  BOOST_CHECK( f.size() == 2 && !f.contains("gone") && f.contains("session") );
+
+  m.save(path);
+  std::shared_ptr<const map_type::file_type> file = map_type::open(path);
+  BOOST_CHECK( file->size() == 2 && !file->contains("gone") && file->contains("plain") );
+  std::filesystem::remove(path);
+
+  //сегмент не менялся, но запись истекла после прошлого снимка
+  m.insert_with_ttl( std::make_pair(std::string("short"), size_t(4)), milliseconds(20) );
+  map_type::snapshot_view before = m.snapshot();
+  std::this_thread::sleep_for( milliseconds(40) );
+  map_type::snapshot_view after = m.snapshot();
+  BOOST_CHECK( before.size() == 3 && before.contains("short") );
+  BOOST_CHECK( after.size() == 2 && !after.contains("short") );
+}
@@ -3,7 +3,7 @@ CONFIG += console
 CONFIG -= app_bundle
 CONFIG -= qt
 
-QMAKE_CXXFLAGS += -std=c++11
+QMAKE_CXXFLAGS += -std=c++20
 
 INCLUDEPATH += /usr/include/boost
 INCLUDEPATH += /usr/include/boost/test/